@@ -0,0 +1,348 @@
+/****************************************************************************************************
+ * File: gensyntax.c
+ * Description:
+ *  - Build-time generator for the syntax highlighting tables used by helio.c. The Makefile compiles
+ *    and runs it to produce syntax_tables.h, so helio never compares keyword strings at runtime:
+ *
+ *      - every language gets a 256 entry character class table (one lookup per byte tells whether
+ *        it can start a word, continue a word, start a number, string or comment)
+ *      - every language's keywords are stored in a perfect hash table; the generator searches for
+ *        a hash seed that gives every keyword its own slot, so a lookup is one hash and at most one
+ *        string comparison
+ *
+ *  - To add or change a language, edit the language definitions below and rebuild.
+ *
+ * SPDX-License-Identifier: MIT
+ * See the LICENSE file in the project root for full license information.
+ ****************************************************************************************************/
+
+//====================Includes====================//
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//====================Global Declarations====================//
+#define MAX_KEYWORDS 128
+#define MAX_SEED_TRIES 1000000 // seeds tried per table size before the table is made bigger
+
+// must match the CC_ constants in helio.c
+#define CC_IDENT_START 0x01
+#define CC_IDENT 0x02
+#define CC_DIGIT 0x04
+#define CC_QUOTE 0x08
+#define CC_COMMENT 0x10
+
+typedef struct
+{
+    const char *word;
+    const char *hl; // highlight class (enum highlight in helio.c) given to the word
+} KeywordDef;
+
+typedef struct
+{
+    const char *name;       // also the prefix of the generated tables' names
+    const char *extensions; // space separated file name endings that select the language
+    const char *identStart; // chars that can start a word; "a-z" style ranges are allowed
+    const char *identChars; // chars that can continue a word
+    const char *quotes;     // chars that start (and end) a string
+    const char *lineComment;
+    const char *blockCommentStart;
+    const char *blockCommentEnd;
+    const char *flags; // HLF_ constants from helio.c or "0"
+    KeywordDef keywords[MAX_KEYWORDS];
+} LanguageDef;
+
+//====================Language Definitions====================//
+static const LanguageDef languages[] = {
+    {"c", ".c .h .cc .cpp .hpp", "A-Za-z_", "A-Za-z0-9_", "\"'", "//", "/*", "*/", "HLF_PREPROC",
+     {{"auto", "HL_KEYWORD"},     {"break", "HL_KEYWORD"},     {"case", "HL_KEYWORD"},
+      {"const", "HL_KEYWORD"},    {"continue", "HL_KEYWORD"},  {"default", "HL_KEYWORD"},
+      {"do", "HL_KEYWORD"},       {"else", "HL_KEYWORD"},      {"enum", "HL_KEYWORD"},
+      {"extern", "HL_KEYWORD"},   {"for", "HL_KEYWORD"},       {"goto", "HL_KEYWORD"},
+      {"if", "HL_KEYWORD"},       {"inline", "HL_KEYWORD"},    {"register", "HL_KEYWORD"},
+      {"restrict", "HL_KEYWORD"}, {"return", "HL_KEYWORD"},    {"sizeof", "HL_KEYWORD"},
+      {"static", "HL_KEYWORD"},   {"struct", "HL_KEYWORD"},    {"switch", "HL_KEYWORD"},
+      {"typedef", "HL_KEYWORD"},  {"union", "HL_KEYWORD"},     {"volatile", "HL_KEYWORD"},
+      {"while", "HL_KEYWORD"},    {"class", "HL_KEYWORD"},     {"namespace", "HL_KEYWORD"},
+      {"template", "HL_KEYWORD"}, {"typename", "HL_KEYWORD"},  {"public", "HL_KEYWORD"},
+      {"private", "HL_KEYWORD"},  {"protected", "HL_KEYWORD"}, {"new", "HL_KEYWORD"},
+      {"delete", "HL_KEYWORD"},   {"this", "HL_KEYWORD"},      {"virtual", "HL_KEYWORD"},
+      {"NULL", "HL_KEYWORD"},     {"true", "HL_KEYWORD"},      {"false", "HL_KEYWORD"},
+      {"char", "HL_TYPE"},        {"double", "HL_TYPE"},       {"float", "HL_TYPE"},
+      {"int", "HL_TYPE"},         {"long", "HL_TYPE"},         {"short", "HL_TYPE"},
+      {"signed", "HL_TYPE"},      {"unsigned", "HL_TYPE"},     {"void", "HL_TYPE"},
+      {"bool", "HL_TYPE"},        {"size_t", "HL_TYPE"},       {"ssize_t", "HL_TYPE"},
+      {"int8_t", "HL_TYPE"},      {"int16_t", "HL_TYPE"},      {"int32_t", "HL_TYPE"},
+      {"int64_t", "HL_TYPE"},     {"uint8_t", "HL_TYPE"},      {"uint16_t", "HL_TYPE"},
+      {"uint32_t", "HL_TYPE"},    {"uint64_t", "HL_TYPE"},     {NULL, NULL}}},
+
+    {"json", ".json", "a-z", "a-z", "\"", NULL, NULL, NULL, "HLF_KEYS",
+     {{"true", "HL_KEYWORD"}, {"false", "HL_KEYWORD"}, {"null", "HL_KEYWORD"}, {NULL, NULL}}},
+
+    {"yaml", ".yml .yaml", "A-Za-z_", "A-Za-z0-9_.-", "\"'", "#", NULL, NULL, "HLF_KEYS | HLF_COMMENT_AFTER_SPACE",
+     {{"true", "HL_KEYWORD"},
+      {"false", "HL_KEYWORD"},
+      {"null", "HL_KEYWORD"},
+      {"yes", "HL_KEYWORD"},
+      {"no", "HL_KEYWORD"},
+      {"on", "HL_KEYWORD"},
+      {"off", "HL_KEYWORD"},
+      {"True", "HL_KEYWORD"},
+      {"False", "HL_KEYWORD"},
+      {"Null", "HL_KEYWORD"},
+      {NULL, NULL}}},
+
+    {"shell", ".sh .bash .zsh .bashrc .profile", "A-Za-z_", "A-Za-z0-9_", "\"'`", "#", NULL, NULL,
+     "HLF_VARIABLES | HLF_COMMENT_AFTER_SPACE",
+     {{"if", "HL_KEYWORD"},       {"then", "HL_KEYWORD"},   {"else", "HL_KEYWORD"},    {"elif", "HL_KEYWORD"},
+      {"fi", "HL_KEYWORD"},       {"for", "HL_KEYWORD"},    {"while", "HL_KEYWORD"},   {"until", "HL_KEYWORD"},
+      {"do", "HL_KEYWORD"},       {"done", "HL_KEYWORD"},   {"case", "HL_KEYWORD"},    {"esac", "HL_KEYWORD"},
+      {"in", "HL_KEYWORD"},       {"function", "HL_KEYWORD"}, {"return", "HL_KEYWORD"}, {"select", "HL_KEYWORD"},
+      {"export", "HL_TYPE"},      {"local", "HL_TYPE"},     {"readonly", "HL_TYPE"},   {"declare", "HL_TYPE"},
+      {"unset", "HL_TYPE"},       {"source", "HL_TYPE"},    {"echo", "HL_TYPE"},       {"exit", "HL_TYPE"},
+      {"shift", "HL_TYPE"},       {"set", "HL_TYPE"},       {"test", "HL_TYPE"},       {"cd", "HL_TYPE"},
+      {NULL, NULL}}},
+
+    {"log", ".log .out", "A-Za-z_", "A-Za-z0-9_", "\"", NULL, NULL, NULL, "0",
+     {{"FATAL", "HL_ERROR"},    {"CRITICAL", "HL_ERROR"}, {"ERROR", "HL_ERROR"},   {"Error", "HL_ERROR"},
+      {"error", "HL_ERROR"},    {"panic", "HL_ERROR"},    {"WARN", "HL_KEYWORD"},  {"WARNING", "HL_KEYWORD"},
+      {"Warning", "HL_KEYWORD"}, {"warning", "HL_KEYWORD"}, {"INFO", "HL_TYPE"},   {"NOTICE", "HL_TYPE"},
+      {"DEBUG", "HL_COMMENT"},  {"TRACE", "HL_COMMENT"},  {NULL, NULL}}},
+};
+
+//====================Function Prototypes====================//
+void AddChars(unsigned char *charClass, const char *spec, unsigned char bit);
+int BuildKeywordTable(const KeywordDef *keywords, int numKeywords, int *table, uint32_t *seed, uint32_t *mask);
+uint32_t KeywordHash(uint32_t seed, const char *word, int length);
+void PrintLanguage(const LanguageDef *lang, uint32_t *seed, uint32_t *mask);
+void PrintString(const char *str);
+
+//=============================================================//
+//====================Function Declarations====================//
+//=============================================================//
+
+/****************************************************************************************************
+ * Hash used for keyword lookups (FNV-1a starting from seed, with the bits mixed at the end so the
+ * low bits used as the slot depend on every char). Must match SyntaxKeywordClass in helio.c.
+ ****************************************************************************************************/
+uint32_t KeywordHash(uint32_t seed, const char *word, int length)
+{
+    uint32_t hash = seed;
+
+    for (int i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)word[i];
+        hash *= 16777619u; // FNV prime
+    }
+    hash ^= hash >> 15;
+    hash *= 0x2c1b3c6du;
+    hash ^= hash >> 12;
+    return hash;
+}
+
+/****************************************************************************************************
+ * Sets bit in charClass for every char in spec. "a-z" in spec stands for all chars from 'a' to 'z'.
+ ****************************************************************************************************/
+void AddChars(unsigned char *charClass, const char *spec, unsigned char bit)
+{
+    for (int i = 0; spec[i] != '\0'; i++)
+    {
+        if ((spec[i + 1] == '-') && (spec[i + 2] != '\0')) // a range such as "a-z"
+        {
+            for (int c = (unsigned char)spec[i]; c <= (unsigned char)spec[i + 2]; c++)
+            {
+                charClass[c] |= bit;
+            }
+            i += 2;
+        }
+        else
+        {
+            charClass[(unsigned char)spec[i]] |= bit;
+        }
+    }
+}
+
+/****************************************************************************************************
+ * Finds the smallest power of two table size (at least twice the number of keywords) and a seed for
+ * which every keyword hashes to a different slot. table receives the index of the keyword in each
+ * slot (-1 for empty slots). Returns the table size.
+ ****************************************************************************************************/
+int BuildKeywordTable(const KeywordDef *keywords, int numKeywords, int *table, uint32_t *seed, uint32_t *mask)
+{
+    int size = 2;
+
+    while (size < numKeywords * 2)
+    {
+        size *= 2;
+    }
+
+    for (;; size *= 2)
+    {
+        for (uint32_t trySeed = 2166136261u; trySeed < 2166136261u + MAX_SEED_TRIES; trySeed++)
+        {
+            int collision = 0;
+
+            for (int i = 0; i < size; i++)
+            {
+                table[i] = -1;
+            }
+            for (int i = 0; (i < numKeywords) && !collision; i++)
+            {
+                uint32_t slot = KeywordHash(trySeed, keywords[i].word, strlen(keywords[i].word)) & (size - 1);
+                collision = (table[slot] != -1);
+                table[slot] = i;
+            }
+
+            if (!collision)
+            {
+                *seed = trySeed;
+                *mask = size - 1;
+                return size;
+            }
+        }
+    }
+}
+
+/****************************************************************************************************
+ * Prints str as a C string literal (or NULL).
+ ****************************************************************************************************/
+void PrintString(const char *str)
+{
+    if (str == NULL)
+    {
+        printf("NULL");
+        return;
+    }
+
+    putchar('"');
+    for (; *str != '\0'; str++)
+    {
+        if ((*str == '"') || (*str == '\\'))
+        {
+            putchar('\\');
+        }
+        putchar(*str);
+    }
+    putchar('"');
+}
+
+/****************************************************************************************************
+ * Prints the extension list, character class table and keyword table of one language. The seed and
+ * mask of the keyword table are returned for the language's entry in syntaxDefs.
+ ****************************************************************************************************/
+void PrintLanguage(const LanguageDef *lang, uint32_t *seed, uint32_t *mask)
+{
+    unsigned char charClass[256] = {0};
+    int table[MAX_KEYWORDS * 256]; // room for the table to double many times if no seed is found
+    int numKeywords = 0;
+
+    // file name endings
+    printf("static const char *%sExtensions[] = {", lang->name);
+    char ext[64];
+    int extLen = 0;
+    for (const char *c = lang->extensions;; c++)
+    {
+        if ((*c == ' ') || (*c == '\0'))
+        {
+            if (extLen > 0)
+            {
+                ext[extLen] = '\0';
+                PrintString(ext);
+                printf(", ");
+                extLen = 0;
+            }
+            if (*c == '\0')
+            {
+                break;
+            }
+        }
+        else if (extLen < (int)sizeof(ext) - 1)
+        {
+            ext[extLen++] = *c;
+        }
+    }
+    printf("NULL};\n");
+
+    // character classes
+    AddChars(charClass, lang->identStart, CC_IDENT_START | CC_IDENT);
+    AddChars(charClass, lang->identChars, CC_IDENT);
+    AddChars(charClass, "0-9", CC_DIGIT);
+    AddChars(charClass, lang->quotes, CC_QUOTE);
+    if (lang->lineComment != NULL)
+    {
+        charClass[(unsigned char)lang->lineComment[0]] |= CC_COMMENT;
+    }
+    if (lang->blockCommentStart != NULL)
+    {
+        charClass[(unsigned char)lang->blockCommentStart[0]] |= CC_COMMENT;
+    }
+
+    printf("static const unsigned char %sCharClass[256] = {", lang->name);
+    for (int i = 0; i < 256; i++)
+    {
+        printf("%s%d,", (i % 32 == 0) ? "\n    " : " ", charClass[i]);
+    }
+    printf("\n};\n");
+
+    // keywords
+    while (lang->keywords[numKeywords].word != NULL)
+    {
+        numKeywords++;
+    }
+    int size = BuildKeywordTable(lang->keywords, numKeywords, table, seed, mask);
+
+    printf("static const SyntaxKeyword %sKeywords[%d] = {\n", lang->name, size);
+    for (int i = 0; i < size; i++)
+    {
+        if (table[i] == -1)
+        {
+            printf("    {NULL, 0, HL_NORMAL},\n");
+        }
+        else
+        {
+            const KeywordDef *kw = &lang->keywords[table[i]];
+            printf("    {");
+            PrintString(kw->word);
+            printf(", %d, %s},\n", (int)strlen(kw->word), kw->hl);
+        }
+    }
+    printf("};\n\n");
+}
+
+/****************************************************************************************************
+ * Writes syntax_tables.h to standard output: the tables of every language followed by the
+ * syntaxDefs array helio.c picks a language from.
+ ****************************************************************************************************/
+int main()
+{
+    int numLanguages = sizeof(languages) / sizeof(languages[0]);
+    uint32_t seeds[sizeof(languages) / sizeof(languages[0])], masks[sizeof(languages) / sizeof(languages[0])];
+
+    printf("// Generated by gensyntax from the language definitions in gensyntax.c; do not edit.\n\n");
+
+    for (int i = 0; i < numLanguages; i++)
+    {
+        PrintLanguage(&languages[i], &seeds[i], &masks[i]);
+    }
+
+    printf("static const SyntaxDef syntaxDefs[] = {\n");
+    for (int i = 0; i < numLanguages; i++)
+    {
+        const LanguageDef *lang = &languages[i];
+
+        printf("    {");
+        PrintString(lang->name);
+        printf(", %sExtensions, %sCharClass, %sKeywords, %uu, %uu, ", lang->name, lang->name, lang->name, seeds[i],
+               masks[i]);
+        PrintString(lang->lineComment);
+        printf(", ");
+        PrintString(lang->blockCommentStart);
+        printf(", ");
+        PrintString(lang->blockCommentEnd);
+        printf(", %s},\n", lang->flags);
+    }
+    printf("};\n");
+
+    return 0;
+}
@@ -17,15 +17,24 @@
 #define _DEFAULT_SOURCE
 #define _BSD_SOURCE
 #define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64 // files over 2 GB on 32-bit systems too
 
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <time.h>
@@ -34,6 +43,56 @@
 //====================Global Declarations====================//
 #define HELIO_VERSION "0.0.1"
 #define TAB_STOP 8
+#define ROW_MAX_BYTES (INT_MAX / TAB_STOP) // longest row; its render string still fits in an int with every char a tab
+#define UNDO_MAGIC "HUJ\x02"    // identifies an undo journal sidecar (last byte is the format version)
+#define UNDO_HEADER_SIZE 12     // 4 byte magic + 8 byte hash of the file the journal belongs to
+#define UNDO_TRAILER_SIZE 8     // 8 byte checksum of everything before it
+#define UNDO_WRITE_BYTES 65536  // new journal records are encoded into a buffer of this size when saving
+#define EDIT_RECORD_MAX 32      // an encoded EditOp never exceeds this many bytes besides its text
+#define EDIT_TEXT_MAX (INT_MAX - EDIT_RECORD_MAX) // most bytes a single paste or cut can take up
+#define EDIT_CHAINED 0x40       // flag in an EditOp's type: undone together with the edit before it
+#define SWAP_MAGIC "HSW\x02"    // identifies a swap file (last byte is the format version)
+#define SWAP_HEADER_SIZE 12     // 4 byte magic + 8 byte hash of the file the logged edits apply to
+#define SWAP_COMMIT_BYTES 65536 // pending log size that forces a group commit
+#define SAVE_BUFFER_BYTES 1048576 // rows are copied into a buffer of this size and written out when it's full
+#define SWAP_COMMIT_MS 250      // longest time logged edits wait for a group commit while typing
+#define HL_BATCH_ROWS 4096      // most rows the highlight worker copies out per batch
+#define HL_BATCH_BYTES 1048576  // most bytes of text the highlight worker copies out per batch
+#define HL_SYNC_ROWS 2000       // rows WriteRows highlights itself to reach the screen; further is guessed
+#define ROW_MARK_COLS 64        // columns between the checkpoints of a row that isn't plain ASCII
+#define REPLAY_AHEAD 4096       // most bytes of a replayed script queued up as input at once
+#define PERF_SAMPLES 512        // input-to-paint times the perf HUD keeps for its average and p99
+#define FRAME_RATE 120          // most frames drawn per second, unless --fps says otherwise
+#define OSC52_MAX_BYTES 1048576 // most bytes copied to the system clipboard, unless --osc52 says otherwise
+#define BASE64_CHUNK 4096       // base64 chars collected before they're appended to the output
+#define BUFFER_CACHE_MB 256     // render caches hidden buffers may keep, unless --cache-budget says otherwise
+#define WINDOW_MAX 16           // most split windows on screen at once
+#define WRAP_TREE_MAX 4         // widths a buffer keeps a wrap tree for, one per width of side by side windows
+#define WINDOW_MIN_ROWS 3       // fewest screen rows of a window split off another, its status bar included
+#define WINDOW_MIN_COLS 10      // fewest columns of a window split off another
+#define GRID_REWRITE_MAX 6      // unchanged cells written again rather than moving the cursor past them
+#define FOLD_NONE -1            // no node in the tree of folds
+#define HEX_ROW_BYTES 16        // bytes on each row of the hex view
+#define HEX_SNIFF_BYTES 4096    // bytes at the start of a file looked at for a NUL, which opens it in hex
+#define TRACE_SPANS 65536       // spans each thread keeps for --trace; the oldest are replaced first
+#define TRACE_THREADS 8         // most threads that can record spans
+#define ROW_CLASSES 48          // size classes of row memory; the largest holds 64 KB
+#define ROW_LARGE 0xFFFFFFFF    // size class of row memory blocks too large for a class
+#define ROW_CHUNK_MIN 1048576   // first chunk row memory is carved from; later ones double
+#define ROW_CHUNK_MAX 67108864  // largest chunk row memory is carved from
+
+// character classes in SyntaxDef.charClass (generated by gensyntax, which has its own copy)
+#define CC_IDENT_START 0x01 // can start a word
+#define CC_IDENT 0x02       // can be part of a word
+#define CC_DIGIT 0x04       // starts a number
+#define CC_QUOTE 0x08       // starts and ends a string
+#define CC_COMMENT 0x10     // first char of the line or block comment marker
+
+// SyntaxDef.flags
+#define HLF_PREPROC 0x01             // '#' at the start of a row begins a preprocessor directive
+#define HLF_KEYS 0x02                // words and strings followed by ':' are keys
+#define HLF_VARIABLES 0x04           // '$name' and '${...}' are variables
+#define HLF_COMMENT_AFTER_SPACE 0x08 // line comments only start at the beginning of a word
 #define ABUFF_INIT \
     {              \
         NULL, 0    \
@@ -53,9 +112,76 @@ enum key
     PAGE_DOWN,
     HOME_KEY,
     END_KEY,
-    DEL_KEY
+    DEL_KEY,
+    CTRL_HOME,
+    CTRL_END,
+    SHIFT_UP_ARROW, // shift-arrows select text
+    SHIFT_DOWN_ARROW,
+    SHIFT_RIGHT_ARROW,
+    SHIFT_LEFT_ARROW,
+    TERMINAL_REPLY // the terminal answered a query rather than a key being pressed
 };
 
+enum highlight
+{
+    HL_NORMAL = 0,
+    HL_COMMENT,
+    HL_KEYWORD,
+    HL_TYPE,
+    HL_STRING,
+    HL_NUMBER,
+    HL_PREPROC,
+    HL_ERROR
+};
+
+enum lineNumbers
+{
+    LINE_NUMBERS_OFF = 0,
+    LINE_NUMBERS_ABSOLUTE, // every row shows its own number
+    LINE_NUMBERS_RELATIVE  // rows show how far they are from the cursor's row, which shows its own
+};
+
+enum highlightState
+{
+    HL_STATE_NORMAL = 0,   // row ends outside of any multi-line construct
+    HL_STATE_BLOCK_COMMENT // row ends inside an unterminated block comment
+};
+
+enum editType
+{
+    EDIT_INSERT_CHAR = 1, // inserts charIn at (row, col)
+    EDIT_DELETE_CHAR,     // deletes the char at (row, col), which was charIn
+    EDIT_INSERT_ROW,      // inserts an empty row at row
+    EDIT_DELETE_ROW,      // deletes the (empty) row at row
+    EDIT_SPLIT_ROW,       // moves the text of row from col on into a new row below it
+    EDIT_JOIN_ROW,        // appends the row below to row, which was col bytes long
+    EDIT_INSERT_TEXT,     // inserts the charIn bytes of text, which may hold newlines, at (row, col)
+    EDIT_DELETE_TEXT,     // deletes the charIn bytes from (row, col) on, which were text
+    EDIT_UNDO             // swap log only: the newest edit in the undo journal was reverted
+};
+
+enum splitType
+{
+    SPLIT_NONE = 0, // a window rather than a split
+    SPLIT_ROWS,     // split into one window above the other
+    SPLIT_COLS,     // split into two windows side by side, with a column of '|' between them
+    SPLIT_FREE      // unused node
+};
+
+enum markState
+{
+    MARK_NONE = 0,
+    MARK_SET,  // set with CTRL-Space; moving the cursor extends the selection
+    MARK_SHIFT // set by a shift-arrow; the next move without shift drops it
+};
+
+typedef struct
+{
+    int index;     // index into text of the first char that starts at or after the checkpoint column
+    int rendIndex; // index of the same char in rendStr
+    int col;       // column the char starts at
+} RowMark;         // checkpoint for converting between columns and indices without walking the whole row
+
 typedef struct
 {
     int size;
@@ -63,7 +189,190 @@ typedef struct
 
     int rendSize;
     char *rendStr;
-} TerminalRow; // contains information for a row of text
+    int rendCols; // screen columns rendStr takes up; equals rendSize only if rendStr is plain ASCII
+
+    RowMark *marks; // one checkpoint every ROW_MARK_COLS columns (NULL until a long row needs them)
+    int numMarks;
+
+    int *wraps;    // column each screen line starts at when soft wrapped (only rows that aren't plain)
+    int numWraps;  // number of screen lines the row is wrapped onto
+    int wrapWidth; // screen width wraps was computed for; 0 after the row changed
+
+    unsigned char *hl; // highlight class of each char in rendStr (NULL until highlighted)
+    int hlState;       // highlightState at the end of the row, which the next row starts in
+} TerminalRow;         // contains information for a row of text
+
+typedef struct
+{
+    const char *word; // NULL for an empty slot
+    unsigned char length;
+    unsigned char hl; // highlight class of the word
+} SyntaxKeyword;      // slot in a perfect hash table of keywords
+
+typedef struct
+{
+    const char *name;
+    const char **extensions;        // file name endings that select this syntax
+    const unsigned char *charClass; // CC_ bits for each byte value
+    const SyntaxKeyword *keywords;  // every keyword has its own slot; see SyntaxKeywordClass
+    uint32_t keywordSeed;
+    uint32_t keywordMask; // number of slots - 1
+    const char *lineComment;
+    const char *blockCommentStart;
+    const char *blockCommentEnd;
+    int flags; // HLF_ constants
+} SyntaxDef;   // describes how to highlight a language; generated into syntax_tables.h by gensyntax
+
+typedef struct
+{
+    int type;   // one of the editType constants, possibly with EDIT_CHAINED
+    int row;    // file row the edit applies to
+    int col;    // index into the row's text (unused for row edits)
+    int charIn; // the char of a char edit, or the number of bytes in text
+    char *text; // bytes of a text edit (NULL for other edits)
+} EditOp;       // a single reversible change made to the text
+
+typedef struct
+{
+    EditOp *ops; // edits made since the journal was last saved
+    int opsTot;
+    int capacity;
+
+    unsigned char *mapped; // journal sidecar memory-mapped by OpenFile or SaveFile (NULL if none)
+    size_t mappedSize;
+    size_t mappedEnd; // offset just past the newest record in mapped that has not been undone
+} UndoJournal;      // undo history; older edits stay on disk in the sidecar instead of in memory
+
+typedef struct
+{
+    int fd;            // -1 until the first edit after opening or saving creates the swap file
+    char *path;        // NULL when no file is open
+    uint64_t fileHash; // hash of the file on disk that the logged edits apply to
+
+    unsigned char *pending; // records appended since the last group commit
+    size_t pendingLen;
+    size_t pendingCap;
+    uint64_t lastCommit; // MonotonicNanos() of the last group commit
+    int failed;          // a commit failed, so nothing is logged until the file is saved or reopened
+} SwapLog;             // append-only log of unsaved edits used to recover them after a crash
+
+typedef struct
+{
+    int hud;                          // CTRL-P shows these numbers in place of the status message
+    uint64_t inputNanos;              // when the key being handled could be read; 0 if no key is
+    uint64_t latencies[PERF_SAMPLES]; // latest input-to-paint times; the oldest is replaced first
+    long long numLatencies;           // input-to-paint times measured so far
+    uint64_t writeRowsNanos;          // time WriteRows took for the last frame
+    int frameBytes;                   // size of the last frame
+    long long allocMark;              // AllocCount() when the key could be read
+    long long frameAllocs;            // allocations made handling the last key and drawing its frame
+} PerfStats;                          // measurements of how long it takes to respond to keys
+
+typedef struct
+{
+    int rowOffset;       // -1 if the terminal doesn't show a frame that can be scrolled
+    int colOffset;
+    int numRows;
+    int numCols;
+    int textCols;
+    int lineNumbers;
+    int guessed;         // some rows were shown with guessed highlighting
+    uint64_t generation; // hlGeneration of the text that's shown
+    int cursorX;         // cursor position in the text when the frame was drawn
+    int cursorY;
+    int softWrap;
+    int wrapTop;
+    int statusShown;     // the status message was shown rather than hidden for being old
+    char statusMsg[80];
+    int mark;            // selection that was shown
+    int markRow;
+    int markIndex;
+    int window;          // current split window
+    long long hexTop;    // view of the hex view
+    long long hexCursor;
+    int hexNibble;
+    uint64_t paintNanos; // MonotonicNanos() when the frame was written
+} ShownText;             // what the terminal shows, so RefreshScreen can scroll it or skip the frame
+
+typedef struct
+{
+    int split;  // enum splitType
+    int parent; // split this node is half of; -1 for the whole screen
+    int first;  // top or left half of a split
+    int second; // bottom or right half of a split
+
+    int top; // area on screen, set by LayoutWindow; the last row is the window's status bar
+    int left;
+    int height;
+    int width;
+
+    int cursorX; // view of a window; the current window's is kept in TerminalAttr instead
+    int cursorY;
+    int rowOffset;
+    int colOffset;
+    int wrapTop;
+} WindowNode; // window or split of the screen; windows only differ in what part of the text they show
+
+typedef struct
+{
+    int gap;    // rows shown between the fold before (or the start of the file) and the fold's first row
+    int hidden; // rows hidden below the fold's first row, which is still shown
+    int rows;   // rows spanned by the folds of the subtree: their gaps, first rows and hidden rows
+    int lines;  // screen lines those rows take up: their gaps and first rows
+    int left;   // folds above; the next unused node while the node isn't in the tree
+    int right;  // folds below
+    uint32_t priority; // random; no node has a higher priority than its parent
+} FoldNode;            // folded range of rows, in the tree of folds (see the Folding section)
+
+typedef struct
+{
+    long long offset;  // byte that was overwritten
+    unsigned char old; // what it was before
+} HexEdit;
+
+typedef struct
+{
+    unsigned char *map; // the file, mapped privately: overwritten bytes stay in memory until saved
+    long long size;     // bytes in the file
+    int fd;             // where saving writes the overwritten bytes; -1 if the file is read-only
+    long long top;      // offset of the first byte on screen, a multiple of HEX_ROW_BYTES
+    long long cursor;   // offset of the byte the cursor is on
+    int nibble;         // 1 if the cursor is on the second hex digit of the byte
+    HexEdit *edits;     // bytes overwritten since the file was last saved, in the order they were typed
+    int numEdits;
+    int editsCap;
+} HexView;              // file shown as bytes (see the Hex View section)
+
+typedef struct
+{
+    uint32_t capacity;  // bytes the block has room for
+    uint32_t sizeClass; // free list the block goes back to, or ROW_LARGE if it's from malloc
+} RowBlock;             // header in front of every block of row memory
+
+typedef struct
+{
+    char *bump;                    // unused part of the newest chunk
+    size_t bumpLeft;               // bytes left there
+    size_t chunkSize;              // size of the next chunk
+    RowBlock *freeLists[ROW_CLASSES];
+    long long liveBytes;           // capacity of the blocks in use
+    long long allocCalls;          // blocks handed out
+    long long chunks;              // chunks and large blocks taken from malloc
+} RowMemory;                       // allocator for the text and render string of rows
+
+typedef struct
+{
+    const char *name; // what was timed; always a string literal
+    uint64_t start;   // MonotonicNanos() when it started
+    uint64_t nanos;   // how long it took
+} TraceSpan;
+
+typedef struct
+{
+    const char *threadName;
+    TraceSpan spans[TRACE_SPANS];
+    uint64_t numSpans; // spans recorded so far; the latest TRACE_SPANS of them are kept
+} TraceRing;           // spans of one thread; only that thread writes to it, so it needs no lock
 
 typedef struct
 {
@@ -72,6 +381,7 @@ typedef struct
 
     TerminalRow *tRow;
     int tRowsTot; // number of rows with text
+    int tRowsCap; // number of rows tRow has room for
 
     int cursorX; // x postion of cursor
     int cursorY; // y position of cursor
@@ -79,49 +389,482 @@ typedef struct
     int numRows; // number of rows on screen
     int numCols; // number of columns on screen
 
+    int lineNumbers;       // enum lineNumbers; shown in a gutter left of the text
+    int gutterDigits;      // digits the gutter has room for
+    long long gutterLimit; // 10 ^ gutterDigits; the gutter widens when the file has this many rows
+    int textCols;          // columns right of the gutter, i.e., the width of the text on screen
+
     int rowOffset; // rows scrolled
     int colOffset; // columns scrolled
 
     int maxrowOffset; // max permissable vertical scrolling
     int maxcolOffset; // max permissable horizontal scrolling
 
+    int softWrap;      // long rows continue on the next screen line instead of scrolling sideways
+    int wrapTop;       // screen line of row rowOffset shown at the top of the screen (soft wrap only)
+    int *wrapTree;     // Fenwick tree of the number of screen lines each row is wrapped onto
+    int wrapTreeWidth; // screen width wrapTree was built for; 0 if it has to be rebuilt
+    int *wrapTrees[WRAP_TREE_MAX];     // a tree for each width windows show the buffer at; wrapTree is one
+    int wrapTreeWidths[WRAP_TREE_MAX]; // width each was built for; 0 if it's unused or has to be rebuilt
+    int wrapTreeNext;                  // tree replaced when a width without one is shown and none is unused
+
+    FoldNode *folds; // nodes of the tree of folded rows
+    int foldRoot;    // root of the tree; FOLD_NONE if no rows are folded
+    int foldFree;    // first unused node; the others are linked through their left
+    int foldsCap;    // nodes folds has room for
+
+    WindowNode *windows; // split windows as a tree with the whole screen at node 0; NULL if there's one window
+    int window;          // node of the current window, whose view is in the fields above
+    int windowKey;       // CTRL-K was pressed, so the next key is a window command
+
+    long long *byteTree; // Fenwick tree of the bytes each row takes up in the saved file
+    int byteTreeCap;     // rows byteTree has room for
+    int byteTreeValid;   // 0 if byteTree has to be rebuilt, e.g., after a row was deleted
+    long long fileBytes; // size of the file as it would be saved, kept up to date as rows change
+
     char statusMsg[80];
     time_t statusMsgTime; // from <time.h>
 
+    int readOnly;        // opened with -R; the file can be viewed but not edited
+    int forceHex;        // opened with -x; files are shown in hex even if they look like text
+    HexView *hex;        // NULL unless the file is shown as bytes
+    int mark;            // enum markState; the text between the mark and the cursor is selected
+    int markRow;         // row of the mark
+    int markIndex;       // index into the row's text
+    long long viewCount; // number typed before a key in the viewer, e.g., 50 in "50%"
+
     char *fileName;
+    uint64_t fileHash; // hash of the file as it was last opened or saved
+
+    const SyntaxDef *syntax; // NULL if the file type isn't highlighted
+    int hlValidTo;           // rows before this one have up to date highlighting
+
+    pthread_mutex_t docLock; // guards the text; the main thread holds it except while waiting for input
+    pthread_cond_t hlWake;   // wakes the highlight worker when there is work or it has to stop
+    pthread_t hlThread;
+    int hlThreadRunning;
+    int hlStop;
+    uint64_t hlGeneration; // changes with every edit so the worker can drop results for old text
+    int hlRepaint;         // the worker highlighted rows that are on screen
+
+    UndoJournal undo;
+    SwapLog swap;
+    PerfStats perf;
+    ShownText shown;     // the last frame written
+    uint64_t frameNanos; // shortest time between two frames; 0 draws a frame after every key
+    long long osc52Max;  // most bytes copied to the system clipboard (OSC 52); 0 turns it off
+
+    uint64_t lastShown;   // buffers.clock when the buffer was last hidden
+    long long cacheBytes; // bytes its render caches took up when it was hidden; 0 once they're dropped
 
 } TerminalAttr; // used for storing terminal/window related variables
 
 typedef struct
 {
     char *buff;
-    int length;
+    size_t length;
 } AppendBuffer; // used for creating dynamic strings; can change/add content to the same buffer
 
+typedef struct
+{
+    int rows;
+    int cols;
+    int cursorY;
+    int cursorX;
+    int top;         // first row of the scroll region (DECSTBM), 0-indexed
+    int bottom;      // last row of the scroll region
+    uint32_t *cells; // code point shown in each cell, row after row; 0 right of a wide char
+    long long bytes; // bytes written to the screen
+    long long writes;
+} VirtualScreen; // terminal kept in memory, used instead of stdout by the headless replay harness
+
+typedef struct
+{
+    int fd;               // where frames are written; a non-blocking descriptor of the terminal if it could be opened
+    int syncUpdates;      // the terminal supports synchronized output (DEC mode 2026)
+    char *sending;        // frame being written; once started, the rest of it has to follow
+    size_t sendingLength;
+    size_t sent;          // bytes of sending written so far
+    char *next;           // newest frame waiting for sending to finish; a newer frame replaces it
+    size_t nextLength;
+    long long dropped;    // frames replaced before they were written because the terminal was behind
+    AppendBuffer queued;  // sequences that aren't frames (OSC 52); never dropped and written between frames
+    size_t queuedSent;    // bytes of queued written so far
+} TerminalOutput;         // frames on their way to the terminal
+
+typedef struct
+{
+    char text[13];         // UTF-8 bytes of the char, with the combining marks that fit; empty right of a wide char
+    unsigned char length;
+    unsigned char color;   // SGR foreground color
+    unsigned char inverse; // shown in inverted colors
+} Cell;                    // one cell of the screen as split windows are composed (see ComposeWindows)
+
+typedef struct
+{
+    Cell *cells; // frame being composed, row after row
+    Cell *shown; // frame the terminal shows
+    int rows;
+    int cols;
+    int valid; // shown is what the terminal shows; 0 writes every cell of the next frame
+} CellGrid;    // the screen as cells, so a frame of split windows only sends the cells that changed
+
+typedef struct
+{
+    TerminalAttr *source; // document the copied text is in; NULL once it was copied out into bytes
+    int startRow;         // the copied text runs from (startRow, startIndex) up to (endRow, endIndex)
+    int startIndex;
+    int endRow;
+    int endIndex;
+    char *bytes; // the copied text when source is NULL
+    size_t length;
+} Clipboard; // text copied with CTRL-C or CTRL-X; only refers to it in the document while it's unchanged
+
+typedef struct
+{
+    const char *text;
+    size_t length;
+} TextPiece; // one line of text to be inserted; consecutive pieces are separated by a newline
+
+typedef struct
+{
+    TerminalAttr **list; // every open file, in the order they were opened
+    int count;
+    int current;         // index of the buffer on screen
+    long long budget;    // bytes the render caches of hidden buffers may take up together
+    uint64_t clock;      // counts the times a buffer was hidden, to find the one hidden longest ago
+} BufferList;            // files opened at the same time; only the one on screen is edited
+
+typedef struct
+{
+    AppendBuffer *abuff;        // where the encoded text goes
+    unsigned char carry[3];     // bytes of an incomplete group of 3 left over from the last call
+    int carryLen;
+    char chunk[BASE64_CHUNK];   // encoded chars not yet appended to abuff
+    int chunkLen;
+} Base64Stream;                 // base64 encoder that can be fed its input in pieces
+
 //====================Function Prototypes====================//
 void AppendRow(TerminalAttr *attr, char *str, size_t rowSize);
-void AppendString(AppendBuffer *abuff, const char *str, int length);
+void AddBuffer(TerminalAttr *attr);
+void AppendString(AppendBuffer *abuff, const char *str, size_t length);
+void Base64Finish(Base64Stream *stream);
+void Base64Write(Base64Stream *stream, const unsigned char *data, size_t length);
+void ApplyEditOp(TerminalAttr *attr, const EditOp *op);
+void ClipboardDetach();
+void ClipboardKeep(TerminalAttr *attr, int row, int lastRow);
+int ClipboardLines(TextPiece **lines);
+int CopySelection(TerminalAttr *attr);
+void CursorIndex(TerminalAttr *attr, int *row, int *index);
+void CutSelection(TerminalAttr *attr);
+int DecodeEditFields(const unsigned char *rec, size_t avail, uint32_t fields[4]);
+int DecodeEditOp(const unsigned char *rec, int recLen, EditOp *op);
+void DeleteChar(TerminalRow *tRow, int x);
+void DeleteRow(TerminalAttr *attr, int at);
+void DeleteRows(TerminalAttr *attr, int at, int count);
+void DeleteSpan(TerminalAttr *attr, int startRow, int startIndex, int endRow, int endIndex);
+void DropBufferCaches(TerminalAttr *attr);
+int EditFieldCount(int type);
+int EditRecordLengthBefore(const unsigned char *end, size_t avail);
+int EditTrailerSize(size_t length);
+int EncodeEditOp(const EditOp *op, unsigned char *rec);
+int EncodeEditFields(const EditOp *op, unsigned char *rec);
+int EncodeEditTrailer(unsigned char *trailer, size_t length);
+int EndEditRecord(unsigned char *rec, size_t length);
 void ErrorHandler(const char *str);
+int BenchHighlight(char *fileName);
+int BenchLines(int numLines);
+int BenchRender(char *fileName);
+int BenchReplay(const char *workload, long long size);
+int BenchReplayScript(char *scriptName, char *fileName);
+int BenchSwapLog(int numOps);
+int CheckHighlightWorker(void);
+int BufferRowBytes(int fd, char *buff, size_t *used, const char *data, size_t length, uint64_t *fileHash);
+long long BufferCacheBytes(TerminalAttr *attr);
+void BuildByteTree(TerminalAttr *attr);
+void BuildRowMarks(TerminalRow *tRow);
+void BuildRowWraps(TerminalRow *tRow, int width);
+void BuildWrapTree(TerminalAttr *attr, int slot);
+void CloseWindow(TerminalAttr *attr);
+int CodePointWidth(int codePoint);
+void ComposeWindows(TerminalAttr *attr, AppendBuffer *abuff, int *screenY, int *screenX);
+long long AllocCount();
+void ByteTreeAdd(TerminalAttr *attr, int row, long long delta);
+void ByteTreeAppend(TerminalAttr *attr);
+int ByteTreeFind(TerminalAttr *attr, long long offset, long long *rowStart);
+long long ByteTreePrefix(TerminalAttr *attr, int row);
+int CompareHexEdits(const void *a, const void *b);
+int CompareNanos(const void *a, const void *b);
+int CursorStep(TerminalAttr *attr, int key);
+int DecodeUtf8(const char *str, int length, int *codePoint);
+int EditRecordLength(const unsigned char *rec, size_t avail);
+int ExportClipboard(TerminalAttr *attr);
 int FetchWindowSize(int *numRows, int *numCols);
+int FlushOutput(int wait);
+void HexGotoPrompt(TerminalAttr *attr);
+int HexKeypress(TerminalAttr *attr, int key);
+void HexMove(TerminalAttr *attr, long long delta);
+void HexOverwrite(TerminalAttr *attr, int digit);
+void HexUndo(TerminalAttr *attr);
+int LooksBinary(const char *fileName);
+void FoldAdd(TerminalAttr *attr, int start, int end);
+void FoldAddGap(TerminalAttr *attr, int node, int delta);
+void FoldAll(TerminalAttr *attr);
+int FoldAt(TerminalAttr *attr, int row, int *start, int *end);
+int FoldEdit(TerminalAttr *attr, int at, int count, int delta);
+void FoldFreeTree(TerminalAttr *attr, int node);
+int FoldLineToRow(TerminalAttr *attr, int line);
+int FoldLines(TerminalAttr *attr, int node);
+int FoldMerge(TerminalAttr *attr, int left, int right);
+int FoldNew(TerminalAttr *attr, int gap, int hidden);
+int FoldNextRange(TerminalAttr *attr, int row, int *start, int *end);
+int FoldRange(TerminalAttr *attr, int row, int *end);
+int FoldRowAbove(TerminalAttr *attr, int row);
+int FoldRowBelow(TerminalAttr *attr, int row);
+int FoldRowToLine(TerminalAttr *attr, int row);
+int FoldRows(TerminalAttr *attr, int node);
+void FoldSplit(TerminalAttr *attr, int node, int row, int byStart, int *left, int *right);
+void FoldUpdate(TerminalAttr *attr, int node);
+void FoldsChanged(TerminalAttr *attr);
+void FormatNumber(char *buff, int width, unsigned int value);
+int FrameDelay(TerminalAttr *attr);
+int FrameNeeded(TerminalAttr *attr);
 void FreeAbuff(AppendBuffer *abuff);
+void FreeBuffer(TerminalAttr *attr);
+void GotoByte(TerminalAttr *attr, long long offset);
+void GotoPrompt(TerminalAttr *attr);
+void HideBuffer(TerminalAttr *attr);
+void GotoRow(TerminalAttr *attr, long long row);
+void GridBegin(int rows, int cols);
+void GridDiff(AppendBuffer *abuff);
+void GridWrite(int top, int left, int height, int width, const char *buff, size_t length);
+uint64_t HashBytes(uint64_t hash, const void *data, size_t length);
+int HighlightRow(TerminalAttr *attr, int row);
+int HighlightText(const SyntaxDef *syntax, const char *str, int length, int state, unsigned char *hl);
+void HighlightUpTo(TerminalAttr *attr, int row);
+int HighlightIsExact(TerminalAttr *attr, int bottom);
+void HighlightVisible(TerminalAttr *attr, int top, int bottom);
+void *HighlightWorker(void *arg);
+void InitEditorState(TerminalAttr *attr);
+void InitHeadless(TerminalAttr *attr, VirtualScreen *screen);
 void InitTerminalAttr(TerminalAttr *attr);
+void InitRow(TerminalRow *tRow, size_t rowSize);
 void InsertChar(TerminalRow *tRow, int x, char charIn);
+void OpenTerminalOutput();
 void InsertCharWrapper(TerminalAttr *attr, char charIn);
+void InsertLines(TerminalAttr *attr, const TextPiece *lines, int numLines);
+void InsertText(TerminalAttr *attr, int row, int index, const char *text, size_t length);
+void JoinRow(TerminalAttr *attr, int row);
+void LayoutWindow(TerminalAttr *attr, int node, int top, int left, int height, int width);
+void LoadWindowView(TerminalAttr *attr, WindowNode *window);
+void LoadUndoJournal(TerminalAttr *attr, uint64_t fileHash);
+uint64_t MonotonicNanos();
 void MoveCursor(TerminalAttr *attr, int key);
-void OpenFile(TerminalAttr *attr, char *fileName);
+void MoveCursorWrapped(TerminalAttr *attr, int key);
+int NextChar(const char *str, int length, int col, int *width);
+void NextWindow(TerminalAttr *attr);
+TerminalAttr *OpenBuffer(TerminalAttr *attr, char *fileName);
+int OpenFile(TerminalAttr *attr, char *fileName);
+int OpenHex(TerminalAttr *attr, char *fileName);
+void OpenPrompt(TerminalAttr *attr);
+void OpenRows(TerminalAttr *attr, int at, int count);
+void PasteClipboard(TerminalAttr *attr);
+int ProcessInput(TerminalAttr *attr);
 int ProcessKeypress(TerminalAttr *attr);
+char *Prompt(TerminalAttr *attr, const char *frmt);
+void PushUndoOp(UndoJournal *undo, const EditOp *op);
 void RawModeOff(struct termios originalState);
 void RawModeOn(struct termios rawState);
 int ReadKeypress();
+int ReadTerminalReply();
+void RecordEdit(TerminalAttr *attr, int type, int row, int col, int charIn);
+void RecordText(TerminalAttr *attr, int type, int row, int col, char *text, size_t length);
+void RemoveText(TerminalAttr *attr, int startRow, int startIndex, int endRow, int endIndex);
+int RevertEdit(TerminalAttr *attr, EditOp *op);
+int RevertStep(TerminalAttr *attr, EditOp *op);
+void RecoverSwapFile(TerminalAttr *attr);
 void RefreshScreen(TerminalAttr *attr);
+void SetBufferMessage(TerminalAttr *attr);
+void ShowBuffer(TerminalAttr *attr, TerminalAttr *from);
+void SwitchBuffer(TerminalAttr *attr, int index);
+void TrimBufferCaches();
+int RenderColToByte(TerminalRow *tRow, int col, int *charCol);
+int ReplayKeyLength(const char *script, size_t length);
+int ReplayScript(TerminalAttr *attr, const char *script, size_t length, const char *label);
+void RenderIfDropped(TerminalRow *tRow);
+void ResetWrapTrees(TerminalAttr *attr);
 void RenderRow(TerminalRow *tRow);
+void RenderUtf8Row(TerminalRow *tRow, int numTabs);
+void *RowAlloc(size_t size);
+void RowBytesChanged(TerminalAttr *attr, int row, long long delta);
+int RowCharStart(TerminalRow *tRow, int col, int *next);
+void RowFree(void *ptr);
+int RowIndent(TerminalAttr *attr, int row);
+int RowIndexToRender(TerminalRow *tRow, int index);
+int RowIsFolded(TerminalAttr *attr, int row);
+int RowIsPlain(TerminalRow *tRow);
+RowMark RowMarkBefore(TerminalRow *tRow, int col, int index);
+void RowNewChunk();
+void *RowRealloc(void *ptr, size_t size);
+int RowRenderToIndex(TerminalRow *tRow, int col);
+uint32_t RowSizeClass(size_t size, size_t *capacity);
+int RowWrapCount(TerminalRow *tRow, int width);
+int RowWrapEstimate(TerminalRow *tRow, int width);
+int RowWrapLine(TerminalRow *tRow, int width, int col);
+int RowWrapStart(TerminalRow *tRow, int width, int line);
 void SaveFile(TerminalAttr *attr);
+void SaveHex(TerminalAttr *attr);
+void SaveUndoJournal(TerminalAttr *attr, uint64_t fileHash);
+void SaveWindowView(TerminalAttr *attr);
+int ScreenEndRow(TerminalAttr *attr);
 void Scroll(TerminalAttr *attr, int key);
+void ScrollFolded(TerminalAttr *attr, int *screenY);
+void ScrollHex(TerminalAttr *attr);
+int ScrollShift(TerminalAttr *attr);
+void ScrollPage(TerminalAttr *attr, int direction);
+void ScrollWrapped(TerminalAttr *attr, int *screenY, int *screenX);
+void SelectSyntax(TerminalAttr *attr);
+void SelectWrapTree(TerminalAttr *attr);
+void SetCursorPosition(TerminalAttr *attr, int row, int col);
+int SelectionBounds(TerminalAttr *attr, int *startRow, int *startIndex, int *endRow, int *endIndex);
+void SelectionBytes(TerminalAttr *attr, int row, int *selStart, int *selEnd);
+void SendFrame(AppendBuffer *frame);
+void SetMark(TerminalAttr *attr, int mark);
+void SplitRow(TerminalAttr *attr, int row, int index);
+void SplitWindow(TerminalAttr *attr, int split);
 void SetStatusMessage(TerminalAttr *attr, const char *frmt, ...);
-void WriteRows(TerminalAttr *attr, AppendBuffer *abuff);
+size_t SpanBytes(TerminalAttr *attr, int startRow, int startIndex, int endRow, int endIndex);
+int StatusMessageShown(TerminalAttr *attr);
+char *SidecarPath(const char *fileName, const char *suffix);
+void StartHighlightWorker(TerminalAttr *attr);
+void StopHighlightWorker(TerminalAttr *attr);
+void SwapLogAppend(SwapLog *swap, const EditOp *op);
+int SwapLogCommit(SwapLog *swap);
+void SwapLogDiscard(SwapLog *swap);
+void SwapLogSignal(int sig);
+void SwapLogTick(TerminalAttr *attr, int idle);
+int SwapLogWrite(SwapLog *swap, const unsigned char *bytes, size_t length);
+int SyntaxColor(int hl);
+int SyntaxKeywordClass(const SyntaxDef *syntax, const char *word, int length);
+int TextSpanEnd(TerminalAttr *attr, int row, int index, size_t length, int *endRow, int *endIndex);
+void ToggleFold(TerminalAttr *attr);
+void ToggleLineNumbers(TerminalAttr *attr);
+void TogglePerfHud(TerminalAttr *attr);
+uint64_t TraceBegin();
+void TraceDump(int allThreads);
+void TraceEnd(const char *name, uint64_t start);
+void TraceStart(const char *path);
+void TraceThread(const char *threadName);
+void ToggleSoftWrap(TerminalAttr *attr);
+void Undo(TerminalAttr *attr);
+void UnfoldAll(TerminalAttr *attr);
+void UnhideCursor(TerminalAttr *attr);
+void UpdateGutter(TerminalAttr *attr);
+void UpdateScreenSize(TerminalAttr *attr);
+void UpdateSyntax(TerminalAttr *attr, int row);
+void UpdateWrap(TerminalAttr *attr, int row);
+int ViewKeypress(TerminalAttr *attr, int key);
+void VirtualScreenPrint(VirtualScreen *screen);
+void VirtualScreenScroll(VirtualScreen *screen, int lines);
+void VirtualScreenWrite(VirtualScreen *screen, const char *buff, size_t length);
+int WaitForInput(TerminalAttr *attr);
+int WindowLeaves(TerminalAttr *attr, int node, int *leaves, int count);
+void WindowKeypress(TerminalAttr *attr, int key);
+void WriteBenchFile(const char *path, long long bytes, int minLines);
+void WriteFoldMarker(TerminalAttr *attr, AppendBuffer *abuff, int row, int room, int *color);
+void WrapRowShown(TerminalAttr *attr, int row);
+void WrapTreeAdd(TerminalAttr *attr, int *tree, int row, int delta);
+int WrapTreeFind(TerminalAttr *attr, int line, int *rowLine);
+int WrapTreePrefix(TerminalAttr *attr, int row);
+int WrapTreeRowLines(int *tree, int row);
+void WriteGutter(TerminalAttr *attr, AppendBuffer *abuff, int row, int firstLine, int *color);
+void WriteHexRows(TerminalAttr *attr, AppendBuffer *abuff, int *screenY, int *screenX);
+void WritePerfHud(TerminalAttr *attr, AppendBuffer *abuff);
+void WriteRows(TerminalAttr *attr, AppendBuffer *abuff, int first, int last);
+void WriteRowRun(TerminalAttr *attr, AppendBuffer *abuff, TerminalRow *tRow, int start, int end, int *color);
+void WriteRowText(TerminalAttr *attr, AppendBuffer *abuff, TerminalRow *tRow, int start, int end, int *color, int row);
 void WriteStatusBar(TerminalAttr *attr, AppendBuffer *abuff);
 void WriteStatusMessage(TerminalAttr *attr, AppendBuffer *abuff);
-char *WriteRowsToBuff(TerminalAttr *attr, int *length);
+int WriteAll(int fd, const void *buff, size_t length);
+int WriteHashed(int fd, const void *data, size_t length, uint64_t *checksum);
+void WriteTerminal(const char *buff, size_t length);
+size_t WriteOutput(const char *buff, size_t length, int wait);
+
+// swap log of the open file; ErrorHandler and fatal signals commit it before Helio exits
+static SwapLog *crashSwap = NULL;
+
+// screen output goes here instead of stdout when Helio runs headless (the replay harness)
+static VirtualScreen *headless = NULL;
+
+// frames not yet written to the terminal (see SendFrame)
+static TerminalOutput output = {STDOUT_FILENO, 0, NULL, 0, 0, NULL, 0, 0, ABUFF_INIT, 0};
+
+// the open files (see AddBuffer); the one on screen is buffers.list[buffers.current]
+static BufferList buffers = {NULL, 0, 0, (long long)BUFFER_CACHE_MB << 20, 0};
+
+// cells of the screen while there are split windows (see ComposeWindows)
+static CellGrid screenGrid = {NULL, NULL, 0, 0, 0};
+
+// text copied with CTRL-C or CTRL-X, pasted with CTRL-V
+static Clipboard clipboard = {NULL, 0, 0, 0, 0, NULL, 0};
+
+// the two base64 chars of every 12 bits, built the first time something is encoded
+static const char base64Chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static char base64Pairs[4096][2];
+static int base64PairsBuilt = 0;
+
+// the two hex digits of every byte, built the first time the hex view is drawn
+static const char hexDigits[] = "0123456789abcdef";
+static char hexPairs[256][2];
+static int hexPairsBuilt = 0;
+
+// --trace: the file spans are written to at exit (NULL if not tracing) and the ring of every thread
+static FILE *traceFile = NULL;
+static pthread_key_t traceKey;
+static TraceRing *traceRings[TRACE_THREADS];
+static int traceNumRings = 0;
+static uint64_t traceEpoch; // MonotonicNanos() when tracing started; timestamps count from here
+
+#ifdef COUNT_ALLOCS
+// allocations made by Helio, counted by wrapping malloc with the linker (see "make bench")
+static long long allocCalls = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    __sync_fetch_and_add(&allocCalls, 1);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    __sync_fetch_and_add(&allocCalls, 1);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    __sync_fetch_and_add(&allocCalls, 1);
+    return __real_realloc(ptr, size);
+}
+#define ALLOC_CALLS() (allocCalls)
+#else
+#define ALLOC_CALLS() (-1LL) // not counted
+#endif
+
+// text and render strings of rows; only used by the thread holding docLock
+static RowMemory rowMemory;
+
+//====================Syntax Definitions====================//
+// tables for every highlighted language, generated at build time from the definitions in gensyntax.c
+#include "syntax_tables.h"
+
+//====================Display Widths====================//
+// two-level table of Unicode display widths, generated at build time from the ranges in genwidth.c
+#include "width_table.h"
 
 //=============================================================//
 //====================Function Declarations====================//
@@ -131,6 +874,68 @@ char *WriteRowsToBuff(TerminalAttr *attr, int *length);
 //---------------Reading Keypresses---------------//
 //------------------------------------------------//
 
+/****************************************************************************************************
+ * Waits until a key can be read. The document lock is released while waiting so the highlight
+ * worker can run. Every 100 ms without a key (the user stopped typing), the swap log gets a chance
+ * to commit the edits that are still pending. Returns 1 once a key is waiting and 0 if the screen
+ * has to be redrawn, because the highlight worker finished rows that are on it or a frame that had
+ * to wait for the frame rate (see FrameDelay) is due. The lock is held again when it returns.
+ *
+ * Frames the terminal couldn't take yet are written while waiting, as soon as it can take more.
+ ****************************************************************************************************/
+int WaitForInput(TerminalAttr *attr)
+{
+    struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {output.fd, POLLOUT, 0}};
+    int ready;
+
+    if (attr->hlValidTo < attr->tRowsTot)
+    {
+        pthread_cond_signal(&attr->hlWake); // there are rows left to highlight
+    }
+
+    while (1)
+    {
+        int backlog = (output.sending != NULL) || (output.queued.length > 0) || (output.next != NULL);
+        int frameWait = FrameNeeded(attr) ? FrameDelay(attr) : -1; // -1 if no frame is waiting
+        if (frameWait == 0)
+        {
+            return 0;
+        }
+
+        pthread_mutex_unlock(&attr->docLock);
+        ready = poll(fds, backlog ? 2 : 1, ((frameWait > 0) && (frameWait < 100)) ? frameWait : 100);
+        pthread_mutex_lock(&attr->docLock);
+
+        if ((ready > 0) && (fds[0].revents != 0))
+        {
+            attr->perf.inputNanos = MonotonicNanos(); // input-to-paint starts here
+            attr->perf.allocMark = AllocCount();
+            return 1;
+        }
+        if ((ready > 0) && backlog) // the terminal can take more of a frame
+        {
+            FlushOutput(0);
+            continue;
+        }
+        if ((ready == -1) && (errno != EINTR))
+        {
+            ErrorHandler("poll");
+        }
+        if (frameWait > 0) // the frame is due now
+        {
+            continue;
+        }
+
+        SwapLogTick(attr, 1); // idle, so commit edits right away
+        if (attr->hlRepaint)
+        {
+            attr->hlRepaint = 0;
+            attr->shown.rowOffset = -1;
+            return 0;
+        }
+    }
+}
+
 /****************************************************************************************************
  * Monitors and captures key presses until a key event is registered. Translates registered
  * keypresses into appropriate enum constants.
@@ -196,6 +1001,39 @@ int ReadKeypress()
                         retSeq = '\x1b';
                     }
                 }
+                else if (escSeq[2] == ';') // keys pressed with a modifier, e.g., "\x1b[1;5H" for CTRL-Home
+                {
+                    char modSeq[2];
+                    retSeq = '\x1b';
+                    if (read(STDIN_FILENO, modSeq, 2) != 2) // the rest of the sequence didn't arrive in time
+                    {
+                        retSeq = '\x1b';
+                    }
+                    else if (modSeq[0] == '5') // 5 is CTRL
+                    {
+                        if (modSeq[1] == 'H')
+                        {
+                            retSeq = CTRL_HOME;
+                        }
+                        else if (modSeq[1] == 'F')
+                        {
+                            retSeq = CTRL_END;
+                        }
+                    }
+                    else if ((modSeq[0] == '2') && (modSeq[1] >= 'A') && (modSeq[1] <= 'D')) // 2 is SHIFT
+                    {
+                        // the arrows are A to D in the same order as the enum
+                        retSeq = SHIFT_UP_ARROW + (modSeq[1] - 'A');
+                    }
+                }
+                else
+                {
+                    retSeq = '\x1b';
+                }
+            }
+            else if (escSeq[1] == '?') // replies to queries start with "\x1b[?"
+            {
+                retSeq = ReadTerminalReply();
             }
             else // this case is for two character esc seq that follow the '['
             {
@@ -247,6 +1085,62 @@ int ReadKeypress()
     return c;
 }
 
+/****************************************************************************************************
+ * Reads the rest of a reply of the terminal to a query, after its "\x1b[?", up to its final char.
+ * The only query is the one OpenTerminalOutput sends to find out whether synchronized output (mode
+ * 2026) is supported; the reply is "\x1b[?2026;Ns$y" where N is 1 or 2 if it is (currently set or
+ * reset) and 0 or 4 if it isn't. The reply can come at any time, so it's read here with the keys.
+ ****************************************************************************************************/
+int ReadTerminalReply()
+{
+    char reply[32];
+    int length = 0;
+    char c;
+
+    while (read(STDIN_FILENO, &c, 1) == 1)
+    {
+        if (length < (int)sizeof(reply) - 1)
+        {
+            reply[length++] = c;
+        }
+        if ((c >= 0x40) && (c <= 0x7e)) // final char of the sequence
+        {
+            break;
+        }
+    }
+    reply[length] = '\0';
+
+    int mode, state;
+    if ((sscanf(reply, "%d;%d$y", &mode, &state) == 2) && (mode == 2026) && (reply[length - 1] == 'y'))
+    {
+        output.syncUpdates = (state == 1) || (state == 2);
+    }
+    return TERMINAL_REPLY;
+}
+
+/****************************************************************************************************
+ * Handles the key that's waiting and every key that came in after it, so the frame drawn next shows
+ * all of them at once; keys arriving faster than frames can be drawn (e.g., pasted text or a held
+ * key over a slow connection) don't each get a frame. Returns 0 if 'Ctrl + Q' was pressed.
+ ****************************************************************************************************/
+int ProcessInput(TerminalAttr *attr)
+{
+    struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+
+    do
+    {
+        if (ProcessKeypress(attr) == 0)
+        {
+            return 0;
+        }
+        if (buffers.count > 0) // the key may have switched to another buffer
+        {
+            attr = buffers.list[buffers.current];
+        }
+    } while (poll(&input, 1, 0) > 0);
+    return 1;
+}
+
 /****************************************************************************************************
  * Utilizes ReadKeyPress() to handle registered keypresses. Returns 0 if 'Ctrl + Q' is pressed,
  * typically indicating a program termination. Directs other keypresses to specific functions for
@@ -255,6 +1149,29 @@ int ReadKeypress()
 int ProcessKeypress(TerminalAttr *attr)
 {
     int key = ReadKeypress();
+    uint64_t traceStart = TraceBegin();
+
+    if (attr->windowKey && (key != TERMINAL_REPLY)) // the key after CTRL-K
+    {
+        attr->windowKey = 0;
+        WindowKeypress(attr, key);
+        TraceEnd("key", traceStart);
+        return 1;
+    }
+    if ((attr->hex != NULL) && HexKeypress(attr, key)) // so does the hex view
+    {
+        TraceEnd("key", traceStart);
+        return 1;
+    }
+    if (attr->readOnly && ViewKeypress(attr, key)) // the viewer has keys of its own and drops edits
+    {
+        TraceEnd("key", traceStart);
+        return 1;
+    }
+    if ((attr->mark == MARK_SHIFT) && (key >= UP_ARROW) && (key <= CTRL_END) && (key != DEL_KEY))
+    {
+        attr->mark = MARK_NONE; // moving without shift ends a shift selection
+    }
 
     switch (key)
     {
@@ -262,10 +1179,80 @@ int ProcessKeypress(TerminalAttr *attr)
         return 0; // returns 0 to end a while loop in main
         break;
 
+    case CTRL_KEY('@'): // CTRL-Space
+        SetMark(attr, (attr->mark == MARK_NONE) ? MARK_SET : MARK_NONE);
+        break;
+
+    case CTRL_KEY('c'):
+        CopySelection(attr);
+        break;
+
+    case CTRL_KEY('x'):
+        CutSelection(attr);
+        break;
+
+    case CTRL_KEY('v'):
+        PasteClipboard(attr);
+        break;
+
     case CTRL_KEY('s'):
         SaveFile(attr);
         break;
 
+    case CTRL_KEY('z'):
+        attr->mark = MARK_NONE;
+        Undo(attr);
+        break;
+
+    case CTRL_KEY('w'):
+        ToggleSoftWrap(attr);
+        break;
+
+    case CTRL_KEY('n'):
+        ToggleLineNumbers(attr);
+        break;
+
+    case CTRL_KEY('g'):
+        GotoPrompt(attr);
+        break;
+
+    case CTRL_KEY('p'):
+        TogglePerfHud(attr);
+        break;
+
+    case CTRL_KEY('f'):
+        ToggleFold(attr);
+        break;
+
+    case CTRL_KEY('t'):
+        FoldAll(attr);
+        break;
+
+    case CTRL_KEY('u'):
+        UnfoldAll(attr);
+        break;
+
+    case CTRL_KEY('k'): // window commands
+        attr->windowKey = 1;
+        SetStatusMessage(attr, "Window: - split, | split side by side, o next window, x close");
+        break;
+
+    case CTRL_KEY('o'):
+    case CTRL_KEY('b'): // next buffer
+        if ((buffers.count == 0) || (buffers.list[buffers.current] != attr)) // e.g., the replay harness
+        {
+            SetStatusMessage(attr, "Only one file can be open here");
+        }
+        else if (key == CTRL_KEY('o'))
+        {
+            OpenPrompt(attr);
+        }
+        else
+        {
+            SwitchBuffer(attr, (buffers.current + 1) % buffers.count);
+        }
+        break;
+
     case UP_ARROW:
     case DOWN_ARROW:
     case RIGHT_ARROW:
@@ -273,25 +1260,50 @@ int ProcessKeypress(TerminalAttr *attr)
         MoveCursor(attr, key);
         break;
 
-    case PAGE_UP:   // moves a whole page up
-    case PAGE_DOWN: // moves a whole page down
-        // goes to begnning of or end of next page by calling MoveCursor iteratively
-        for (int i = 0; i < attr->numRows - 1; i++) // iterates one whole page length
+    case SHIFT_UP_ARROW:
+    case SHIFT_DOWN_ARROW:
+    case SHIFT_RIGHT_ARROW:
+    case SHIFT_LEFT_ARROW:
+        if (attr->mark == MARK_NONE)
         {
-            // delegates scrolling to MoveCursor by simulating an up or down arrow key
-            MoveCursor(attr, key == PAGE_UP ? UP_ARROW : DOWN_ARROW);
+            SetMark(attr, MARK_SHIFT);
         }
+        MoveCursor(attr, key - SHIFT_UP_ARROW + UP_ARROW);
+        break;
+
+    case PAGE_UP:   // moves a whole page up
+    case PAGE_DOWN: // moves a whole page down
+        ScrollPage(attr, key == PAGE_UP ? -1 : 1);
         break;
     case HOME_KEY: // moves cursorX to beggining of the line
         attr->cursorX = 0;
         break;
+    case CTRL_HOME: // moves to the start of the file
+        GotoRow(attr, 0);
+        break;
+    case CTRL_END: // moves to the end of the last row
+        if (attr->tRowsTot > 0)
+        {
+            SetCursorPosition(attr, attr->tRowsTot - 1, attr->tRow[attr->tRowsTot - 1].rendCols);
+        }
+        break;
     case END_KEY: // moves cursorX to end of the line
-        attr->cursorX = attr->tRow[attr->cursorY + attr->rowOffset].rendSize;
+        if (attr->cursorY + attr->rowOffset < attr->tRowsTot)
+        {
+            int row = attr->cursorY + attr->rowOffset;
+            SetCursorPosition(attr, row, attr->tRow[row].rendCols); // scrolls if the end is off screen
+        }
         break;
 
-    // do nothing when ESC or CTRL-L is pressed
+    // ESC drops the selection; nothing happens when the terminal answered a query; CTRL-L redraws the whole screen
     case '\x1b':
-    case CTRL_KEY('l'):
+        attr->mark = MARK_NONE;
+        break;
+    case TERMINAL_REPLY:
+        break;
+    case CTRL_KEY('l'):
+        attr->shown.rowOffset = -1;
+        screenGrid.valid = 0;
         break;
 
     // special characters
@@ -306,13 +1318,157 @@ int ProcessKeypress(TerminalAttr *attr)
         break;
 
     default:
+        attr->mark = MARK_NONE;
         InsertCharWrapper(attr, key); // to insert characters typed by other keys
         break;
     }
 
+    TraceEnd("key", traceStart);
+    return 1;
+}
+
+/****************************************************************************************************
+ * Keys of the read-only viewer (-R), which are like the ones of less. A number typed before '%',
+ * 'g' or 'G' says where to go: "50%" jumps halfway into the file and "120g" to line 120. Returns 1
+ * if the key was handled here (keys that would edit the file are dropped) and 0 if ProcessKeypress
+ * should handle it the same way as in the editor.
+ ****************************************************************************************************/
+int ViewKeypress(TerminalAttr *attr, int key)
+{
+    long long count = attr->viewCount;
+    attr->viewCount = 0; // a number only applies to the key right after it
+
+    if ((key >= '0') && (key <= '9'))
+    {
+        if (count < 1000000000000LL) // more digits than any file has lines are ignored
+        {
+            attr->viewCount = count * 10 + (key - '0');
+        }
+        else
+        {
+            attr->viewCount = count;
+        }
+        SetStatusMessage(attr, ":%lld", attr->viewCount);
+        return 1;
+    }
+
+    switch (key)
+    {
+    case '%': // jumps to a percentage of the file
+        count = (count < 100) ? count : 100;
+        GotoRow(attr, count * (attr->tRowsTot - 1) / 100);
+        break;
+    case 'g': // jumps to line count, or the first line
+        GotoRow(attr, count ? count - 1 : 0);
+        break;
+    case 'G': // jumps to line count, or the last line
+        GotoRow(attr, count ? count - 1 : attr->tRowsTot - 1);
+        break;
+    case ' ':
+    case 'f':
+        ScrollPage(attr, 1);
+        break;
+    case 'b':
+        ScrollPage(attr, -1);
+        break;
+    case 'j':
+        MoveCursor(attr, DOWN_ARROW);
+        break;
+    case 'k':
+        MoveCursor(attr, UP_ARROW);
+        break;
+
+    // keys that don't change the file work like in the editor
+    case CTRL_KEY('q'):
+    case CTRL_KEY('w'):
+    case CTRL_KEY('n'):
+    case CTRL_KEY('g'):
+    case CTRL_KEY('p'):
+    case CTRL_KEY('l'):
+    case CTRL_KEY('@'):
+    case CTRL_KEY('c'):
+    case CTRL_KEY('o'):
+    case CTRL_KEY('b'):
+    case CTRL_KEY('k'):
+    case CTRL_KEY('f'):
+    case CTRL_KEY('t'):
+    case CTRL_KEY('u'):
+    case '\x1b':
+        return 0;
+
+    default:
+        if ((key >= UP_ARROW) && (key != DEL_KEY)) // cursor keys
+        {
+            return 0;
+        }
+        SetStatusMessage(attr, "%.40s is opened read-only", attr->fileName);
+        break;
+    }
     return 1;
 }
 
+/****************************************************************************************************
+ * Asks for a line of input in the status message area. frmt is shown with the text typed so far in
+ * place of its %s. The screen keeps being refreshed while typing. Returns the text (to be freed by
+ * the caller) once ENTER is pressed, or NULL if ESC cancels the prompt.
+ ****************************************************************************************************/
+char *Prompt(TerminalAttr *attr, const char *frmt)
+{
+    size_t capacity = 32, length = 0;
+    char *input = malloc(capacity);
+
+    if (input == NULL)
+    {
+        ErrorHandler("Prompt: Couldn't allocate memory to input");
+    }
+    input[0] = '\0';
+
+    while (1)
+    {
+        SetStatusMessage(attr, frmt, input);
+        UpdateScreenSize(attr);
+        RefreshScreen(attr);
+
+        if (!WaitForInput(attr)) // only a repaint
+        {
+            continue;
+        }
+        int key = ReadKeypress();
+
+        if ((key == BACKSPACE) || (key == DEL_KEY) || (key == CTRL_KEY('h')))
+        {
+            if (length > 0)
+            {
+                input[--length] = '\0';
+            }
+        }
+        else if (key == '\x1b')
+        {
+            SetStatusMessage(attr, "");
+            free(input);
+            return NULL;
+        }
+        else if ((key == '\r') && (length > 0))
+        {
+            SetStatusMessage(attr, "");
+            return input;
+        }
+        else if ((key >= ' ') && (key < BACKSPACE)) // printable ASCII
+        {
+            if (length + 1 == capacity)
+            {
+                capacity *= 2;
+                if ((input = realloc(input, capacity)) == NULL)
+                {
+                    ErrorHandler("Prompt: Couldn't reallocate memory to input");
+                }
+            }
+            input[length++] = key;
+            input[length] = '\0';
+        }
+    }
+}
+
 //-------------------------------------------------------------//
 //---------------Moving the Cursor and Scrolling---------------//
 //-------------------------------------------------------------//
@@ -329,9 +1485,15 @@ void MoveCursor(TerminalAttr *attr, int key)
 {
     int txtLen;
 
+    if (attr->softWrap)
+    {
+        MoveCursorWrapped(attr, key);
+        return;
+    }
+
     if (attr->cursorY < attr->tRowsTot) // checks if current row has text
     {
-        txtLen = attr->tRow[attr->cursorY + attr->rowOffset].rendSize;
+        txtLen = attr->tRow[attr->cursorY + attr->rowOffset].rendCols;
     }
     else // used for rows with no text (tilde rows) and is also a default size value for a file with no text
     {
@@ -341,7 +1503,11 @@ void MoveCursor(TerminalAttr *attr, int key)
     switch (key)
     {
     case UP_ARROW:
-        if (attr->cursorY == 0) // if cursor is at topmost of screen
+        if (attr->foldRoot != FOLD_NONE) // passes over folded rows; RefreshScreen scrolls (ScrollFolded)
+        {
+            attr->cursorY = FoldRowAbove(attr, attr->cursorY + attr->rowOffset) - attr->rowOffset;
+        }
+        else if (attr->cursorY == 0) // if cursor is at topmost of screen
         {
             Scroll(attr, UP_ARROW);
         }
@@ -352,7 +1518,12 @@ void MoveCursor(TerminalAttr *attr, int key)
         break;
 
     case DOWN_ARROW:
-        if (attr->cursorY == attr->numRows - 1) // if cursor is at bottom end of screen
+        if (attr->foldRoot != FOLD_NONE)
+        {
+            int below = FoldRowBelow(attr, attr->cursorY + attr->rowOffset);
+            attr->cursorY += (below < attr->tRowsTot) ? below - attr->cursorY - attr->rowOffset : 0;
+        }
+        else if (attr->cursorY == attr->numRows - 1) // if cursor is at bottom end of screen
         {
             Scroll(attr, DOWN_ARROW);
         }
@@ -363,13 +1534,19 @@ void MoveCursor(TerminalAttr *attr, int key)
         break;
 
     case RIGHT_ARROW:
-        if ((attr->cursorX < attr->numCols - 1) && (attr->cursorX < txtLen)) // if cursorX is less than screen or end of line
-        {
-            attr->cursorX++;
-        }
-        else if (attr->colOffset < attr->maxcolOffset)
+        if (attr->cursorX + attr->colOffset < txtLen) // moves past the whole char, which can be wider than 1
         {
-            Scroll(attr, RIGHT_ARROW); // scrolls right if less than maxcolOffset
+            for (int step = CursorStep(attr, RIGHT_ARROW); step > 0; step--)
+            {
+                if (attr->cursorX < attr->textCols - 1) // if cursorX is less than screen width
+                {
+                    attr->cursorX++;
+                }
+                else
+                {
+                    Scroll(attr, RIGHT_ARROW); // scrolls right; can't pass maxcolOffset before the end of line
+                }
+            }
         }
         // when the cursor reaches the end of the line, jump to the beginning of the line below
         else // means cursorX is on right side of last char
@@ -381,25 +1558,33 @@ void MoveCursor(TerminalAttr *attr, int key)
         break;
 
     case LEFT_ARROW:
-        if ((attr->cursorX == 0) && (attr->colOffset > 0)) // cursorX is at left end of screen & if screen has scrolled right
-        {
-            Scroll(attr, LEFT_ARROW);
-        }
         // when the cursor passes the beginning of the line, jump to the end of the line above
-        else if (attr->cursorX == 0)
+        if ((attr->cursorX == 0) && (attr->colOffset == 0))
         {
             MoveCursor(attr, UP_ARROW);           // recursive call to move cursorY up one line and update scroll/offset values
-            attr->cursorX = attr->numCols - 1;    // set cursorX to right end of screen
+            attr->cursorX = attr->textCols - 1;    // set cursorX to right end of screen
             attr->colOffset = attr->maxcolOffset; // set offset to max to ensure it reaches end of line
         }
-        else
-            attr->cursorX--;
+        else // moves to the start of the char before the cursor
+        {
+            for (int step = CursorStep(attr, LEFT_ARROW); step > 0; step--)
+            {
+                if (attr->cursorX == 0) // cursorX is at left end of screen & screen has scrolled right
+                {
+                    Scroll(attr, LEFT_ARROW);
+                }
+                else
+                {
+                    attr->cursorX--;
+                }
+            }
+        }
         break;
     }
 
     if (attr->cursorY < attr->tRowsTot) // checks if current row has text
     {
-        txtLen = attr->tRow[attr->cursorY + attr->rowOffset].rendSize;
+        txtLen = attr->tRow[attr->cursorY + attr->rowOffset].rendCols;
     }
     // used for rows with no text (tilde rows) and is also a default size value for a file with no text
     else
@@ -407,7 +1592,7 @@ void MoveCursor(TerminalAttr *attr, int key)
         txtLen = 0;
     }
 
-    attr->maxcolOffset = txtLen - attr->numCols + 1; // calculate max col offset
+    attr->maxcolOffset = txtLen - attr->textCols + 1; // calculate max col offset
     if (attr->maxcolOffset < 0)                      // make sure its not a negative value
     {
         attr->maxcolOffset = 0;
@@ -420,6 +1605,50 @@ void MoveCursor(TerminalAttr *attr, int key)
     {
         attr->colOffset = attr->maxcolOffset;
     }
+
+    // after moving up or down, the cursor can end up in the middle of a wide char or tab
+    if (attr->cursorY + attr->rowOffset < attr->tRowsTot)
+    {
+        int col = attr->cursorX + attr->colOffset;
+        int next;
+        attr->cursorX -= col - RowCharStart(&attr->tRow[attr->cursorY + attr->rowOffset], col, &next);
+        if (attr->cursorX < 0) // the char starts left of the screen
+        {
+            attr->colOffset += attr->cursorX;
+            attr->cursorX = 0;
+        }
+        // a wide char under the cursor at the right edge of the screen is scrolled fully into view
+        if ((next - attr->colOffset > attr->textCols) && (attr->colOffset < attr->maxcolOffset))
+        {
+            attr->colOffset++;
+            attr->cursorX--;
+        }
+    }
+}
+
+/****************************************************************************************************
+ * Returns how many columns the cursor has to move to reach the start of the next char (RIGHT_ARROW)
+ * or the previous char (LEFT_ARROW) on its row. That's 1 for ASCII text; wide chars and tabs take
+ * up more columns, and zero width chars (e.g., combining accents) are passed together with the char
+ * before them.
+ ****************************************************************************************************/
+int CursorStep(TerminalAttr *attr, int key)
+{
+    int row = attr->cursorY + attr->rowOffset;
+    int col = attr->cursorX + attr->colOffset;
+    int next;
+
+    if (row >= attr->tRowsTot) // rows without text
+    {
+        return 1;
+    }
+
+    if (key == RIGHT_ARROW)
+    {
+        RowCharStart(&attr->tRow[row], col, &next);
+        return next - col;
+    }
+    return (col > 0) ? col - RowCharStart(&attr->tRow[row], col - 1, NULL) : 0;
 }
 
 /****************************************************************************************************
@@ -458,429 +1687,8062 @@ void Scroll(TerminalAttr *attr, int key)
     }
 }
 
-//--------------------------------------------------------//
-//---------------Processing Text from Files---------------//
-//--------------------------------------------------------//
-
 /****************************************************************************************************
- * OpenFile takes the file name pointer as a parameter. It opens the file and copies each line
- * without including '/r' and '/n' characters. The size is also updated accordingly. The string of
- * each row or line is then put into AppendRow which handles storing the text for each row.
+ * Scrolls a page (a screen minus one line) down (direction 1) or up (direction -1) and moves the
+ * cursor along, so it stays on the same screen line unless the start or end of the file is
+ * reached. rowOffset and cursorY are worked out directly, so this takes the same time anywhere in a
+ * file of any size. With soft wrap on, pages are counted in screen lines using wrapTree.
  ****************************************************************************************************/
-void OpenFile(TerminalAttr *attr, char *fileName)
+void ScrollPage(TerminalAttr *attr, int direction)
 {
-    // free(attr->fileName);
-    attr->fileName = strdup(fileName);
+    int page = (attr->numRows > 1) ? attr->numRows - 1 : 1;
 
-    FILE *fp = fopen(fileName, "r");
-    if (!fp)
+    if (attr->tRowsTot == 0)
     {
-        ErrorHandler("fopen");
+        return;
     }
-    char *lineTxt = NULL;
-    size_t capacity = 0;
-    ssize_t lineSize;
 
-    while ((lineSize = getline(&lineTxt, &capacity, fp)) != -1)
-    { // skips through all newline and return char in the row
+    if (attr->softWrap)
+    {
+        int width = attr->textCols;
+        int row = attr->cursorY + attr->rowOffset;
+        row = (row < attr->tRowsTot) ? row : attr->tRowsTot - 1;
 
-        while ((lineSize > 0) && ((lineTxt[lineSize - 1] == '\n') || (lineTxt[lineSize - 1] == '\r')))
+        if (attr->wrapTreeWidth != width)
         {
-            lineSize--; // the size is updated and excludes '\n' & '\r' chars
+            SelectWrapTree(attr);
         }
-        // the line is then copied without '\n' or '\r' chars
-        AppendRow(attr, lineTxt, lineSize);
+        WrapRowShown(attr, row);
+        int rowLine = RowWrapLine(&attr->tRow[row], width, attr->cursorX);
+        int lineCol = attr->cursorX - RowWrapStart(&attr->tRow[row], width, rowLine);
+
+        int totalLines = WrapTreePrefix(attr, attr->tRowsTot);
+        int topLine = WrapTreePrefix(attr, attr->rowOffset) + attr->wrapTop + direction * page;
+        int cursorLine = WrapTreePrefix(attr, row) + rowLine + direction * page;
+        topLine = (topLine < totalLines - attr->numRows) ? topLine : totalLines - attr->numRows;
+        topLine = (topLine > 0) ? topLine : 0;
+        cursorLine = (cursorLine < totalLines - 1) ? cursorLine : totalLines - 1;
+        cursorLine = (cursorLine > 0) ? cursorLine : 0;
+
+        attr->rowOffset = WrapTreeFind(attr, topLine, &attr->wrapTop);
+        row = WrapTreeFind(attr, cursorLine, &rowLine);
+        WrapRowShown(attr, row); // the row's estimated number of lines can change once it's wrapped
+        int count = RowWrapCount(&attr->tRow[row], width);
+        rowLine = (rowLine < count) ? rowLine : count - 1;
+
+        // keeps the cursor's column on the screen line, without passing to the next one
+        attr->cursorX = RowWrapStart(&attr->tRow[row], width, rowLine) + lineCol;
+        if ((rowLine + 1 < count) && (attr->cursorX >= RowWrapStart(&attr->tRow[row], width, rowLine + 1)))
+        {
+            attr->cursorX = RowWrapStart(&attr->tRow[row], width, rowLine + 1) - 1;
+        }
+        attr->cursorY = row - attr->rowOffset;
+        MoveCursor(attr, 0); // snaps the cursor to the start of a char
+        return;
     }
 
-    attr->maxrowOffset = attr->tRowsTot - attr->numRows;
-    free(lineTxt);
-    fclose(fp);
-}
-
-/****************************************************************************************************
- * This function copies text from the string given to it into a string within tRow (TerminalRow
- * struct). tRow is an array where each index contains a string and the size of that string for a
- * single row of text from the file. Tabs are accounted for in RenderRow.
- ****************************************************************************************************/
-void AppendRow(TerminalAttr *attr, char *str, size_t rowSize)
-{
-    attr->tRowsTot++; // new row added
-    attr->tRow = realloc(attr->tRow, sizeof(TerminalRow) * (attr->tRowsTot));
-
-    int i = attr->tRowsTot - 1;
+    if (attr->foldRoot != FOLD_NONE) // pages are counted in screen lines, which folded rows don't take up
+    {
+        int row = attr->cursorY + attr->rowOffset;
+        row = (row < attr->tRowsTot) ? row : attr->tRowsTot - 1;
+
+        int totalLines = FoldRowToLine(attr, attr->tRowsTot);
+        int topLine = FoldRowToLine(attr, attr->rowOffset) + direction * page;
+        int cursorLine = FoldRowToLine(attr, row) + direction * page;
+        topLine = (topLine < totalLines - attr->numRows) ? topLine : totalLines - attr->numRows;
+        topLine = (topLine > 0) ? topLine : 0;
+        cursorLine = (cursorLine < totalLines - 1) ? cursorLine : totalLines - 1;
+        cursorLine = (cursorLine > 0) ? cursorLine : 0;
+
+        attr->rowOffset = FoldLineToRow(attr, topLine);
+        attr->cursorY = FoldLineToRow(attr, cursorLine) - attr->rowOffset;
+        MoveCursor(attr, 0);
+        return;
+    }
 
-    attr->tRow[i].size = rowSize;
-    attr->tRow[i].text = malloc(rowSize + 1); // +1 for null char
-    memcpy(attr->tRow[i].text, str, rowSize); // copy string into allocated slot
-    attr->tRow[i].text[rowSize] = '\0';
+    int maxOffset = (attr->tRowsTot > attr->numRows) ? attr->tRowsTot - attr->numRows : 0;
+    int row = attr->cursorY + attr->rowOffset + direction * page;
 
-    attr->tRow[i].rendSize = 0; // initialize render string and its size
-    attr->tRow[i].rendStr = NULL;
+    attr->rowOffset += direction * page;
+    attr->rowOffset = (attr->rowOffset < maxOffset) ? attr->rowOffset : maxOffset;
+    attr->rowOffset = (attr->rowOffset > 0) ? attr->rowOffset : 0;
+    row = (row < attr->tRowsTot - 1) ? row : attr->tRowsTot - 1;
+    row = (row > 0) ? row : 0;
 
-    RenderRow(&attr->tRow[i]); // send to RenderRow to account for tabs
+    attr->cursorY = row - attr->rowOffset;
+    MoveCursor(attr, 0); // no key; only clamps the cursor to the new row
 }
 
 /****************************************************************************************************
- * This function takes one tRow index as it's parameter. It first checks the string in tRow for
- * tab characters. It then allocates memory for a new string, rendStr. If it found tab characters
- * in text (tRow string), it allocates 7 additional spaces in memory for each tab characrer found.
- * It then adds spaces for each tab in rendStr until it reaches a tab stop.
+ * Places the cursor on file row 'row' at render column 'col', scrolling only when that position is
+ * not already on screen. Used when the cursor has to jump somewhere (e.g., to the location of an
+ * undone edit) rather than move one step at a time.
  ****************************************************************************************************/
-void RenderRow(TerminalRow *tRow)
+void SetCursorPosition(TerminalAttr *attr, int row, int col)
 {
-    int numTabs = 0;
-    int i;
+    if (RowIsFolded(attr, row)) // jumping into a fold opens it
+    {
+        FoldEdit(attr, row, 1, 0);
+        FoldsChanged(attr);
+    }
 
-    for (i = 0; i < tRow->size; i++)
+    if (attr->softWrap) // RefreshScreen scrolls to the cursor (ScrollWrapped)
     {
-        if (tRow->text[i] == '\t')
+        attr->cursorY = row - attr->rowOffset;
+        attr->cursorX = col;
+        MoveCursor(attr, 0);
+        return;
+    }
+
+    if (attr->foldRoot != FOLD_NONE) // the same, counting screen lines rather than rows
+    {
+        int line = FoldRowToLine(attr, row), top = FoldRowToLine(attr, attr->rowOffset);
+        if ((line < top) || (line >= top + attr->numRows))
         {
-            numTabs++;
+            int maxTop = FoldRowToLine(attr, attr->tRowsTot) - attr->numRows;
+            top = line - attr->numRows / 2;
+            top = (top < maxTop) ? top : maxTop;
+            attr->rowOffset = FoldLineToRow(attr, (top > 0) ? top : 0);
         }
     }
-
-    free(tRow->rendStr); // make sure no memory is reserved for rendStr
-    // each tab is a maximum of 8 characters, 1 character has already been accounted for each tab
-    tRow->rendStr = malloc(tRow->size + 1 + numTabs * 7); // reserves the appropiate amount of memory
-
-    int j = 0; // used to keep track of rendStr indices seperately of text indices
-
-    for (i = 0; i < tRow->size; i++)
+    else if ((row < attr->rowOffset) || (row >= attr->rowOffset + attr->numRows)) // row is off screen
     {
-        if (tRow->text[i] != '\t')
+        attr->rowOffset = row - attr->numRows / 2; // centers the row vertically
+        if (attr->rowOffset > attr->tRowsTot - attr->numRows)
         {
-            tRow->rendStr[j++] = tRow->text[i]; // copy character from text string
+            attr->rowOffset = attr->tRowsTot - attr->numRows;
         }
-        else
+        if (attr->rowOffset < 0)
         {
-            tRow->rendStr[j++] = ' '; // each tab must increment by at least one space
-            while (j % TAB_STOP != 0) // checks for a tab stop
-            {
-                tRow->rendStr[j++] = ' '; // keep adding tabs until we reach a tab stop
-            }
+            attr->rowOffset = 0;
         }
     }
+    attr->cursorY = row - attr->rowOffset;
 
-    tRow->rendStr[j] = '\0';
-    tRow->rendSize = j; // set to num of chars copied
+    if ((col < attr->colOffset) || (col >= attr->colOffset + attr->textCols)) // column is off screen
+    {
+        attr->colOffset = (col < attr->textCols) ? 0 : col - attr->textCols + 1;
+    }
+    attr->cursorX = col - attr->colOffset;
+
+    MoveCursor(attr, 0); // no key; only updates maxcolOffset and clamps the cursor to the row
 }
 
-//-------------------------------------------------------//
-//---------------Displaying Text on Screen---------------//
-//-------------------------------------------------------//
+/****************************************************************************************************
+ * Moves the cursor to the start of row 'row' (counted from 0), or the first or last row if it's
+ * outside the file.
+ ****************************************************************************************************/
+void GotoRow(TerminalAttr *attr, long long row)
+{
+    if (row > attr->tRowsTot - 1)
+    {
+        row = attr->tRowsTot - 1;
+    }
+    if (row < 0)
+    {
+        row = 0;
+    }
+    SetCursorPosition(attr, row, 0);
+}
 
 /****************************************************************************************************
- * Taking a string, the string's length and an AppendBuffer as its parameters, this function
- * reallocates memory for a pointer that points to the buffer string within the abuff struct. The
- * buffer string's job is to store all the text for a file. So when a new line of text is sent to
- * AppendString, AppendString must make sure there is enough memory in the buffer string to append
- * the new string on top of the text that is already inside the buffer.
+ * Moves the cursor to the char at byte 'offset' of the file, counting one byte for the newline at
+ * the end of each row (the file as Helio saves it). Offsets past the end go to the end of the file.
  ****************************************************************************************************/
-void AppendString(AppendBuffer *abuff, const char *str, int length)
+void GotoByte(TerminalAttr *attr, long long offset)
 {
-    // creates new buffer pointer with appropiate memory size
-    char *newBuff = realloc(abuff->buff, abuff->length + length); // length of new string is accounted for
+    long long rowStart;
 
-    if (newBuff == NULL) // in case of failure of trying to allocate memory
+    if (attr->tRowsTot == 0)
     {
         return;
     }
+    int row = ByteTreeFind(attr, (offset > 0) ? offset : 0, &rowStart);
 
-    memcpy(&newBuff[abuff->length], str, length); // appends new string to end of old buffer
-    abuff->buff = newBuff;                        // sets pointer to the new buffer pointer that has additional memory
-    abuff->length += length;                      // adjusts the lenght of the buffer string
+    long long index = offset - rowStart;
+    index = (index < attr->tRow[row].size) ? index : attr->tRow[row].size;
+    SetCursorPosition(attr, row, RowIndexToRender(&attr->tRow[row], index)); // snaps to the start of the char
 }
 
 /****************************************************************************************************
- * Deallocates memory from the append buffer.
+ * CTRL-G asks where to go: a line number, a percentage of the file ("25%") or a byte offset
+ * ("@4096").
  ****************************************************************************************************/
-void FreeAbuff(AppendBuffer *abuff)
+void GotoPrompt(TerminalAttr *attr)
 {
-    free(abuff->buff);
+    char *input = Prompt(attr, "Go to line, N%% or @byte offset: %s");
+    char *number, *end;
+
+    if (input == NULL)
+    {
+        return;
+    }
+    number = (input[0] == '@') ? input + 1 : input;
+    long long value = strtoll(number, &end, 10);
+
+    if ((end == number) || (value < 0))
+    {
+        SetStatusMessage(attr, "Not a line number: %.40s", input);
+    }
+    else if ((number != input) && (*end == '\0'))
+    {
+        GotoByte(attr, value);
+    }
+    else if ((number == input) && (*end == '%') && (end[1] == '\0'))
+    {
+        value = (value < 100) ? value : 100;
+        GotoRow(attr, value * (attr->tRowsTot - 1) / 100);
+    }
+    else if ((number == input) && (*end == '\0'))
+    {
+        GotoRow(attr, value - 1);
+    }
+    else
+    {
+        SetStatusMessage(attr, "Not a line number: %.40s", input);
+    }
+    free(input);
 }
 
+//------------------------------------------------//
+//---------------Soft Wrapping--------------------//
+//------------------------------------------------//
+
 /****************************************************************************************************
- * This function takes in the append buffer as a parameter. If no file is loaded, it prints a
- * welcome message. If a file was opened, WriteRows prints as many rows that fit onto the screen.
+ * With soft wrap on (CTRL-W), a row that is wider than the screen continues on the next screen line
+ * and colOffset stays 0. The cursor is then kept as a position in the text rather than on screen:
+ * cursorY + rowOffset is still the row and cursorX the column in that row, which can be wider than
+ * the screen. Only RefreshScreen works out where that is on screen (ScrollWrapped), and wrapTop
+ * says how many screen lines of row rowOffset are scrolled off the top.
  *
- * If vertical scrolling has occured, we start copying rows from the rendStr array with an index
- * offset by the amount of vertical scrolling that occured. If horizontal scrolling has occured,
- * we copy the text from from each row with the index of the string offset by the amount of
- * horizontal scrolling that occured. RefreshScreen handles printing to the terminal.
+ * Where a row breaks only depends on the row and the screen width. Plain rows break every textCols
+ * columns, which is computed on the spot. Other rows (wide chars can't be split) store the columns
+ * their screen lines start at in wraps, computed the first time they're needed for a width; the
+ * row changing (RenderRow) or a different width recomputes them.
+ *
+ * The number of screen lines of every row is kept in a Fenwick tree (wrapTree), so the screen line
+ * a row starts at and the row shown on a given screen line are both found in O(log n). It's built in
+ * O(n) when soft wrap is turned on, after rows are added or removed and after the screen is resized,
+ * using the row widths alone (which is exact for plain rows). Rows that aren't plain are wrapped
+ * exactly once they're about to be shown, and WrapRowShown corrects their count in the tree.
+ *
+ * Side by side windows show the buffer at different widths, so a tree is kept for each of up to
+ * WRAP_TREE_MAX widths (wrapTrees) and wrapTree is the one for the window being drawn; a frame
+ * switches between them instead of rebuilding one. An edit updates all of them (UpdateWrap): the
+ * current window's exactly and the others as BuildWrapTree would count the row, until it's shown.
+ ****************************************************************************************************/
+
+/****************************************************************************************************
+ * Turns soft wrap on or off, keeping the cursor on the same char.
  ****************************************************************************************************/
-void WriteRows(TerminalAttr *attr, AppendBuffer *abuff)
+void ToggleSoftWrap(TerminalAttr *attr)
 {
-    int rows = attr->numRows;
-    int columns = attr->numCols;
-    int scrollRows = attr->rowOffset;
-    int scrollCols = attr->colOffset;
-    int fileRows = attr->tRowsTot;
-    char welcome[40];
+    int row = attr->cursorY + attr->rowOffset;
+    int col = attr->cursorX + attr->colOffset;
 
-    int length = snprintf(welcome, sizeof(welcome), "Helio Editor -- version %s", HELIO_VERSION);
-    if (length > columns)
+    attr->softWrap = !attr->softWrap;
+    attr->wrapTop = 0;
+    ResetWrapTrees(attr);
+    attr->colOffset = 0;
+    attr->maxcolOffset = 0;
+
+    if (attr->softWrap)
+    {
+        attr->cursorX = col;
+    }
+    else // the cursor has to be on screen again
     {
-        length = columns; // makes sure message fits screen
+        attr->cursorX = 0;
+        SetCursorPosition(attr, row, col);
     }
-    int padding = (columns - length - 1) / 2; // minus 1 to account for the tilde
+    SetStatusMessage(attr, "Soft wrap %s", attr->softWrap ? "on" : "off");
+}
 
-    for (int i = 0; i < rows; i++)
-    { // only prints as many rows that fit on screen
+/****************************************************************************************************
+ * MoveCursor while soft wrap is on. The arrow keys move the cursor through the text (UP and DOWN by
+ * whole rows) and ScrollWrapped scrolls the screen after the fact.
+ ****************************************************************************************************/
+void MoveCursorWrapped(TerminalAttr *attr, int key)
+{
+    int row = attr->cursorY + attr->rowOffset;
+    int txtLen = (row < attr->tRowsTot) ? attr->tRow[row].rendCols : 0;
 
-        // makes sure all rows of text are written (matters only when text file is smaller than screen)
-        if (i < fileRows)
+    int below = FoldRowBelow(attr, row); // folded rows are passed over
+
+    switch (key)
+    {
+    case UP_ARROW:
+        row = FoldRowAbove(attr, row);
+        break;
+    case DOWN_ARROW:
+        row = (below < attr->tRowsTot) ? below : row;
+        break;
+    case RIGHT_ARROW:
+        if (attr->cursorX < txtLen)
+        {
+            attr->cursorX += CursorStep(attr, RIGHT_ARROW);
+        }
+        else if (below < attr->tRowsTot) // jumps to the beginning of the row below
+        {
+            row = below;
+            attr->cursorX = 0;
+        }
+        break;
+    case LEFT_ARROW:
+        if (attr->cursorX > 0)
+        {
+            attr->cursorX -= CursorStep(attr, LEFT_ARROW);
+        }
+        else if (row > 0) // jumps to the end of the row above
         {
-            int txtLen = attr->tRow[i + scrollRows].rendSize - scrollCols; // accounts for scrolled rows
+            row = FoldRowAbove(attr, row);
+            attr->cursorX = attr->tRow[row].rendCols;
+        }
+        break;
+    }
 
-            if (txtLen > columns) // if txtLen is greater than window width
-            {
-                txtLen = columns; // makes txtLen same legnth of window width
-            }
+    attr->cursorY = row - attr->rowOffset;
+    if (row < attr->tRowsTot)
+    {
+        if (attr->cursorX > attr->tRow[row].rendCols)
+        {
+            attr->cursorX = attr->tRow[row].rendCols;
+        }
+        attr->cursorX = RowCharStart(&attr->tRow[row], attr->cursorX, NULL); // never in a wide char
+    }
+    else
+    {
+        attr->cursorX = 0;
+    }
+}
 
-            if (txtLen > 0) // doesn't let string be printed if no there is no text
-            {
-                AppendString(abuff, &attr->tRow[i + scrollRows].rendStr[scrollCols], txtLen);
-            }
+/****************************************************************************************************
+ * Scrolls so the cursor's screen line is on screen, like moving the cursor does without soft wrap,
+ * and sets screenY and screenX to where the cursor is on screen. Called by RefreshScreen before the
+ * rows are written.
+ ****************************************************************************************************/
+void ScrollWrapped(TerminalAttr *attr, int *screenY, int *screenX)
+{
+    int width = attr->textCols;
+    int row = attr->cursorY + attr->rowOffset;
+    int rowLine = 0; // screen line of the cursor within its row
+
+    if (RowIsFolded(attr, row))
+    {
+        UnhideCursor(attr);
+        row = attr->cursorY + attr->rowOffset;
+    }
+    if (attr->wrapTreeWidth != width)
+    {
+        SelectWrapTree(attr);
+    }
+    if (row < attr->tRowsTot)
+    {
+        WrapRowShown(attr, row);
+        rowLine = RowWrapLine(&attr->tRow[row], width, attr->cursorX);
+        *screenX = attr->cursorX - RowWrapStart(&attr->tRow[row], width, rowLine);
+    }
+    else
+    {
+        *screenX = 0;
+    }
+
+    int cursorLine = WrapTreePrefix(attr, row) + rowLine;
+    int topLine = WrapTreePrefix(attr, attr->rowOffset) + attr->wrapTop;
+    for (int pass = 0; pass < 2; pass++) // rows that just got wrapped exactly can push the cursor down
+    {
+        if (cursorLine < topLine)
+        {
+            topLine = cursorLine;
         }
-        else // inserts padding and welcome message
+        else if (cursorLine >= topLine + attr->numRows)
         {
-            AppendString(abuff, "~", 1); // prints tilde on left most column of screen
-            // prints welcome message a fourth down the screen
-            if ((i == rows / 4) && (fileRows == 0)) // only prints wlc msg if no file loaded
+            topLine = cursorLine - attr->numRows + 1;
+        }
+        attr->rowOffset = WrapTreeFind(attr, topLine, &attr->wrapTop);
+
+        // wraps the rows on screen exactly
+        for (int r = attr->rowOffset, lines = -attr->wrapTop; (r < attr->tRowsTot) && (lines < attr->numRows);
+             r = FoldRowBelow(attr, r))
+        {
+            WrapRowShown(attr, r);
+            lines += RowWrapCount(&attr->tRow[r], width);
+        }
+        cursorLine = WrapTreePrefix(attr, row) + rowLine;
+        topLine = WrapTreePrefix(attr, attr->rowOffset) + attr->wrapTop;
+    }
+
+    attr->cursorY = row - attr->rowOffset;
+    *screenY = cursorLine - topLine;
+    if (*screenX > width - 1) // the end of a row that exactly fills its last screen line
+    {
+        *screenX = width - 1;
+    }
+}
+
+/****************************************************************************************************
+ * Computes the columns the screen lines of a row that isn't plain start at, if they aren't known for
+ * this width yet. A line breaks before the char that doesn't fit anymore, so wide chars are never
+ * split; zero width chars stay on the line of the char before them.
+ ****************************************************************************************************/
+void BuildRowWraps(TerminalRow *tRow, int width)
+{
+    if (((tRow->wraps != NULL) && (tRow->wrapWidth == width)) || RowIsPlain(tRow))
+    {
+        return;
+    }
+
+    RenderIfDropped(tRow);
+    int capacity = tRow->rendCols / (width > 1 ? width - 1 : 1) + 2; // lines are at least width - 1 wide
+    free(tRow->wraps);
+    if ((tRow->wraps = malloc(sizeof(int) * capacity)) == NULL)
+    {
+        ErrorHandler("BuildRowWraps: Couldn't allocate memory");
+    }
+
+    int col = 0, lineStart = 0;
+    tRow->wraps[0] = 0;
+    tRow->numWraps = 1;
+    for (int i = 0; i < tRow->rendSize;)
+    {
+        int charWidth;
+        i += NextChar(&tRow->rendStr[i], tRow->rendSize - i, col, &charWidth);
+        if ((col + charWidth - lineStart > width) && (col > lineStart)) // starts a new line
+        {
+            if (tRow->numWraps == capacity)
             {
-                for (int j = 0; j < padding; j++) // centers message by adding spaces
+                capacity *= 2;
+                if ((tRow->wraps = realloc(tRow->wraps, sizeof(int) * capacity)) == NULL)
                 {
-                    AppendString(abuff, " ", 1);
+                    ErrorHandler("BuildRowWraps: realloc memory for tRow->wraps");
                 }
-                AppendString(abuff, welcome, length);
             }
+            tRow->wraps[tRow->numWraps++] = lineStart = col;
         }
+        col += charWidth;
+    }
+    tRow->wrapWidth = width;
+}
 
-        AppendString(abuff, "\x1b[K", 3); // command that clears everything right of the cursor
-        AppendString(abuff, "\r\n", 2);   // adds newline for every line
+/****************************************************************************************************
+ * Returns the number of screen lines a row takes up when wrapped at width columns (at least one).
+ ****************************************************************************************************/
+int RowWrapCount(TerminalRow *tRow, int width)
+{
+    if (RowIsPlain(tRow))
+    {
+        return (tRow->rendCols > 0) ? (tRow->rendCols + width - 1) / width : 1;
     }
+    BuildRowWraps(tRow, width);
+    return tRow->numWraps;
 }
 
 /****************************************************************************************************
- * Prints the statusBar (last bar on screen) to display information about the file (file name and
- * row number). If no file is opened and therefore no file name is given, the default is set to
- * "[No Name]" in InitTerminalAttr. Up to 20 characters of the file name will be shown.
+ * Returns the column screen line 'line' of a row starts at when wrapped at width columns.
+ ****************************************************************************************************/
+int RowWrapStart(TerminalRow *tRow, int width, int line)
+{
+    if (RowIsPlain(tRow))
+    {
+        return line * width;
+    }
+    BuildRowWraps(tRow, width);
+    return tRow->wraps[line];
+}
+
+/****************************************************************************************************
+ * Returns the screen line of a row that column col is on when wrapped at width columns. The end of
+ * the row counts as part of its last line.
+ ****************************************************************************************************/
+int RowWrapLine(TerminalRow *tRow, int width, int col)
+{
+    int count = RowWrapCount(tRow, width);
+    int low = 0, high = count - 1;
+
+    if (RowIsPlain(tRow))
+    {
+        return (col / width < count) ? col / width : count - 1;
+    }
+    while (low < high) // binary search for the last line that starts at or before col
+    {
+        int mid = (low + high + 1) / 2;
+        if (tRow->wraps[mid] <= col)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+/****************************************************************************************************
+ * Returns the number of screen lines of a row at width columns without wrapping it: exact if it's
+ * plain or already wrapped for this width, else as many as its columns fill.
+ ****************************************************************************************************/
+int RowWrapEstimate(TerminalRow *tRow, int width)
+{
+    if (RowIsPlain(tRow) || ((tRow->wraps != NULL) && (tRow->wrapWidth == width)))
+    {
+        return RowWrapCount(tRow, width);
+    }
+    return (tRow->rendCols > 0) ? (tRow->rendCols + width - 1) / width : 1;
+}
+
+/****************************************************************************************************
+ * Makes wrapTree the tree for the current screen width, building it in a tree that's unused or,
+ * failing that, in the next one in turn if there's none for this width yet.
+ ****************************************************************************************************/
+void SelectWrapTree(TerminalAttr *attr)
+{
+    int slot = -1;
+
+    for (int i = 0; (i < WRAP_TREE_MAX) && (slot == -1); i++)
+    {
+        slot = (attr->wrapTreeWidths[i] == attr->textCols) ? i : -1;
+    }
+    for (int i = 0; (i < WRAP_TREE_MAX) && (slot == -1); i++)
+    {
+        slot = (attr->wrapTreeWidths[i] == 0) ? i : -1;
+    }
+    if (slot == -1)
+    {
+        slot = attr->wrapTreeNext;
+        attr->wrapTreeNext = (slot + 1) % WRAP_TREE_MAX;
+    }
+
+    if (attr->wrapTreeWidths[slot] != attr->textCols)
+    {
+        BuildWrapTree(attr, slot);
+    }
+    attr->wrapTree = attr->wrapTrees[slot];
+    attr->wrapTreeWidth = attr->textCols;
+}
+
+/****************************************************************************************************
+ * Marks every wrap tree to be rebuilt, after rows were added or removed or folds changed. Their
+ * memory is kept for the rebuild.
+ ****************************************************************************************************/
+void ResetWrapTrees(TerminalAttr *attr)
+{
+    for (int i = 0; i < WRAP_TREE_MAX; i++)
+    {
+        attr->wrapTreeWidths[i] = 0;
+    }
+    attr->wrapTreeWidth = 0;
+}
+
+/****************************************************************************************************
+ * Rebuilds wrap tree slot for the current screen width in O(n). Rows that aren't wrapped for this
+ * width yet are counted as if they were plain, which WrapRowShown corrects once they're shown. Rows
+ * hidden in folds take up no screen lines.
+ ****************************************************************************************************/
+void BuildWrapTree(TerminalAttr *attr, int slot)
+{
+    uint64_t traceStart = TraceBegin();
+    int width = attr->textCols;
+    int foldStart, foldEnd, fold = FoldNextRange(attr, 0, &foldStart, &foldEnd);
+    int *tree = realloc(attr->wrapTrees[slot], sizeof(int) * ((size_t)attr->tRowsTot + 1));
+
+    if (tree == NULL)
+    {
+        ErrorHandler("BuildWrapTree: realloc memory for wrapTree");
+    }
+    memset(tree, 0, sizeof(int) * ((size_t)attr->tRowsTot + 1));
+
+    for (int i = 1; i <= attr->tRowsTot; i++) // node i covers rows i - (i & -i) up to i - 1
+    {
+        TerminalRow *tRow = &attr->tRow[i - 1];
+        if ((fold != FOLD_NONE) && (i - 1 > foldEnd)) // past the fold; the next one is looked up
+        {
+            fold = FoldNextRange(attr, i - 1, &foldStart, &foldEnd);
+        }
+
+        if ((fold == FOLD_NONE) || (i - 1 <= foldStart)) // rows folded away take up no lines
+        {
+            tree[i] += RowWrapEstimate(tRow, width);
+        }
+
+        int parent = i + (i & -i);
+        if (parent <= attr->tRowsTot)
+        {
+            tree[parent] += tree[i];
+        }
+    }
+    attr->wrapTrees[slot] = tree;
+    attr->wrapTreeWidths[slot] = width;
+    TraceEnd("build wrap tree", traceStart);
+}
+
+/****************************************************************************************************
+ * Adds delta to the number of screen lines of a row in one of the wrap trees.
+ ****************************************************************************************************/
+void WrapTreeAdd(TerminalAttr *attr, int *tree, int row, int delta)
+{
+    for (int i = row + 1; i <= attr->tRowsTot; i += i & -i)
+    {
+        tree[i] += delta;
+    }
+}
+
+/****************************************************************************************************
+ * Returns the number of screen lines of a row in one of the wrap trees: its node less the nodes
+ * below it that cover the rows before it.
+ ****************************************************************************************************/
+int WrapTreeRowLines(int *tree, int row)
+{
+    int node = row + 1, lines = tree[node];
+
+    for (int i = node - 1; i > node - (node & -node); i -= i & -i)
+    {
+        lines -= tree[i];
+    }
+    return lines;
+}
+
+/****************************************************************************************************
+ * Returns the number of screen lines taken up by the rows before 'row', i.e., the screen line the
+ * row starts at if the file were shown from its first row.
+ ****************************************************************************************************/
+int WrapTreePrefix(TerminalAttr *attr, int row)
+{
+    int lines = 0;
+
+    for (int i = (row < attr->tRowsTot) ? row : attr->tRowsTot; i > 0; i -= i & -i)
+    {
+        lines += attr->wrapTree[i];
+    }
+    return lines;
+}
+
+/****************************************************************************************************
+ * Returns the row shown on screen line 'line' (counted from the first row of the file) and sets
+ * rowLine to which of the row's screen lines it is. Walks down the tree one power of two at a time.
+ * Lines past the end of the file map to rows past the last row.
+ ****************************************************************************************************/
+int WrapTreeFind(TerminalAttr *attr, int line, int *rowLine)
+{
+    int row = 0; // rows before the one that's looked for
+
+    if (line < 0)
+    {
+        line = 0;
+    }
+
+    int step = 1;
+    while (step * 2 <= attr->tRowsTot)
+    {
+        step *= 2;
+    }
+    for (; (step > 0) && (attr->tRowsTot > 0); step /= 2)
+    {
+        if ((row + step <= attr->tRowsTot) && (attr->wrapTree[row + step] <= line))
+        {
+            row += step;
+            line -= attr->wrapTree[row];
+        }
+    }
+
+    if (row >= attr->tRowsTot) // past the end of the file, one screen line per row
+    {
+        *rowLine = 0;
+        return attr->tRowsTot + line;
+    }
+    *rowLine = line;
+    return row;
+}
+
+/****************************************************************************************************
+ * Brings the number of screen lines of a row up to date in wrapTree once it's wrapped exactly for
+ * the current width, which it may not have been when the tree was built. The other wrap trees are
+ * left as they are, as their windows correct the row themselves if they show it.
+ ****************************************************************************************************/
+void WrapRowShown(TerminalAttr *attr, int row)
+{
+    if (!attr->softWrap || (attr->wrapTreeWidth != attr->textCols) || (row >= attr->tRowsTot))
+    {
+        return;
+    }
+
+    int count = RowIsFolded(attr, row) ? 0 : RowWrapCount(&attr->tRow[row], attr->textCols);
+    int stored = WrapTreeRowLines(attr->wrapTree, row);
+    if (count != stored)
+    {
+        WrapTreeAdd(attr, attr->wrapTree, row, count - stored);
+    }
+}
+
+/****************************************************************************************************
+ * Brings the number of screen lines of a row up to date in every wrap tree after the row changed:
+ * exactly for the current width and as BuildWrapTree would count it for the others. Trees that have
+ * to be rebuilt anyway are skipped.
+ ****************************************************************************************************/
+void UpdateWrap(TerminalAttr *attr, int row)
+{
+    if (!attr->softWrap || (row >= attr->tRowsTot))
+    {
+        return;
+    }
+
+    TerminalRow *tRow = &attr->tRow[row];
+    int folded = RowIsFolded(attr, row);
+    for (int i = 0; i < WRAP_TREE_MAX; i++)
+    {
+        int width = attr->wrapTreeWidths[i];
+        if (width == 0)
+        {
+            continue;
+        }
+
+        int count = (width == attr->textCols) ? RowWrapCount(tRow, width) : RowWrapEstimate(tRow, width);
+        if (folded)
+        {
+            count = 0;
+        }
+        int stored = WrapTreeRowLines(attr->wrapTrees[i], row);
+        if (count != stored)
+        {
+            WrapTreeAdd(attr, attr->wrapTrees[i], row, count - stored);
+        }
+    }
+}
+
+//--------------------------------------------//
+//---------------Folding----------------------//
+//--------------------------------------------//
+
+/****************************************************************************************************
+ * CTRL-F folds the block the cursor is in into its first row, or opens the fold the cursor is on;
+ * CTRL-T folds every block that starts at the indentation of the cursor's row, and CTRL-U opens
+ * every fold. A block is what an opening bracket at the end of its first row encloses, up to the
+ * row with the matching closing bracket, or else the rows below it that are indented further.
  *
- * For the m command, refer to selecting graphic rendition in the VT100 user guide.
+ * Folds are ranges of rows that don't overlap, kept in order in a treap (a binary search tree
+ * balanced by random priorities). A node doesn't store where its fold is but how many rows come
+ * between it and the fold before (gap), and every node sums up the rows and screen lines its
+ * subtree spans. Both are found by walking down the tree: the screen line of a row (FoldRowToLine)
+ * and the row on a screen line (FoldLineToRow), so WriteRows and the cursor keys pass over folded
+ * rows in O(log n) for n folds rather than looking at every row. Inserting or deleting rows only
+ * changes the gap of the fold below them (FoldEdit), not the position of every fold after them.
+ *
+ * The cursor and rowOffset are rows as usual and are never in a fold. Without soft wrap, the
+ * cursor keys move by rows and ScrollFolded scrolls by screen lines before a frame is drawn; with
+ * soft wrap, folded rows take up no lines in wrapTree. Folds belong to the buffer, so split windows
+ * of it share them. An edit within a fold, or jumping into one (SetCursorPosition), opens it.
  ****************************************************************************************************/
-void WriteStatusBar(TerminalAttr *attr, AppendBuffer *abuff)
+
+/****************************************************************************************************
+ * Folds the block the cursor is in, or opens the fold it's on. The block is the one starting at
+ * the cursor's row, or else at the nearest row above with less indentation whose block reaches the
+ * cursor's row.
+ ****************************************************************************************************/
+void ToggleFold(TerminalAttr *attr)
 {
-    AppendString(abuff, "\x1b[7m", 4);   // command to display inverted colors (switches black with white)
-    char statusBar1[80], statusBar2[80]; // left side and right side string of the status bar respectively
+    int row = attr->cursorY + attr->rowOffset;
+    int start, end, indent = INT_MAX;
 
-    // sets length as well as prints the file name and the number of rows in the file
-    int length1 = snprintf(statusBar1, sizeof(statusBar1), "%.20s - %d Lines", attr->fileName, attr->tRowsTot);
-    // sets length and prints the current row the cursor is on as well as the number of rows in the file
-    int length2 = snprintf(statusBar2, sizeof(statusBar2), "%d/%d", attr->cursorY + attr->rowOffset + 1, attr->tRowsTot);
+    if (FoldAt(attr, row, &start, &end) != FOLD_NONE) // the cursor is on the first row of a fold
+    {
+        FoldEdit(attr, row, 1, 0);
+        FoldsChanged(attr);
+        SetStatusMessage(attr, "Unfolded %d lines", end - start);
+        return;
+    }
 
-    if (length1 > attr->numCols)
+    for (start = (row < attr->tRowsTot) ? row : attr->tRowsTot - 1; start >= 0; start--)
     {
-        length1 = attr->numCols; // makes sure length of statusBar doesn't exceed screen width
+        int rowIndent = RowIndent(attr, start);
+        if ((rowIndent < 0) || (rowIndent >= indent)) // blank or within the blocks already tried
+        {
+            continue;
+        }
+        if (FoldRange(attr, start, &end) && (end >= row))
+        {
+            FoldAdd(attr, start, end);
+            FoldsChanged(attr);
+            SetCursorPosition(attr, start, 0);
+            SetStatusMessage(attr, "Folded %d lines", end - start);
+            return;
+        }
+        if ((indent = rowIndent) == 0) // nothing encloses a row that isn't indented
+        {
+            break;
+        }
+    }
+    SetStatusMessage(attr, "Nothing to fold here");
+}
+
+/****************************************************************************************************
+ * Folds every block whose first row is indented like the cursor's row (the top level if that's
+ * blank), apart from rows that are folded already.
+ ****************************************************************************************************/
+void FoldAll(TerminalAttr *attr)
+{
+    int row = attr->cursorY + attr->rowOffset;
+    int indent = (row < attr->tRowsTot) ? RowIndent(attr, row) : -1;
+    int count = 0, end, foldStart, foldEnd;
+    int fold = FoldNextRange(attr, 0, &foldStart, &foldEnd);
+
+    indent = (indent > 0) ? indent : 0;
+    for (int r = 0; r < attr->tRowsTot; r++)
+    {
+        if ((fold != FOLD_NONE) && (r >= foldStart)) // skips a fold that's already there
+        {
+            r = foldEnd;
+            fold = FoldNextRange(attr, r + 1, &foldStart, &foldEnd);
+        }
+        else if ((RowIndent(attr, r) == indent) && FoldRange(attr, r, &end))
+        {
+            FoldAdd(attr, r, end); // can take in folds below that it encloses
+            count++;
+            r = end;
+            fold = FoldNextRange(attr, r + 1, &foldStart, &foldEnd);
+        }
+    }
+
+    FoldsChanged(attr);
+    UnhideCursor(attr);
+    SetStatusMessage(attr, "Folded %d blocks", count);
+}
+
+/****************************************************************************************************
+ * Opens every fold.
+ ****************************************************************************************************/
+void UnfoldAll(TerminalAttr *attr)
+{
+    FoldFreeTree(attr, attr->foldRoot);
+    attr->foldRoot = FOLD_NONE;
+    FoldsChanged(attr);
+    SetStatusMessage(attr, "Unfolded everything");
+}
+
+/****************************************************************************************************
+ * Sets end to the last row of the block starting at row and returns 1, or returns 0 if no block
+ * starts there. If row has more opening than closing brackets, the block ends at the row with the
+ * bracket that closes the first of them, or at the row before that if it opens another block right
+ * away (as in "} else {"). Otherwise the block is the rows below that are indented further, without
+ * the blank rows after them. Brackets in strings and comments are skipped where the highlighting
+ * is exact; further down, every bracket counts. The closing bracket has to come before a row that
+ * isn't indented further than row (or on it), so a bracket that's never closed is only followed to
+ * the end of its block, rather than to the end of the file.
+ ****************************************************************************************************/
+int FoldRange(TerminalAttr *attr, int row, int *end)
+{
+    int indent = RowIndent(attr, row);
+    int open = 0, lowest = 0;
+
+    if (indent < 0)
+    {
+        return 0;
+    }
+
+    for (int r = row; r < attr->tRowsTot; r++)
+    {
+        TerminalRow *tRow = &attr->tRow[r];
+        int code = (tRow->hl != NULL) && (r < attr->hlValidTo); // hl can be told apart from text
+        RenderIfDropped(tRow);
+
+        for (int i = 0; i < tRow->rendSize; i++)
+        {
+            char c = tRow->rendStr[i];
+            if (((c != '{') && (c != '[') && (c != '(') && (c != '}') && (c != ']') && (c != ')')) ||
+                (code && ((tRow->hl[i] == HL_COMMENT) || (tRow->hl[i] == HL_STRING))))
+            {
+                continue;
+            }
+            open += ((c == '{') || (c == '[') || (c == '(')) ? 1 : -1;
+            lowest = (open < lowest) ? open : lowest;
+
+            if ((r > row) && (open == 0)) // the bracket that closes the block
+            {
+                int reopen = 0;
+                for (i++; i < tRow->rendSize; i++)
+                {
+                    c = tRow->rendStr[i];
+                    reopen += (c == '{') || (c == '[') || (c == '(');
+                    reopen -= ((c == '}') || (c == ']') || (c == ')')) && (reopen > 0);
+                }
+                *end = r - (reopen > 0);
+                return *end > row;
+            }
+        }
+
+        if (r == row) // only brackets left open at the end of the first row start a block
+        {
+            if (open <= lowest)
+            {
+                break;
+            }
+            open -= lowest;
+        }
+        else if ((RowIndent(attr, r) >= 0) && (RowIndent(attr, r) <= indent)) // the block ended unclosed
+        {
+            break;
+        }
+    }
+
+    *end = row; // the rows below that are indented further
+    for (int r = row + 1; r < attr->tRowsTot; r++)
+    {
+        int rowIndent = RowIndent(attr, r);
+        if ((rowIndent >= 0) && (rowIndent <= indent))
+        {
+            break;
+        }
+        *end = (rowIndent >= 0) ? r : *end;
+    }
+    return *end > row;
+}
+
+/****************************************************************************************************
+ * Returns the columns of white space a row starts with, or -1 if it's blank.
+ ****************************************************************************************************/
+int RowIndent(TerminalAttr *attr, int row)
+{
+    TerminalRow *tRow = &attr->tRow[row];
+    int i = 0;
+
+    RenderIfDropped(tRow);
+    while ((i < tRow->rendSize) && ((tRow->rendStr[i] == ' ') || (tRow->rendStr[i] == '\t')))
+    {
+        i++;
+    }
+    return (i < tRow->rendSize) ? i : -1;
+}
+
+/****************************************************************************************************
+ * Redraws everything once folds were added or removed, as rows moved to other screen lines.
+ ****************************************************************************************************/
+void FoldsChanged(TerminalAttr *attr)
+{
+    attr->shown.rowOffset = -1;
+    ResetWrapTrees(attr);
+}
+
+/****************************************************************************************************
+ * Moves the cursor to the first row of the fold it's hidden in, if it is; e.g., after a fold was
+ * made around it in another window.
+ ****************************************************************************************************/
+void UnhideCursor(TerminalAttr *attr)
+{
+    int start, end;
+
+    if ((FoldAt(attr, attr->cursorY + attr->rowOffset, &start, &end) != FOLD_NONE) &&
+        (attr->cursorY + attr->rowOffset > start))
+    {
+        attr->cursorY = start - attr->rowOffset;
+        MoveCursor(attr, 0);
+    }
+}
+
+/****************************************************************************************************
+ * Scrolls so the cursor's screen line is on screen, as MoveCursor doesn't while rows are folded, and
+ * sets screenY to that line. rowOffset is made the first row of a fold if it's hidden in one.
+ ****************************************************************************************************/
+void ScrollFolded(TerminalAttr *attr, int *screenY)
+{
+    UnhideCursor(attr);
+
+    int row = attr->cursorY + attr->rowOffset;
+    int line = FoldRowToLine(attr, row);
+    int top = FoldRowToLine(attr, attr->rowOffset);
+
+    if (line < top)
+    {
+        top = line;
+    }
+    else if (line >= top + attr->numRows)
+    {
+        top = line - attr->numRows + 1;
+    }
+    attr->rowOffset = FoldLineToRow(attr, top);
+    attr->cursorY = row - attr->rowOffset;
+    *screenY = line - top;
+}
+
+/****************************************************************************************************
+ * Returns the row after the last one on screen, which is further down than rowOffset + numRows when
+ * rows are folded.
+ ****************************************************************************************************/
+int ScreenEndRow(TerminalAttr *attr)
+{
+    if (attr->foldRoot == FOLD_NONE)
+    {
+        return attr->rowOffset + attr->numRows;
+    }
+    return FoldLineToRow(attr, FoldRowToLine(attr, attr->rowOffset) + attr->numRows);
+}
+
+/****************************************************************************************************
+ * Appends how many rows are folded into row, if it's the first row of a fold, in at most room
+ * columns.
+ ****************************************************************************************************/
+void WriteFoldMarker(TerminalAttr *attr, AppendBuffer *abuff, int row, int room, int *color)
+{
+    char marker[32];
+    int start, end;
+
+    if ((attr->foldRoot == FOLD_NONE) || (room <= 0) || (FoldAt(attr, row, &start, &end) == FOLD_NONE))
+    {
+        return;
+    }
+
+    int length = snprintf(marker, sizeof(marker), " [+%d line%s]", end - start, (end - start == 1) ? "" : "s");
+    if (*color != 90) // gray, like line numbers
+    {
+        AppendString(abuff, "\x1b[90m", 5);
+        *color = 90;
+    }
+    AppendString(abuff, marker, (length < room) ? length : room);
+}
+
+/****************************************************************************************************
+ * Returns 1 if row is hidden in a fold (the first row of a fold isn't).
+ ****************************************************************************************************/
+int RowIsFolded(TerminalAttr *attr, int row)
+{
+    int start, end;
+
+    return (FoldAt(attr, row, &start, &end) != FOLD_NONE) && (row > start);
+}
+
+/****************************************************************************************************
+ * Returns the row shown below row: the one after it, or after the fold it starts.
+ ****************************************************************************************************/
+int FoldRowBelow(TerminalAttr *attr, int row)
+{
+    int start, end;
+
+    if ((attr->foldRoot != FOLD_NONE) && (FoldAt(attr, row, &start, &end) != FOLD_NONE))
+    {
+        return end + 1;
+    }
+    return row + 1;
+}
+
+/****************************************************************************************************
+ * Returns the row shown above row: the one before it, or the first row of the fold that's in.
+ ****************************************************************************************************/
+int FoldRowAbove(TerminalAttr *attr, int row)
+{
+    int start, end;
+
+    if (row <= 0)
+    {
+        return 0;
+    }
+    if (FoldAt(attr, row - 1, &start, &end) != FOLD_NONE)
+    {
+        return start;
+    }
+    return row - 1;
+}
+
+/****************************************************************************************************
+ * Returns the node of the fold that row is in (its first row included) and sets start and end to
+ * its first and last row, or returns FOLD_NONE.
+ ****************************************************************************************************/
+int FoldAt(TerminalAttr *attr, int row, int *start, int *end)
+{
+    int node = attr->foldRoot, base = 0; // base is the first row the subtree spans
+
+    while (node != FOLD_NONE)
+    {
+        FoldNode *fold = &attr->folds[node];
+        int first = base + FoldRows(attr, fold->left) + fold->gap;
+
+        if (row < first - fold->gap)
+        {
+            node = fold->left;
+        }
+        else if (row < first) // in the gap before the fold
+        {
+            return FOLD_NONE;
+        }
+        else if (row > first + fold->hidden)
+        {
+            base = first + fold->hidden + 1;
+            node = fold->right;
+        }
+        else
+        {
+            *start = first;
+            *end = first + fold->hidden;
+            return node;
+        }
+    }
+    return FOLD_NONE;
+}
+
+/****************************************************************************************************
+ * Returns the node of the first fold that ends at or after row and sets start and end to its first
+ * and last row, or returns FOLD_NONE if there's none.
+ ****************************************************************************************************/
+int FoldNextRange(TerminalAttr *attr, int row, int *start, int *end)
+{
+    int node = attr->foldRoot, base = 0, found = FOLD_NONE;
+
+    while (node != FOLD_NONE)
+    {
+        FoldNode *fold = &attr->folds[node];
+        int first = base + FoldRows(attr, fold->left) + fold->gap;
+
+        if (first + fold->hidden >= row) // a candidate; an earlier one can only be above
+        {
+            found = node;
+            *start = first;
+            *end = first + fold->hidden;
+            node = fold->left;
+        }
+        else
+        {
+            base = first + fold->hidden + 1;
+            node = fold->right;
+        }
+    }
+    return found;
+}
+
+/****************************************************************************************************
+ * Returns the screen line row is on, counted from the top of the file; rows in a fold are on the
+ * line of its first row.
+ ****************************************************************************************************/
+int FoldRowToLine(TerminalAttr *attr, int row)
+{
+    int node = attr->foldRoot, base = 0, line = 0; // the first row and line the subtree spans
+
+    while (node != FOLD_NONE)
+    {
+        FoldNode *fold = &attr->folds[node];
+        int leftRows = FoldRows(attr, fold->left);
+
+        if (row < base + leftRows)
+        {
+            node = fold->left;
+            continue;
+        }
+        int first = base + leftRows + fold->gap;
+        line += FoldLines(attr, fold->left);
+        if (row < first)
+        {
+            return line + row - (base + leftRows);
+        }
+        if (row <= first + fold->hidden)
+        {
+            return line + fold->gap;
+        }
+        base = first + fold->hidden + 1;
+        line += fold->gap + 1;
+        node = fold->right;
+    }
+    return line + row - base;
+}
+
+/****************************************************************************************************
+ * Returns the row shown on screen line 'line', counted from the top of the file. Lines past the
+ * end of the file map to rows past the last row.
+ ****************************************************************************************************/
+int FoldLineToRow(TerminalAttr *attr, int line)
+{
+    int node = attr->foldRoot, row = 0; // the first row the subtree spans
+
+    while (node != FOLD_NONE)
+    {
+        FoldNode *fold = &attr->folds[node];
+        int leftLines = FoldLines(attr, fold->left);
+
+        if (line < leftLines)
+        {
+            node = fold->left;
+            continue;
+        }
+        line -= leftLines;
+        row += FoldRows(attr, fold->left);
+        if (line <= fold->gap) // in the gap, or the fold's first row
+        {
+            return row + line;
+        }
+        line -= fold->gap + 1;
+        row += fold->gap + 1 + fold->hidden;
+        node = fold->right;
+    }
+    return row + line;
+}
+
+/****************************************************************************************************
+ * Folds rows start to end: rows start + 1 to end are hidden. Folds it overlaps are merged into it.
+ ****************************************************************************************************/
+void FoldAdd(TerminalAttr *attr, int start, int end)
+{
+    int before, rest, overlap, after;
+
+    FoldSplit(attr, attr->foldRoot, start, 0, &before, &rest); // folds that end before start
+    int base = FoldRows(attr, before);
+    FoldSplit(attr, rest, end + 1 - base, 1, &overlap, &after); // folds that start up to end
+
+    if (overlap != FOLD_NONE)
+    {
+        int first = overlap;
+        while (attr->folds[first].left != FOLD_NONE)
+        {
+            first = attr->folds[first].left;
+        }
+        start = (base + attr->folds[first].gap < start) ? base + attr->folds[first].gap : start;
+        end = (base + FoldRows(attr, overlap) - 1 > end) ? base + FoldRows(attr, overlap) - 1 : end;
+    }
+    FoldAddGap(attr, after, base + FoldRows(attr, overlap) - (end + 1)); // now follows the new fold
+    FoldFreeTree(attr, overlap);
+
+    int node = FoldNew(attr, start - base, end - start);
+    attr->foldRoot = FoldMerge(attr, FoldMerge(attr, before, node), after);
+}
+
+/****************************************************************************************************
+ * Updates the folds after rows changed: the folds that rows at to at + count - 1 are part of are
+ * opened (with a count of 0, the fold that hides row at), and delta rows were inserted (positive)
+ * or deleted (negative) there. Returns 1 if a fold was opened.
+ ****************************************************************************************************/
+int FoldEdit(TerminalAttr *attr, int at, int count, int delta)
+{
+    int before, rest, overlap, after;
+
+    if (attr->foldRoot == FOLD_NONE)
+    {
+        return 0;
+    }
+
+    FoldSplit(attr, attr->foldRoot, at, 0, &before, &rest); // folds that end before at
+    int base = FoldRows(attr, before);
+    FoldSplit(attr, rest, at + count - base, 1, &overlap, &after); // folds that start before at + count
+
+    FoldAddGap(attr, after, FoldRows(attr, overlap) + delta); // the opened rows are shown in its gap
+    FoldFreeTree(attr, overlap);
+    attr->foldRoot = FoldMerge(attr, before, after);
+    return overlap != FOLD_NONE;
+}
+
+/****************************************************************************************************
+ * Splits the folds of the subtree at node into the ones that end (byStart 0) or start (byStart 1)
+ * before row, put in left, and the others, put in right. row counts from the first row the subtree
+ * spans. The gap of the first fold in right stays counted from the last fold in left.
+ ****************************************************************************************************/
+void FoldSplit(TerminalAttr *attr, int node, int row, int byStart, int *left, int *right)
+{
+    if (node == FOLD_NONE)
+    {
+        *left = FOLD_NONE;
+        *right = FOLD_NONE;
+        return;
+    }
+
+    FoldNode *fold = &attr->folds[node];
+    int first = FoldRows(attr, fold->left) + fold->gap;
+
+    if ((byStart ? first : first + fold->hidden) < row)
+    {
+        FoldSplit(attr, fold->right, row - (first + fold->hidden + 1), byStart, &fold->right, right);
+        *left = node;
+    }
+    else
+    {
+        FoldSplit(attr, fold->left, row, byStart, left, &fold->left);
+        *right = node;
+    }
+    FoldUpdate(attr, node);
+}
+
+/****************************************************************************************************
+ * Returns the tree of the folds of left followed by the folds of right.
+ ****************************************************************************************************/
+int FoldMerge(TerminalAttr *attr, int left, int right)
+{
+    if ((left == FOLD_NONE) || (right == FOLD_NONE))
+    {
+        return (left == FOLD_NONE) ? right : left;
+    }
+
+    if (attr->folds[left].priority >= attr->folds[right].priority)
+    {
+        int merged = FoldMerge(attr, attr->folds[left].right, right);
+        attr->folds[left].right = merged;
+        FoldUpdate(attr, left);
+        return left;
+    }
+    int merged = FoldMerge(attr, left, attr->folds[right].left);
+    attr->folds[right].left = merged;
+    FoldUpdate(attr, right);
+    return right;
+}
+
+/****************************************************************************************************
+ * Adds delta to the gap before the first fold of the subtree at node.
+ ****************************************************************************************************/
+void FoldAddGap(TerminalAttr *attr, int node, int delta)
+{
+    for (; node != FOLD_NONE; node = attr->folds[node].left)
+    {
+        attr->folds[node].rows += delta;
+        attr->folds[node].lines += delta;
+        if (attr->folds[node].left == FOLD_NONE)
+        {
+            attr->folds[node].gap += delta;
+        }
+    }
+}
+
+/****************************************************************************************************
+ * Recomputes the rows and lines a node spans from its own fold and its children.
+ ****************************************************************************************************/
+void FoldUpdate(TerminalAttr *attr, int node)
+{
+    FoldNode *fold = &attr->folds[node];
+
+    fold->rows = FoldRows(attr, fold->left) + fold->gap + 1 + fold->hidden + FoldRows(attr, fold->right);
+    fold->lines = FoldLines(attr, fold->left) + fold->gap + 1 + FoldLines(attr, fold->right);
+}
+
+/****************************************************************************************************
+ * Return the rows and the screen lines the subtree at node spans (0 for no node).
+ ****************************************************************************************************/
+int FoldRows(TerminalAttr *attr, int node)
+{
+    return (node == FOLD_NONE) ? 0 : attr->folds[node].rows;
+}
+
+int FoldLines(TerminalAttr *attr, int node)
+{
+    return (node == FOLD_NONE) ? 0 : attr->folds[node].lines;
+}
+
+/****************************************************************************************************
+ * Returns a new node for a fold gap rows after the one before it, hiding 'hidden' rows. Unused
+ * nodes are reused before folds grows.
+ ****************************************************************************************************/
+int FoldNew(TerminalAttr *attr, int gap, int hidden)
+{
+    static uint32_t seed = 2463534242u; // xorshift state for the priorities
+
+    if (attr->foldFree == FOLD_NONE)
+    {
+        int capacity = attr->foldsCap ? attr->foldsCap * 2 : 64;
+        if ((attr->folds = realloc(attr->folds, sizeof(FoldNode) * capacity)) == NULL)
+        {
+            ErrorHandler("FoldNew: realloc memory for folds");
+        }
+        for (int i = capacity - 1; i >= attr->foldsCap; i--)
+        {
+            attr->folds[i].left = attr->foldFree;
+            attr->foldFree = i;
+        }
+        attr->foldsCap = capacity;
+    }
+
+    int node = attr->foldFree;
+    attr->foldFree = attr->folds[node].left;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    attr->folds[node] = (FoldNode){gap, hidden, gap + 1 + hidden, gap + 1, FOLD_NONE, FOLD_NONE, seed};
+    return node;
+}
+
+/****************************************************************************************************
+ * Returns the nodes of the subtree at node to the unused ones.
+ ****************************************************************************************************/
+void FoldFreeTree(TerminalAttr *attr, int node)
+{
+    if (node == FOLD_NONE)
+    {
+        return;
+    }
+    FoldFreeTree(attr, attr->folds[node].left);
+    FoldFreeTree(attr, attr->folds[node].right);
+    attr->folds[node].left = attr->foldFree;
+    attr->foldFree = node;
+}
+
+//--------------------------------------------//
+//---------------Line Table-------------------//
+//--------------------------------------------//
+
+/****************************************************************************************************
+ * The rows keep their text, render string and highlighting together in tRow, which is what drawing
+ * and editing a row needs. Questions about the whole file only need the size of each row, so those
+ * sizes are also kept in an array of their own: byteTree, a Fenwick tree of the bytes each row takes
+ * up in the saved file (newline included), in 64-bit counts. The size of the file is kept as a
+ * running total in fileBytes, and the byte offset of a row and the row at a byte offset are found
+ * in O(log n) without touching tRow.
+ *
+ * The tree is built the first time it's needed, so opening a file doesn't pay for it. After that,
+ * edits within a row and rows added at the end update it in place; deleting a row moves every row
+ * below it, so the tree is built again.
+ ****************************************************************************************************/
+
+/****************************************************************************************************
+ * Rebuilds byteTree from the row sizes in O(n), with room for as many rows as tRow has.
+ ****************************************************************************************************/
+void BuildByteTree(TerminalAttr *attr)
+{
+    uint64_t traceStart = TraceBegin();
+    int capacity = (attr->tRowsCap > attr->tRowsTot) ? attr->tRowsCap : attr->tRowsTot;
+
+    if ((attr->byteTree == NULL) || (attr->byteTreeCap < capacity))
+    {
+        free(attr->byteTree);
+        if ((attr->byteTree = malloc(sizeof(long long) * ((size_t)capacity + 1))) == NULL)
+        {
+            ErrorHandler("BuildByteTree: malloc memory for byteTree");
+        }
+        attr->byteTreeCap = capacity;
+    }
+    for (int i = 1; i <= attr->tRowsTot; i++)
+    {
+        attr->byteTree[i] = attr->tRow[i - 1].size + 1; // +1 for the newline
+    }
+    for (int i = 1; i <= attr->tRowsTot; i++) // node i covers rows i - (i & -i) up to i - 1
+    {
+        int parent = i + (i & -i);
+        if (parent <= attr->tRowsTot)
+        {
+            attr->byteTree[parent] += attr->byteTree[i];
+        }
+    }
+    attr->byteTreeValid = 1;
+    TraceEnd("build byte tree", traceStart);
+}
+
+/****************************************************************************************************
+ * Adds delta to the bytes of a row in byteTree.
+ ****************************************************************************************************/
+void ByteTreeAdd(TerminalAttr *attr, int row, long long delta)
+{
+    for (int i = row + 1; i <= attr->tRowsTot; i += i & -i)
+    {
+        attr->byteTree[i] += delta;
+    }
+}
+
+/****************************************************************************************************
+ * Adds the last row of tRow, which was just appended, to byteTree in O(log n). The new node covers
+ * the row and the nodes below it, which add up to the difference of two prefix sums.
+ ****************************************************************************************************/
+void ByteTreeAppend(TerminalAttr *attr)
+{
+    int i = attr->tRowsTot; // node of the new row
+
+    if (!attr->byteTreeValid)
+    {
+        return;
+    }
+    if (i > attr->byteTreeCap) // rebuilt with more room the next time it's needed
+    {
+        attr->byteTreeValid = 0;
+        return;
+    }
+    attr->byteTree[i] = attr->tRow[i - 1].size + 1;
+    for (int j = i - 1; j > i - (i & -i); j -= j & -j)
+    {
+        attr->byteTree[i] += attr->byteTree[j];
+    }
+}
+
+/****************************************************************************************************
+ * Returns the byte offset in the saved file of the first char of 'row'.
+ ****************************************************************************************************/
+long long ByteTreePrefix(TerminalAttr *attr, int row)
+{
+    long long bytes = 0;
+
+    if (!attr->byteTreeValid)
+    {
+        BuildByteTree(attr);
+    }
+    for (int i = (row < attr->tRowsTot) ? row : attr->tRowsTot; i > 0; i -= i & -i)
+    {
+        bytes += attr->byteTree[i];
+    }
+    return bytes;
+}
+
+/****************************************************************************************************
+ * Returns the row that byte 'offset' of the saved file is in and sets rowStart to the offset of the
+ * row's first char. Offsets past the end of the file map to the last row.
+ ****************************************************************************************************/
+int ByteTreeFind(TerminalAttr *attr, long long offset, long long *rowStart)
+{
+    int row = 0; // rows before the one that's looked for
+    long long start = 0;
+
+    if (!attr->byteTreeValid)
+    {
+        BuildByteTree(attr);
+    }
+
+    int step = 1;
+    while (step * 2 <= attr->tRowsTot)
+    {
+        step *= 2;
+    }
+    for (; (step > 0) && (attr->tRowsTot > 0); step /= 2)
+    {
+        if ((row + step <= attr->tRowsTot) && (start + attr->byteTree[row + step] <= offset))
+        {
+            row += step;
+            start += attr->byteTree[row];
+        }
+    }
+
+    if ((row >= attr->tRowsTot) && (attr->tRowsTot > 0)) // past the end of the file
+    {
+        row = attr->tRowsTot - 1;
+        start -= attr->tRow[row].size + 1;
+    }
+    *rowStart = start;
+    return row;
+}
+
+/****************************************************************************************************
+ * Called after the text of a row grew or shrank by delta bytes.
+ ****************************************************************************************************/
+void RowBytesChanged(TerminalAttr *attr, int row, long long delta)
+{
+    attr->fileBytes += delta;
+    if (attr->byteTreeValid && (delta != 0))
+    {
+        ByteTreeAdd(attr, row, delta);
+    }
+}
+
+//--------------------------------------------//
+//---------------Row Memory-------------------//
+//--------------------------------------------//
+
+/****************************************************************************************************
+ * Rows get their text and render string from here rather than from malloc. Blocks are rounded up
+ * to a size class and carved one after another out of large chunks, so opening a file takes a few
+ * dozen mallocs instead of two per line. Freed blocks go on a free list for their class and are
+ * handed out again before the chunk is touched, and a block that is grown keeps its place until it
+ * outgrows its class. Chunks are never given back; blocks larger than the biggest class come
+ * straight from malloc.
+ ****************************************************************************************************/
+
+/****************************************************************************************************
+ * Classes are 16 bytes apart up to 256 bytes, then four for every power of two up to 64 KB, so a
+ * block is never more than a quarter larger than asked for. Sets capacity to the size of the class.
+ ****************************************************************************************************/
+uint32_t RowSizeClass(size_t size, size_t *capacity)
+{
+    if (size <= 256)
+    {
+        size = (size > 0) ? size : 1;
+        *capacity = (size + 15) & ~(size_t)15;
+        return *capacity / 16 - 1;
+    }
+    if (size > 65536)
+    {
+        *capacity = size;
+        return ROW_LARGE;
+    }
+
+    int power = 8; // 2^power < size <= 2^(power + 1)
+    while (((size_t)2 << power) < size)
+    {
+        power++;
+    }
+    size_t step = (size_t)1 << (power - 2);
+    size_t steps = (size - ((size_t)1 << power) + step - 1) / step; // 1 to 4
+
+    *capacity = ((size_t)1 << power) + steps * step;
+    return 16 + (power - 8) * 4 + steps - 1;
+}
+
+/****************************************************************************************************
+ * Mallocs the next chunk for RowAlloc to carve blocks from. Chunks start at ROW_CHUNK_MIN and double
+ * up to ROW_CHUNK_MAX, so small files stay small. What's left of the old chunk is abandoned.
+ ****************************************************************************************************/
+void RowNewChunk()
+{
+    size_t size = rowMemory.chunkSize ? rowMemory.chunkSize : ROW_CHUNK_MIN;
+
+    if ((rowMemory.bump = malloc(size)) == NULL)
+    {
+        ErrorHandler("RowNewChunk: malloc");
+    }
+    rowMemory.bumpLeft = size;
+    rowMemory.chunkSize = (size < ROW_CHUNK_MAX) ? size * 2 : ROW_CHUNK_MAX;
+    rowMemory.chunks++;
+}
+
+/****************************************************************************************************
+ * Returns a block with room for at least size bytes, from the free list of its class if there is
+ * one on it and from the newest chunk otherwise.
+ ****************************************************************************************************/
+void *RowAlloc(size_t size)
+{
+    size_t capacity;
+    uint32_t sizeClass = RowSizeClass(size, &capacity);
+    RowBlock *block;
+
+    if (sizeClass == ROW_LARGE)
+    {
+        if ((block = malloc(sizeof(RowBlock) + capacity)) == NULL)
+        {
+            ErrorHandler("RowAlloc: malloc");
+        }
+        rowMemory.chunks++;
+    }
+    else if (rowMemory.freeLists[sizeClass] != NULL)
+    {
+        block = rowMemory.freeLists[sizeClass];
+        memcpy(&rowMemory.freeLists[sizeClass], block + 1, sizeof(RowBlock *)); // next block on the list
+    }
+    else
+    {
+        if (rowMemory.bumpLeft < sizeof(RowBlock) + capacity)
+        {
+            RowNewChunk();
+        }
+        block = (RowBlock *)rowMemory.bump;
+        rowMemory.bump += sizeof(RowBlock) + capacity; // capacities are multiples of 16, so blocks stay aligned
+        rowMemory.bumpLeft -= sizeof(RowBlock) + capacity;
+    }
+
+    block->capacity = capacity;
+    block->sizeClass = sizeClass;
+    rowMemory.liveBytes += capacity;
+    rowMemory.allocCalls++;
+    return block + 1;
+}
+
+/****************************************************************************************************
+ * Gives a block back. Blocks of a class are kept on its free list, with the next block on the list
+ * stored where the text was.
+ ****************************************************************************************************/
+void RowFree(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    RowBlock *block = (RowBlock *)ptr - 1;
+    rowMemory.liveBytes -= block->capacity;
+    if (block->sizeClass == ROW_LARGE)
+    {
+        free(block);
+        return;
+    }
+    memcpy(block + 1, &rowMemory.freeLists[block->sizeClass], sizeof(RowBlock *));
+    rowMemory.freeLists[block->sizeClass] = block;
+}
+
+/****************************************************************************************************
+ * Returns a block with room for size bytes holding the contents of ptr. The block is only moved if
+ * it's too small, which for a row being typed into is once every few chars at most.
+ ****************************************************************************************************/
+void *RowRealloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return RowAlloc(size);
+    }
+
+    RowBlock *block = (RowBlock *)ptr - 1;
+    if (block->capacity >= size)
+    {
+        return ptr;
+    }
+
+    void *moved = RowAlloc(size);
+    memcpy(moved, ptr, block->capacity);
+    RowFree(ptr);
+    return moved;
+}
+
+/****************************************************************************************************
+ * Allocations made so far: the blocks handed out for rows, plus every malloc in the bench build.
+ ****************************************************************************************************/
+long long AllocCount()
+{
+    return rowMemory.allocCalls + ((ALLOC_CALLS() >= 0) ? ALLOC_CALLS() : 0);
+}
+
+//--------------------------------------------------------//
+//---------------Processing Text from Files---------------//
+//--------------------------------------------------------//
+
+/****************************************************************************************************
+ * OpenFile takes the file name pointer as a parameter. It opens the file and copies each line
+ * without including '/r' and '/n' characters. The size is also updated accordingly. The string of
+ * each row or line is then put into AppendRow which handles storing the text for each row.
+ *
+ * The file is hashed while it is read so the undo journal and swap file saved alongside it can be
+ * matched to it. Binary files, and every file with -x, are shown in the hex view instead, and so
+ * is a file with a line longer than ROW_MAX_BYTES, as the row table keeps sizes within a row in ints.
+ *
+ * Returns -1 with errno set if the file can't be read, so a file opened with CTRL-O doesn't end the
+ * session. The rows read so far are freed again; the caller frees the rest of attr.
+ ****************************************************************************************************/
+int OpenFile(TerminalAttr *attr, char *fileName)
+{
+    uint64_t traceStart = TraceBegin();
+    // free(attr->fileName);
+    attr->fileName = strdup(fileName);
+    SelectSyntax(attr);
+
+    if (attr->forceHex || LooksBinary(fileName)) // split into lines, bytes that aren't text would be mangled
+    {
+        int opened = OpenHex(attr, fileName);
+        TraceEnd("open", traceStart);
+        return opened;
+    }
+
+    FILE *fp = fopen(fileName, "r");
+    if (!fp)
+    {
+        TraceEnd("open", traceStart);
+        return -1;
+    }
+    char *lineTxt = NULL;
+    size_t capacity = 0;
+    ssize_t lineSize;
+    uint64_t fileHash = HashBytes(0, NULL, 0);
+
+    while ((lineSize = getline(&lineTxt, &capacity, fp)) != -1)
+    { // skips through all newline and return char in the row
+        fileHash = HashBytes(fileHash, lineTxt, lineSize); // hashes the line as stored on disk
+
+        while ((lineSize > 0) && ((lineTxt[lineSize - 1] == '\n') || (lineTxt[lineSize - 1] == '\r')))
+        {
+            lineSize--; // the size is updated and excludes '\n' & '\r' chars
+        }
+        if (lineSize > ROW_MAX_BYTES) // column and index arithmetic within a row is done in ints
+        {
+            DeleteRows(attr, 0, attr->tRowsTot);
+            free(lineTxt);
+            fclose(fp);
+            int opened = OpenHex(attr, fileName); // has no rows, so no limit on their length
+            if (opened == 0)
+            {
+                SetStatusMessage(attr, "A line is longer than 256 MB, so the file is shown in hex");
+            }
+            TraceEnd("open", traceStart);
+            return opened;
+        }
+        // the line is then copied without '\n' or '\r' chars
+        AppendRow(attr, lineTxt, lineSize);
+    }
+
+    attr->maxrowOffset = attr->tRowsTot - attr->numRows;
+    free(lineTxt);
+    fclose(fp);
+
+    attr->fileHash = fileHash;
+    if (!attr->readOnly) // the viewer shows the file as it is on disk
+    {
+        LoadUndoJournal(attr, fileHash); // resumes the undo history if it belongs to this exact file
+        RecoverSwapFile(attr);           // replays edits that weren't saved before Helio last died
+    }
+    TraceEnd("open", traceStart);
+    return 0;
+}
+
+/****************************************************************************************************
+ * This function copies text from the string given to it into a string within tRow (TerminalRow
+ * struct). tRow is an array where each index contains a string and the size of that string for a
+ * single row of text from the file. Tabs are accounted for in RenderRow.
+ ****************************************************************************************************/
+void AppendRow(TerminalAttr *attr, char *str, size_t rowSize)
+{
+    OpenRows(attr, attr->tRowsTot, 1);
+
+    TerminalRow *tRow = &attr->tRow[attr->tRowsTot - 1];
+    InitRow(tRow, rowSize);
+    memcpy(tRow->text, str, rowSize); // copy string into allocated slot
+    attr->fileBytes += rowSize + 1;   // +1 for the newline
+    ByteTreeAppend(attr);
+
+    RenderRow(tRow); // send to RenderRow to account for tabs
+}
+
+/****************************************************************************************************
+ * Makes room for count rows at index 'at' by moving the rows from there on down. The new rows are
+ * left for the caller to set up with InitRow. The tRow array doubles, so a file is read with few
+ * reallocs.
+ ****************************************************************************************************/
+void OpenRows(TerminalAttr *attr, int at, int count)
+{
+    if (count > INT_MAX - attr->tRowsTot) // rows are numbered with ints
+    {
+        errno = EFBIG;
+        ErrorHandler("OpenRows: more than 2147483647 lines");
+    }
+    if (attr->tRowsTot + count > attr->tRowsCap)
+    {
+        long long capacity = attr->tRowsCap ? attr->tRowsCap : 64;
+        while (capacity < attr->tRowsTot + count)
+        {
+            capacity *= 2;
+        }
+        attr->tRowsCap = (capacity > INT_MAX) ? INT_MAX : capacity;
+        if ((attr->tRow = realloc(attr->tRow, sizeof(TerminalRow) * attr->tRowsCap)) == NULL)
+        {
+            ErrorHandler("OpenRows: realloc tRow");
+        }
+    }
+
+    memmove(&attr->tRow[at + count], &attr->tRow[at], sizeof(TerminalRow) * (attr->tRowsTot - at));
+    if (at < attr->tRowsTot) // rows moved down
+    {
+        attr->byteTreeValid = 0;
+        if (attr->hlValidTo > at)
+        {
+            attr->hlValidTo = at;
+        }
+    }
+    attr->tRowsTot += count;
+    ResetWrapTrees(attr); // rows moved, so the trees are rebuilt
+    attr->hlGeneration++;
+    FoldEdit(attr, at, 0, count); // folds below move down; one the rows are inserted into is opened
+}
+
+/****************************************************************************************************
+ * Sets up a new row with room for rowSize bytes of text. The caller copies the text in and calls
+ * RenderRow.
+ ****************************************************************************************************/
+void InitRow(TerminalRow *tRow, size_t rowSize)
+{
+    tRow->size = rowSize;
+    tRow->text = RowAlloc(rowSize + 1); // +1 for null char
+    tRow->text[rowSize] = '\0';
+
+    tRow->rendSize = 0; // initialize render string and its size
+    tRow->rendStr = NULL;
+    tRow->rendCols = 0;
+    tRow->marks = NULL;
+    tRow->numMarks = 0;
+    tRow->wraps = NULL;
+    tRow->numWraps = 0;
+    tRow->wrapWidth = 0;
+    tRow->hl = NULL; // highlighted lazily once the row is about to be displayed
+    tRow->hlState = HL_STATE_NORMAL;
+}
+
+/****************************************************************************************************
+ * This function takes one tRow index as it's parameter. It first checks the string in tRow for
+ * tab characters. It then allocates memory for a new string, rendStr. If it found tab characters
+ * in text (tRow string), it allocates 7 additional spaces in memory for each tab characrer found.
+ * It then adds spaces for each tab in rendStr until it reaches a tab stop.
+ *
+ * Rows that are plain ASCII take one column per byte. Other rows are decoded as UTF-8 in
+ * RenderUtf8Row so tab stops are counted in columns rather than bytes, and rendCols is set to the
+ * number of columns the row takes up on screen.
+ ****************************************************************************************************/
+void RenderRow(TerminalRow *tRow)
+{
+    int numTabs = 0;
+    int i;
+    unsigned char highBits = 0; // ORed with every byte; 0x80 is set if the row isn't plain ASCII
+
+    free(tRow->marks); // checkpoints are rebuilt from the new text the next time they're needed
+    tRow->marks = NULL;
+    tRow->numMarks = 0;
+    tRow->wrapWidth = 0; // so are the wrap points
+
+    // no branches that depend on the text, so compilers vectorize this loop
+    for (i = 0; i < tRow->size; i++)
+    {
+        highBits |= (unsigned char)tRow->text[i];
+        numTabs += (tRow->text[i] == '\t');
+    }
+
+    if (highBits & 0x80)
+    {
+        RenderUtf8Row(tRow, numTabs);
+        return;
+    }
+
+    // each tab is a maximum of 8 characters, 1 character has already been accounted for each tab
+    // the old render string is kept if it's big enough, since it's rewritten below anyway
+    tRow->rendStr = RowRealloc(tRow->rendStr, (size_t)tRow->size + 1 + (size_t)numTabs * 7);
+
+    int j = 0; // used to keep track of rendStr indices seperately of text indices
+
+    if (numTabs == 0) // nothing to expand, so the text is copied as is
+    {
+        memcpy(tRow->rendStr, tRow->text, tRow->size);
+        j = tRow->size;
+    }
+
+    for (i = j; i < tRow->size; i++)
+    {
+        if (tRow->text[i] != '\t')
+        {
+            tRow->rendStr[j++] = tRow->text[i]; // copy character from text string
+        }
+        else
+        {
+            tRow->rendStr[j++] = ' '; // each tab must increment by at least one space
+            while (j % TAB_STOP != 0) // checks for a tab stop
+            {
+                tRow->rendStr[j++] = ' '; // keep adding tabs until we reach a tab stop
+            }
+        }
+    }
+
+    tRow->rendStr[j] = '\0';
+    tRow->rendSize = j; // set to num of chars copied
+    tRow->rendCols = j;
+}
+
+/****************************************************************************************************
+ * Rebuilds the render string of a row of a buffer whose caches were dropped (see DropBufferCaches)
+ * right before it's read. Rows come back one at a time as they're drawn, highlighted or scanned, so
+ * showing the buffer again doesn't have to go through all of them first. rendSize and rendCols are
+ * kept when the caches are dropped, so only the string itself needs this.
+ ****************************************************************************************************/
+void RenderIfDropped(TerminalRow *tRow)
+{
+    if (tRow->rendStr == NULL)
+    {
+        RenderRow(tRow);
+    }
+}
+
+/****************************************************************************************************
+ * RenderRow for rows that contain UTF-8 text (numTabs was already counted by RenderRow). Chars are
+ * copied over whole and tabs are expanded up to the next tab stop column, which is no longer the
+ * same as the next multiple of TAB_STOP bytes.
+ ****************************************************************************************************/
+void RenderUtf8Row(TerminalRow *tRow, int numTabs)
+{
+    tRow->rendStr = RowRealloc(tRow->rendStr, (size_t)tRow->size + 1 + (size_t)numTabs * 7);
+
+    int j = 0;   // index into rendStr
+    int col = 0; // column the next char starts at
+
+    for (int i = 0; i < tRow->size;)
+    {
+        int width;
+        int length = NextChar(&tRow->text[i], tRow->size - i, col, &width);
+
+        if (tRow->text[i] == '\t')
+        {
+            memset(&tRow->rendStr[j], ' ', width);
+            j += width;
+        }
+        else
+        {
+            memcpy(&tRow->rendStr[j], &tRow->text[i], length);
+            j += length;
+        }
+        i += length;
+        col += width;
+    }
+
+    tRow->rendStr[j] = '\0';
+    tRow->rendSize = j;
+    tRow->rendCols = col;
+}
+
+//---------------------------------------------//
+//---------------UTF-8 Text--------------------//
+//---------------------------------------------//
+
+/****************************************************************************************************
+ * Text is stored as the bytes read from the file, which are UTF-8 for anything other than ASCII. A
+ * char can take up to 4 bytes and 0, 1 or 2 columns on screen, so a row has three kinds of
+ * positions: indices into text, indices into rendStr and screen columns (cursorX + colOffset).
+ *
+ * Rows are almost always plain ASCII, where one byte is one column. RenderRow checks that once per
+ * row while it counts tabs, and every conversion below returns right away for such rows
+ * (RowIsPlain). Only other rows are decoded char by char.
+ *
+ * So that a long row isn't decoded from its start for every arrow key, such a row gets a checkpoint
+ * (RowMark) every ROW_MARK_COLS columns the first time a conversion needs them (BuildRowMarks).
+ * Conversions start decoding at the closest checkpoint before the position they look for, so they
+ * decode at most about ROW_MARK_COLS columns. RenderRow drops the checkpoints whenever the row
+ * changes.
+ ****************************************************************************************************/
+
+/****************************************************************************************************
+ * Decodes the UTF-8 char at the start of str into codePoint and returns the number of bytes it
+ * takes up. Bytes that don't start a valid char (including overlong encodings and surrogates) are
+ * decoded one at a time as U+FFFD, so a broken file is still displayed byte for byte.
+ ****************************************************************************************************/
+int DecodeUtf8(const char *str, int length, int *codePoint)
+{
+    static const int minCodePoint[5] = {0, 0, 0x80, 0x800, 0x10000}; // smaller ones are overlong
+    const unsigned char *bytes = (const unsigned char *)str;
+    int charLen = (bytes[0] >= 0xF0) ? 4 : (bytes[0] >= 0xE0) ? 3 : (bytes[0] >= 0xC0) ? 2 : 1;
+    int cp = bytes[0] & (0x7F >> charLen); // the lead byte's bits that belong to the code point
+
+    *codePoint = 0xFFFD;
+    if (bytes[0] < 0x80)
+    {
+        *codePoint = bytes[0];
+        return 1;
+    }
+    if ((charLen == 1) || (charLen > length) || (bytes[0] >= 0xF8))
+    {
+        return 1;
+    }
+
+    for (int i = 1; i < charLen; i++)
+    {
+        if ((bytes[i] & 0xC0) != 0x80) // not a continuation byte
+        {
+            return 1;
+        }
+        cp = (cp << 6) | (bytes[i] & 0x3F);
+    }
+    if ((cp < minCodePoint[charLen]) || (cp > 0x10FFFF) || ((cp >= 0xD800) && (cp <= 0xDFFF)))
+    {
+        return 1;
+    }
+
+    *codePoint = cp;
+    return charLen;
+}
+
+/****************************************************************************************************
+ * Returns the number of columns (0, 1 or 2) a code point takes up on screen. widthIndex picks the
+ * block of 256 code points cp belongs to and the block holds four 2 bit widths per byte.
+ ****************************************************************************************************/
+int CodePointWidth(int codePoint)
+{
+    unsigned char packed = widthBlocks[widthIndex[codePoint >> 8]][(codePoint & 0xFF) >> 2];
+    return (packed >> ((codePoint & 3) * 2)) & 3;
+}
+
+/****************************************************************************************************
+ * Returns the number of bytes of the char at the start of str and sets width to the number of
+ * columns it takes up when it starts at column col (col only matters for tabs).
+ ****************************************************************************************************/
+int NextChar(const char *str, int length, int col, int *width)
+{
+    int codePoint;
+
+    if (str[0] == '\t')
+    {
+        *width = TAB_STOP - (col % TAB_STOP); // jumps to the next tab stop
+        return 1;
+    }
+    if ((unsigned char)str[0] < 0x80)
+    {
+        *width = 1;
+        return 1;
+    }
+
+    int charLen = DecodeUtf8(str, length, &codePoint);
+    *width = CodePointWidth(codePoint);
+    return charLen;
+}
+
+/****************************************************************************************************
+ * Returns 1 if every byte of the row's text takes up exactly one column (ASCII, and tabs, if any,
+ * only one column wide), so text indices, rendStr indices and columns are all the same.
+ ****************************************************************************************************/
+int RowIsPlain(TerminalRow *tRow)
+{
+    return (tRow->size == tRow->rendSize) && (tRow->rendSize == tRow->rendCols);
+}
+
+/****************************************************************************************************
+ * Walks the row once and records a checkpoint at the first char that starts at or after every
+ * multiple of ROW_MARK_COLS columns. Rows that are plain or short enough to walk don't get any.
+ ****************************************************************************************************/
+void BuildRowMarks(TerminalRow *tRow)
+{
+    if ((tRow->marks != NULL) || (tRow->rendCols < 2 * ROW_MARK_COLS) || RowIsPlain(tRow))
+    {
+        return;
+    }
+
+    tRow->numMarks = tRow->rendCols / ROW_MARK_COLS + 1;
+    if ((tRow->marks = malloc(sizeof(RowMark) * tRow->numMarks)) == NULL)
+    {
+        ErrorHandler("BuildRowMarks: Couldn't allocate memory");
+    }
+
+    int i = 0, rendIndex = 0, col = 0, mark = 0;
+    while (mark < tRow->numMarks) // the end of the row counts as a char boundary too
+    {
+        if (col >= mark * ROW_MARK_COLS)
+        {
+            tRow->marks[mark].index = i;
+            tRow->marks[mark].rendIndex = rendIndex;
+            tRow->marks[mark].col = col;
+            mark++;
+            continue;
+        }
+
+        int width;
+        int length = NextChar(&tRow->text[i], tRow->size - i, col, &width);
+        rendIndex += (tRow->text[i] == '\t') ? width : length; // tabs are spaces in rendStr
+        i += length;
+        col += width;
+    }
+}
+
+/****************************************************************************************************
+ * Returns the last checkpoint of the row that is at or before both column col and text index index
+ * (INT_MAX if only one of them matters), or the start of the row if it has no checkpoints.
+ ****************************************************************************************************/
+RowMark RowMarkBefore(TerminalRow *tRow, int col, int index)
+{
+    RowMark start = {0, 0, 0};
+
+    BuildRowMarks(tRow);
+    if (tRow->marks == NULL)
+    {
+        return start;
+    }
+
+    int low = 0, high = tRow->numMarks - 1; // marks[0] is the start of the row
+    if (col < INT_MAX) // checkpoint number col / ROW_MARK_COLS is at most one too far
+    {
+        high = (col / ROW_MARK_COLS < high) ? col / ROW_MARK_COLS : high;
+    }
+    while (low < high) // binary search for the last checkpoint that isn't past col or index
+    {
+        int mid = (low + high + 1) / 2;
+        if ((tRow->marks[mid].col <= col) && (tRow->marks[mid].index <= index))
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+    return tRow->marks[low];
+}
+
+/****************************************************************************************************
+ * Converts an index into a row's text into the matching column of its render string (tabs take up
+ * more than one column once rendered and UTF-8 chars can take up more than one byte).
+ ****************************************************************************************************/
+int RowIndexToRender(TerminalRow *tRow, int index)
+{
+    if (RowIsPlain(tRow))
+    {
+        return (index < tRow->size) ? index : tRow->size;
+    }
+
+    RowMark mark = RowMarkBefore(tRow, INT_MAX, index);
+    int col = mark.col;
+
+    for (int i = mark.index; (i < index) && (i < tRow->size);)
+    {
+        int width;
+        i += NextChar(&tRow->text[i], tRow->size - i, col, &width);
+        col += width;
+    }
+    return col;
+}
+
+/****************************************************************************************************
+ * Converts a column into the index of the char of the row's text that covers it, which is where
+ * text typed at that column is inserted. Zero width chars right before the column are skipped, as
+ * they belong to the char before them. Columns past the end of the row map to the end of the text.
+ ****************************************************************************************************/
+int RowRenderToIndex(TerminalRow *tRow, int col)
+{
+    if (RowIsPlain(tRow))
+    {
+        return (col < tRow->size) ? col : tRow->size;
+    }
+
+    RowMark mark = RowMarkBefore(tRow, col, INT_MAX);
+    int i = mark.index, charCol = mark.col;
+
+    while (i < tRow->size)
+    {
+        int width;
+        int length = NextChar(&tRow->text[i], tRow->size - i, charCol, &width);
+        if ((width > 0) && (charCol + width > col))
+        {
+            break;
+        }
+        i += length;
+        charCol += width;
+    }
+    return i;
+}
+
+/****************************************************************************************************
+ * Returns the column the char covering column col starts at. If next isn't NULL, it's set to the
+ * column right after that char. Columns past the end of the row are returned unchanged.
+ ****************************************************************************************************/
+int RowCharStart(TerminalRow *tRow, int col, int *next)
+{
+    if (next != NULL)
+    {
+        *next = col + 1;
+    }
+    if (RowIsPlain(tRow) || (col >= tRow->rendCols))
+    {
+        return col;
+    }
+
+    RowMark mark = RowMarkBefore(tRow, col, INT_MAX);
+    int i = mark.index, charCol = mark.col;
+
+    while (i < tRow->size)
+    {
+        int width;
+        int length = NextChar(&tRow->text[i], tRow->size - i, charCol, &width);
+        if ((width > 0) && (charCol + width > col))
+        {
+            if (next != NULL)
+            {
+                *next = charCol + width;
+            }
+            return charCol;
+        }
+        i += length;
+        charCol += width;
+    }
+    return col;
+}
+
+/****************************************************************************************************
+ * Returns the index into rendStr of the char that covers column col (or rendSize past the end of
+ * the row) and sets charCol to the column it starts at, which is left of col if the char is wide.
+ * Used by WriteRows to find the part of a row that fits on screen.
+ ****************************************************************************************************/
+int RenderColToByte(TerminalRow *tRow, int col, int *charCol)
+{
+    RenderIfDropped(tRow);
+    RowMark mark = RowMarkBefore(tRow, col, INT_MAX);
+    int i = mark.rendIndex, startCol = mark.col;
+
+    while (i < tRow->rendSize)
+    {
+        int width;
+        int length = NextChar(&tRow->rendStr[i], tRow->rendSize - i, startCol, &width);
+        if ((width > 0) && (startCol + width > col))
+        {
+            break;
+        }
+        i += length;
+        startCol += width;
+    }
+    *charCol = startCol;
+    return i;
+}
+
+//---------------------------------------------------//
+//---------------Syntax Highlighting-----------------//
+//---------------------------------------------------//
+
+/****************************************************************************************************
+ * Each row stores a highlight class per rendered char (hl) and the lexer state it ends in (hlState),
+ * which is the state the next row starts in. Rows before attr->hlValidTo are known to be up to date.
+ *
+ * Rows are only highlighted when they are about to be displayed (HighlightUpTo), so opening a large
+ * file costs nothing extra. After an edit, UpdateSyntax re-highlights the edited row and keeps going
+ * only while a row's end state changes (e.g., a block comment was opened), which usually means a
+ * single row per keystroke.
+ *
+ * The rest of the file is highlighted by a low priority worker thread (HighlightWorker) that moves
+ * hlValidTo forward batch by batch, both towards the rows on screen and past them. It copies a batch
+ * of text while holding the document lock, highlights it without the lock and only stores the
+ * result if hlGeneration shows the text hasn't been edited in the meantime. When the screen is far
+ * past hlValidTo, HighlightVisible guesses the rows on screen so typing never waits for the worker.
+ ****************************************************************************************************/
+
+/****************************************************************************************************
+ * Picks the SyntaxDef whose file name endings match the open file, if any. An ending can be the
+ * whole name, as with ".bashrc" opened from the home directory.
+ ****************************************************************************************************/
+void SelectSyntax(TerminalAttr *attr)
+{
+    size_t nameLen = strlen(attr->fileName);
+
+    attr->syntax = NULL;
+    attr->hlValidTo = 0;
+    attr->hlGeneration++;
+
+    for (size_t i = 0; i < sizeof(syntaxDefs) / sizeof(syntaxDefs[0]); i++)
+    {
+        for (const char **ext = syntaxDefs[i].extensions; *ext != NULL; ext++)
+        {
+            size_t extLen = strlen(*ext);
+            if ((nameLen >= extLen) && (strcmp(&attr->fileName[nameLen - extLen], *ext) == 0))
+            {
+                attr->syntax = &syntaxDefs[i];
+                return;
+            }
+        }
+    }
+}
+
+/****************************************************************************************************
+ * Highlights one row starting in the end state of the row above it. Returns 1 if the row's end
+ * state changed, meaning the row below has to be highlighted again too.
+ ****************************************************************************************************/
+int HighlightRow(TerminalAttr *attr, int row)
+{
+    TerminalRow *tRow = &attr->tRow[row];
+    int state = (row > 0) ? attr->tRow[row - 1].hlState : HL_STATE_NORMAL;
+
+    RenderIfDropped(tRow);
+    unsigned char *hl = realloc(tRow->hl, tRow->rendSize + 1); // +1 so empty rows still get an array
+    if (hl == NULL)
+    {
+        ErrorHandler("HighlightRow: realloc memory for tRow->hl");
+    }
+    tRow->hl = hl;
+    state = HighlightText(attr->syntax, tRow->rendStr, tRow->rendSize, state, hl);
+
+    int changed = (tRow->hlState != state);
+    tRow->hlState = state;
+    return changed;
+}
+
+/****************************************************************************************************
+ * Fills hl with the highlight class of each of the length chars of str, starting in lexer state
+ * 'state', and returns the state at the end. What a char can start is looked up in the syntax's
+ * character class table and words are looked up in its keyword table. Only reads its arguments, so
+ * the highlight worker can call it without holding the document lock. str needn't end in a NUL;
+ * the worker passes rows copied back to back, so nothing past length may be read.
+ ****************************************************************************************************/
+int HighlightText(const SyntaxDef *syntax, const char *str, int length, int state, unsigned char *hl)
+{
+    const unsigned char *cc = syntax->charClass;
+
+    memset(hl, HL_NORMAL, length);
+
+    int lineLen = syntax->lineComment ? strlen(syntax->lineComment) : 0;
+    int startLen = syntax->blockCommentStart ? strlen(syntax->blockCommentStart) : 0;
+    int endLen = syntax->blockCommentEnd ? strlen(syntax->blockCommentEnd) : 0;
+    int lineStart = 1; // only whitespace has been seen so far on this row
+
+    int i = 0;
+    while (i < length)
+    {
+        unsigned char c = str[i];
+        int start = i;
+
+        if (state == HL_STATE_BLOCK_COMMENT) // comment continues until its end marker
+        {
+            if ((length - i >= endLen) && (memcmp(&str[i], syntax->blockCommentEnd, endLen) == 0))
+            {
+                memset(&hl[i], HL_COMMENT, endLen);
+                i += endLen;
+                state = HL_STATE_NORMAL;
+            }
+            else
+            {
+                hl[i++] = HL_COMMENT;
+            }
+            continue;
+        }
+
+        if (cc[c] & CC_COMMENT)
+        {
+            if (lineLen && (length - i >= lineLen) && (memcmp(&str[i], syntax->lineComment, lineLen) == 0) &&
+                (!(syntax->flags & HLF_COMMENT_AFTER_SPACE) || (i == 0) || (str[i - 1] == ' ')))
+            {
+                memset(&hl[i], HL_COMMENT, length - i); // rest of the row is a comment
+                break;
+            }
+            if (startLen && (length - i >= startLen) && (memcmp(&str[i], syntax->blockCommentStart, startLen) == 0))
+            {
+                memset(&hl[i], HL_COMMENT, startLen);
+                i += startLen;
+                state = HL_STATE_BLOCK_COMMENT;
+                continue;
+            }
+        }
+
+        if (cc[c] & CC_QUOTE)
+        {
+            i++;
+            while (i < length) // string ends at the matching quote or the end of the row
+            {
+                if ((str[i] == '\\') && (i + 1 < length)) // escaped char can't end the string
+                {
+                    i++;
+                }
+                else if (str[i] == (char)c)
+                {
+                    i++;
+                    break;
+                }
+                i++;
+            }
+            memset(&hl[start], HL_STRING, i - start);
+        }
+        else if ((cc[c] & CC_DIGIT) && ((i == 0) || !(cc[(unsigned char)str[i - 1]] & CC_IDENT)))
+        {
+            // covers hex, floating point and suffixes like 0x1fULL or 1.5e-3f
+            while ((i < length) && (isalnum((unsigned char)str[i]) || (str[i] == '.') ||
+                                    (((str[i] == '-') || (str[i] == '+')) && ((str[i - 1] | 0x20) == 'e'))))
+            {
+                i++;
+            }
+            memset(&hl[start], HL_NUMBER, i - start);
+        }
+        else if (cc[c] & CC_IDENT_START)
+        {
+            while ((i < length) && (cc[(unsigned char)str[i]] & CC_IDENT))
+            {
+                i++;
+            }
+            memset(&hl[start], SyntaxKeywordClass(syntax, &str[start], i - start), i - start);
+        }
+        else if ((c == '#') && lineStart && (syntax->flags & HLF_PREPROC)) // e.g., #include
+        {
+            i++;
+            while ((i < length) && (isalpha((unsigned char)str[i]) || (str[i] == ' ')))
+            {
+                i++;
+            }
+            memset(&hl[start], HL_PREPROC, i - start);
+        }
+        else if ((c == '$') && (syntax->flags & HLF_VARIABLES)) // $name, ${name} and $1 style variables
+        {
+            i++;
+            if ((i < length) && (str[i] == '{'))
+            {
+                while ((i < length) && (str[i++] != '}'))
+                    ;
+            }
+            else
+            {
+                while ((i < length) && (cc[(unsigned char)str[i]] & (CC_IDENT | CC_DIGIT)))
+                {
+                    i++;
+                }
+            }
+            memset(&hl[start], HL_PREPROC, i - start);
+        }
+        else
+        {
+            i++;
+        }
+
+        if ((syntax->flags & HLF_KEYS) && (i > start) && (hl[start] != HL_COMMENT))
+        {
+            int next = i;
+            while ((next < length) && (str[next] == ' '))
+            {
+                next++;
+            }
+            if ((next < length) && (str[next] == ':') && (hl[start] != HL_NUMBER)) // a key, e.g., "name": or name:
+            {
+                memset(&hl[start], HL_TYPE, i - start);
+            }
+        }
+
+        if (!isspace(c))
+        {
+            lineStart = 0;
+        }
+    }
+
+    return state;
+}
+
+/****************************************************************************************************
+ * Looks up a word in the syntax's perfect hash table of keywords and returns its highlight class
+ * (HL_NORMAL if it isn't a keyword). gensyntax picked a seed for which no two keywords share a
+ * slot, so only the one keyword in the word's slot has to be compared. The hash must match
+ * KeywordHash in gensyntax.c.
+ ****************************************************************************************************/
+int SyntaxKeywordClass(const SyntaxDef *syntax, const char *word, int length)
+{
+    uint32_t hash = syntax->keywordSeed;
+
+    for (int i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)word[i];
+        hash *= 16777619u; // FNV prime
+    }
+    hash ^= hash >> 15; // mixes every char into the low bits used as the slot
+    hash *= 0x2c1b3c6du;
+    hash ^= hash >> 12;
+
+    const SyntaxKeyword *slot = &syntax->keywords[hash & syntax->keywordMask];
+    if ((slot->length == length) && (memcmp(slot->word, word, length) == 0))
+    {
+        return slot->hl;
+    }
+    return HL_NORMAL;
+}
+
+/****************************************************************************************************
+ * Makes sure the highlighting of every row before 'row' is up to date. Called by WriteRows with the
+ * last row on screen, so only rows that are (or were) displayed ever get highlighted.
+ ****************************************************************************************************/
+void HighlightUpTo(TerminalAttr *attr, int row)
+{
+    if (attr->syntax == NULL)
+    {
+        return;
+    }
+
+    if (row > attr->tRowsTot)
+    {
+        row = attr->tRowsTot;
+    }
+    while (attr->hlValidTo < row)
+    {
+        HighlightRow(attr, attr->hlValidTo++);
+    }
+}
+
+/****************************************************************************************************
+ * Re-highlights an edited row. The rows below it are re-highlighted as long as the end state keeps
+ * changing. If the change reaches past the bottom of the screen, the rest is left to HighlightUpTo
+ * by moving hlValidTo, which keeps a keystroke cheap even when it opens a comment in a huge file.
+ ****************************************************************************************************/
+void UpdateSyntax(TerminalAttr *attr, int row)
+{
+    attr->hlGeneration++; // any highlighting the worker is busy with is for the old text
+
+    if ((attr->syntax == NULL) || (row >= attr->hlValidTo)) // will be highlighted once displayed
+    {
+        return;
+    }
+
+    int screenEnd = ScreenEndRow(attr);
+
+    while (HighlightRow(attr, row++) && (row < attr->hlValidTo))
+    {
+        if (row >= screenEnd)
+        {
+            attr->hlValidTo = row; // rows below the screen are redone when scrolled to
+            return;
+        }
+    }
+}
+
+/****************************************************************************************************
+ * Returns 1 if HighlightVisible highlights the rows up to bottom properly, rather than guessing.
+ ****************************************************************************************************/
+int HighlightIsExact(TerminalAttr *attr, int bottom)
+{
+    if (bottom > attr->tRowsTot)
+    {
+        bottom = attr->tRowsTot;
+    }
+    return (attr->syntax == NULL) || (bottom - attr->hlValidTo <= HL_SYNC_ROWS) || !attr->hlThreadRunning;
+}
+
+/****************************************************************************************************
+ * Highlights the rows from top up to (not including) bottom before they're drawn. If hlValidTo is
+ * close enough, the rows are highlighted properly. Otherwise the worker hasn't got there yet, so the
+ * rows are highlighted as if the top row started outside of any comment; the worker replaces the
+ * guess once it reaches them.
+ ****************************************************************************************************/
+void HighlightVisible(TerminalAttr *attr, int top, int bottom)
+{
+    if (attr->syntax == NULL)
+    {
+        return;
+    }
+
+    if (bottom > attr->tRowsTot)
+    {
+        bottom = attr->tRowsTot;
+    }
+    if (HighlightIsExact(attr, bottom))
+    {
+        HighlightUpTo(attr, bottom);
+        return;
+    }
+
+    int state = HL_STATE_NORMAL;
+    for (int row = top; row < bottom; row = FoldRowBelow(attr, row)) // rows in folds aren't shown
+    {
+        TerminalRow *tRow = &attr->tRow[row];
+        RenderIfDropped(tRow);
+        unsigned char *hl = realloc(tRow->hl, tRow->rendSize + 1);
+        if (hl == NULL)
+        {
+            ErrorHandler("HighlightVisible: realloc memory for tRow->hl");
+        }
+        tRow->hl = hl;
+        state = tRow->hlState = HighlightText(attr->syntax, tRow->rendStr, tRow->rendSize, state, hl);
+    }
+    pthread_cond_signal(&attr->hlWake);
+}
+
+/****************************************************************************************************
+ * Body of the highlight worker thread. Sleeps until there are rows past hlValidTo, then highlights
+ * them one batch at a time as described at the top of this section, until StopHighlightWorker.
+ ****************************************************************************************************/
+void *HighlightWorker(void *arg)
+{
+    TerminalAttr *attr = arg;
+    int *lengths = malloc(sizeof(int) * HL_BATCH_ROWS);
+    int *states = malloc(sizeof(int) * HL_BATCH_ROWS);
+    char *text = NULL;
+    unsigned char *hl = NULL;
+    size_t capacity = 0;
+
+    if ((lengths == NULL) || (states == NULL))
+    {
+        ErrorHandler("HighlightWorker: Couldn't allocate memory");
+    }
+    TraceThread("highlight worker");
+
+    pthread_mutex_lock(&attr->docLock);
+    while (!attr->hlStop)
+    {
+        if ((attr->syntax == NULL) || (attr->hlValidTo >= attr->tRowsTot))
+        {
+            pthread_cond_wait(&attr->hlWake, &attr->docLock); // nothing left to do
+            continue;
+        }
+
+        // copies the rows after the last up to date one
+        const SyntaxDef *syntax = attr->syntax;
+        uint64_t generation = attr->hlGeneration;
+        int first = attr->hlValidTo;
+        int state = (first > 0) ? attr->tRow[first - 1].hlState : HL_STATE_NORMAL;
+        int numRows = 0;
+        size_t bytes = 0;
+
+        while ((first + numRows < attr->tRowsTot) && (numRows < HL_BATCH_ROWS) && (bytes < HL_BATCH_BYTES))
+        {
+            TerminalRow *tRow = &attr->tRow[first + numRows];
+            RenderIfDropped(tRow); // safe with the document lock held, which every row allocation takes
+            if (bytes + tRow->rendSize > capacity)
+            {
+                capacity = (bytes + tRow->rendSize) * 2;
+                text = realloc(text, capacity);
+                hl = realloc(hl, capacity);
+                if ((text == NULL) || (hl == NULL))
+                {
+                    ErrorHandler("HighlightWorker: realloc memory for batch");
+                }
+            }
+            memcpy(&text[bytes], tRow->rendStr, tRow->rendSize);
+            lengths[numRows++] = tRow->rendSize;
+            bytes += tRow->rendSize;
+        }
+        pthread_mutex_unlock(&attr->docLock);
+
+        // highlights the copy while the main thread is free to edit
+        uint64_t traceStart = TraceBegin();
+        size_t pos = 0;
+        for (int i = 0; i < numRows; i++)
+        {
+            state = states[i] = HighlightText(syntax, &text[pos], lengths[i], state, &hl[pos]);
+            pos += lengths[i];
+        }
+        TraceEnd("highlight batch", traceStart);
+
+        pthread_mutex_lock(&attr->docLock);
+        if ((generation != attr->hlGeneration) || (first != attr->hlValidTo))
+        {
+            continue; // the text changed since it was copied; start over from hlValidTo
+        }
+
+        pos = 0;
+        for (int i = 0; i < numRows; i++)
+        {
+            TerminalRow *tRow = &attr->tRow[first + i];
+            unsigned char *rowHl = realloc(tRow->hl, lengths[i] + 1);
+            if (rowHl == NULL)
+            {
+                ErrorHandler("HighlightWorker: realloc memory for tRow->hl");
+            }
+            memcpy(rowHl, &hl[pos], lengths[i]);
+            tRow->hl = rowHl;
+            tRow->hlState = states[i];
+            pos += lengths[i];
+        }
+        attr->hlValidTo = first + numRows;
+
+        if ((first < ScreenEndRow(attr)) && (first + numRows > attr->rowOffset))
+        {
+            attr->hlRepaint = 1; // rows on screen may have been guessed wrong before
+        }
+    }
+    pthread_mutex_unlock(&attr->docLock);
+
+    free(lengths);
+    free(states);
+    free(text);
+    free(hl);
+    return NULL;
+}
+
+/****************************************************************************************************
+ * Starts the highlight worker with the lowest scheduling priority where that's available, so it only
+ * gets the CPU when nothing else needs it. If the thread can't be started, WriteRows highlights
+ * everything itself like before.
+ ****************************************************************************************************/
+void StartHighlightWorker(TerminalAttr *attr)
+{
+    pthread_attr_t threadAttr;
+    pthread_attr_init(&threadAttr);
+#ifdef SCHED_IDLE
+    struct sched_param param = {0};
+    pthread_attr_setinheritsched(&threadAttr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&threadAttr, SCHED_IDLE);
+    pthread_attr_setschedparam(&threadAttr, &param);
+#endif
+
+    attr->hlStop = 0;
+    attr->hlThreadRunning = (pthread_create(&attr->hlThread, &threadAttr, HighlightWorker, attr) == 0) ||
+                            (pthread_create(&attr->hlThread, NULL, HighlightWorker, attr) == 0);
+    pthread_attr_destroy(&threadAttr);
+}
+
+/****************************************************************************************************
+ * Tells the highlight worker to stop and waits for it. Must be called with the document lock held,
+ * which is held again when it returns.
+ ****************************************************************************************************/
+void StopHighlightWorker(TerminalAttr *attr)
+{
+    if (!attr->hlThreadRunning)
+    {
+        return;
+    }
+
+    attr->hlStop = 1;
+    pthread_cond_signal(&attr->hlWake);
+    pthread_mutex_unlock(&attr->docLock);
+    pthread_join(attr->hlThread, NULL);
+    pthread_mutex_lock(&attr->docLock);
+    attr->hlThreadRunning = 0;
+}
+
+/****************************************************************************************************
+ * Maps a highlight class to the SGR foreground color that displays it (39 is the default color).
+ ****************************************************************************************************/
+int SyntaxColor(int hl)
+{
+    switch (hl)
+    {
+    case HL_COMMENT:
+        return 36; // cyan
+    case HL_KEYWORD:
+        return 33; // yellow
+    case HL_TYPE:
+        return 32; // green
+    case HL_STRING:
+        return 35; // magenta
+    case HL_NUMBER:
+        return 31; // red
+    case HL_PREPROC:
+        return 34; // blue
+    case HL_ERROR:
+        return 91; // bright red
+    default:
+        return 39;
+    }
+}
+
+//-------------------------------------------------------//
+//---------------Displaying Text on Screen---------------//
+//-------------------------------------------------------//
+
+/****************************************************************************************************
+ * Taking a string, the string's length and an AppendBuffer as its parameters, this function
+ * reallocates memory for a pointer that points to the buffer string within the abuff struct. The
+ * buffer string's job is to store all the text for a file. So when a new line of text is sent to
+ * AppendString, AppendString must make sure there is enough memory in the buffer string to append
+ * the new string on top of the text that is already inside the buffer.
+ ****************************************************************************************************/
+void AppendString(AppendBuffer *abuff, const char *str, size_t length)
+{
+    if ((length == 0) || (length > SIZE_MAX - abuff->length)) // nothing to add, or the buffer can't get any bigger
+    {
+        return; // realloc with a size of 0 could free an empty buffer
+    }
+    // creates new buffer pointer with appropiate memory size
+    char *newBuff = realloc(abuff->buff, abuff->length + length); // length of new string is accounted for
+
+    if (newBuff == NULL) // in case of failure of trying to allocate memory
+    {
+        return;
+    }
+
+    memcpy(&newBuff[abuff->length], str, length); // appends new string to end of old buffer
+    abuff->buff = newBuff;                        // sets pointer to the new buffer pointer that has additional memory
+    abuff->length += length;                      // adjusts the lenght of the buffer string
+}
+
+/****************************************************************************************************
+ * Deallocates memory from the append buffer.
+ ****************************************************************************************************/
+void FreeAbuff(AppendBuffer *abuff)
+{
+    free(abuff->buff);
+}
+
+/****************************************************************************************************
+ * This function takes in the append buffer as a parameter. If no file is loaded, it prints a
+ * welcome message. If a file was opened, WriteRows prints as many rows that fit onto the screen.
+ *
+ * If vertical scrolling has occured, we start copying rows from the rendStr array with an index
+ * offset by the amount of vertical scrolling that occured. If horizontal scrolling has occured,
+ * we copy the text from from each row with the index of the string offset by the amount of
+ * horizontal scrolling that occured. RefreshScreen handles printing to the terminal. With soft wrap
+ * on, rows are written one screen line at a time instead, starting at screen line wrapTop of the
+ * first row.
+ *
+ * Highlighted rows are written as runs of same colored text; the SGR color command is only sent
+ * when the color actually changes, even across rows.
+ *
+ * Only the screen lines from first up to (not including) last are written, starting wherever the
+ * cursor is, so RefreshScreen can draw just the lines that scrolled into view. With soft wrap on,
+ * first must be 0.
+ ****************************************************************************************************/
+void WriteRows(TerminalAttr *attr, AppendBuffer *abuff, int first, int last)
+{
+    int rows = attr->numRows;
+    int columns = attr->textCols;
+    int scrollRows = attr->rowOffset;
+    int scrollCols = attr->colOffset;
+    int fileRows = attr->tRowsTot;
+    char welcome[40];
+
+    int length = snprintf(welcome, sizeof(welcome), "Helio Editor -- version %s", HELIO_VERSION);
+    if (length > attr->numCols)
+    {
+        length = attr->numCols; // makes sure message fits screen
+    }
+    int padding = (attr->numCols - length - 1) / 2; // minus 1 to account for the tilde
+    int color = 39;                           // current foreground color; only changes are sent
+
+    HighlightVisible(attr, scrollRows, ScreenEndRow(attr));
+
+    int wrapLine = attr->wrapTop; // screen line of row scrollRows that's written next (soft wrap only)
+    int row = scrollRows + first; // row written on screen line i (without soft wrap)
+    if ((attr->foldRoot != FOLD_NONE) && !attr->softWrap)
+    {
+        row = FoldLineToRow(attr, FoldRowToLine(attr, scrollRows) + first);
+    }
+
+    for (int i = first; (i < last) && (i < rows); i++, row = FoldRowBelow(attr, row))
+    { // only prints as many rows that fit on screen
+
+        if (attr->softWrap && (scrollRows < fileRows)) // writes one screen line of a wrapped row
+        {
+            TerminalRow *tRow = &attr->tRow[scrollRows];
+            int numLines = RowWrapCount(tRow, columns);
+            int start = RowWrapStart(tRow, columns, wrapLine);
+            int end = (wrapLine + 1 < numLines) ? RowWrapStart(tRow, columns, wrapLine + 1) : tRow->rendCols;
+            int startCol, lineCols = end - start;
+
+            if (attr->lineNumbers != LINE_NUMBERS_OFF) // only the first line of a row is numbered
+            {
+                WriteGutter(attr, abuff, scrollRows, wrapLine == 0, &color);
+            }
+            if (tRow->rendCols != tRow->rendSize) // columns to bytes
+            {
+                start = RenderColToByte(tRow, start, &startCol);
+                end = (wrapLine + 1 < numLines) ? RenderColToByte(tRow, end, &startCol) : tRow->rendSize;
+            }
+            WriteRowText(attr, abuff, tRow, start, end, &color, scrollRows);
+
+            if (++wrapLine == numLines) // the next screen line shows the next row
+            {
+                WriteFoldMarker(attr, abuff, scrollRows, columns - lineCols, &color);
+                scrollRows = FoldRowBelow(attr, scrollRows);
+                wrapLine = 0;
+            }
+        }
+        // makes sure all rows of text are written (matters only when text file is smaller than screen)
+        else if (!attr->softWrap && (row < fileRows))
+        {
+            TerminalRow *tRow = &attr->tRow[row];
+            int txtLen = tRow->rendCols - scrollCols; // accounts for scrolled rows
+
+            if (attr->lineNumbers != LINE_NUMBERS_OFF)
+            {
+                WriteGutter(attr, abuff, row, 1, &color);
+            }
+
+            if (txtLen > columns) // if txtLen is greater than window width
+            {
+                txtLen = columns; // makes txtLen same legnth of window width
+            }
+
+            // bytes of rendStr that fit on screen; they only differ from the columns for UTF-8 text
+            int start = scrollCols, end = scrollCols + txtLen;
+            if ((txtLen > 0) && (tRow->rendCols != tRow->rendSize))
+            {
+                int startCol, endCol;
+                start = RenderColToByte(tRow, scrollCols, &startCol);
+                if (startCol < scrollCols) // a wide char is cut in half by the left edge of the screen
+                {
+                    start = RenderColToByte(tRow, scrollCols + 1, &startCol);
+                    AppendString(abuff, " ", 1);
+                }
+                end = RenderColToByte(tRow, scrollCols + columns, &endCol); // excludes a wide char cut in half
+            }
+
+            if (txtLen > 0) // doesn't let string be printed if no there is no text
+            {
+                WriteRowText(attr, abuff, tRow, start, end, &color, row);
+            }
+            WriteFoldMarker(attr, abuff, row, columns - ((txtLen > 0) ? txtLen : 0), &color);
+        }
+        else // inserts padding and welcome message
+        {
+            if (color != 39) // tildes are never highlighted
+            {
+                AppendString(abuff, "\x1b[39m", 5);
+                color = 39;
+            }
+            AppendString(abuff, "~", 1); // prints tilde on left most column of screen
+            // prints welcome message a fourth down the screen
+            if ((i == rows / 4) && (fileRows == 0)) // only prints wlc msg if no file loaded
+            {
+                for (int j = 0; j < padding; j++) // centers message by adding spaces
+                {
+                    AppendString(abuff, " ", 1);
+                }
+                AppendString(abuff, welcome, length);
+            }
+        }
+
+        AppendString(abuff, "\x1b[K", 3); // command that clears everything right of the cursor
+        AppendString(abuff, "\r\n", 2);   // adds newline for every line
+    }
+
+    if (color != 39) // the color carries over rows, so it's only reset at the end
+    {
+        AppendString(abuff, "\x1b[39m", 5);
+    }
+}
+
+/****************************************************************************************************
+ * Appends the chars of tRow->rendStr from index start up to (not including) end; tRow is file row
+ * 'row'. The selected part of it is shown in inverted colors.
+ ****************************************************************************************************/
+void WriteRowText(TerminalAttr *attr, AppendBuffer *abuff, TerminalRow *tRow, int start, int end, int *color, int row)
+{
+    int selStart, selEnd;
+
+    RenderIfDropped(tRow);
+    SelectionBytes(attr, row, &selStart, &selEnd);
+    selStart = (selStart < start) ? start : (selStart > end) ? end : selStart;
+    selEnd = (selEnd < selStart) ? selStart : (selEnd > end) ? end : selEnd;
+
+    WriteRowRun(attr, abuff, tRow, start, selStart, color);
+    if (selStart < selEnd)
+    {
+        AppendString(abuff, "\x1b[7m", 4);
+        WriteRowRun(attr, abuff, tRow, selStart, selEnd, color);
+        AppendString(abuff, "\x1b[27m", 5);
+    }
+    WriteRowRun(attr, abuff, tRow, selEnd, end, color);
+}
+
+/****************************************************************************************************
+ * Appends the chars of tRow->rendStr from index start up to (not including) end. With highlighting,
+ * they're written as runs of same colored text; color is the foreground color currently set on the
+ * terminal and is updated when it changes.
+ ****************************************************************************************************/
+void WriteRowRun(TerminalAttr *attr, AppendBuffer *abuff, TerminalRow *tRow, int start, int end, int *color)
+{
+    if (attr->syntax == NULL)
+    {
+        if (*color != 39) // the gutter is colored
+        {
+            AppendString(abuff, "\x1b[39m", 5);
+            *color = 39;
+        }
+        AppendString(abuff, &tRow->rendStr[start], end - start);
+        return;
+    }
+
+    int runStart = start;
+    for (int j = start; j <= end; j++)
+    {
+        int newColor = (j < end) ? SyntaxColor(tRow->hl[j]) : *color;
+        if ((newColor != *color) || (j == end))
+        {
+            AppendString(abuff, &tRow->rendStr[runStart], j - runStart);
+            runStart = j;
+        }
+        if (newColor != *color)
+        {
+            char sgr[8];
+            AppendString(abuff, sgr, snprintf(sgr, sizeof(sgr), "\x1b[%dm", newColor));
+            *color = newColor;
+        }
+    }
+}
+
+/****************************************************************************************************
+ * The line number gutter is gutterDigits wide plus a space. Its width is only recomputed when the
+ * number of rows crosses a power of ten (UpdateGutter), and numbers are formatted straight into the
+ * frame by FormatNumber, two digits per table lookup, so numbering the rows costs next to nothing
+ * per frame.
+ ****************************************************************************************************/
+
+/****************************************************************************************************
+ * Cycles through the line number modes: off, absolute and relative.
+ ****************************************************************************************************/
+void ToggleLineNumbers(TerminalAttr *attr)
+{
+    static const char *modes[] = {"off", "on", "relative"};
+
+    attr->lineNumbers = (attr->lineNumbers + 1) % 3;
+    UpdateGutter(attr);
+    MoveCursor(attr, 0); // the text got narrower or wider, so the horizontal scrolling is checked again
+    SetStatusMessage(attr, "Line numbers %s", modes[attr->lineNumbers]);
+}
+
+/****************************************************************************************************
+ * Updates gutterDigits if the number of rows crossed a power of ten since the last call and sets
+ * textCols to the columns left for the text.
+ ****************************************************************************************************/
+void UpdateGutter(TerminalAttr *attr)
+{
+    if (attr->lineNumbers == LINE_NUMBERS_OFF)
+    {
+        attr->textCols = attr->numCols;
+        return;
+    }
+
+    while (attr->tRowsTot >= attr->gutterLimit)
+    {
+        attr->gutterDigits++;
+        attr->gutterLimit *= 10;
+    }
+    while ((attr->gutterDigits > 1) && (attr->tRowsTot < attr->gutterLimit / 10))
+    {
+        attr->gutterDigits--;
+        attr->gutterLimit /= 10;
+    }
+
+    attr->textCols = attr->numCols - attr->gutterDigits - 1; // -1 for the space after the numbers
+    if (attr->textCols < 1)
+    {
+        attr->textCols = 1;
+    }
+}
+
+/****************************************************************************************************
+ * Appends the gutter of a screen line showing file row 'row'. Lines that continue a soft wrapped row
+ * (firstLine is 0) get an empty gutter.
+ ****************************************************************************************************/
+void WriteGutter(TerminalAttr *attr, AppendBuffer *abuff, int row, int firstLine, int *color)
+{
+    char gutter[24];
+    int width = attr->numCols - attr->textCols;
+    int cursorRow = attr->cursorY + attr->rowOffset;
+    unsigned int number = row + 1;
+
+    if ((attr->lineNumbers == LINE_NUMBERS_RELATIVE) && (row != cursorRow))
+    {
+        number = (row > cursorRow) ? row - cursorRow : cursorRow - row;
+        if (attr->foldRoot != FOLD_NONE) // counts screen lines, as a folded row is passed with one key
+        {
+            number = abs(FoldRowToLine(attr, row) - FoldRowToLine(attr, cursorRow));
+        }
+    }
+    if (width > (int)sizeof(gutter))
+    {
+        width = sizeof(gutter);
+    }
+
+    if (firstLine)
+    {
+        FormatNumber(gutter, width - 1, number);
+    }
+    else
+    {
+        memset(gutter, ' ', width - 1);
+    }
+    gutter[width - 1] = ' ';
+
+    if (*color != 90) // line numbers are gray
+    {
+        AppendString(abuff, "\x1b[90m", 5);
+        *color = 90;
+    }
+    AppendString(abuff, gutter, width);
+}
+
+/****************************************************************************************************
+ * Writes value as decimal digits right aligned in the first width chars of buff (no null char),
+ * padded with spaces on the left. Two digits are looked up at a time, so there is one division by
+ * 100 for every two digits and no snprintf.
+ ****************************************************************************************************/
+void FormatNumber(char *buff, int width, unsigned int value)
+{
+    static const char digitPairs[201] = "00010203040506070809"
+                                        "10111213141516171819"
+                                        "20212223242526272829"
+                                        "30313233343536373839"
+                                        "40414243444546474849"
+                                        "50515253545556575859"
+                                        "60616263646566676869"
+                                        "70717273747576777879"
+                                        "80818283848586878889"
+                                        "90919293949596979899";
+    int i = width;
+
+    while ((value >= 100) && (i >= 2))
+    {
+        const char *pair = &digitPairs[(value % 100) * 2];
+        buff[--i] = pair[1];
+        buff[--i] = pair[0];
+        value /= 100;
+    }
+    if ((value >= 10) && (i >= 2))
+    {
+        buff[--i] = digitPairs[value * 2 + 1];
+        buff[--i] = digitPairs[value * 2];
+    }
+    else if (i >= 1)
+    {
+        buff[--i] = '0' + value % 10;
+    }
+    memset(buff, ' ', i);
+}
+
+/****************************************************************************************************
+ * Prints the statusBar (last bar on screen) to display information about the file (file name and
+ * row number). If no file is opened and therefore no file name is given, the default is set to
+ * "[No Name]" in InitTerminalAttr. Up to 20 characters of the file name will be shown.
+ *
+ * For the m command, refer to selecting graphic rendition in the VT100 user guide.
+ ****************************************************************************************************/
+void WriteStatusBar(TerminalAttr *attr, AppendBuffer *abuff)
+{
+    AppendString(abuff, "\x1b[7m", 4);   // command to display inverted colors (switches black with white)
+    char statusBar1[80], statusBar2[80]; // left side and right side string of the status bar respectively
+
+    // sets length as well as prints the file name and the number of rows in the file
+    int length1 = snprintf(statusBar1, sizeof(statusBar1), "%.20s%s - %d Lines", attr->fileName,
+                           attr->readOnly ? " (read-only)" : "", attr->tRowsTot);
+    if (attr->hex != NULL) // the size in bytes, and where the cursor is as an offset
+    {
+        length1 = snprintf(statusBar1, sizeof(statusBar1), "%.20s%s - %lld Bytes (hex)", attr->fileName,
+                           attr->readOnly ? " (read-only)" : "", attr->hex->size);
+    }
+    if (buffers.count > 1) // which of the open files this is
+    {
+        length1 += snprintf(&statusBar1[length1], sizeof(statusBar1) - length1, " [%d/%d]",
+                            buffers.current + 1, buffers.count);
+    }
+    // sets length and prints the current row the cursor is on as well as the number of rows in the file
+    int length2 = snprintf(statusBar2, sizeof(statusBar2), "%d/%d", attr->cursorY + attr->rowOffset + 1, attr->tRowsTot);
+    if (attr->hex != NULL)
+    {
+        length2 = snprintf(statusBar2, sizeof(statusBar2), "0x%llx/0x%llx", attr->hex->cursor, attr->hex->size);
+    }
+
+    if (length1 > attr->numCols)
+    {
+        length1 = attr->numCols; // makes sure length of statusBar doesn't exceed screen width
+    }
+
+    AppendString(abuff, statusBar1, length1);
+
+    // makes sure it prints spaces until there is exactly enough space left for statusBar2
+    for (int i = length1 + length2; i < attr->numCols; i++)
+    {
+        AppendString(abuff, " ", 1); // adds spaces
+    }
+    AppendString(abuff, statusBar2, length2); // prints right side of statusBar (statusBar2)
+
+    AppendString(abuff, "\x1b[m", 3); // sets display colors back to default
+    AppendString(abuff, "\r\n", 2);   // makes room for status message to be displayed
+}
+
+/****************************************************************************************************
+ * Takes in a variable amount of arguments (like printf), so it is a variadic
+ * function. To use such functions, we must use a va_list type. We then input the last argument
+ * before "..." into va_start so the next arguments' addresses are known. Then we call vsnprintf to
+ * take care of reading and formatting the string. Lastly we call va_end.
+ ****************************************************************************************************/
+void SetStatusMessage(TerminalAttr *attr, const char *frmt, ...)
+{
+    va_list arguments;
+    va_start(arguments, frmt);                                            // call va_start to provide address of arguments
+    vsnprintf(attr->statusMsg, sizeof(attr->statusMsg), frmt, arguments); // reads and formats the string
+    va_end(arguments);
+
+    attr->statusMsgTime = time(NULL);
+}
+
+/****************************************************************************************************
+ * Writes the status message that was set in SetStatusMessage to the append buffer, abuff. It also
+ * makes sure that it only display status messages that are less than 5 seconds after a keypress.
+ ****************************************************************************************************/
+void WriteStatusMessage(TerminalAttr *attr, AppendBuffer *abuff)
+{
+    AppendString(abuff, "\x1b[K", 3); // clears the current row
+    int length = strlen(attr->statusMsg);
+
+    if (length > attr->numCols) // makes sure string length doesn't exceed screen width
+    {
+        length = attr->numCols;
+    }
+
+    if (StatusMessageShown(attr))
+    {
+        AppendString(abuff, attr->statusMsg, length);
+    }
+    else if (attr->perf.hud)
+    {
+        WritePerfHud(attr, abuff);
+    }
+}
+
+/****************************************************************************************************
+ * Returns 1 if there is a status message and it was set less than 5 seconds ago, so it's shown.
+ ****************************************************************************************************/
+int StatusMessageShown(TerminalAttr *attr)
+{
+    return (attr->statusMsg[0] != '\0') && (time(NULL) - attr->statusMsgTime < 5);
+}
+
+/****************************************************************************************************
+ * Turns the perf HUD on or off. The HUD replaces the status message when there is none to show.
+ ****************************************************************************************************/
+void TogglePerfHud(TerminalAttr *attr)
+{
+    attr->perf.hud = !attr->perf.hud;
+    SetStatusMessage(attr, attr->perf.hud ? "" : "Perf HUD off"); // no message, so the HUD shows right away
+}
+
+/****************************************************************************************************
+ * Writes the perf HUD: the last, average and 99th percentile time from a key becoming readable to
+ * its frame being written (over the latest PERF_SAMPLES keys), then the time WriteRows took, the
+ * size of the frame, the allocations made for the last key and the memory held by row text. The
+ * numbers are from the frames before the one being drawn. Allocations count the blocks handed out
+ * by the row allocator, plus every malloc in the bench build ("make bench").
+ ****************************************************************************************************/
+void WritePerfHud(TerminalAttr *attr, AppendBuffer *abuff)
+{
+    PerfStats *perf = &attr->perf;
+    uint64_t sorted[PERF_SAMPLES], sum = 0;
+    int count = (perf->numLatencies < PERF_SAMPLES) ? perf->numLatencies : PERF_SAMPLES;
+    char hud[160];
+
+    for (int i = 0; i < count; i++)
+    {
+        sorted[i] = perf->latencies[i];
+        sum += sorted[i];
+    }
+    qsort(sorted, count, sizeof(uint64_t), CompareNanos);
+    uint64_t last = count ? perf->latencies[(perf->numLatencies - 1) % PERF_SAMPLES] : 0;
+
+    int length = snprintf(hud, sizeof(hud), "key %.2f avg %.2f p99 %.2f ms | rows %.0f us | %d B | %lld allocs | %.1f MB rows",
+                          last / 1e6, count ? sum / 1e6 / count : 0.0, count ? sorted[count * 99 / 100] / 1e6 : 0.0,
+                          perf->writeRowsNanos / 1e3, perf->frameBytes, perf->frameAllocs,
+                          rowMemory.liveBytes / 1e6);
+
+    length = (length < attr->numCols) ? length : attr->numCols;
+    AppendString(abuff, "\x1b[7m", 4); // inverted colors set the HUD apart from messages
+    AppendString(abuff, hud, length);
+    AppendString(abuff, "\x1b[m", 3);
+}
+
+/****************************************************************************************************
+ * Returns how many lines the text on the terminal can be scrolled up (down if negative) to show the
+ * current rowOffset, or 0 if every row has to be written. That's only possible if nothing but
+ * rowOffset changed since the last frame: no edits, the same column offset, screen size and gutter,
+ * no soft wrap or folds, and no highlighting that was guessed or has been replaced by the worker since.
+ * Relative line numbers change on every row as the cursor moves, so they're always written.
+ ****************************************************************************************************/
+int ScrollShift(TerminalAttr *attr)
+{
+    ShownText *shown = &attr->shown;
+    int shift = attr->rowOffset - shown->rowOffset;
+
+    if ((shown->rowOffset < 0) || shown->guessed || attr->softWrap || shown->softWrap || attr->hlRepaint ||
+        (attr->foldRoot != FOLD_NONE) ||
+        (attr->mark != MARK_NONE) || (shown->mark != MARK_NONE) ||
+        (attr->lineNumbers == LINE_NUMBERS_RELATIVE) || (shown->lineNumbers != attr->lineNumbers) ||
+        (shown->colOffset != attr->colOffset) || (shown->numRows != attr->numRows) ||
+        (shown->numCols != attr->numCols) || (shown->textCols != attr->textCols) ||
+        (shown->generation != attr->hlGeneration) || (abs(shift) >= attr->numRows))
+    {
+        return 0;
+    }
+    return HighlightIsExact(attr, ScreenEndRow(attr)) ? shift : 0;
+}
+
+/****************************************************************************************************
+ * Returns 1 if a frame drawn now would differ from the last one: the text, what part of it is on
+ * screen, the cursor or the status message changed, the highlight worker finished rows on screen,
+ * or the whole screen has to be redrawn. Keys that change nothing, such as an arrow key pushing
+ * against the end of the file, then don't draw a frame. The perf HUD changes with every key.
+ ****************************************************************************************************/
+int FrameNeeded(TerminalAttr *attr)
+{
+    ShownText *shown = &attr->shown;
+
+    return (shown->rowOffset < 0) || attr->hlRepaint || (attr->perf.hud && (attr->perf.inputNanos != 0)) ||
+           (shown->generation != attr->hlGeneration) || (shown->rowOffset != attr->rowOffset) ||
+           (shown->colOffset != attr->colOffset) || (shown->cursorX != attr->cursorX) ||
+           (shown->cursorY != attr->cursorY) || (shown->softWrap != attr->softWrap) ||
+           (shown->wrapTop != attr->wrapTop) || (shown->numRows != attr->numRows) ||
+           (shown->numCols != attr->numCols) || (shown->lineNumbers != attr->lineNumbers) ||
+           (shown->mark != attr->mark) || (shown->markRow != attr->markRow) || (shown->markIndex != attr->markIndex) ||
+           (shown->window != attr->window) ||
+           ((attr->hex != NULL) && ((shown->hexTop != attr->hex->top) || (shown->hexCursor != attr->hex->cursor) ||
+                                    (shown->hexNibble != attr->hex->nibble))) ||
+           (shown->statusShown != StatusMessageShown(attr)) || (strcmp(shown->statusMsg, attr->statusMsg) != 0);
+}
+
+/****************************************************************************************************
+ * Returns the milliseconds left until the next frame can be drawn (0 if it can be drawn now), so
+ * no more than one frame is drawn per frame interval (attr->frameNanos, set with --fps). Keys
+ * handled in the meantime are shown together by that frame.
+ ****************************************************************************************************/
+int FrameDelay(TerminalAttr *attr)
+{
+    uint64_t now = MonotonicNanos(), due = attr->shown.paintNanos + attr->frameNanos;
+
+    return (now >= due) ? 0 : (int)((due - now + 999999) / 1000000);
+}
+
+/****************************************************************************************************
+ * The screen is refreshed after every key press in main through this function. It is also refreshed
+ * when a new character is typed in InsertChar. This function calls WriteRows and then prints the
+ * append buffer with one snprintf call to avoid flickering.
+ *
+ * When the text only scrolled by a few lines since the last frame (see ScrollShift), the terminal
+ * is told to scroll the text rows itself: a scroll region (DECSTBM) is set around them and they're
+ * scrolled up (SU) or down (SD), so only the lines that scrolled into view are written. Holding
+ * an arrow key at the edge of the screen then sends one row per frame instead of all of them.
+ ****************************************************************************************************/
+void RefreshScreen(TerminalAttr *attr)
+{
+    AppendBuffer abuff = ABUFF_INIT;
+    uint64_t traceStart = TraceBegin();
+
+    // refer to VT100 user guide for descriptions of commands (\x1b = 27 in decimal)
+    UpdateGutter(attr);
+    int screenY = attr->cursorY, screenX = attr->cursorX;
+    if (attr->softWrap) // scrolling happens here, as the cursor is kept as a position in the text
+    {
+        ScrollWrapped(attr, &screenY, &screenX);
+    }
+    else if (attr->foldRoot != FOLD_NONE) // and here, as rows and screen lines differ
+    {
+        ScrollFolded(attr, &screenY);
+    }
+    screenX += attr->numCols - attr->textCols; // the text starts right of the gutter
+
+    char buff[32];
+    if (output.next != NULL) // the frame waiting to be written is replaced, so this one can't build on it
+    {
+        attr->shown.rowOffset = -1;
+        screenGrid.valid = 0;
+    }
+    int shift = (attr->windows == NULL) ? ScrollShift(attr) : 0;
+    if (output.syncUpdates)
+    {
+        AppendString(&abuff, "\x1b[?2026h", 8); // the terminal holds off painting until the frame is complete
+    }
+    AppendString(&abuff, "\x1b[?25l", 6); // command to hide the cursor
+
+    uint64_t rowsStart = MonotonicNanos();
+    uint64_t rowsTrace = TraceBegin();
+    if (attr->windows != NULL) // split windows are composed into cells; only the cells that changed are sent
+    {
+        ComposeWindows(attr, &abuff, &screenY, &screenX);
+        attr->hlRepaint = 0;
+    }
+    else if (attr->hex != NULL) // bytes rather than rows of text
+    {
+        ScrollHex(attr);
+        AppendString(&abuff, "\x1b[H", 3);
+        WriteHexRows(attr, &abuff, &screenY, &screenX);
+    }
+    else if (shift != 0) // the terminal moves the rows that are still on screen; only the new ones are written
+    {
+        // sets the scroll region to the text rows, scrolls it up (SU) or down (SD) and resets it
+        int length = snprintf(buff, sizeof(buff), "\x1b[1;%dr\x1b[%d%c\x1b[r", attr->numRows, abs(shift),
+                              (shift > 0) ? 'S' : 'T');
+        AppendString(&abuff, buff, length);
+
+        int first = (shift > 0) ? attr->numRows - shift : 0;
+        length = snprintf(buff, sizeof(buff), "\x1b[%d;1H", first + 1);
+        AppendString(&abuff, buff, length);
+        WriteRows(attr, &abuff, first, first + abs(shift));
+
+        length = snprintf(buff, sizeof(buff), "\x1b[%d;1H", attr->numRows + 1); // back to the status bar
+        AppendString(&abuff, buff, length);
+    }
+    else
+    {
+        AppendString(&abuff, "\x1b[H", 3); // command to reposition cursor to top-left of screen
+        WriteRows(attr, &abuff, 0, attr->numRows); // appends rows from file into the append buffer that are supposed to be visible
+        attr->hlRepaint = 0;                       // whatever the worker highlighted is shown now
+    }
+    if (attr->windows == NULL) // the cells no longer match the terminal
+    {
+        screenGrid.valid = 0;
+    }
+    attr->perf.writeRowsNanos = MonotonicNanos() - rowsStart;
+
+    ShownText *shown = &attr->shown;
+    shown->rowOffset = attr->rowOffset;
+    shown->colOffset = attr->colOffset;
+    shown->numRows = attr->numRows;
+    shown->numCols = attr->numCols;
+    shown->textCols = attr->textCols;
+    shown->lineNumbers = attr->lineNumbers;
+    shown->guessed = !HighlightIsExact(attr, ScreenEndRow(attr));
+    shown->generation = attr->hlGeneration;
+    shown->cursorX = attr->cursorX;
+    shown->cursorY = attr->cursorY;
+    shown->softWrap = attr->softWrap; // wrapped frames start mid-row, so aren't scrolled
+    shown->wrapTop = attr->wrapTop;
+    shown->statusShown = StatusMessageShown(attr);
+    shown->mark = attr->mark;
+    shown->markRow = attr->markRow;
+    shown->markIndex = attr->markIndex;
+    shown->window = attr->window;
+    if (attr->hex != NULL)
+    {
+        shown->hexTop = attr->hex->top;
+        shown->hexCursor = attr->hex->cursor;
+        shown->hexNibble = attr->hex->nibble;
+    }
+    memcpy(shown->statusMsg, attr->statusMsg, sizeof(shown->statusMsg));
+    TraceEnd("render rows", rowsTrace);
+    if (attr->windows == NULL) // split windows have status bars of their own
+    {
+        WriteStatusBar(attr, &abuff);     // adds status bar to the bottom of the display
+        WriteStatusMessage(attr, &abuff); // adds a status message below the status bar (i.e., bottommost line)
+    }
+
+    // moves cursor to specified cursorY and cursorX position (+1 to convert 0-indexed to 1-indexed)
+    snprintf(buff, sizeof(buff), "\x1b[%d;%dH", screenY + 1, screenX + 1);
+    AppendString(&abuff, buff, strlen(buff));
+
+    AppendString(&abuff, "\x1b[?25h", 6); // command to show the cursor
+    if (output.syncUpdates)
+    {
+        AppendString(&abuff, "\x1b[?2026l", 8);
+    }
+
+    PerfStats *perf = &attr->perf;
+    perf->frameBytes = abuff.length;
+    SendFrame(&abuff); // writes the whole buffer at once to avoid flickering
+    shown->paintNanos = MonotonicNanos();
+    if (perf->inputNanos != 0) // the frame shows a key, rather than a repaint of the highlight worker
+    {
+        perf->latencies[perf->numLatencies++ % PERF_SAMPLES] = MonotonicNanos() - perf->inputNanos;
+        perf->frameAllocs = AllocCount() - perf->allocMark;
+        perf->inputNanos = 0;
+    }
+    FreeAbuff(&abuff);
+    TraceEnd("refresh", traceStart);
+}
+
+/****************************************************************************************************
+ * Everything shown on the terminal goes through here. It's written to stdout, or to the virtual
+ * screen when Helio runs headless. Frames still waiting to be written go first, and it waits until
+ * all of buff is written.
+ ****************************************************************************************************/
+void WriteTerminal(const char *buff, size_t length)
+{
+    if (headless != NULL)
+    {
+        VirtualScreenWrite(headless, buff, length);
+        return;
+    }
+    FlushOutput(1);
+    WriteOutput(buff, length, 1);
+}
+
+/****************************************************************************************************
+ * Hands a frame built by RefreshScreen over to the terminal; frame is emptied. As much of it is
+ * written as the terminal takes without waiting, and WaitForInput writes the rest once it can take
+ * more. When the terminal falls behind (a slow connection, or a key held down), frames aren't
+ * queued up: only the newest one waits, and a newer frame replaces it. Since the replaced frame is
+ * never shown, RefreshScreen makes the frame that replaces it a full one.
+ ****************************************************************************************************/
+void SendFrame(AppendBuffer *frame)
+{
+    if (headless != NULL)
+    {
+        VirtualScreenWrite(headless, frame->buff, frame->length);
+        return;
+    }
+
+    if (output.next != NULL)
+    {
+        free(output.next);
+        output.dropped++;
+    }
+    output.next = frame->buff;
+    output.nextLength = frame->length;
+    frame->buff = NULL;
+    frame->length = 0;
+    FlushOutput(0);
+}
+
+/****************************************************************************************************
+ * Writes the frames waiting for the terminal. The frame being written is finished first, since the
+ * terminal already got part of it, then the queued sequences and the newest frame. Without wait it
+ * stops as soon as the terminal can't take more. Returns 1 once nothing is waiting.
+ ****************************************************************************************************/
+int FlushOutput(int wait)
+{
+    while ((output.sending != NULL) || (output.queued.length > 0) || (output.next != NULL))
+    {
+        if ((output.sending == NULL) && (output.queued.length > 0)) // never goes in the middle of a frame
+        {
+            output.queuedSent += WriteOutput(output.queued.buff + output.queuedSent,
+                                             output.queued.length - output.queuedSent, wait);
+            if (output.queuedSent < output.queued.length)
+            {
+                return 0;
+            }
+            FreeAbuff(&output.queued);
+            output.queued.buff = NULL;
+            output.queued.length = 0;
+            output.queuedSent = 0;
+            continue;
+        }
+        if (output.sending == NULL)
+        {
+            output.sending = output.next;
+            output.sendingLength = output.nextLength;
+            output.sent = 0;
+            output.next = NULL;
+        }
+
+        output.sent += WriteOutput(output.sending + output.sent, output.sendingLength - output.sent, wait);
+        if (output.sent < output.sendingLength)
+        {
+            return 0;
+        }
+        free(output.sending);
+        output.sending = NULL;
+    }
+    return 1;
+}
+
+/****************************************************************************************************
+ * Writes length bytes of buff to the terminal and returns how many were written. write can write
+ * fewer bytes than asked for, be interrupted by a signal, or fail with EAGAIN when the terminal's
+ * descriptor is non-blocking and its buffer is full. With wait, poll waits until it can take more
+ * and everything is written; without, it returns once the terminal is full. Bytes that can't be
+ * written because of an error count as written, since a terminal that fails writes shows nothing.
+ ****************************************************************************************************/
+size_t WriteOutput(const char *buff, size_t length, int wait)
+{
+    size_t written = 0;
+
+    while (written < length)
+    {
+        ssize_t n = write(output.fd, buff + written, length - written);
+        if (n >= 0)
+        {
+            written += n;
+        }
+        else if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        {
+            if (!wait)
+            {
+                break;
+            }
+            struct pollfd out = {output.fd, POLLOUT, 0};
+            poll(&out, 1, -1);
+        }
+        else if (errno != EINTR)
+        {
+            return length;
+        }
+    }
+    return written;
+}
+
+/****************************************************************************************************
+ * Sets up writing frames to the terminal. The terminal is opened a second time for writing without
+ * blocking, so a slow terminal never holds up reading keys; setting O_NONBLOCK on stdout itself
+ * would make stdin non-blocking as well, since both share one open file. If it can't be opened,
+ * frames go to stdout. The terminal is also asked whether it supports synchronized output; the
+ * reply arrives with the keys (see ReadTerminalReply).
+ ****************************************************************************************************/
+void OpenTerminalOutput()
+{
+    char *name = ttyname(STDOUT_FILENO);
+
+    if (name == NULL) // not a terminal, so there's nothing to ask
+    {
+        return;
+    }
+    int fd = open(name, O_WRONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd != -1)
+    {
+        output.fd = fd;
+    }
+    WriteTerminal("\x1b[?2026$p", 9); // DECRQM: is mode 2026 supported?
+}
+
+/****************************************************************************************************
+ * Applies output meant for the terminal to a virtual screen. Only what Helio sends is understood:
+ * text, "\r\n", cursor positioning (H) and clearing (K, J). Other escape sequences (colors,
+ * showing and hiding the cursor, OSC) don't change the cells and are skipped. Escape sequences are
+ * expected to be whole within one write, which holds since every frame is a single write.
+ ****************************************************************************************************/
+void VirtualScreenWrite(VirtualScreen *screen, const char *buff, size_t length)
+{
+    screen->bytes += length;
+    screen->writes++;
+
+    for (size_t i = 0; i < length;)
+    {
+        uint32_t *row = &screen->cells[screen->cursorY * screen->cols];
+
+        if ((buff[i] == '\x1b') && (i + 1 < length) && (buff[i + 1] == '['))
+        {
+            int params[2] = {0, 0}, numParams = 0;
+            size_t j = i + 2;
+
+            j += (j < length) && (buff[j] == '?'); // private modes, e.g., hiding the cursor
+            for (; (j < length) && (((buff[j] >= '0') && (buff[j] <= '9')) || (buff[j] == ';')); j++)
+            {
+                if (buff[j] == ';')
+                {
+                    numParams += (numParams < 1);
+                }
+                else
+                {
+                    params[numParams] = params[numParams] * 10 + (buff[j] - '0');
+                }
+            }
+
+            switch ((j < length) ? buff[j] : 0)
+            {
+            case 'H': // parameters are 1-indexed and default to 1
+                screen->cursorY = (params[0] > 1) ? params[0] - 1 : 0;
+                screen->cursorX = (params[1] > 1) ? params[1] - 1 : 0;
+                screen->cursorY = (screen->cursorY < screen->rows) ? screen->cursorY : screen->rows - 1;
+                screen->cursorX = (screen->cursorX < screen->cols) ? screen->cursorX : screen->cols - 1;
+                break;
+            case 'K': // clears right of the cursor
+                for (int x = screen->cursorX; x < screen->cols; x++)
+                {
+                    row[x] = ' ';
+                }
+                break;
+            case 'J': // clears the whole screen
+                for (int cell = 0; cell < screen->rows * screen->cols; cell++)
+                {
+                    screen->cells[cell] = ' ';
+                }
+                break;
+            case 'r': // sets the scroll region (the whole screen without parameters) and homes the cursor
+                screen->top = (params[0] > 1) ? params[0] - 1 : 0;
+                screen->bottom = ((params[1] > 0) && (params[1] <= screen->rows)) ? params[1] - 1 : screen->rows - 1;
+                if (screen->top >= screen->bottom)
+                {
+                    screen->top = 0;
+                    screen->bottom = screen->rows - 1;
+                }
+                screen->cursorY = 0;
+                screen->cursorX = 0;
+                break;
+            case 'S': // scrolls the region up
+                VirtualScreenScroll(screen, (params[0] > 1) ? params[0] : 1);
+                break;
+            case 'T': // scrolls the region down
+                VirtualScreenScroll(screen, (params[0] > 1) ? -params[0] : -1);
+                break;
+            }
+            i = j + 1;
+        }
+        else if ((buff[i] == '\x1b') && (i + 1 < length) && (buff[i + 1] == ']')) // OSC, e.g., copying to the clipboard
+        {
+            while ((i < length) && (buff[i] != '\x07')) // ends with BEL
+            {
+                i++;
+            }
+            i++;
+        }
+        else if (buff[i] == '\r')
+        {
+            screen->cursorX = 0;
+            i++;
+        }
+        else if (buff[i] == '\n')
+        {
+            if (screen->cursorY == screen->bottom) // scrolls the region up a line
+            {
+                VirtualScreenScroll(screen, 1);
+            }
+            else if (screen->cursorY < screen->rows - 1)
+            {
+                screen->cursorY++;
+            }
+            i++;
+        }
+        else
+        {
+            int codePoint;
+            i += DecodeUtf8(&buff[i], length - i, &codePoint);
+            int width = (codePoint < ' ') ? 0 : CodePointWidth(codePoint);
+
+            if ((width > 0) && (screen->cursorX + width <= screen->cols)) // chars past the right edge are dropped
+            {
+                row[screen->cursorX] = codePoint;
+                if (width == 2)
+                {
+                    row[screen->cursorX + 1] = 0;
+                }
+                screen->cursorX += width;
+            }
+        }
+    }
+}
+
+/****************************************************************************************************
+ * Moves the rows of the scroll region up by 'lines' (down if negative). The rows that scroll in are
+ * blank.
+ ****************************************************************************************************/
+void VirtualScreenScroll(VirtualScreen *screen, int lines)
+{
+    int height = screen->bottom - screen->top + 1;
+    int count = (lines < 0) ? -lines : lines;
+    uint32_t *top = &screen->cells[screen->top * screen->cols];
+
+    count = (count < height) ? count : height;
+    if (lines > 0)
+    {
+        memmove(top, &top[count * screen->cols], sizeof(uint32_t) * (height - count) * screen->cols);
+        top += (height - count) * screen->cols; // the rows that scrolled in at the bottom
+    }
+    else
+    {
+        memmove(&top[count * screen->cols], top, sizeof(uint32_t) * (height - count) * screen->cols);
+    }
+    for (int cell = 0; cell < count * screen->cols; cell++)
+    {
+        top[cell] = ' ';
+    }
+}
+
+/****************************************************************************************************
+ * Prints the cells of a virtual screen to stdout, one line per row.
+ ****************************************************************************************************/
+void VirtualScreenPrint(VirtualScreen *screen)
+{
+    for (int y = 0; y < screen->rows; y++)
+    {
+        for (int x = 0; x < screen->cols; x++)
+        {
+            uint32_t cp = screen->cells[y * screen->cols + x];
+
+            if (cp == 0) // right half of a wide char
+            {
+                continue;
+            }
+            if (cp < 0x80)
+            {
+                putchar(cp);
+            }
+            else if (cp < 0x800)
+            {
+                putchar(0xC0 | (cp >> 6));
+                putchar(0x80 | (cp & 0x3F));
+            }
+            else if (cp < 0x10000)
+            {
+                putchar(0xE0 | (cp >> 12));
+                putchar(0x80 | ((cp >> 6) & 0x3F));
+                putchar(0x80 | (cp & 0x3F));
+            }
+            else
+            {
+                putchar(0xF0 | (cp >> 18));
+                putchar(0x80 | ((cp >> 12) & 0x3F));
+                putchar(0x80 | ((cp >> 6) & 0x3F));
+                putchar(0x80 | (cp & 0x3F));
+            }
+        }
+        putchar('\n');
+    }
+}
+
+//-------------------------------------------//
+//---------------Split Windows---------------//
+//-------------------------------------------//
+
+/****************************************************************************************************
+ * CTRL-K followed by '-' or '|' splits the current window in two, one above the other or side by
+ * side; 'o' goes to the next window and 'x' closes the current one. The windows are views of the
+ * same buffer: each has its own cursor and scroll offsets (a WindowNode), but the rows, their
+ * render strings and highlighting are shared, so a second view of a large file only costs its
+ * viewport. The view of the current window lives in TerminalAttr like it does without splits, so
+ * moving and editing don't know about windows; numRows and numCols are the size of that window.
+ *
+ * The windows are kept as a tree of splits, with the whole screen at node 0. Each window has a
+ * status bar of its own, and the status message is below all of them.
+ *
+ * A frame of split windows is composed into a grid of cells (screenGrid) rather than sent as is:
+ * every window writes its rows as usual, which GridWrite applies to the cells of its area, and
+ * GridDiff then sends only the cells that differ from the frame before.
+ ****************************************************************************************************/
+
+/****************************************************************************************************
+ * Handles the key after CTRL-K.
+ ****************************************************************************************************/
+void WindowKeypress(TerminalAttr *attr, int key)
+{
+    SetStatusMessage(attr, "");
+    switch (key)
+    {
+    case '-':
+    case 's':
+        SplitWindow(attr, SPLIT_ROWS);
+        break;
+    case '|':
+    case 'v':
+        SplitWindow(attr, SPLIT_COLS);
+        break;
+    case 'o':
+    case CTRL_KEY('k'):
+        NextWindow(attr);
+        break;
+    case 'x':
+    case 'c':
+        CloseWindow(attr);
+        break;
+    case '\x1b':
+        break;
+    default:
+        SetStatusMessage(attr, "Not a window command; CTRL-K and then - | o or x");
+        break;
+    }
+}
+
+/****************************************************************************************************
+ * Splits the current window in two halves showing the same view; the bottom or right one becomes
+ * the current window.
+ ****************************************************************************************************/
+void SplitWindow(TerminalAttr *attr, int split)
+{
+    if (attr->windows == NULL) // the whole screen becomes node 0
+    {
+        if ((attr->windows = malloc(sizeof(WindowNode) * (2 * WINDOW_MAX - 1))) == NULL)
+        {
+            ErrorHandler("SplitWindow: Couldn't allocate memory to windows");
+        }
+        for (int i = 0; i < 2 * WINDOW_MAX - 1; i++)
+        {
+            attr->windows[i].split = SPLIT_FREE;
+        }
+        attr->windows[0] = (WindowNode){SPLIT_NONE, -1, -1, -1, 0, 0, attr->numRows + 1, attr->numCols, 0, 0, 0, 0, 0};
+        attr->window = 0;
+    }
+
+    WindowNode *current = &attr->windows[attr->window];
+    int first = -1, second = -1;
+    for (int i = 0; i < 2 * WINDOW_MAX - 1; i++)
+    {
+        if (attr->windows[i].split != SPLIT_FREE)
+        {
+            continue;
+        }
+        if (first == -1)
+        {
+            first = i;
+        }
+        else if (second == -1)
+        {
+            second = i;
+        }
+    }
+
+    if ((second == -1) || ((split == SPLIT_ROWS) && (current->height < 2 * WINDOW_MIN_ROWS)) ||
+        ((split == SPLIT_COLS) && (current->width < 2 * WINDOW_MIN_COLS + 1)))
+    {
+        SetStatusMessage(attr, "No room for another window");
+        if (current->parent == -1) // still just the one window
+        {
+            free(attr->windows);
+            attr->windows = NULL;
+        }
+        return;
+    }
+
+    SaveWindowView(attr);
+    attr->windows[first] = *current;
+    attr->windows[first].parent = attr->window;
+    attr->windows[second] = *current;
+    attr->windows[second].parent = attr->window;
+    current->split = split;
+    current->first = first;
+    current->second = second;
+
+    attr->mark = MARK_NONE;
+    attr->window = second;
+    UpdateScreenSize(attr);
+    LoadWindowView(attr, &attr->windows[second]);
+}
+
+/****************************************************************************************************
+ * Closes the current window; the other half of its split takes its place, and the first window in
+ * that half becomes the current one.
+ ****************************************************************************************************/
+void CloseWindow(TerminalAttr *attr)
+{
+    if (attr->windows == NULL)
+    {
+        SetStatusMessage(attr, "There is only one window");
+        return;
+    }
+
+    WindowNode *windows = attr->windows;
+    int parent = windows[attr->window].parent;
+    int sibling = (windows[parent].first == attr->window) ? windows[parent].second : windows[parent].first;
+    int grandParent = windows[parent].parent;
+
+    windows[attr->window].split = SPLIT_FREE;
+    windows[parent] = windows[sibling]; // the sibling moves up into the place of the split
+    windows[parent].parent = grandParent;
+    windows[sibling].split = SPLIT_FREE;
+    if (windows[parent].split != SPLIT_NONE)
+    {
+        windows[windows[parent].first].parent = parent;
+        windows[windows[parent].second].parent = parent;
+    }
+
+    int node = parent;
+    while (windows[node].split != SPLIT_NONE)
+    {
+        node = windows[node].first;
+    }
+    attr->mark = MARK_NONE;
+    attr->window = node;
+    if (windows[0].split == SPLIT_NONE) // back to one window
+    {
+        attr->windows = NULL;
+        attr->window = 0;
+        attr->shown.rowOffset = -1;
+    }
+    UpdateScreenSize(attr);
+    LoadWindowView(attr, &windows[node]);
+    if (attr->windows == NULL)
+    {
+        free(windows);
+    }
+}
+
+/****************************************************************************************************
+ * Makes the window after the current one (left to right, top to bottom) the current window.
+ ****************************************************************************************************/
+void NextWindow(TerminalAttr *attr)
+{
+    int leaves[WINDOW_MAX];
+
+    if (attr->windows == NULL)
+    {
+        SetStatusMessage(attr, "There is only one window");
+        return;
+    }
+
+    int count = WindowLeaves(attr, 0, leaves, 0);
+    int next = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (leaves[i] == attr->window)
+        {
+            next = leaves[(i + 1) % count];
+        }
+    }
+    SaveWindowView(attr);
+    attr->mark = MARK_NONE;
+    attr->window = next;
+    UpdateScreenSize(attr);
+    LoadWindowView(attr, &attr->windows[next]);
+}
+
+/****************************************************************************************************
+ * Appends the windows under node to leaves, starting at index count, in order from the top left.
+ * Returns the new count.
+ ****************************************************************************************************/
+int WindowLeaves(TerminalAttr *attr, int node, int *leaves, int count)
+{
+    WindowNode *window = &attr->windows[node];
+
+    if (window->split == SPLIT_NONE)
+    {
+        leaves[count++] = node;
+        return count;
+    }
+    count = WindowLeaves(attr, window->first, leaves, count);
+    return WindowLeaves(attr, window->second, leaves, count);
+}
+
+/****************************************************************************************************
+ * Gives node the area at (top, left) of height rows and width columns and divides it between the
+ * windows under it: splits give their first half the top or left half of the area, rounded down.
+ ****************************************************************************************************/
+void LayoutWindow(TerminalAttr *attr, int node, int top, int left, int height, int width)
+{
+    WindowNode *window = &attr->windows[node];
+
+    window->top = top;
+    window->left = left;
+    window->height = height;
+    window->width = width;
+
+    if (window->split == SPLIT_ROWS)
+    {
+        LayoutWindow(attr, window->first, top, left, height / 2, width);
+        LayoutWindow(attr, window->second, top + height / 2, left, height - height / 2, width);
+    }
+    else if (window->split == SPLIT_COLS) // the column between the halves is the separator
+    {
+        int half = (width - 1) / 2;
+        LayoutWindow(attr, window->first, top, left, height, half);
+        LayoutWindow(attr, window->second, top, left + half + 1, height, width - half - 1);
+    }
+}
+
+/****************************************************************************************************
+ * Sets numRows and numCols to the size of the current window (the whole screen without splits),
+ * after the terminal was resized or the windows changed.
+ ****************************************************************************************************/
+void UpdateScreenSize(TerminalAttr *attr)
+{
+    int numRows, numCols;
+
+    // providing pointers of row member and column member to function FetchWindowSize
+    if (FetchWindowSize(&numRows, &numCols) == -1)
+    {
+        ErrorHandler("fetch_window_size");
+    }
+    if (attr->windows == NULL)
+    {
+        attr->numRows = numRows;
+        attr->numCols = numCols;
+        return;
+    }
+
+    LayoutWindow(attr, 0, 0, 0, numRows + 1, numCols); // + 1 as the status bars are part of the windows
+    WindowNode *current = &attr->windows[attr->window];
+    attr->numRows = (current->height > 2) ? current->height - 1 : 1;
+    attr->numCols = (current->width > 1) ? current->width : 1;
+    attr->maxrowOffset = attr->tRowsTot - attr->numRows;
+}
+
+/****************************************************************************************************
+ * Stores the view of the current window in its node.
+ ****************************************************************************************************/
+void SaveWindowView(TerminalAttr *attr)
+{
+    WindowNode *window = &attr->windows[attr->window];
+
+    window->cursorX = attr->cursorX;
+    window->cursorY = attr->cursorY;
+    window->rowOffset = attr->rowOffset;
+    window->colOffset = attr->colOffset;
+    window->wrapTop = attr->wrapTop;
+}
+
+/****************************************************************************************************
+ * Loads the view of window into attr, which has to have the size of that window already. The other
+ * windows may have deleted rows since it was shown, or it may have shrunk, so the cursor is moved
+ * back into the text and onto the window when it's out of either.
+ ****************************************************************************************************/
+void LoadWindowView(TerminalAttr *attr, WindowNode *window)
+{
+    attr->cursorX = window->cursorX;
+    attr->cursorY = window->cursorY;
+    attr->rowOffset = window->rowOffset;
+    attr->colOffset = window->colOffset;
+    attr->wrapTop = window->wrapTop;
+    attr->maxrowOffset = attr->tRowsTot - attr->numRows;
+    UpdateGutter(attr);
+
+    int row = attr->cursorY + attr->rowOffset;
+    if ((row > attr->tRowsTot) || (attr->rowOffset > attr->tRowsTot) || (attr->cursorY >= attr->numRows) ||
+        (attr->cursorX >= attr->textCols))
+    {
+        attr->rowOffset = (attr->rowOffset < attr->tRowsTot) ? attr->rowOffset : attr->tRowsTot;
+        attr->wrapTop = 0;
+        SetCursorPosition(attr, (row < attr->tRowsTot) ? row : attr->tRowsTot, attr->cursorX + attr->colOffset);
+    }
+}
+
+/****************************************************************************************************
+ * Composes a frame of split windows: the rows and status bar of every window, the separators of
+ * side by side windows and the status message below them go into screenGrid, and the cells that
+ * changed are appended to abuff. Sets screenY and screenX to where the cursor of the current
+ * window is on screen.
+ ****************************************************************************************************/
+void ComposeWindows(TerminalAttr *attr, AppendBuffer *abuff, int *screenY, int *screenX)
+{
+    WindowNode *screen = &attr->windows[0];
+    int current = attr->window, mark = attr->mark;
+
+    GridBegin(screen->height + 1, screen->width); // + 1 for the status message
+    SaveWindowView(attr);
+
+    for (int node = 0; node < 2 * WINDOW_MAX - 1; node++)
+    {
+        WindowNode *window = &attr->windows[node];
+        AppendBuffer text = ABUFF_INIT;
+
+        if (window->split == SPLIT_COLS)
+        {
+            int separator = attr->windows[window->first].left + attr->windows[window->first].width;
+            for (int i = 0; i < window->height; i++)
+            {
+                AppendString(&text, "|\r\n", 3);
+            }
+            GridWrite(window->top, separator, window->height, 1, text.buff, text.length);
+        }
+        if (window->split != SPLIT_NONE)
+        {
+            FreeAbuff(&text);
+            continue;
+        }
+
+        // the window is drawn the same way the whole screen is without splits
+        attr->window = node;
+        attr->numRows = (window->height > 2) ? window->height - 1 : 1;
+        attr->numCols = (window->width > 1) ? window->width : 1;
+        attr->mark = (node == current) ? mark : MARK_NONE; // the selection belongs to the current window
+        LoadWindowView(attr, window);
+
+        int y = attr->cursorY, x = attr->cursorX;
+        if (attr->softWrap)
+        {
+            ScrollWrapped(attr, &y, &x);
+        }
+        else if (attr->foldRoot != FOLD_NONE)
+        {
+            ScrollFolded(attr, &y);
+        }
+        WriteRows(attr, &text, 0, attr->numRows);
+        WriteStatusBar(attr, &text);
+        GridWrite(window->top, window->left, window->height, window->width, text.buff, text.length);
+        FreeAbuff(&text);
+
+        SaveWindowView(attr);
+        if (node == current)
+        {
+            *screenY = window->top + y;
+            *screenX = window->left + x + attr->numCols - attr->textCols;
+        }
+    }
+
+    attr->window = current;
+    attr->mark = mark;
+    attr->numRows = (attr->windows[current].height > 2) ? attr->windows[current].height - 1 : 1;
+    attr->numCols = (attr->windows[current].width > 1) ? attr->windows[current].width : 1;
+    LoadWindowView(attr, &attr->windows[current]);
+
+    AppendBuffer message = ABUFF_INIT;
+    attr->numCols = screen->width; // the status message takes up the whole width
+    WriteStatusMessage(attr, &message);
+    attr->numCols = (attr->windows[current].width > 1) ? attr->windows[current].width : 1;
+    GridWrite(screen->height, 0, 1, screen->width, message.buff, message.length);
+    FreeAbuff(&message);
+
+    GridDiff(abuff);
+}
+
+/****************************************************************************************************
+ * Starts composing a frame of rows x cols cells, all blank. If the screen changed size, the next
+ * frame is written in full.
+ ****************************************************************************************************/
+void GridBegin(int rows, int cols)
+{
+    Cell blank;
+
+    if ((rows != screenGrid.rows) || (cols != screenGrid.cols))
+    {
+        free(screenGrid.cells);
+        free(screenGrid.shown);
+        screenGrid.cells = malloc(sizeof(Cell) * rows * cols);
+        screenGrid.shown = malloc(sizeof(Cell) * rows * cols);
+        if ((screenGrid.cells == NULL) || (screenGrid.shown == NULL))
+        {
+            ErrorHandler("GridBegin: Couldn't allocate memory to cells");
+        }
+        screenGrid.rows = rows;
+        screenGrid.cols = cols;
+        screenGrid.valid = 0;
+    }
+
+    memset(&blank, 0, sizeof(blank)); // cells are compared with memcmp, so no byte is left unset
+    blank.text[0] = ' ';
+    blank.length = 1;
+    blank.color = 39;
+    for (int i = 0; i < rows * cols; i++)
+    {
+        screenGrid.cells[i] = blank;
+    }
+}
+
+/****************************************************************************************************
+ * Applies output meant for the terminal to the cells of the area at (top, left) of height rows and
+ * width columns, as if it were written starting at its top left corner. What WriteRows,
+ * WriteStatusBar and WriteStatusMessage send is understood: text, "\r\n", SGR colors and inverse,
+ * and clearing the rest of the line (K), which only clears up to the right edge of the area. Text
+ * past the edges is dropped.
+ ****************************************************************************************************/
+void GridWrite(int top, int left, int height, int width, const char *buff, size_t length)
+{
+    int y = 0, x = 0, color = 39, inverse = 0;
+
+    for (size_t i = 0; i < length;)
+    {
+        int onGrid = (y < height) && (top + y < screenGrid.rows);
+        Cell *row = onGrid ? &screenGrid.cells[(top + y) * screenGrid.cols + left] : NULL;
+
+        if ((buff[i] == '\x1b') && (i + 1 < length) && (buff[i + 1] == '['))
+        {
+            int params[4] = {0, 0, 0, 0}, numParams = 0;
+            size_t j = i + 2;
+
+            j += (j < length) && (buff[j] == '?'); // private modes, e.g., hiding the cursor
+            for (; (j < length) && (((buff[j] >= '0') && (buff[j] <= '9')) || (buff[j] == ';')); j++)
+            {
+                if (buff[j] == ';')
+                {
+                    numParams += (numParams < 3);
+                }
+                else
+                {
+                    params[numParams] = params[numParams] * 10 + (buff[j] - '0');
+                }
+            }
+
+            char final = (j < length) ? buff[j] : 0;
+            for (int p = 0; (final == 'm') && (p <= numParams); p++)
+            {
+                if (params[p] == 0)
+                {
+                    color = 39;
+                    inverse = 0;
+                }
+                else if ((params[p] == 7) || (params[p] == 27))
+                {
+                    inverse = (params[p] == 7);
+                }
+                else if (((params[p] >= 30) && (params[p] <= 39)) || ((params[p] >= 90) && (params[p] <= 97)))
+                {
+                    color = params[p];
+                }
+            }
+            for (int col = x; (final == 'K') && onGrid && (col < width) && (left + col < screenGrid.cols); col++)
+            {
+                row[col] = (Cell){" ", 1, 39, 0};
+            }
+            i = j + 1;
+        }
+        else if (buff[i] == '\r')
+        {
+            x = 0;
+            i++;
+        }
+        else if (buff[i] == '\n')
+        {
+            y++;
+            i++;
+        }
+        else
+        {
+            int codePoint, charLen = DecodeUtf8(&buff[i], length - i, &codePoint);
+            int charWidth = (codePoint < ' ') ? -1 : CodePointWidth(codePoint);
+
+            if ((charWidth == 0) && onGrid && (x > 0) && (x <= width)) // combining mark on the char before
+            {
+                Cell *cell = &row[x - 1 - (row[x - 1].length == 0)];
+                if (cell->length + charLen < (int)sizeof(cell->text))
+                {
+                    memcpy(&cell->text[cell->length], &buff[i], charLen);
+                    cell->length += charLen;
+                }
+            }
+            else if ((charWidth > 0) && onGrid && (x + charWidth <= width) && (left + x + charWidth <= screenGrid.cols))
+            {
+                Cell cell;
+                memset(&cell, 0, sizeof(cell));
+                memcpy(cell.text, &buff[i], charLen);
+                cell.length = charLen;
+                cell.color = color;
+                cell.inverse = inverse;
+                row[x] = cell;
+                if (charWidth == 2) // the cell right of a wide char is covered by it
+                {
+                    memset(&cell, 0, sizeof(cell));
+                    cell.color = color;
+                    cell.inverse = inverse;
+                    row[x + 1] = cell;
+                }
+                x += charWidth;
+            }
+            i += charLen;
+        }
+    }
+}
+
+/****************************************************************************************************
+ * Appends the cells of the composed frame that differ from the frame the terminal shows (or all of
+ * them if that isn't known), then remembers the composed frame as the one shown. Runs of changed
+ * cells are written after one cursor move, and SGR commands are only sent when the color changes.
+ * A few unchanged cells between two runs are written again, as that's shorter than a cursor move.
+ ****************************************************************************************************/
+void GridDiff(AppendBuffer *abuff)
+{
+    int cols = screenGrid.cols, color = -1, inverse = -1; // -1 until the first cell sets them
+    char buff[32];
+
+    for (int y = 0; y < screenGrid.rows; y++)
+    {
+        int cursorX = -1; // column the terminal's cursor is at in this row; -1 if it's elsewhere
+        int rewrite = 0;  // cells before this column are written even if they didn't change
+        Cell *row = &screenGrid.cells[y * cols];
+        Cell *shownRow = &screenGrid.shown[y * cols];
+
+        for (int x = 0; x < cols; x++)
+        {
+            if (screenGrid.valid && (x >= rewrite) && (memcmp(&row[x], &shownRow[x], sizeof(Cell)) == 0))
+            {
+                continue;
+            }
+            if ((x >= rewrite) && (cursorX >= 0) && (cursorX < x) && (x - cursorX <= GRID_REWRITE_MAX))
+            {
+                rewrite = x;
+                x = cursorX;
+            }
+            if ((row[x].length == 0) && (x > 0)) // right half of a wide char, which is written with its left half
+            {
+                if (cursorX == x + 1)
+                {
+                    continue;
+                }
+                x--;
+            }
+
+            if (cursorX != x)
+            {
+                AppendString(abuff, buff, snprintf(buff, sizeof(buff), "\x1b[%d;%dH", y + 1, x + 1));
+            }
+            if (row[x].color != color)
+            {
+                color = row[x].color;
+                AppendString(abuff, buff, snprintf(buff, sizeof(buff), "\x1b[%dm", color));
+            }
+            if (row[x].inverse != inverse)
+            {
+                inverse = row[x].inverse;
+                AppendString(abuff, inverse ? "\x1b[7m" : "\x1b[27m", inverse ? 4 : 5);
+            }
+            AppendString(abuff, row[x].length ? row[x].text : " ", row[x].length ? row[x].length : 1);
+            cursorX = x + (((x + 1 < cols) && (row[x + 1].length == 0)) ? 2 : 1);
+        }
+    }
+    AppendString(abuff, "\x1b[m", 3); // the frame ends with the default colors, like one without splits
+
+    Cell *shown = screenGrid.shown;
+    screenGrid.shown = screenGrid.cells;
+    screenGrid.cells = shown;
+    screenGrid.valid = 1;
+}
+
+//----------------------------------------------------//
+//---------------Text Editing Functions---------------//
+//----------------------------------------------------//
+
+/****************************************************************************************************
+ * Gives tRow and index directly to InsertChar as paramaters (reduces wordiness in InsertChar).
+ ****************************************************************************************************/
+void InsertCharWrapper(TerminalAttr *attr, char charIn)
+{
+    int row = attr->cursorY + attr->rowOffset;
+
+    ClipboardKeep(attr, row, row);
+    if ((row < attr->tRowsTot) && (attr->tRow[row].size >= ROW_MAX_BYTES))
+    {
+        SetStatusMessage(attr, "Line is too long (256 MB at most)");
+        return;
+    }
+    while (row >= attr->tRowsTot) // means cursorY is on a line after the last row of the file
+    {
+        RecordEdit(attr, EDIT_INSERT_ROW, attr->tRowsTot, 0, 0);
+        AppendRow(attr, "", 0); // makes new rows up to the cursor so text can be written in it
+    }
+
+    // the cursor is at a column; the char is inserted at the matching index of the text
+    int index = RowRenderToIndex(&attr->tRow[row], attr->cursorX + attr->colOffset);
+    InsertChar(&attr->tRow[row], index, charIn);
+    RowBytesChanged(attr, row, 1);
+    RecordEdit(attr, EDIT_INSERT_CHAR, row, index, (unsigned char)charIn);
+    UpdateSyntax(attr, row);
+    UpdateWrap(attr, row);
+
+    // places the cursor after the new byte; a UTF-8 char typed one byte at a time only moves the
+    // cursor its full width once its last byte arrives
+    SetCursorPosition(attr, row, RowIndexToRender(&attr->tRow[row], index + 1));
+}
+
+/****************************************************************************************************
+ * tRow is given directly as a pointer to a individual row (not the whole array) and x is cursorX.
+ * The size of the row's string is incremented by one and then we reallocate the appropiate amount
+ * of memory for the new char. Next, we move the char at index x one to the right to make room for
+ * the new char to be inserted. Lastly, the new char is inserted at index x.
+ ****************************************************************************************************/
+void InsertChar(TerminalRow *tRow, int x, char charIn)
+{
+    if (x < 0 || x > tRow->size) // makes sure column index (x) is within valid range
+    {
+        x = tRow->size; // cursor can exceed current size by one (to type a char at end of line)
+    }
+
+    tRow->text = RowRealloc(tRow->text, (size_t)tRow->size + 2); // add 2 to make room for null byte + new char
+
+    // moves char currently at x one to the right to make room for the new char
+    memmove(&tRow->text[x + 1], &tRow->text[x], tRow->size - x + 1);
+
+    tRow->size++;           // increase row size by 1
+    tRow->text[x] = charIn; // inserts newly typed char in specified location
+    RenderRow(tRow);        // to make sure string is updated onto screen
+}
+
+/****************************************************************************************************
+ * Removes the char at index x of the row by moving everything right of it one to the left. The
+ * memory is not shrunk since the row will most likely grow again.
+ ****************************************************************************************************/
+void DeleteChar(TerminalRow *tRow, int x)
+{
+    if (x < 0 || x >= tRow->size) // nothing to delete outside of the text
+    {
+        return;
+    }
+
+    memmove(&tRow->text[x], &tRow->text[x + 1], tRow->size - x); // also moves the null char
+    tRow->size--;
+    RenderRow(tRow);
+}
+
+/****************************************************************************************************
+ * Frees the row at index 'at' and closes the gap it leaves in the tRow array.
+ ****************************************************************************************************/
+void DeleteRow(TerminalAttr *attr, int at)
+{
+    DeleteRows(attr, at, 1);
+}
+
+/****************************************************************************************************
+ * Frees count rows starting at index 'at' and closes the gap with a single move of the rows below.
+ ****************************************************************************************************/
+void DeleteRows(TerminalAttr *attr, int at, int count)
+{
+    if (at < 0 || count <= 0 || count > attr->tRowsTot - at)
+    {
+        return;
+    }
+
+    attr->byteTreeValid = 0; // the rows below move up
+    for (int i = at; i < at + count; i++)
+    {
+        attr->fileBytes -= attr->tRow[i].size + 1;
+        RowFree(attr->tRow[i].text);
+        RowFree(attr->tRow[i].rendStr);
+        free(attr->tRow[i].hl);
+        free(attr->tRow[i].marks);
+        free(attr->tRow[i].wraps);
+    }
+    memmove(&attr->tRow[at], &attr->tRow[at + count], sizeof(TerminalRow) * (attr->tRowsTot - at - count));
+    attr->tRowsTot -= count;
+    ResetWrapTrees(attr);
+    FoldEdit(attr, at, count, -count); // folds below move up; ones the rows were part of are opened
+
+    attr->hlGeneration++;
+    if (attr->hlValidTo > at) // the rows below now follow a different row
+    {
+        attr->hlValidTo = at;
+    }
+}
+
+/****************************************************************************************************
+ * Moves the text of row from index on into a new row below it.
+ ****************************************************************************************************/
+void SplitRow(TerminalAttr *attr, int row, int index)
+{
+    if ((index < 0) || (index > attr->tRow[row].size))
+    {
+        index = attr->tRow[row].size;
+    }
+
+    OpenRows(attr, row + 1, 1);
+    TerminalRow *tRow = &attr->tRow[row], *below = &attr->tRow[row + 1];
+    InitRow(below, tRow->size - index);
+    memcpy(below->text, &tRow->text[index], below->size);
+    RenderRow(below);
+
+    tRow->size = index;
+    tRow->text[index] = '\0';
+    RenderRow(tRow);
+    attr->fileBytes++;       // the new row's newline
+    attr->byteTreeValid = 0; // OpenRows doesn't add rows to the tree
+    UpdateSyntax(attr, row);
+}
+
+/****************************************************************************************************
+ * Appends the row below row to it and deletes the row below.
+ ****************************************************************************************************/
+void JoinRow(TerminalAttr *attr, int row)
+{
+    TerminalRow *tRow = &attr->tRow[row], *below = &attr->tRow[row + 1];
+
+    tRow->text = RowRealloc(tRow->text, (size_t)tRow->size + below->size + 1);
+    memcpy(&tRow->text[tRow->size], below->text, (size_t)below->size + 1); // with the null char
+    tRow->size += below->size;
+    attr->fileBytes += below->size; // DeleteRow takes the row's bytes away again
+    RenderRow(tRow);
+
+    DeleteRow(attr, row + 1);
+    UpdateSyntax(attr, row);
+}
+
+//-----------------------------------------------------//
+//---------------Selection and Clipboard---------------//
+//-----------------------------------------------------//
+
+/****************************************************************************************************
+ * The selection runs between the mark and the cursor. Copying it only records where it is in the
+ * document (the clipboard's span), so CTRL-C takes the same time for a word as for a whole file.
+ * Pasting reads the text straight from the rows of the span, one TextPiece per row, without
+ * copying it anywhere first. The text is only copied out of the document into the clipboard's own
+ * bytes when the rows of the span are about to change (ClipboardKeep), since the span wouldn't
+ * describe the copied text anymore, or when the text has to leave the document.
+ ****************************************************************************************************/
+
+/****************************************************************************************************
+ * Sets the row of the cursor and the index into its text the cursor is at. The row can be past the
+ * last row of the file, in which case index is 0.
+ ****************************************************************************************************/
+void CursorIndex(TerminalAttr *attr, int *row, int *index)
+{
+    *row = attr->cursorY + attr->rowOffset;
+    *index = (*row < attr->tRowsTot) ? RowRenderToIndex(&attr->tRow[*row], attr->cursorX + attr->colOffset) : 0;
+}
+
+/****************************************************************************************************
+ * Sets (MARK_SET or MARK_SHIFT) the mark at the cursor or drops it (MARK_NONE).
+ ****************************************************************************************************/
+void SetMark(TerminalAttr *attr, int mark)
+{
+    attr->mark = mark;
+    CursorIndex(attr, &attr->markRow, &attr->markIndex);
+    if (mark == MARK_SET)
+    {
+        SetStatusMessage(attr, "Mark set");
+    }
+}
+
+/****************************************************************************************************
+ * Gets the selection, from the start up to (not including) the end, with rows past the end of the
+ * file moved to the end of the last row. Returns 0 if nothing is selected.
+ ****************************************************************************************************/
+int SelectionBounds(TerminalAttr *attr, int *startRow, int *startIndex, int *endRow, int *endIndex)
+{
+    int row[2], index[2];
+
+    if ((attr->mark == MARK_NONE) || (attr->tRowsTot == 0))
+    {
+        return 0;
+    }
+
+    row[0] = attr->markRow;
+    index[0] = attr->markIndex;
+    CursorIndex(attr, &row[1], &index[1]);
+    for (int i = 0; i < 2; i++) // the text can have changed under the mark (e.g., by an undo)
+    {
+        if (row[i] >= attr->tRowsTot)
+        {
+            row[i] = attr->tRowsTot - 1;
+            index[i] = attr->tRow[row[i]].size;
+        }
+        index[i] = (index[i] > attr->tRow[row[i]].size) ? attr->tRow[row[i]].size : index[i];
+    }
+
+    int first = (row[1] < row[0]) || ((row[1] == row[0]) && (index[1] < index[0]));
+    *startRow = row[first];
+    *startIndex = index[first];
+    *endRow = row[!first];
+    *endIndex = index[!first];
+    return (*startRow != *endRow) || (*startIndex != *endIndex);
+}
+
+/****************************************************************************************************
+ * Sets the part of file row 'row' that's selected as indices into its rendStr, for WriteRowText. If
+ * none of it is, both are 0.
+ ****************************************************************************************************/
+void SelectionBytes(TerminalAttr *attr, int row, int *selStart, int *selEnd)
+{
+    int startRow, startIndex, endRow, endIndex;
+
+    *selStart = *selEnd = 0;
+    if (!SelectionBounds(attr, &startRow, &startIndex, &endRow, &endIndex) || (row < startRow) || (row > endRow))
+    {
+        return;
+    }
+
+    TerminalRow *tRow = &attr->tRow[row];
+    int bounds[2] = {(row == startRow) ? startIndex : 0, (row == endRow) ? endIndex : tRow->size};
+    for (int i = 0; i < 2; i++) // text index to render column to rendStr index
+    {
+        int col = RowIndexToRender(tRow, bounds[i]), charCol;
+        bounds[i] = (tRow->rendCols == tRow->rendSize) ? col : RenderColToByte(tRow, col, &charCol);
+    }
+    *selStart = bounds[0];
+    *selEnd = bounds[1];
+}
+
+/****************************************************************************************************
+ * Puts the selection on the clipboard. Only its bounds are recorded, so this is instant however much
+ * is selected. It's also sent to the system clipboard (see ExportClipboard). Returns 0 if it was too
+ * big for that and 1 otherwise.
+ ****************************************************************************************************/
+int CopySelection(TerminalAttr *attr)
+{
+    int startRow, startIndex, endRow, endIndex;
+
+    if (!SelectionBounds(attr, &startRow, &startIndex, &endRow, &endIndex))
+    {
+        SetStatusMessage(attr, "Nothing is selected; CTRL-Space or SHIFT-arrows select text");
+        return 1;
+    }
+
+    free(clipboard.bytes);
+    clipboard = (Clipboard){attr, startRow, startIndex, endRow, endIndex, NULL, 0};
+    attr->mark = MARK_NONE;
+    int exported = ExportClipboard(attr);
+    SetStatusMessage(attr, "Copied %d line%s%s", endRow - startRow + 1, (endRow > startRow) ? "s" : "",
+                     exported ? "" : " (too big for the system clipboard)");
+    return exported;
+}
+
+/****************************************************************************************************
+ * Puts the selection on the clipboard and deletes it from the text.
+ ****************************************************************************************************/
+void CutSelection(TerminalAttr *attr)
+{
+    int startRow, startIndex, endRow, endIndex;
+
+    if (!SelectionBounds(attr, &startRow, &startIndex, &endRow, &endIndex))
+    {
+        SetStatusMessage(attr, "Nothing is selected; CTRL-Space or SHIFT-arrows select text");
+        return;
+    }
+    if ((size_t)startIndex + attr->tRow[endRow].size - endIndex > ROW_MAX_BYTES)
+    {
+        SetStatusMessage(attr, "Line is too long (256 MB at most)");
+        return;
+    }
+    if (SpanBytes(attr, startRow, startIndex, endRow, endIndex) > EDIT_TEXT_MAX)
+    {
+        SetStatusMessage(attr, "Selection is too big to cut (2 GB at most)");
+        return;
+    }
+
+    int exported = CopySelection(attr);
+    DeleteSpan(attr, startRow, startIndex, endRow, endIndex); // copies the text out of the rows first
+    SetStatusMessage(attr, "Cut %d line%s%s", endRow - startRow + 1, (endRow > startRow) ? "s" : "",
+                     exported ? "" : " (too big for the system clipboard)");
+}
+
+/****************************************************************************************************
+ * Sends the clipboard's text to the terminal in an OSC 52 sequence, which puts it on the system
+ * clipboard (also over ssh). The text is base64 encoded straight from the rows of the span into the
+ * output queue, BASE64_CHUNK chars at a time, without being copied out of the document first. The
+ * queue is written without waiting, like frames, so a slow connection doesn't freeze editing while
+ * it takes the sequence. Terminals limit how big the sequence can be, so text over attr->osc52Max
+ * bytes (set with --osc52) isn't sent. Returns 0 if the text was too big and 1 otherwise.
+ ****************************************************************************************************/
+int ExportClipboard(TerminalAttr *attr)
+{
+    TextPiece *lines;
+    int numLines = ClipboardLines(&lines);
+    long long length = numLines - 1; // newlines between the lines
+
+    if (numLines == 0)
+    {
+        return 1;
+    }
+    for (int i = 0; (i < numLines) && (length <= attr->osc52Max); i++)
+    {
+        length += lines[i].length;
+    }
+    if ((attr->osc52Max == 0) || (length > attr->osc52Max))
+    {
+        free(lines);
+        return attr->osc52Max == 0;
+    }
+
+    AppendBuffer *abuff = &output.queued;
+    Base64Stream stream;
+    stream.abuff = abuff;
+    stream.carryLen = 0;
+    stream.chunkLen = 0;
+
+    AppendString(abuff, "\x1b]52;c;", 7);
+    for (int i = 0; i < numLines; i++)
+    {
+        if (i > 0)
+        {
+            Base64Write(&stream, (const unsigned char *)"\n", 1);
+        }
+        Base64Write(&stream, (const unsigned char *)lines[i].text, lines[i].length);
+    }
+    Base64Finish(&stream);
+    AppendString(abuff, "\x07", 1);
+
+    if (headless != NULL) // the virtual screen takes everything at once
+    {
+        VirtualScreenWrite(headless, abuff->buff, abuff->length);
+        FreeAbuff(abuff);
+        abuff->buff = NULL;
+        abuff->length = 0;
+    }
+    else
+    {
+        FlushOutput(0); // WaitForInput writes what the terminal can't take yet
+    }
+    free(lines);
+    return 1;
+}
+
+/****************************************************************************************************
+ * Base64 encodes length bytes of data onto the end of what was written to stream so far. Every group
+ * of 3 bytes becomes 4 chars with two lookups in base64Pairs (12 bits each), and the groups are
+ * encoded into the stream's chunk in a loop without branches, which is appended to the output once
+ * it's full. Bytes that don't make a whole group are kept for the next call or Base64Finish.
+ ****************************************************************************************************/
+void Base64Write(Base64Stream *stream, const unsigned char *data, size_t length)
+{
+    if (!base64PairsBuilt)
+    {
+        for (int i = 0; i < 4096; i++)
+        {
+            base64Pairs[i][0] = base64Chars[i >> 6];
+            base64Pairs[i][1] = base64Chars[i & 63];
+        }
+        base64PairsBuilt = 1;
+    }
+
+    while ((stream->carryLen > 0) && (length > 0)) // completes the group left over from the last call
+    {
+        stream->carry[stream->carryLen++] = *data++;
+        length--;
+        if (stream->carryLen == 3)
+        {
+            stream->carryLen = 0;
+            Base64Write(stream, stream->carry, 3);
+        }
+    }
+
+    while (length >= 3)
+    {
+        size_t groups = (BASE64_CHUNK - stream->chunkLen) / 4;
+        if (groups == 0)
+        {
+            AppendString(stream->abuff, stream->chunk, stream->chunkLen);
+            stream->chunkLen = 0;
+            continue;
+        }
+        groups = (groups < length / 3) ? groups : length / 3;
+
+        char *out = &stream->chunk[stream->chunkLen];
+        for (size_t i = 0; i < groups; i++)
+        {
+            uint32_t bits = ((uint32_t)data[0] << 16) | ((uint32_t)data[1] << 8) | data[2];
+            memcpy(out, base64Pairs[bits >> 12], 2);
+            memcpy(out + 2, base64Pairs[bits & 0xFFF], 2);
+            data += 3;
+            out += 4;
+        }
+        stream->chunkLen += groups * 4;
+        length -= groups * 3;
+    }
+
+    memcpy(&stream->carry[stream->carryLen], data, length); // carryLen is 0 unless length is
+    stream->carryLen += length;
+}
+
+/****************************************************************************************************
+ * Encodes the bytes left in stream, padded with '=', and appends what's still in its chunk.
+ ****************************************************************************************************/
+void Base64Finish(Base64Stream *stream)
+{
+    if (stream->chunkLen + 4 > BASE64_CHUNK)
+    {
+        AppendString(stream->abuff, stream->chunk, stream->chunkLen);
+        stream->chunkLen = 0;
+    }
+    if (stream->carryLen > 0)
+    {
+        unsigned char *carry = stream->carry;
+        uint32_t bits = ((uint32_t)carry[0] << 16) | ((stream->carryLen == 2) ? (uint32_t)carry[1] << 8 : 0);
+        char *out = &stream->chunk[stream->chunkLen];
+
+        out[0] = base64Chars[bits >> 18];
+        out[1] = base64Chars[(bits >> 12) & 63];
+        out[2] = (stream->carryLen == 2) ? base64Chars[(bits >> 6) & 63] : '=';
+        out[3] = '=';
+        stream->chunkLen += 4;
+        stream->carryLen = 0;
+    }
+    AppendString(stream->abuff, stream->chunk, stream->chunkLen);
+    stream->chunkLen = 0;
+}
+
+/****************************************************************************************************
+ * Inserts the clipboard's text at the cursor.
+ ****************************************************************************************************/
+void PasteClipboard(TerminalAttr *attr)
+{
+    int row, index;
+    TextPiece *lines;
+
+    CursorIndex(attr, &row, &index);
+    ClipboardKeep(attr, row, INT_MAX); // the span has to stay put while it's read from
+    int numLines = ClipboardLines(&lines);
+    if (numLines == 0)
+    {
+        SetStatusMessage(attr, "Nothing to paste; CTRL-C copies the selection");
+        return;
+    }
+
+    InsertLines(attr, lines, numLines);
+    free(lines);
+}
+
+/****************************************************************************************************
+ * Makes *lines an array (to be freed by the caller) with a piece for every line of the clipboard's
+ * text and returns how many there are, or 0 if the clipboard is empty. The pieces point into the
+ * rows of the span, or into the clipboard's bytes once they were copied out.
+ ****************************************************************************************************/
+int ClipboardLines(TextPiece **lines)
+{
+    int numLines = 0;
+
+    if (clipboard.source != NULL)
+    {
+        numLines = clipboard.endRow - clipboard.startRow + 1;
+    }
+    else if (clipboard.bytes != NULL)
+    {
+        numLines = 1;
+        for (const char *c = clipboard.bytes; (c = memchr(c, '\n', clipboard.bytes + clipboard.length - c)); c++)
+        {
+            numLines++;
+        }
+    }
+    if ((numLines == 0) || ((*lines = malloc(sizeof(TextPiece) * numLines)) == NULL))
+    {
+        return 0;
+    }
+
+    if (clipboard.source != NULL)
+    {
+        for (int i = 0; i < numLines; i++)
+        {
+            TerminalRow *tRow = &clipboard.source->tRow[clipboard.startRow + i];
+            int start = (i == 0) ? clipboard.startIndex : 0;
+            int end = (i == numLines - 1) ? clipboard.endIndex : tRow->size;
+            (*lines)[i] = (TextPiece){&tRow->text[start], end - start};
+        }
+    }
+    else
+    {
+        const char *start = clipboard.bytes, *end = clipboard.bytes + clipboard.length;
+        for (int i = 0; i < numLines; i++)
+        {
+            const char *newline = memchr(start, '\n', end - start);
+            const char *lineEnd = newline ? newline : end;
+            (*lines)[i] = (TextPiece){start, lineEnd - start};
+            start = lineEnd + 1;
+        }
+    }
+    return numLines;
+}
+
+/****************************************************************************************************
+ * Called before rows row up to lastRow of attr change (INT_MAX if the rows below move). If the
+ * clipboard's span is in those rows, its text is copied out of them first.
+ ****************************************************************************************************/
+void ClipboardKeep(TerminalAttr *attr, int row, int lastRow)
+{
+    if ((clipboard.source == attr) && (clipboard.endRow >= row) && (clipboard.startRow <= lastRow))
+    {
+        ClipboardDetach();
+    }
+}
+
+/****************************************************************************************************
+ * Copies the text of the clipboard's span out of its document into the clipboard's own bytes, so the
+ * document can change (or go away) without changing what was copied.
+ ****************************************************************************************************/
+void ClipboardDetach()
+{
+    TextPiece *lines;
+    int numLines = ClipboardLines(&lines);
+    size_t length = 0;
+
+    if (clipboard.source == NULL)
+    {
+        free(numLines ? lines : NULL);
+        return;
+    }
+    for (int i = 0; i < numLines; i++)
+    {
+        length += lines[i].length + (i > 0); // newlines between the lines
+    }
+    if ((clipboard.bytes = malloc(length + 1)) == NULL)
+    {
+        ErrorHandler("ClipboardDetach: Couldn't allocate memory to the copied text");
+    }
+
+    char *bytes = clipboard.bytes;
+    for (int i = 0; i < numLines; i++)
+    {
+        if (i > 0)
+        {
+            *bytes++ = '\n';
+        }
+        memcpy(bytes, lines[i].text, lines[i].length);
+        bytes += lines[i].length;
+    }
+    clipboard.length = length;
+    clipboard.source = NULL;
+    free(lines);
+}
+
+/****************************************************************************************************
+ * Inserts lines at the cursor, as if they were typed: the text of the cursor's row after the cursor
+ * ends up after the last line, and the cursor after the inserted text. The lines are joined into a
+ * single text edit, so the whole paste is one record in the undo journal and one CTRL-Z reverts it.
+ ****************************************************************************************************/
+void InsertLines(TerminalAttr *attr, const TextPiece *lines, int numLines)
+{
+    int row, index, last = numLines - 1;
+    int chained = 0; // rows added to reach the cursor are undone together with the text
+
+    CursorIndex(attr, &row, &index);
+    ClipboardKeep(attr, row, (numLines > 1) ? INT_MAX : row);
+    size_t tailSize = (row < attr->tRowsTot) ? attr->tRow[row].size - index : 0; // moves to the end of the last line
+    size_t length = last; // every line but the last ends in a newline
+    for (int i = 0; i <= last; i++)
+    {
+        size_t size = lines[i].length + ((i == 0) ? index : 0) + ((i == last) ? tailSize : 0);
+        if (size > ROW_MAX_BYTES)
+        {
+            SetStatusMessage(attr, "Line is too long (256 MB at most)");
+            return;
+        }
+        length += lines[i].length;
+    }
+    if (length > EDIT_TEXT_MAX)
+    {
+        SetStatusMessage(attr, "Paste is too big (2 GB at most)");
+        return;
+    }
+    if (length == 0)
+    {
+        return;
+    }
+
+    while (row >= attr->tRowsTot) // cursorY is after the last row; only added once the paste fits
+    {
+        RecordEdit(attr, EDIT_INSERT_ROW | chained, attr->tRowsTot, 0, 0);
+        AppendRow(attr, "", 0);
+        chained = EDIT_CHAINED;
+    }
+
+    char *text = malloc(length);
+    if (text == NULL)
+    {
+        ErrorHandler("InsertLines: Couldn't allocate memory to the pasted text");
+    }
+    char *bytes = text;
+    for (int i = 0; i <= last; i++)
+    {
+        memcpy(bytes, lines[i].text, lines[i].length);
+        bytes += lines[i].length;
+        if (i < last)
+        {
+            *bytes++ = '\n';
+        }
+    }
+
+    RecordText(attr, EDIT_INSERT_TEXT | chained, row, index, text, length); // the journal keeps text
+    InsertText(attr, row, index, text, length);
+
+    TerminalRow *endRow = &attr->tRow[row + last];
+    SetCursorPosition(attr, row + last, RowIndexToRender(endRow, endRow->size - (int)tailSize));
+}
+
+/****************************************************************************************************
+ * Inserts length bytes of text, which may hold newlines, at index of row without recording the
+ * edit. All the new rows are made room for at once, so inserting many lines into a big file moves
+ * the rows below only once.
+ ****************************************************************************************************/
+void InsertText(TerminalAttr *attr, int row, int index, const char *text, size_t length)
+{
+    const char *end = text + length;
+    const char *firstEnd = memchr(text, '\n', length);
+    int last = 0; // rows added after row
+
+    for (const char *c = firstEnd; c != NULL; c = memchr(c + 1, '\n', end - c - 1))
+    {
+        last++;
+    }
+
+    OpenRows(attr, row + 1, last);
+    if (last > 0)
+    {
+        attr->byteTreeValid = 0; // OpenRows doesn't add rows to the tree
+    }
+    TerminalRow *tRow = &attr->tRow[row];
+    size_t tailSize = tRow->size - index;
+    size_t firstLength = (last > 0) ? (size_t)(firstEnd - text) : length;
+    if (last == 0) // the text goes in the middle of the row
+    {
+        tRow->text = RowRealloc(tRow->text, (size_t)tRow->size + length + 1);
+        memmove(&tRow->text[index + length], &tRow->text[index], tailSize + 1);
+    }
+    else // the tail of the row goes after the last line, and the first line replaces it
+    {
+        const char *line = firstEnd + 1;
+        for (int i = 1; i < last; i++)
+        {
+            const char *lineEnd = memchr(line, '\n', end - line);
+            InitRow(&attr->tRow[row + i], lineEnd - line);
+            memcpy(attr->tRow[row + i].text, line, lineEnd - line);
+            RenderRow(&attr->tRow[row + i]);
+            line = lineEnd + 1;
+        }
+
+        TerminalRow *lastRow = &attr->tRow[row + last];
+        InitRow(lastRow, (end - line) + tailSize);
+        memcpy(lastRow->text, line, end - line);
+        memcpy(&lastRow->text[end - line], &tRow->text[index], tailSize);
+        RenderRow(lastRow);
+
+        tRow->text = RowRealloc(tRow->text, (size_t)index + firstLength + 1);
+        tRow->text[index + firstLength] = '\0';
+        tRow->size = index;
+    }
+    memcpy(&tRow->text[index], text, firstLength);
+    tRow->size += firstLength;
+    RenderRow(tRow);
+
+    RowBytesChanged(attr, row, length); // every byte of text, newlines included, ends up in the file
+    UpdateSyntax(attr, row);
+    UpdateWrap(attr, row);
+}
+
+/****************************************************************************************************
+ * Returns the number of bytes from (startRow, startIndex) up to (endRow, endIndex), counting a
+ * newline at the end of every row but the last.
+ ****************************************************************************************************/
+size_t SpanBytes(TerminalAttr *attr, int startRow, int startIndex, int endRow, int endIndex)
+{
+    size_t length = (size_t)endIndex - startIndex;
+
+    for (int row = startRow; row < endRow; row++)
+    {
+        length += (size_t)attr->tRow[row].size + 1;
+    }
+    return length;
+}
+
+/****************************************************************************************************
+ * Finds where the length bytes starting at index of row end, counting a newline at the end of every
+ * row. Returns -1 if they go past the end of the text.
+ ****************************************************************************************************/
+int TextSpanEnd(TerminalAttr *attr, int row, int index, size_t length, int *endRow, int *endIndex)
+{
+    if ((row < 0) || (row >= attr->tRowsTot) || (index < 0) || (index > attr->tRow[row].size))
+    {
+        return -1;
+    }
+
+    while (length > (size_t)(attr->tRow[row].size - index)) // the span goes on past this row's newline
+    {
+        length -= attr->tRow[row].size - index + 1;
+        row++;
+        index = 0;
+        if (row >= attr->tRowsTot)
+        {
+            return -1;
+        }
+    }
+
+    *endRow = row;
+    *endIndex = index + length;
+    return 0;
+}
+
+/****************************************************************************************************
+ * Deletes the text from (startRow, startIndex) up to (endRow, endIndex), joining what is left of the
+ * two rows. The deleted text is copied into a single text edit, so the whole cut is one record in
+ * the undo journal and one CTRL-Z brings it back.
+ ****************************************************************************************************/
+void DeleteSpan(TerminalAttr *attr, int startRow, int startIndex, int endRow, int endIndex)
+{
+    ClipboardKeep(attr, startRow, (startRow < endRow) ? INT_MAX : startRow);
+
+    size_t length = SpanBytes(attr, startRow, startIndex, endRow, endIndex);
+    char *text = malloc(length ? length : 1);
+    if (text == NULL)
+    {
+        ErrorHandler("DeleteSpan: Couldn't allocate memory to the deleted text");
+    }
+    char *bytes = text;
+    for (int row = startRow; row <= endRow; row++)
+    {
+        TerminalRow *tRow = &attr->tRow[row];
+        int start = (row == startRow) ? startIndex : 0;
+        int end = (row == endRow) ? endIndex : tRow->size;
+        memcpy(bytes, &tRow->text[start], end - start);
+        bytes += end - start;
+        if (row < endRow)
+        {
+            *bytes++ = '\n';
+        }
+    }
+
+    if (length > 0)
+    {
+        RecordText(attr, EDIT_DELETE_TEXT, startRow, startIndex, text, length); // the journal keeps text
+    }
+    else
+    {
+        free(text);
+    }
+    RemoveText(attr, startRow, startIndex, endRow, endIndex);
+    SetCursorPosition(attr, startRow, RowIndexToRender(&attr->tRow[startRow], startIndex));
+}
+
+/****************************************************************************************************
+ * Deletes the text from (startRow, startIndex) up to (endRow, endIndex) without recording the edit.
+ * The rows in between are removed with a single move of the rows below.
+ ****************************************************************************************************/
+void RemoveText(TerminalAttr *attr, int startRow, int startIndex, int endRow, int endIndex)
+{
+    TerminalRow *first = &attr->tRow[startRow], *last = &attr->tRow[endRow];
+    size_t tailSize = last->size - endIndex;
+    long long sizeBefore = first->size;
+    if (startRow == endRow)
+    {
+        memmove(&first->text[startIndex], &first->text[endIndex], tailSize + 1);
+    }
+    else
+    {
+        first->text = RowRealloc(first->text, (size_t)startIndex + tailSize + 1);
+        memcpy(&first->text[startIndex], &last->text[endIndex], tailSize + 1);
+    }
+    first->size = startIndex + tailSize;
+    RenderRow(first);
+    RowBytesChanged(attr, startRow, first->size - sizeBefore);
+    DeleteRows(attr, startRow + 1, endRow - startRow);
+
+    UpdateSyntax(attr, startRow);
+    UpdateWrap(attr, startRow);
+}
+
+//---------------------------------------------//
+//---------------Undo Journal------------------//
+//---------------------------------------------//
+
+/****************************************************************************************************
+ * Every change to the text is described by an EditOp and stored in the undo journal through
+ * RecordEdit. Undo pops the newest EditOp (and any chained to it) and applies the inverses.
+ *
+ * When the file is saved, the journal is written to a sidecar file next to it (see SidecarPath) and
+ * memory-mapped back in, so the history of a long editing session lives on disk rather than in
+ * memory. The sidecar starts with UNDO_MAGIC and a hash of the saved file, followed by one record per
+ * EditOp and a checksum. OpenFile only maps the sidecar back in if the hash matches the file, meaning
+ * the history still describes how the text on disk came to be.
+ *
+ * A record is the EditOp's fields as varints (7 bits per byte, high bit set when more bytes follow),
+ * then the bytes of a text edit, and ends with the record's own length so the journal can be walked
+ * backwards one undo at a time. The length is one byte for all but text edits; see EndEditRecord.
+ ****************************************************************************************************/
+
+/****************************************************************************************************
+ * Adds an edit that was just made to the text to the end of the undo journal and to the swap log.
+ ****************************************************************************************************/
+void RecordEdit(TerminalAttr *attr, int type, int row, int col, int charIn)
+{
+    EditOp op = {type, row, col, charIn, NULL};
+
+    PushUndoOp(&attr->undo, &op);
+    SwapLogAppend(&attr->swap, &op);
+}
+
+/****************************************************************************************************
+ * Like RecordEdit, for a text edit of length bytes. The journal takes text over and frees it once
+ * the edit is undone or saved into the sidecar.
+ ****************************************************************************************************/
+void RecordText(TerminalAttr *attr, int type, int row, int col, char *text, size_t length)
+{
+    EditOp op = {type, row, col, (int)length, text};
+
+    PushUndoOp(&attr->undo, &op);
+    SwapLogAppend(&attr->swap, &op);
+}
+
+/****************************************************************************************************
+ * Adds op to the end of the edits kept in memory by the undo journal.
+ ****************************************************************************************************/
+void PushUndoOp(UndoJournal *undo, const EditOp *op)
+{
+    if (undo->opsTot == undo->capacity) // grows the journal geometrically to keep typing cheap
+    {
+        int capacity = undo->capacity ? undo->capacity * 2 : 64;
+        EditOp *ops = realloc(undo->ops, sizeof(EditOp) * capacity);
+        if (ops == NULL)
+        {
+            ErrorHandler("PushUndoOp: realloc memory for undo journal");
+        }
+        undo->ops = ops;
+        undo->capacity = capacity;
+    }
+
+    undo->ops[undo->opsTot++] = *op;
+}
+
+/****************************************************************************************************
+ * Applies an EditOp to the text without recording it in the journal.
+ ****************************************************************************************************/
+void ApplyEditOp(TerminalAttr *attr, const EditOp *op)
+{
+    if (op->row < 0 || op->row > attr->tRowsTot) // ignores edits that don't fit the text
+    {
+        return;
+    }
+    int type = op->type & ~EDIT_CHAINED;
+    int inRow = (type == EDIT_INSERT_CHAR) || (type == EDIT_DELETE_CHAR); // other edits move rows
+    ClipboardKeep(attr, op->row, inRow ? op->row : INT_MAX);
+    int endRow, endIndex;
+
+    switch (type)
+    {
+    case EDIT_INSERT_CHAR:
+        if (op->row < attr->tRowsTot)
+        {
+            InsertChar(&attr->tRow[op->row], op->col, op->charIn);
+            RowBytesChanged(attr, op->row, 1);
+            UpdateSyntax(attr, op->row);
+            UpdateWrap(attr, op->row);
+        }
+        break;
+    case EDIT_DELETE_CHAR:
+        if (op->row < attr->tRowsTot)
+        {
+            int sizeBefore = attr->tRow[op->row].size;
+            DeleteChar(&attr->tRow[op->row], op->col);
+            RowBytesChanged(attr, op->row, attr->tRow[op->row].size - sizeBefore); // 0 if col was past the end
+            UpdateSyntax(attr, op->row);
+            UpdateWrap(attr, op->row);
+        }
+        break;
+    case EDIT_INSERT_ROW:
+        if (op->row == attr->tRowsTot) // rows are only ever added after the last row
+        {
+            AppendRow(attr, "", 0);
+        }
+        break;
+    case EDIT_DELETE_ROW:
+        DeleteRow(attr, op->row);
+        break;
+    case EDIT_SPLIT_ROW:
+        if (op->row < attr->tRowsTot)
+        {
+            SplitRow(attr, op->row, op->col);
+        }
+        break;
+    case EDIT_JOIN_ROW:
+        if (op->row + 1 < attr->tRowsTot)
+        {
+            JoinRow(attr, op->row);
+        }
+        break;
+    case EDIT_INSERT_TEXT:
+        if ((op->row < attr->tRowsTot) && (op->col >= 0) && (op->col <= attr->tRow[op->row].size))
+        {
+            InsertText(attr, op->row, op->col, op->text, op->charIn);
+        }
+        break;
+    case EDIT_DELETE_TEXT:
+        if (TextSpanEnd(attr, op->row, op->col, op->charIn, &endRow, &endIndex) == 0)
+        {
+            RemoveText(attr, op->row, op->col, endRow, endIndex);
+        }
+        break;
+    }
+}
+
+/****************************************************************************************************
+ * Takes the newest edit off the journal and applies its inverse, which is stored in op. Edits made
+ * since the last save are taken from memory first; older ones are read from the mapped sidecar.
+ * Returns -1 (with a status message) if there was nothing left to undo, 1 if the edit before it
+ * belongs to the same undo step and 0 otherwise.
+ ****************************************************************************************************/
+int RevertEdit(TerminalAttr *attr, EditOp *op)
+{
+    UndoJournal *undo = &attr->undo;
+    int inMemory = (undo->opsTot > 0);
+
+    if (inMemory)
+    {
+        *op = undo->ops[--undo->opsTot];
+    }
+    else if ((undo->mapped != NULL) && (undo->mappedEnd > UNDO_HEADER_SIZE))
+    {
+        int recLen = EditRecordLengthBefore(&undo->mapped[undo->mappedEnd], undo->mappedEnd - UNDO_HEADER_SIZE);
+        if ((recLen == -1) || (DecodeEditOp(&undo->mapped[undo->mappedEnd - recLen], recLen, op) == -1))
+        {
+            undo->mappedEnd = UNDO_HEADER_SIZE; // damaged history; nothing older can be undone
+            SetStatusMessage(attr, "Undo history is damaged");
+            return -1;
+        }
+        undo->mappedEnd -= recLen;
+    }
+    else
+    {
+        SetStatusMessage(attr, "Nothing to undo");
+        return -1;
+    }
+
+    int chained = (op->type & EDIT_CHAINED) != 0;
+    op->type &= ~EDIT_CHAINED;
+    switch (op->type) // turns the edit into its inverse
+    {
+    case EDIT_INSERT_CHAR:
+        op->type = EDIT_DELETE_CHAR;
+        break;
+    case EDIT_DELETE_CHAR:
+        op->type = EDIT_INSERT_CHAR;
+        break;
+    case EDIT_INSERT_ROW:
+        op->type = EDIT_DELETE_ROW;
+        break;
+    case EDIT_DELETE_ROW:
+        op->type = EDIT_INSERT_ROW;
+        break;
+    case EDIT_SPLIT_ROW:
+        op->type = EDIT_JOIN_ROW;
+        break;
+    case EDIT_JOIN_ROW:
+        op->type = EDIT_SPLIT_ROW;
+        break;
+    case EDIT_INSERT_TEXT:
+        op->type = EDIT_DELETE_TEXT;
+        break;
+    case EDIT_DELETE_TEXT:
+        op->type = EDIT_INSERT_TEXT;
+        break;
+    }
+    ApplyEditOp(attr, op);
+    if (inMemory)
+    {
+        free(op->text); // text read from the sidecar stays in the mapping
+    }
+    op->text = NULL;
+
+    // UTF-8 chars are edited one byte at a time; undoing a continuation byte keeps going until the
+    // rest of the char is undone too, so a char is never left half typed
+    if (((op->type == EDIT_INSERT_CHAR) || (op->type == EDIT_DELETE_CHAR)) && ((op->charIn & 0xC0) == 0x80))
+    {
+        chained = 1;
+    }
+    return chained;
+}
+
+/****************************************************************************************************
+ * Reverts the newest undo step: the newest edit in the journal along with the edits chained to it.
+ * op is left with the last edit that was applied. Returns -1 if there was nothing to undo.
+ ****************************************************************************************************/
+int RevertStep(TerminalAttr *attr, EditOp *op)
+{
+    int result = RevertEdit(attr, op);
+    if (result == -1)
+    {
+        return -1;
+    }
+
+    while (result == 1)
+    {
+        result = RevertEdit(attr, op);
+    }
+    return 0;
+}
+
+/****************************************************************************************************
+ * Reverts the newest undo step and moves the cursor to where it happened.
+ ****************************************************************************************************/
+void Undo(TerminalAttr *attr)
+{
+    EditOp op;
+
+    if (RevertStep(attr, &op) == -1)
+    {
+        return;
+    }
+
+    // the swap log records that an undo happened rather than the inverse edits, so replaying it takes
+    // the edits off the journal again instead of adding ones that a later undo would redo
+    EditOp undone = {EDIT_UNDO, 0, 0, 0, NULL};
+    SwapLogAppend(&attr->swap, &undone);
+
+    if (op.row < attr->tRowsTot)
+    {
+        SetCursorPosition(attr, op.row, RowIndexToRender(&attr->tRow[op.row], op.col));
+    }
+    else
+    {
+        SetCursorPosition(attr, attr->tRowsTot, 0);
+    }
+}
+
+/****************************************************************************************************
+ * Returns the number of varint fields a record of the given edit type starts with.
+ ****************************************************************************************************/
+int EditFieldCount(int type)
+{
+    switch (type & ~EDIT_CHAINED)
+    {
+    case EDIT_INSERT_CHAR:
+    case EDIT_DELETE_CHAR:
+    case EDIT_INSERT_TEXT: // the length of the text takes the place of the char
+    case EDIT_DELETE_TEXT:
+        return 4;
+    case EDIT_SPLIT_ROW: // no char, but a col
+    case EDIT_JOIN_ROW:
+        return 3;
+    default:
+        return 2;
+    }
+}
+
+/****************************************************************************************************
+ * Returns the number of bytes the length at the end of a record takes up when the rest of the
+ * record takes up length bytes.
+ ****************************************************************************************************/
+int EditTrailerSize(size_t length)
+{
+    int size = 1;
+
+    while ((length + size) >> (7 * size)) // the total length has to fit in 7 bits per byte
+    {
+        size++;
+    }
+    return size;
+}
+
+/****************************************************************************************************
+ * Ends a record whose fields and text take up the first length bytes of rec with its total length
+ * and returns that. The length is written as a varint with its high bits first and the high bit set
+ * on every byte but the first, so it can be read from the end of the record backwards without
+ * running into the text before it. A length below 128 is a single plain byte.
+ ****************************************************************************************************/
+int EndEditRecord(unsigned char *rec, size_t length)
+{
+    return length + EncodeEditTrailer(&rec[length], length);
+}
+
+/****************************************************************************************************
+ * Writes the length at the end of a record whose fields and text take up length bytes into trailer
+ * and returns the number of bytes it takes up (see EndEditRecord). Lets a record be written in
+ * pieces without its text being copied.
+ ****************************************************************************************************/
+int EncodeEditTrailer(unsigned char *trailer, size_t length)
+{
+    int size = EditTrailerSize(length);
+    size_t value = length + size;
+
+    for (int i = size - 1; i >= 0; i--)
+    {
+        trailer[i] = (value & 0x7f) | ((i > 0) ? 0x80 : 0);
+        value >>= 7;
+    }
+    return size;
+}
+
+/****************************************************************************************************
+ * Reads the length of the record that ends just before end, which has avail bytes of records before
+ * it. Returns -1 if the length is malformed or longer than avail.
+ ****************************************************************************************************/
+int EditRecordLengthBefore(const unsigned char *end, size_t avail)
+{
+    uint64_t length = 0;
+    size_t size = 1; // bytes of the length read so far
+    int shift = 0;
+
+    while ((size <= avail) && (*(end - size) & 0x80) && (shift < 35))
+    {
+        length |= (uint64_t)(*(end - size) & 0x7f) << shift;
+        shift += 7;
+        size++;
+    }
+    if ((size > avail) || (*(end - size) & 0x80))
+    {
+        return -1;
+    }
+    length |= (uint64_t)*(end - size) << shift;
+
+    if ((length <= size) || (length > avail) || (length > INT_MAX))
+    {
+        return -1;
+    }
+    return length;
+}
+
+/****************************************************************************************************
+ * Encodes an EditOp into rec as a journal record and returns the length of the record. rec must
+ * have room for EDIT_RECORD_MAX bytes plus the text of a text edit.
+ ****************************************************************************************************/
+int EncodeEditOp(const EditOp *op, unsigned char *rec)
+{
+    size_t length = EncodeEditFields(op, rec);
+
+    if (op->text != NULL)
+    {
+        memcpy(&rec[length], op->text, op->charIn);
+        length += op->charIn;
+    }
+    return EndEditRecord(rec, length);
+}
+
+/****************************************************************************************************
+ * Encodes the fields of an EditOp, the start of its journal record, into rec and returns their
+ * length, which never exceeds EDIT_RECORD_MAX. The text of a text edit and the trailer come next.
+ ****************************************************************************************************/
+int EncodeEditFields(const EditOp *op, unsigned char *rec)
+{
+    uint32_t fields[4] = {op->type, op->row, op->col, op->charIn};
+    int numFields = EditFieldCount(op->type);
+    size_t length = 0;
+
+    for (int i = 0; i < numFields; i++)
+    {
+        uint32_t value = fields[i];
+        while (value >= 0x80) // low 7 bits first; the high bit marks that more bytes follow
+        {
+            rec[length++] = (value & 0x7f) | 0x80;
+            value >>= 7;
+        }
+        rec[length++] = value;
+    }
+    return length;
+}
+
+/****************************************************************************************************
+ * Decodes the varint fields at the start of the record rec, which has avail bytes left, into fields
+ * (those the record's type doesn't store are 0). Returns the number of bytes the fields take up, or
+ * -1 if they are malformed, cut off or of an unknown type.
+ ****************************************************************************************************/
+int DecodeEditFields(const unsigned char *rec, size_t avail, uint32_t fields[4])
+{
+    size_t pos = 0;
+    int numFields = 2;
+
+    memset(fields, 0, sizeof(uint32_t) * 4);
+    for (int i = 0; i < numFields; i++)
+    {
+        int shift = 0;
+        while ((pos < avail) && (rec[pos] & 0x80) && (shift < 28))
+        {
+            fields[i] |= (uint32_t)(rec[pos++] & 0x7f) << shift;
+            shift += 7;
+        }
+        if ((pos >= avail) || (rec[pos] & 0x80)) // varint ran past the end of the record
+        {
+            return -1;
+        }
+        fields[i] |= (uint32_t)rec[pos++] << shift;
+
+        if (i == 0)
+        {
+            uint32_t type = fields[0] & ~EDIT_CHAINED;
+            if ((type < EDIT_INSERT_CHAR) || (type > EDIT_UNDO))
+            {
+                return -1;
+            }
+            numFields = EditFieldCount(type);
+        }
+    }
+    return pos;
+}
+
+/****************************************************************************************************
+ * Decodes a journal record of recLen bytes (as produced by EncodeEditOp) into op. The text of a text
+ * edit is left in rec. Returns -1 if the record is malformed and 0 otherwise.
+ ****************************************************************************************************/
+int DecodeEditOp(const unsigned char *rec, int recLen, EditOp *op)
+{
+    uint32_t fields[4];
+    int pos = DecodeEditFields(rec, recLen, fields);
+    if (pos == -1)
+    {
+        return -1;
+    }
+
+    int type = fields[0] & ~EDIT_CHAINED;
+    const unsigned char *text = NULL;
+    if ((type == EDIT_INSERT_TEXT) || (type == EDIT_DELETE_TEXT))
+    {
+        if ((fields[3] == 0) || (fields[3] > EDIT_TEXT_MAX) || (fields[3] > (size_t)(recLen - pos)))
+        {
+            return -1;
+        }
+        text = &rec[pos];
+        pos += fields[3];
+    }
+
+    if (pos + EditTrailerSize(pos) != recLen)
+    {
+        return -1;
+    }
+
+    op->type = fields[0];
+    op->row = fields[1];
+    op->col = fields[2];
+    op->charIn = fields[3];
+    op->text = (char *)text;
+    return 0;
+}
+
+/****************************************************************************************************
+ * Finds the length of the record at the start of rec, which has avail bytes left, when reading a
+ * journal or swap file forwards. Returns -1 if the record is malformed or cut off.
+ ****************************************************************************************************/
+int EditRecordLength(const unsigned char *rec, size_t avail)
+{
+    uint32_t fields[4];
+    int pos = DecodeEditFields(rec, (avail < EDIT_RECORD_MAX) ? avail : EDIT_RECORD_MAX, fields);
+    if (pos == -1)
+    {
+        return -1;
+    }
+
+    int type = fields[0] & ~EDIT_CHAINED;
+    if ((type == EDIT_INSERT_TEXT) || (type == EDIT_DELETE_TEXT))
+    {
+        if ((fields[3] > EDIT_TEXT_MAX) || (fields[3] > avail - pos))
+        {
+            return -1;
+        }
+        pos += fields[3];
+    }
+
+    size_t length = pos + EditTrailerSize(pos);
+    if ((length > avail) || (EditRecordLengthBefore(&rec[length], length) != (int)length))
+    {
+        return -1; // the length at the end must agree with the fields
+    }
+    return length;
+}
+
+/****************************************************************************************************
+ * Writes length bytes of data to fd and adds them to the running checksum. Returns -1 with errno
+ * set if the write failed.
+ ****************************************************************************************************/
+int WriteHashed(int fd, const void *data, size_t length, uint64_t *checksum)
+{
+    *checksum = HashBytes(*checksum, data, length);
+    return WriteAll(fd, data, length);
+}
+
+/****************************************************************************************************
+ * Writes the whole undo journal (the records still mapped from the previous sidecar followed by the
+ * edits in memory) to the sidecar of the file that was just saved with hash fileHash. The sidecar is
+ * written to a temporary file and renamed over the old one so the mapping of the old one stays
+ * valid until it's replaced. The old records are written straight from the mapping and the new ones
+ * are encoded through a small buffer, with the text of a large text edit written from the edit
+ * itself, so the history is never copied into memory. Afterwards the edits in memory are dropped
+ * and the new sidecar mapped.
+ ****************************************************************************************************/
+void SaveUndoJournal(TerminalAttr *attr, uint64_t fileHash)
+{
+    UndoJournal *undo = &attr->undo;
+    char *path = SidecarPath(attr->fileName, ".hundo");
+    size_t oldLength = (undo->mapped != NULL) ? undo->mappedEnd - UNDO_HEADER_SIZE : 0;
+
+    if ((oldLength == 0) && (undo->opsTot == 0)) // nothing to undo, so no sidecar is needed
+    {
+        unlink(path);
+        free(path);
+        return;
+    }
+
+    unsigned char *buff = malloc(UNDO_WRITE_BYTES);
+    if (buff == NULL)
+    {
+        ErrorHandler("SaveUndoJournal: Couldn't allocate memory to buff");
+    }
+
+    char *tmpPath = SidecarPath(attr->fileName, ".hundo.tmp");
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    uint64_t checksum = HashBytes(0, NULL, 0);
+    int failed = (fd == -1);
+
+    memcpy(buff, UNDO_MAGIC, 4);
+    for (int i = 0; i < 8; i++)
+    {
+        buff[4 + i] = fileHash >> (8 * i); // stored little endian
+    }
+    failed = failed || (WriteHashed(fd, buff, UNDO_HEADER_SIZE, &checksum) == -1);
+    if (oldLength > 0)
+    {
+        failed = failed || (WriteHashed(fd, &undo->mapped[UNDO_HEADER_SIZE], oldLength, &checksum) == -1);
+    }
+
+    size_t length = 0;
+    for (int i = 0; (i < undo->opsTot) && !failed; i++)
+    {
+        EditOp *op = &undo->ops[i];
+        size_t textLength = (op->text != NULL) ? op->charIn : 0;
+
+        if (length + EDIT_RECORD_MAX + textLength > UNDO_WRITE_BYTES) // no room left in the buffer
+        {
+            failed = (WriteHashed(fd, buff, length, &checksum) == -1);
+            length = 0;
+        }
+        if (failed)
+        {
+            break;
+        }
+        if (EDIT_RECORD_MAX + textLength <= UNDO_WRITE_BYTES)
+        {
+            length += EncodeEditOp(op, &buff[length]);
+            continue;
+        }
+
+        // too big for the buffer: the fields, then the text from the edit, then the trailer
+        int fieldsLength = EncodeEditFields(op, buff);
+        if ((WriteHashed(fd, buff, fieldsLength, &checksum) == -1) ||
+            (WriteHashed(fd, op->text, textLength, &checksum) == -1))
+        {
+            failed = 1;
+            break;
+        }
+        length = EncodeEditTrailer(buff, fieldsLength + textLength);
+    }
+    failed = failed || (WriteHashed(fd, buff, length, &checksum) == -1);
+
+    for (int i = 0; i < 8; i++)
+    {
+        buff[i] = checksum >> (8 * i);
+    }
+    failed = failed || (WriteAll(fd, buff, UNDO_TRAILER_SIZE) == -1);
+
+    if (!failed && (close(fd) == 0) && (rename(tmpPath, path) == 0))
+    {
+        if (undo->mapped != NULL)
+        {
+            munmap(undo->mapped, undo->mappedSize);
+            undo->mapped = NULL;
+        }
+        for (int i = 0; i < undo->opsTot; i++)
+        {
+            free(undo->ops[i].text);
+        }
+        undo->opsTot = 0; // the edits now live in the sidecar
+        LoadUndoJournal(attr, fileHash);
+    }
+    else // history stays in memory; the file itself was still saved
+    {
+        int error = errno;
+        if (fd != -1)
+        {
+            if (failed)
+            {
+                close(fd);
+            }
+            unlink(tmpPath);
+        }
+        SetStatusMessage(attr, "Couldn't save undo history: %s", strerror(error));
+    }
+
+    free(tmpPath);
+    free(buff);
+    free(path);
+}
+
+/****************************************************************************************************
+ * Memory-maps the sidecar of the opened file if it exists, has a valid checksum and was saved
+ * together with the file whose hash is fileHash. Otherwise the journal simply starts out empty.
+ ****************************************************************************************************/
+void LoadUndoJournal(TerminalAttr *attr, uint64_t fileHash)
+{
+    UndoJournal *undo = &attr->undo;
+    char *path = SidecarPath(attr->fileName, ".hundo");
+    int fd = open(path, O_RDONLY);
+    free(path);
+
+    if (fd == -1)
+    {
+        return;
+    }
+
+    struct stat st;
+    if ((fstat(fd, &st) == -1) || (st.st_size < UNDO_HEADER_SIZE + UNDO_TRAILER_SIZE))
+    {
+        close(fd);
+        return;
+    }
+
+    size_t size = st.st_size;
+    unsigned char *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping stays valid after closing
+    if (mapped == MAP_FAILED)
+    {
+        return;
+    }
+
+    uint64_t storedHash = 0, storedChecksum = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        storedHash |= (uint64_t)mapped[4 + i] << (8 * i);
+        storedChecksum |= (uint64_t)mapped[size - UNDO_TRAILER_SIZE + i] << (8 * i);
+    }
+
+    if ((memcmp(mapped, UNDO_MAGIC, 4) != 0) || (storedHash != fileHash) ||
+        (storedChecksum != HashBytes(HashBytes(0, NULL, 0), mapped, size - UNDO_TRAILER_SIZE)))
+    {
+        munmap(mapped, size); // stale or damaged; the file was changed outside of Helio
+        return;
+    }
+
+    undo->mapped = mapped;
+    undo->mappedSize = size;
+    undo->mappedEnd = size - UNDO_TRAILER_SIZE;
+}
+
+//-----------------------------------------------//
+//---------------Crash Recovery------------------//
+//-----------------------------------------------//
+
+/****************************************************************************************************
+ * Every edit (including undos) is appended to a swap file next to the open file, so edits that
+ * weren't saved can be replayed over the file after Helio dies. The swap file starts with SWAP_MAGIC
+ * and the hash of the file on disk, followed by the same records the undo journal uses. An undo is
+ * logged as an EDIT_UNDO record, which replaying turns back into an undo.
+ *
+ * To keep keystrokes cheap, SwapLogAppend only encodes the record into memory. The records are
+ * written and synced to disk together (group commit) when SWAP_COMMIT_BYTES have piled up, at least
+ * every SWAP_COMMIT_MS while typing, as soon as typing stops, and before Helio exits on an error or
+ * a fatal signal. The swap file is removed once the file is saved or Helio quits normally.
+ ****************************************************************************************************/
+
+/****************************************************************************************************
+ * Encodes op at the end of the pending records, creating the swap file first if this is the first
+ * edit since the file was opened or saved. A text edit too big for the pending buffer is written
+ * and synced on its own after the records before it.
+ ****************************************************************************************************/
+void SwapLogAppend(SwapLog *swap, const EditOp *op)
+{
+    if ((swap->path == NULL) || swap->failed) // no file to recover the edits onto, or no usable log
+    {
+        return;
+    }
+
+    if (swap->fd == -1)
+    {
+        swap->fd = open(swap->path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600); // may hold private text
+        if (swap->fd == -1)
+        {
+            return; // editing goes on without crash recovery
+        }
+
+        unsigned char header[SWAP_HEADER_SIZE];
+        memcpy(header, SWAP_MAGIC, 4);
+        for (int i = 0; i < 8; i++)
+        {
+            header[4 + i] = swap->fileHash >> (8 * i); // stored little endian
+        }
+        memcpy(swap->pending, header, SWAP_HEADER_SIZE); // committed together with the first records
+        swap->pendingLen = SWAP_HEADER_SIZE;
+        crashSwap = swap;
+    }
+
+    size_t recordMax = EDIT_RECORD_MAX + ((op->text != NULL) ? op->charIn : 0);
+    if ((swap->pendingLen + recordMax > swap->pendingCap) && (SwapLogCommit(swap) == -1))
+    {
+        return;
+    }
+
+    if (recordMax > swap->pendingCap)
+    {
+        unsigned char *rec = malloc(recordMax);
+        if (rec == NULL)
+        {
+            ErrorHandler("SwapLogAppend: Couldn't allocate memory to a record");
+        }
+        if (SwapLogWrite(swap, rec, EncodeEditOp(op, rec)) == 0)
+        {
+            fdatasync(swap->fd);
+            swap->lastCommit = MonotonicNanos();
+        }
+        free(rec);
+        return;
+    }
+
+    swap->pendingLen += EncodeEditOp(op, &swap->pending[swap->pendingLen]);
+
+    if (swap->pendingLen + EDIT_RECORD_MAX > swap->pendingCap)
+    {
+        SwapLogCommit(swap); // the pending buffer is full
+    }
+}
+
+/****************************************************************************************************
+ * Writes the pending records to the swap file and syncs it (the group commit). Only uses calls that
+ * are safe inside a signal handler. Returns -1 if the records couldn't be written, in which case the
+ * swap file is removed, since replaying it would lose the edits that are missing from it.
+ ****************************************************************************************************/
+int SwapLogCommit(SwapLog *swap)
+{
+    if ((swap->fd == -1) || (swap->pendingLen == 0))
+    {
+        return 0;
+    }
+
+    if (SwapLogWrite(swap, swap->pending, swap->pendingLen) == -1)
+    {
+        return -1;
+    }
+
+    fdatasync(swap->fd);
+    swap->pendingLen = 0;
+    swap->lastCommit = MonotonicNanos();
+    return 0;
+}
+
+/****************************************************************************************************
+ * Appends length bytes to the swap file. If that fails, the pending records are dropped and the swap
+ * file is removed and no longer logged to. Safe inside a signal handler. Returns -1 on failure.
+ ****************************************************************************************************/
+int SwapLogWrite(SwapLog *swap, const unsigned char *bytes, size_t length)
+{
+    size_t written = 0;
+
+    while (written < length)
+    {
+        ssize_t n = write(swap->fd, &bytes[written], length - written);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            swap->pendingLen = 0; // dropped; the log can't be trusted anymore so stop logging
+            close(swap->fd);
+            swap->fd = -1;
+            unlink(swap->path);
+            swap->failed = 1;
+            return -1;
+        }
+        written += n;
+    }
+    return 0;
+}
+
+/****************************************************************************************************
+ * Called after every keypress (idle = 0) and whenever the user stops typing (idle = 1). Commits the
+ * pending records if the user is idle or the last commit is more than SWAP_COMMIT_MS ago.
+ ****************************************************************************************************/
+void SwapLogTick(TerminalAttr *attr, int idle)
+{
+    SwapLog *swap = &attr->swap;
+
+    if (swap->pendingLen == 0)
+    {
+        return;
+    }
+
+    if (idle || (MonotonicNanos() - swap->lastCommit >= (uint64_t)SWAP_COMMIT_MS * 1000000))
+    {
+        uint64_t traceStart = TraceBegin();
+        if (SwapLogCommit(swap) == -1)
+        {
+            SetStatusMessage(attr, "Swap file write failed: %s", strerror(errno));
+        }
+        TraceEnd("swap commit", traceStart);
+    }
+}
+
+/****************************************************************************************************
+ * Throws away the swap file and any pending records. Used once the edits are safe in the file itself
+ * (or the user quit without saving them).
+ ****************************************************************************************************/
+void SwapLogDiscard(SwapLog *swap)
+{
+    if (swap->fd != -1)
+    {
+        close(swap->fd);
+        swap->fd = -1;
+    }
+    if (swap->path != NULL)
+    {
+        unlink(swap->path);
+    }
+    swap->pendingLen = 0;
+    swap->failed = 0; // the next edit starts a new log
+}
+
+/****************************************************************************************************
+ * Handler for signals that would kill Helio. Commits the pending edits, restores the default action
+ * and raises the signal again.
+ ****************************************************************************************************/
+void SwapLogSignal(int sig)
+{
+    if (crashSwap != NULL)
+    {
+        SwapLogCommit(crashSwap);
+    }
+
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/****************************************************************************************************
+ * Looks for a swap file left behind by an earlier session of the opened file. If it was logged
+ * against the file as it is on disk now, its edits are replayed over the text (up to the first
+ * damaged or cut off record) and added to the undo journal, while its undos take edits off the
+ * journal again. The swap file is then kept and logging continues after the last good record.
+ ****************************************************************************************************/
+void RecoverSwapFile(TerminalAttr *attr)
+{
+    SwapLog *swap = &attr->swap;
+
+    free(swap->path);
+    swap->path = SidecarPath(attr->fileName, ".hswp");
+    swap->fileHash = attr->fileHash;
+    swap->failed = 0;
+
+    int fd = open(swap->path, O_RDWR);
+    if (fd == -1)
+    {
+        return; // the last session ended normally
+    }
+
+    struct stat st;
+    unsigned char *log = MAP_FAILED;
+    if ((fstat(fd, &st) == -1) ||
+        ((st.st_size >= SWAP_HEADER_SIZE) &&
+         ((log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)))
+    {
+        SetStatusMessage(attr, "Couldn't read swap file %s: %s", swap->path, strerror(errno));
+        close(fd);
+        return; // left for the next time the file is opened
+    }
+
+    // the header is written with the first group commit, so a session killed before it leaves a
+    // shorter log; without a header (or with one of another format) there is nothing to recover
+    if ((log == MAP_FAILED) || (memcmp(log, SWAP_MAGIC, 4) != 0))
+    {
+        if (log != MAP_FAILED)
+        {
+            munmap(log, st.st_size);
+        }
+        close(fd);
+        unlink(swap->path);
+        return;
+    }
+
+    uint64_t storedHash = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        storedHash |= (uint64_t)log[4 + i] << (8 * i);
+    }
+    if (storedHash != attr->fileHash)
+    {
+        munmap(log, st.st_size);
+        close(fd);
+        SetStatusMessage(attr, "Ignored swap file %s: file changed since", swap->path);
+        return; // overwritten by the next edit
+    }
+
+    size_t pos = SWAP_HEADER_SIZE;
+    int numEdits = 0;
+    int recLen;
+    EditOp op;
+
+    while (((recLen = EditRecordLength(&log[pos], st.st_size - pos)) != -1) &&
+           (DecodeEditOp(&log[pos], recLen, &op) == 0))
+    {
+        if (op.type != EDIT_UNDO)
+        {
+            ApplyEditOp(attr, &op);
+            if (op.text != NULL) // the journal keeps its own copy of the text; the log is unmapped below
+            {
+                char *text = malloc(op.charIn);
+                if (text == NULL)
+                {
+                    ErrorHandler("RecoverSwapFile: Couldn't allocate memory to a text edit");
+                }
+                op.text = memcpy(text, op.text, op.charIn);
+            }
+            PushUndoOp(&attr->undo, &op);
+        }
+        else if (RevertStep(attr, &op) == -1) // the journal the undo was made in is gone
+        {
+            break;
+        }
+        pos += recLen;
+        numEdits++;
+    }
+    munmap(log, st.st_size);
+
+    if (numEdits == 0)
+    {
+        close(fd);
+        unlink(swap->path);
+        return;
+    }
+
+    ftruncate(fd, pos); // drops a record cut off by the crash so new records follow good ones
+    lseek(fd, 0, SEEK_END);
+    swap->fd = fd;
+    swap->lastCommit = MonotonicNanos();
+    crashSwap = swap;
+
+    attr->maxrowOffset = attr->tRowsTot - attr->numRows;
+    SetStatusMessage(attr, "Recovered %d unsaved edits from %s", numEdits, swap->path);
+}
+
+//------------------------------------------//
+//---------------Saving Files---------------//
+//------------------------------------------//
+
+/****************************************************************************************************
+ * Copies length bytes of data into buff, which holds 'used' bytes, and writes buff to fd each time
+ * it fills up. The bytes written are added to fileHash. Returns -1 if a write failed.
+ ****************************************************************************************************/
+int BufferRowBytes(int fd, char *buff, size_t *used, const char *data, size_t length, uint64_t *fileHash)
+{
+    while (length > 0)
+    {
+        size_t n = (length < SAVE_BUFFER_BYTES - *used) ? length : SAVE_BUFFER_BYTES - *used;
+        memcpy(&buff[*used], data, n);
+        *used += n;
+        data += n;
+        length -= n;
+
+        if (*used == SAVE_BUFFER_BYTES)
+        {
+            if (WriteAll(fd, buff, *used) == -1)
+            {
+                return -1;
+            }
+            *fileHash = HashBytes(*fileHash, buff, *used);
+            *used = 0;
+        }
+    }
+    return 0;
+}
+
+/****************************************************************************************************
+ * Creates file with the same file name as the opened file (if a file was opened) and saves it to
+ * storage (same directory as program). The rows are written out through a buffer of
+ * SAVE_BUFFER_BYTES, with '\n' after each row, so saving a file of several GB doesn't need a copy
+ * of it in memory. The undo journal is saved alongside the file.
+ *
+ * The text is written to a temporary file next to it, which is synced to disk and then renamed over
+ * the file, so the file is either the old one or the new one, never half written. If it can't be
+ * written (e.g., the disk is full), a message says so, the file is left untouched and the undo
+ * journal and swap file are left as they were, so the swap file still matches the file and the
+ * edits can be recovered.
+ *
+ * Renaming replaces the file's inode, so the file is overwritten in place instead (and truncated to
+ * its new size) when that would change more than its contents: when it has hard links, which would
+ * be split off, when the new file can't be given the owner of the old one (e.g., root editing
+ * someone else's file), or when the temporary file can't be created because the directory isn't
+ * writable. A write failing then can leave the file half written, and the message says so.
+ ****************************************************************************************************/
+void SaveFile(TerminalAttr *attr)
+{
+    if (attr->fileName == NULL)
+    {
+        return;
+    }
+
+    uint64_t traceStart = TraceBegin();
+    uint64_t fileHash = HashBytes(0, NULL, 0);
+    size_t used = 0;
+    char *buff = malloc(SAVE_BUFFER_BYTES);
+    struct stat st;
+
+    // a symbolic link keeps pointing at the file; the new file gets the permissions of the old one
+    char *path = realpath(attr->fileName, NULL);
+    path = (path != NULL) ? path : strdup(attr->fileName);
+    char *tmpPath = SidecarPath(path, ".tmp");
+    int exists = (stat(path, &st) == 0);
+    int inPlace = exists && (st.st_nlink > 1); // renaming would split the hard links off
+    int fd = -1;
+
+    if (!inPlace)
+    {
+        fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644); // 0644 is standard text file perms
+        if (exists && (fd != -1) &&
+            ((fchown(fd, st.st_uid, st.st_gid) == -1) || (fchmod(fd, st.st_mode & 07777) == -1)))
+        {
+            close(fd); // the new file couldn't look like the old one
+            unlink(tmpPath);
+            fd = -1;
+        }
+        inPlace = (fd == -1); // e.g., the directory can't be written to
+    }
+    if (inPlace)
+    {
+        fd = open(path, O_WRONLY | O_CREAT, 0644); // truncated once the new text is written
+    }
+    int failed = (buff == NULL) || (fd == -1);
+
+    for (int i = 0; (i < attr->tRowsTot) && !failed; i++)
+    {
+        failed = (BufferRowBytes(fd, buff, &used, attr->tRow[i].text, attr->tRow[i].size, &fileHash) == -1) ||
+                 (BufferRowBytes(fd, buff, &used, "\n", 1, &fileHash) == -1);
+    }
+    if (!failed && (used > 0))
+    {
+        failed = (WriteAll(fd, buff, used) == -1);
+        fileHash = HashBytes(fileHash, buff, used);
+    }
+    if (inPlace)
+    {
+        failed = failed || (ftruncate(fd, attr->fileBytes) == -1); // cuts off the rest of a longer old file
+    }
+    failed = failed || (fsync(fd) == -1); // on disk before it replaces the file
+    if ((fd != -1) && (close(fd) == -1))
+    {
+        failed = 1;
+    }
+    if (!inPlace)
+    {
+        failed = failed || (rename(tmpPath, path) == -1);
+    }
+    int error = errno;
+    free(buff);
+
+    if (failed)
+    {
+        if (!inPlace)
+        {
+            unlink(tmpPath);
+        }
+        if (inPlace && (fd != -1))
+        {
+            SetStatusMessage(attr, "Can't save! %s (the file was written in place and may be incomplete)",
+                             strerror(error));
+        }
+        else
+        {
+            SetStatusMessage(attr, "Can't save! %s", strerror(error));
+        }
+        free(tmpPath);
+        free(path);
+        TraceEnd("save", traceStart);
+        return;
+    }
+    free(tmpPath);
+    free(path);
+    attr->fileHash = fileHash;
+    SaveUndoJournal(attr, attr->fileHash); // ties the history to what was saved
+    SwapLogDiscard(&attr->swap);           // all edits are in the file now
+    attr->swap.fileHash = attr->fileHash;
+    TraceEnd("save", traceStart);
+}
+
+//------------------------------------------//
+//---------------Hex View-------------------//
+//------------------------------------------//
+
+/****************************************************************************************************
+ * Files with a NUL byte near the start, and every file opened with -x, are shown as rows of 16
+ * bytes: the offset of the row, the bytes in hex and the bytes as ASCII. Typing hex digits
+ * overwrites the byte under the cursor one digit at a time; bytes are never inserted or deleted,
+ * so the file keeps its size. CTRL-Z takes back the last digit and CTRL-G goes to an offset
+ * ("0x1f00", "4096" or "50%").
+ *
+ * The file isn't read into rows. It's memory-mapped privately and read-only, and only the rows on
+ * screen are formatted, straight from the mapping, when a frame is drawn, so opening a core dump of
+ * several GB takes no longer than a small file and only the pages looked at are read. Overwriting a
+ * byte makes just its page writable, which turns it into a private copy (copy-on-write), and the
+ * byte stays there until CTRL-S writes it back with pwrite, one write per run of adjacent bytes,
+ * rather than writing the whole file. The hex view keeps no undo journal or swap file.
+ ****************************************************************************************************/
+
+/****************************************************************************************************
+ * Returns 1 if the start of the file has a NUL byte, which text files don't have.
+ ****************************************************************************************************/
+int LooksBinary(const char *fileName)
+{
+    char buff[HEX_SNIFF_BYTES];
+    int fd = open(fileName, O_RDONLY);
+
+    if (fd == -1) // OpenFile says why
+    {
+        return 0;
+    }
+    ssize_t length = pread(fd, buff, sizeof(buff), 0);
+    close(fd);
+    return (length > 0) && (memchr(buff, '\0', length) != NULL);
+}
+
+/****************************************************************************************************
+ * Maps fileName into attr->hex. A file that can't be written is opened read-only. Returns -1 with
+ * errno set if it can't be read or mapped.
+ ****************************************************************************************************/
+int OpenHex(TerminalAttr *attr, char *fileName)
+{
+    HexView *hex = calloc(1, sizeof(HexView));
+    struct stat st;
+
+    if (hex == NULL)
+    {
+        ErrorHandler("OpenHex: Couldn't allocate memory to the hex view");
+    }
+    hex->fd = attr->readOnly ? -1 : open(fileName, O_RDWR);
+    if ((hex->fd == -1) && !attr->readOnly)
+    {
+        attr->readOnly = 1;
+        SetStatusMessage(attr, "%.40s can't be written: %s", fileName, strerror(errno));
+    }
+    else
+    {
+        SetStatusMessage(attr, "HELP: CTRL-Q to quit | CTRL-S to save | type hex digits to overwrite bytes");
+    }
+
+    int fd = (hex->fd != -1) ? hex->fd : open(fileName, O_RDONLY);
+    int failed = (fd == -1) || (fstat(fd, &st) == -1);
+    if (!failed)
+    {
+        hex->size = st.st_size;
+    }
+    if (!failed && (hex->size > 0))
+    {
+        // read-only until a byte is overwritten, so no memory is set aside for copies of it
+        hex->map = mmap(NULL, (size_t)hex->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        failed = (hex->map == MAP_FAILED);
+    }
+    if ((fd != -1) && (failed || (hex->fd == -1))) // the mapping stays without it
+    {
+        int error = errno;
+        close(fd);
+        errno = error;
+    }
+    if (failed)
+    {
+        free(hex);
+        return -1;
+    }
+    attr->hex = hex;
+    return 0;
+}
+
+/****************************************************************************************************
+ * Keys of the hex view. Returns 1 if the key was handled here and 0 if ProcessKeypress should
+ * handle it the same way as in the editor (quitting, buffers, the perf HUD and redrawing). Without
+ * edits (-R), SPACE, f, b, g and G page and jump like in the viewer.
+ ****************************************************************************************************/
+int HexKeypress(TerminalAttr *attr, int key)
+{
+    HexView *hex = attr->hex;
+    long long page = (long long)attr->numRows * HEX_ROW_BYTES;
+
+    if (attr->readOnly)
+    {
+        key = ((key == ' ') || (key == 'f')) ? PAGE_DOWN : (key == 'b') ? PAGE_UP : key;
+        key = (key == 'g') ? CTRL_HOME : (key == 'G') ? CTRL_END : key;
+    }
+
+    switch (key)
+    {
+    case UP_ARROW:
+    case DOWN_ARROW:
+        HexMove(attr, (key == UP_ARROW) ? -HEX_ROW_BYTES : HEX_ROW_BYTES);
+        break;
+    case LEFT_ARROW:
+    case RIGHT_ARROW:
+        HexMove(attr, (key == LEFT_ARROW) ? -1 : 1);
+        break;
+    case PAGE_UP:
+    case PAGE_DOWN: // the bytes on screen move up or down a page with the cursor
+        page = (key == PAGE_UP) ? -page : page;
+        hex->top += page;
+        HexMove(attr, page);
+        break;
+    case HOME_KEY:
+        HexMove(attr, -(hex->cursor % HEX_ROW_BYTES));
+        break;
+    case END_KEY:
+        HexMove(attr, HEX_ROW_BYTES - 1 - hex->cursor % HEX_ROW_BYTES);
+        break;
+    case CTRL_HOME:
+    case CTRL_END:
+        HexMove(attr, (key == CTRL_HOME) ? -hex->cursor : hex->size - hex->cursor);
+        break;
+
+    case CTRL_KEY('s'):
+        SaveHex(attr);
+        break;
+    case CTRL_KEY('z'):
+        HexUndo(attr);
+        break;
+    case CTRL_KEY('g'):
+        HexGotoPrompt(attr);
+        break;
+    case CTRL_KEY('k'):
+        SetStatusMessage(attr, "The hex view can't be split");
+        break;
+    case '\x1b':
+        break;
+
+    // keys that don't depend on what the file is shown as work like in the editor
+    case CTRL_KEY('q'):
+    case CTRL_KEY('p'):
+    case CTRL_KEY('l'):
+    case CTRL_KEY('o'):
+    case CTRL_KEY('b'):
+    case TERMINAL_REPLY:
+        return 0;
+
+    default:
+        if (attr->readOnly)
+        {
+            SetStatusMessage(attr, "%.40s is opened read-only", attr->fileName);
+        }
+        else if ((key < 128) && isxdigit(key))
+        {
+            HexOverwrite(attr, isdigit(key) ? key - '0' : tolower(key) - 'a' + 10);
+        }
+        else
+        {
+            SetStatusMessage(attr, "Type hex digits to overwrite bytes");
+        }
+        break;
+    }
+    return 1;
+}
+
+/****************************************************************************************************
+ * Moves the cursor delta bytes, onto the first digit of a byte, but not out of the file. ScrollHex
+ * scrolls to it when the frame is drawn.
+ ****************************************************************************************************/
+void HexMove(TerminalAttr *attr, long long delta)
+{
+    HexView *hex = attr->hex;
+    long long last = (hex->size > 0) ? hex->size - 1 : 0;
+
+    hex->cursor += delta;
+    hex->cursor = (hex->cursor < last) ? hex->cursor : last;
+    hex->cursor = (hex->cursor > 0) ? hex->cursor : 0;
+    hex->nibble = 0;
+}
+
+/****************************************************************************************************
+ * Scrolls so the cursor's row is on screen, without scrolling past the last row of the file.
+ ****************************************************************************************************/
+void ScrollHex(TerminalAttr *attr)
+{
+    HexView *hex = attr->hex;
+    long long page = (long long)attr->numRows * HEX_ROW_BYTES;
+    long long row = hex->cursor - hex->cursor % HEX_ROW_BYTES;
+    long long lastRow = (hex->size > 0) ? (hex->size - 1) - (hex->size - 1) % HEX_ROW_BYTES : 0;
+
+    if (row < hex->top)
+    {
+        hex->top = row;
+    }
+    else if (row >= hex->top + page)
+    {
+        hex->top = row - page + HEX_ROW_BYTES;
+    }
+    hex->top = (hex->top < lastRow - page + HEX_ROW_BYTES) ? hex->top : lastRow - page + HEX_ROW_BYTES;
+    hex->top = (hex->top > 0) ? hex->top : 0;
+}
+
+/****************************************************************************************************
+ * Appends the rows of bytes on screen: the offset, the bytes in hex (with a gap after 8 of them)
+ * and as ASCII, where the byte under the cursor is shown in inverted colors. Digits come from
+ * hexPairs rather than printf, a byte at a time. Sets screenY and screenX to the cursor's digit.
+ ****************************************************************************************************/
+void WriteHexRows(TerminalAttr *attr, AppendBuffer *abuff, int *screenY, int *screenX)
+{
+    HexView *hex = attr->hex;
+    char line[16 + 2 + 3 * HEX_ROW_BYTES + 2 + HEX_ROW_BYTES];
+    int digits = 8; // the offset has 2 digits more for every byte it needs past 4
+
+    if (!hexPairsBuilt)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            hexPairs[i][0] = hexDigits[i >> 4];
+            hexPairs[i][1] = hexDigits[i & 15];
+        }
+        hexPairsBuilt = 1;
+    }
+    while ((digits < 16) && (hex->size > (1LL << (4 * digits))))
+    {
+        digits += 2;
+    }
+    int asciiCol = digits + 2 + 3 * HEX_ROW_BYTES + 2; // where the ASCII column starts
+
+    for (int y = 0; y < attr->numRows; y++)
+    {
+        long long offset = hex->top + (long long)y * HEX_ROW_BYTES;
+
+        if (offset >= hex->size)
+        {
+            AppendString(abuff, "~", 1); // like the rows past the end of a text file
+        }
+        else
+        {
+            const unsigned char *bytes = &hex->map[offset];
+            int count = (hex->size - offset < HEX_ROW_BYTES) ? (int)(hex->size - offset) : HEX_ROW_BYTES;
+            int length = 0;
+
+            for (int shift = 4 * digits - 8; shift >= 0; shift -= 8)
+            {
+                memcpy(&line[length], hexPairs[(offset >> shift) & 0xFF], 2);
+                length += 2;
+            }
+            line[length++] = ' ';
+            for (int i = 0; i < HEX_ROW_BYTES; i++)
+            {
+                line[length++] = ' ';
+                line[length++] = (i < count) ? hexPairs[bytes[i]][0] : ' ';
+                line[length++] = (i < count) ? hexPairs[bytes[i]][1] : ' ';
+                line[length] = ' ';
+                length += (i == HEX_ROW_BYTES / 2 - 1); // the gap in the middle
+            }
+            line[length++] = ' ';
+            line[length++] = ' ';
+            for (int i = 0; i < count; i++)
+            {
+                line[length++] = ((bytes[i] >= 32) && (bytes[i] < 127)) ? bytes[i] : '.';
+            }
+
+            int end = (length < attr->numCols) ? length : attr->numCols;
+            int cursor = asciiCol + (int)(hex->cursor - offset); // the cursor's byte as ASCII
+            if ((hex->cursor >= offset) && (hex->cursor < offset + count) && (cursor < end))
+            {
+                AppendString(abuff, line, cursor);
+                AppendString(abuff, "\x1b[7m", 4);
+                AppendString(abuff, &line[cursor], 1);
+                AppendString(abuff, "\x1b[m", 3);
+                AppendString(abuff, &line[cursor + 1], end - cursor - 1);
+            }
+            else
+            {
+                AppendString(abuff, line, end);
+            }
+        }
+        AppendString(abuff, "\x1b[K", 3);
+        AppendString(abuff, "\r\n", 2);
+    }
+
+    int column = (int)(hex->cursor % HEX_ROW_BYTES);
+    *screenY = (int)((hex->cursor - hex->top) / HEX_ROW_BYTES);
+    *screenX = digits + 2 + 3 * column + (column >= HEX_ROW_BYTES / 2) + hex->nibble;
+    *screenX = (*screenX < attr->numCols) ? *screenX : attr->numCols - 1;
+}
+
+/****************************************************************************************************
+ * Overwrites the digit of the byte under the cursor with digit (0 to 15) and moves to the next
+ * digit. The byte is changed in the mapping only; SaveHex writes it to the file.
+ ****************************************************************************************************/
+void HexOverwrite(TerminalAttr *attr, int digit)
+{
+    HexView *hex = attr->hex;
+
+    if (hex->size == 0)
+    {
+        SetStatusMessage(attr, "The file is empty; bytes can only be overwritten");
+        return;
+    }
+    if (hex->numEdits == hex->editsCap)
+    {
+        int capacity = hex->editsCap ? hex->editsCap * 2 : 64;
+        HexEdit *edits = realloc(hex->edits, sizeof(HexEdit) * capacity);
+        if (edits == NULL)
+        {
+            ErrorHandler("HexOverwrite: realloc memory for edits");
+        }
+        hex->edits = edits;
+        hex->editsCap = capacity;
+    }
+
+    // the page of the byte becomes writable; the first write makes it a private copy of the file's page
+    unsigned char *byte = &hex->map[hex->cursor];
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (mprotect(&hex->map[hex->cursor - hex->cursor % pageSize], 1, PROT_READ | PROT_WRITE) == -1)
+    {
+        SetStatusMessage(attr, "Can't overwrite the byte: %s", strerror(errno));
+        return;
+    }
+    hex->edits[hex->numEdits++] = (HexEdit){hex->cursor, *byte};
+    *byte = hex->nibble ? (*byte & 0xF0) | digit : (*byte & 0x0F) | (digit << 4);
+    attr->hlGeneration++; // the frame has to show the new byte
+
+    if (hex->nibble)
+    {
+        HexMove(attr, 1);
+    }
+    else
+    {
+        hex->nibble = 1;
+    }
+}
+
+/****************************************************************************************************
+ * Takes back the last digit typed since the file was saved.
+ ****************************************************************************************************/
+void HexUndo(TerminalAttr *attr)
+{
+    HexView *hex = attr->hex;
+
+    if (hex->numEdits == 0)
+    {
+        SetStatusMessage(attr, "Nothing to undo");
+        return;
+    }
+    HexEdit *edit = &hex->edits[--hex->numEdits];
+    hex->map[edit->offset] = edit->old;
+    hex->cursor = edit->offset;
+    hex->nibble = 0;
+    attr->hlGeneration++;
+}
+
+/****************************************************************************************************
+ * CTRL-G asks for an offset to go to: decimal, hex with "0x" in front, or a percentage of the file.
+ * The row it's on is shown in the middle of the screen.
+ ****************************************************************************************************/
+void HexGotoPrompt(TerminalAttr *attr)
+{
+    HexView *hex = attr->hex;
+    char *input = Prompt(attr, "Go to offset, 0x hex offset or N%%: %s");
+    char *end;
+
+    if (input == NULL)
+    {
+        return;
+    }
+    long long offset = strtoll(input, &end, 0);
+
+    if ((end == input) || (offset < 0) || ((*end != '\0') && ((*end != '%') || (end[1] != '\0'))))
+    {
+        SetStatusMessage(attr, "Not an offset: %.40s", input);
+    }
+    else
+    {
+        if (*end == '%')
+        {
+            offset = (offset < 100) ? offset : 100;
+            offset = (long long)((double)hex->size * offset / 100);
+        }
+        HexMove(attr, offset - hex->cursor);
+        hex->top = hex->cursor - hex->cursor % HEX_ROW_BYTES - (long long)(attr->numRows / 2) * HEX_ROW_BYTES;
+    }
+    free(input);
+}
+
+/****************************************************************************************************
+ * Writes the bytes overwritten since the last save to the file with pwrite, one write for every run
+ * of adjacent bytes, in place; the rest of the file isn't touched.
+ ****************************************************************************************************/
+void SaveHex(TerminalAttr *attr)
+{
+    HexView *hex = attr->hex;
+    long long written = 0;
+    int failed = 0;
+
+    if (attr->readOnly)
+    {
+        SetStatusMessage(attr, "%.40s is opened read-only", attr->fileName);
+        return;
+    }
+    uint64_t traceStart = TraceBegin();
+
+    // sorted in a copy, so the edits stay in the order CTRL-Z takes them back if saving fails
+    HexEdit *sorted = malloc(sizeof(HexEdit) * (hex->numEdits + 1));
+    if (sorted == NULL)
+    {
+        ErrorHandler("SaveHex: Couldn't allocate memory to sort the edits");
+    }
+    memcpy(sorted, hex->edits, sizeof(HexEdit) * hex->numEdits);
+    qsort(sorted, hex->numEdits, sizeof(HexEdit), CompareHexEdits);
+
+    for (int i = 0; (i < hex->numEdits) && !failed;)
+    {
+        long long start = sorted[i].offset, end = start + 1;
+        for (i++; (i < hex->numEdits) && (sorted[i].offset <= end); i++) // the same byte or the next one
+        {
+            end = sorted[i].offset + 1;
+        }
+
+        for (long long done = start; (done < end) && !failed;)
+        {
+            ssize_t length = pwrite(hex->fd, &hex->map[done], (size_t)(end - done), (off_t)done);
+            failed = (length == -1) && (errno != EINTR);
+            done += (length > 0) ? length : 0;
+        }
+        written += end - start;
+    }
+    free(sorted);
+
+    if (failed)
+    {
+        SetStatusMessage(attr, "Can't save! %s", strerror(errno));
+    }
+    else
+    {
+        hex->numEdits = 0;
+        SetStatusMessage(attr, "%lld byte%s written to disk", written, (written == 1) ? "" : "s");
+    }
+    TraceEnd("save", traceStart);
+}
+
+//-----------------------------------------//
+//---------------Buffers-------------------//
+//-----------------------------------------//
+
+/****************************************************************************************************
+ * Every file on the command line, and every file opened later with CTRL-O, is kept open in a buffer
+ * of its own; CTRL-B goes to the next one. Only the buffer on screen has a highlight worker and its
+ * document lock held, and its swap log is committed when it's hidden, so a hidden buffer is simply
+ * left alone until it's shown again. Its rows stay in memory, so switching never reads the file.
+ *
+ * What a hidden buffer only keeps to draw itself faster (render strings, highlighting, wrap points
+ * and the line tables) is its render cache. Hidden buffers keep their caches up to buffers.budget
+ * bytes together (--cache-budget); past that, the ones hidden longest ago drop them, along with the
+ * pages of their memory-mapped undo journal, and rebuild them from their rows when shown again.
+ ****************************************************************************************************/
+
+/****************************************************************************************************
+ * Adds attr to the open buffers. The first buffer added is the one on screen.
+ ****************************************************************************************************/
+void AddBuffer(TerminalAttr *attr)
+{
+    TerminalAttr **list = realloc(buffers.list, sizeof(TerminalAttr *) * (buffers.count + 1));
+
+    if (list == NULL)
+    {
+        ErrorHandler("AddBuffer: realloc memory for the buffer list");
+    }
+    buffers.list = list;
+    buffers.list[buffers.count++] = attr;
+}
+
+/****************************************************************************************************
+ * Opens fileName into a new hidden buffer with the settings of attr (screen size, read-only, line
+ * numbers and so on) and returns it. If the file is already open, its buffer is returned instead.
+ * Returns NULL with errno set if the file can't be opened; the other buffers are left as they were.
+ ****************************************************************************************************/
+TerminalAttr *OpenBuffer(TerminalAttr *attr, char *fileName)
+{
+    struct stat st, open;
+
+    if (stat(fileName, &st) == 0)
+    {
+        for (int i = 0; i < buffers.count; i++)
+        {
+            if ((stat(buffers.list[i]->fileName, &open) == 0) && (open.st_dev == st.st_dev) &&
+                (open.st_ino == st.st_ino))
+            {
+                return buffers.list[i];
+            }
+        }
+    }
+
+    TerminalAttr *buffer = malloc(sizeof(TerminalAttr));
+    if (buffer == NULL)
+    {
+        ErrorHandler("OpenBuffer: Couldn't allocate memory to buffer");
+    }
+    InitEditorState(buffer);
+    buffer->originalState = attr->originalState;
+    buffer->numRows = attr->numRows;
+    buffer->numCols = attr->numCols;
+    buffer->lineNumbers = attr->lineNumbers;
+    buffer->readOnly = attr->readOnly;
+    buffer->forceHex = attr->forceHex;
+    buffer->frameNanos = attr->frameNanos;
+    buffer->osc52Max = attr->osc52Max;
+    UpdateGutter(buffer);
+
+    SwapLog *shownSwap = crashSwap; // recovering the file sets crashSwap to the new buffer's log
+    if (OpenFile(buffer, fileName) == -1)
+    {
+        int error = errno;
+        FreeBuffer(buffer);
+        errno = error;
+        return NULL;
+    }
+    crashSwap = shownSwap;
+    if (buffer->swap.fd != -1)
+    {
+        SwapLogCommit(&buffer->swap); // hidden buffers have nothing pending
+    }
+
+    AddBuffer(buffer);
+    buffer->lastShown = ++buffers.clock;
+    buffer->cacheBytes = BufferCacheBytes(buffer);
+    TrimBufferCaches();
+    return buffer;
+}
+
+/****************************************************************************************************
+ * Frees a buffer whose file couldn't be opened: its rows, the row table and byte tree, its file
+ * name and its swap log's pending buffer. Nothing else has been set up for it yet.
+ ****************************************************************************************************/
+void FreeBuffer(TerminalAttr *attr)
+{
+    DeleteRows(attr, 0, attr->tRowsTot);
+    free(attr->tRow);
+    free(attr->byteTree);
+    free(attr->fileName);
+    free(attr->swap.pending);
+    pthread_mutex_destroy(&attr->docLock);
+    pthread_cond_destroy(&attr->hlWake);
+    free(attr);
+}
+
+/****************************************************************************************************
+ * CTRL-O asks for a file to open in a new buffer and switches to it.
+ ****************************************************************************************************/
+void OpenPrompt(TerminalAttr *attr)
+{
+    char *input = Prompt(attr, "Open file: %s");
+    struct stat st;
+
+    if (input == NULL)
+    {
+        return;
+    }
+    if (stat(input, &st) == -1)
+    {
+        SetStatusMessage(attr, "Can't open %.40s: %s", input, strerror(errno));
+    }
+    else if (!S_ISREG(st.st_mode))
+    {
+        SetStatusMessage(attr, "Can't open %.40s: not a file", input);
+    }
+    else
+    {
+        TerminalAttr *buffer = OpenBuffer(attr, input);
+        if (buffer == NULL)
+        {
+            SetStatusMessage(attr, "Can't open %.40s: %s", input, strerror(errno));
+        }
+        for (int i = 0; (i < buffers.count) && (buffer != NULL); i++)
+        {
+            if (buffers.list[i] == buffer)
+            {
+                SwitchBuffer(attr, i);
+            }
+        }
+    }
+    free(input);
+}
+
+/****************************************************************************************************
+ * Hides the buffer on screen, attr, and shows buffer number index instead. Must be called with the
+ * document lock of attr held; the lock of the buffer shown is held when it returns.
+ ****************************************************************************************************/
+void SwitchBuffer(TerminalAttr *attr, int index)
+{
+    TerminalAttr *next = buffers.list[index];
+
+    if (next == attr)
+    {
+        SetBufferMessage(attr);
+        return;
+    }
+
+    uint64_t traceStart = TraceBegin();
+    HideBuffer(attr);
+    buffers.current = index;
+    TrimBufferCaches();
+    ShowBuffer(next, attr);
+    SetBufferMessage(next);
+    TraceEnd("switch buffer", traceStart);
+}
+
+/****************************************************************************************************
+ * Stops the highlight worker of attr, commits its swap log and releases its document lock. Its
+ * render cache is measured for TrimBufferCaches.
+ ****************************************************************************************************/
+void HideBuffer(TerminalAttr *attr)
+{
+    StopHighlightWorker(attr);
+    if (SwapLogCommit(&attr->swap) == -1)
+    {
+        SetStatusMessage(attr, "Swap file write failed: %s", strerror(errno));
+    }
+    attr->lastShown = ++buffers.clock;
+    attr->cacheBytes = BufferCacheBytes(attr);
+    attr->mark = MARK_NONE;
+    pthread_mutex_unlock(&attr->docLock);
+}
+
+/****************************************************************************************************
+ * Takes the document lock of attr and starts its highlight worker. Rows whose render strings were
+ * dropped while it was hidden are rendered again as they're used (see RenderIfDropped). The screen
+ * size is taken over from from, the buffer shown before it, and the next frame is drawn in full.
+ ****************************************************************************************************/
+void ShowBuffer(TerminalAttr *attr, TerminalAttr *from)
+{
+    pthread_mutex_lock(&attr->docLock);
+    attr->cacheBytes = 0;
+    UpdateScreenSize(attr);
+    attr->perf.hud = from->perf.hud;
+    attr->shown.rowOffset = -1;
+    attr->maxrowOffset = attr->tRowsTot - attr->numRows;
+    crashSwap = (attr->swap.fd != -1) ? &attr->swap : NULL;
+    StartHighlightWorker(attr);
+}
+
+/****************************************************************************************************
+ * Drops the render caches of the buffers hidden longest ago until the caches of all hidden buffers
+ * fit in buffers.budget.
+ ****************************************************************************************************/
+void TrimBufferCaches()
+{
+    long long total = 0;
+
+    for (int i = 0; i < buffers.count; i++)
+    {
+        total += (i != buffers.current) ? buffers.list[i]->cacheBytes : 0;
+    }
+    while (total > buffers.budget)
+    {
+        TerminalAttr *oldest = NULL;
+        for (int i = 0; i < buffers.count; i++)
+        {
+            TerminalAttr *buffer = buffers.list[i];
+            if ((i != buffers.current) && (buffer->cacheBytes > 0) &&
+                ((oldest == NULL) || (buffer->lastShown < oldest->lastShown)))
+            {
+                oldest = buffer;
+            }
+        }
+        if (oldest == NULL)
+        {
+            break;
+        }
+        total -= oldest->cacheBytes;
+        DropBufferCaches(oldest);
+    }
+}
+
+/****************************************************************************************************
+ * Bytes taken up by what a buffer keeps only to draw itself faster; see DropBufferCaches.
+ ****************************************************************************************************/
+long long BufferCacheBytes(TerminalAttr *attr)
+{
+    long long bytes = 0;
+
+    for (int i = 0; i < attr->tRowsTot; i++)
+    {
+        TerminalRow *tRow = &attr->tRow[i];
+        bytes += (tRow->rendStr != NULL) ? tRow->rendSize + 1 : 0;
+        bytes += (tRow->hl != NULL) ? tRow->rendSize + 1 : 0;
+        bytes += (long long)sizeof(RowMark) * tRow->numMarks;
+        bytes += (tRow->wraps != NULL) ? (long long)sizeof(int) * tRow->numWraps : 0;
+    }
+    for (int i = 0; i < WRAP_TREE_MAX; i++)
+    {
+        bytes += (attr->wrapTrees[i] != NULL) ? (long long)sizeof(int) * (attr->tRowsTot + 1) : 0;
+    }
+    bytes += (attr->byteTree != NULL) ? (long long)sizeof(long long) * (attr->byteTreeCap + 1) : 0;
+    bytes += attr->undo.mappedSize;
+    return bytes;
+}
+
+/****************************************************************************************************
+ * Frees the render strings, highlighting, checkpoints and wrap points of every row of a hidden
+ * buffer and its wrap and byte trees, which are all rebuilt from the text. The pages of its undo
+ * journal are given back too; the journal is mapped read-only from its sidecar, so they're read in
+ * again if it's undone into. The text itself is kept, so the file isn't read again.
+ ****************************************************************************************************/
+void DropBufferCaches(TerminalAttr *attr)
+{
+    for (int i = 0; i < attr->tRowsTot; i++)
+    {
+        TerminalRow *tRow = &attr->tRow[i];
+        RowFree(tRow->rendStr); // rendSize and rendCols stay, as the cursor and the wrap tree use them
+        tRow->rendStr = NULL;
+        free(tRow->hl);
+        tRow->hl = NULL;
+        tRow->hlState = HL_STATE_NORMAL;
+        free(tRow->marks);
+        tRow->marks = NULL;
+        tRow->numMarks = 0;
+        free(tRow->wraps);
+        tRow->wraps = NULL;
+        tRow->numWraps = 0;
+        tRow->wrapWidth = 0;
+    }
+    attr->hlValidTo = 0;
+    attr->hlGeneration++;
+
+    for (int i = 0; i < WRAP_TREE_MAX; i++)
+    {
+        free(attr->wrapTrees[i]);
+        attr->wrapTrees[i] = NULL;
+        attr->wrapTreeWidths[i] = 0;
+    }
+    attr->wrapTree = NULL;
+    attr->wrapTreeWidth = 0;
+    free(attr->byteTree);
+    attr->byteTree = NULL;
+    attr->byteTreeCap = 0;
+    attr->byteTreeValid = 0;
+
+    if (attr->undo.mapped != NULL)
+    {
+        madvise(attr->undo.mapped, attr->undo.mappedSize, MADV_DONTNEED);
+    }
+    attr->cacheBytes = 0;
+}
+
+/****************************************************************************************************
+ * Lists the open buffers in the status message, with the one on screen in brackets.
+ ****************************************************************************************************/
+void SetBufferMessage(TerminalAttr *attr)
+{
+    char list[sizeof(attr->statusMsg)];
+    int length = 0;
+
+    for (int i = 0; (i < buffers.count) && (length < (int)sizeof(list) - 1); i++)
+    {
+        const char *name = strrchr(buffers.list[i]->fileName, '/');
+        name = (name != NULL) ? name + 1 : buffers.list[i]->fileName;
+        length += snprintf(&list[length], sizeof(list) - length, (i == buffers.current) ? "[%d %s] " : "%d %s ",
+                           i + 1, name);
+    }
+    SetStatusMessage(attr, "%s", (length > 0) ? list : "");
+}
+
+//-----------------------------------------//
+//---------------Tracing-------------------//
+//-----------------------------------------//
+
+/****************************************************************************************************
+ * "./helio --trace <traceFile> <fileName>" records how long the main steps take (opening, building
+ * the wrap tree and the byte tree, handling a key, refreshing and rendering rows, highlighting,
+ * saving, committing the swap log) and writes them to traceFile at exit in the Chrome trace event
+ * format, which Perfetto and chrome://tracing can load.
+ *
+ * A step is timed with
+ *     uint64_t traceStart = TraceBegin();
+ *     ...
+ *     TraceEnd("name", traceStart);
+ * When not tracing, TraceBegin returns 0 without reading the clock and TraceEnd returns right away.
+ * Every thread records into a ring of its own (TraceThread), so recording takes no lock; the rings
+ * are only read by TraceDump once the other threads have stopped. ErrorHandler can't stop them, so
+ * an error only keeps the spans of the main thread, and only if it happened on the main thread.
+ ****************************************************************************************************/
+
+/****************************************************************************************************
+ * Starts tracing to the file at path. The calling thread is recorded as "main".
+ ****************************************************************************************************/
+void TraceStart(const char *path)
+{
+    if ((traceFile = fopen(path, "w")) == NULL)
+    {
+        ErrorHandler("TraceStart: fopen");
+    }
+    if (pthread_key_create(&traceKey, NULL) != 0)
+    {
+        ErrorHandler("TraceStart: pthread_key_create");
+    }
+    traceEpoch = MonotonicNanos();
+    TraceThread("main");
+}
+
+/****************************************************************************************************
+ * Gives the calling thread a ring to record its spans into, shown under threadName. Spans of
+ * threads that never call this (or when all TRACE_THREADS rings are taken) are dropped.
+ ****************************************************************************************************/
+void TraceThread(const char *threadName)
+{
+    if (traceFile == NULL)
+    {
+        return;
+    }
+
+    int slot = __sync_fetch_and_add(&traceNumRings, 1);
+    if (slot >= TRACE_THREADS)
+    {
+        return;
+    }
+    TraceRing *ring = malloc(sizeof(TraceRing));
+    if (ring == NULL)
+    {
+        ErrorHandler("TraceThread: Couldn't allocate memory to trace ring");
+    }
+    ring->threadName = threadName;
+    ring->numSpans = 0;
+    traceRings[slot] = ring;
+    pthread_setspecific(traceKey, ring);
+}
+
+/****************************************************************************************************
+ * Returns the start time of a span, or 0 when not tracing.
+ ****************************************************************************************************/
+uint64_t TraceBegin()
+{
+    return (traceFile != NULL) ? MonotonicNanos() : 0;
+}
+
+/****************************************************************************************************
+ * Records a span that started at 'start' (from TraceBegin) and ends now.
+ ****************************************************************************************************/
+void TraceEnd(const char *name, uint64_t start)
+{
+    if (start == 0)
+    {
+        return;
+    }
+
+    TraceRing *ring = pthread_getspecific(traceKey);
+    if (ring == NULL)
+    {
+        return;
+    }
+    TraceSpan *span = &ring->spans[ring->numSpans % TRACE_SPANS];
+    span->name = name;
+    span->start = start;
+    span->nanos = MonotonicNanos() - start;
+    ring->numSpans++;
+}
+
+/****************************************************************************************************
+ * Writes the spans of every thread to the trace file as complete ("X") events with timestamps in
+ * microseconds, and closes it. Called at exit, after the highlight worker has stopped. With
+ * allThreads 0 (other threads may still be recording), only the main thread's spans are written,
+ * and nothing is if it's called on another thread.
+ ****************************************************************************************************/
+void TraceDump(int allThreads)
+{
+    const char *separator = "";
+
+    if (traceFile == NULL)
+    {
+        return;
+    }
+    TraceRing *own = pthread_getspecific(traceKey);
+    if (!allThreads && (own != traceRings[0])) // the main thread's ring is the first
+    {
+        return;
+    }
+
+    fprintf(traceFile, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (int tid = 0; (tid < traceNumRings) && (tid < TRACE_THREADS); tid++)
+    {
+        TraceRing *ring = traceRings[tid];
+        if (!allThreads && (ring != own))
+        {
+            continue;
+        }
+        fprintf(traceFile, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                separator, tid, ring->threadName);
+        separator = ",";
+
+        uint64_t first = (ring->numSpans > TRACE_SPANS) ? ring->numSpans - TRACE_SPANS : 0;
+        for (uint64_t i = first; i < ring->numSpans; i++)
+        {
+            TraceSpan *span = &ring->spans[i % TRACE_SPANS];
+            fprintf(traceFile, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    span->name, tid, (span->start - traceEpoch) / 1e3, span->nanos / 1e3);
+        }
+    }
+    fprintf(traceFile, "\n]}\n");
+    fclose(traceFile);
+    traceFile = NULL;
+}
+
+//--------------------------------------------//
+//---------------Benchmarks-------------------//
+//--------------------------------------------//
+
+/****************************************************************************************************
+ * Run with "./helio --bench-swap [numOps]". Times how long logging one keystroke to a swap file
+ * takes (SwapLogAppend plus the SwapLogTick that follows every keypress), group commits included,
+ * and prints the mean, median, 99th percentile and worst case.
+ ****************************************************************************************************/
+int BenchSwapLog(int numOps)
+{
+    TerminalAttr attr; // only its swap log (and status message for SwapLogTick) is used
+    SwapLog *swap = &attr.swap;
+    const char *tmpDir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char path[256];
+
+    if (numOps <= 0)
+    {
+        fprintf(stderr, "usage: ./helio --bench-swap [numOps], with numOps above 0\n");
+        return 1;
+    }
+    uint64_t *nanos = malloc(sizeof(uint64_t) * numOps);
+
+    snprintf(path, sizeof(path), "%s/helio-bench-%d", tmpDir, (int)getpid());
+    swap->fd = -1;
+    swap->path = SidecarPath(path, ".hswp");
+    swap->fileHash = 0;
+    swap->pendingCap = SWAP_COMMIT_BYTES;
+    swap->pending = malloc(swap->pendingCap);
+    swap->pendingLen = 0;
+    swap->lastCommit = MonotonicNanos();
+    swap->failed = 0;
+    if ((nanos == NULL) || (swap->pending == NULL))
+    {
+        ErrorHandler("BenchSwapLog: Couldn't allocate memory");
+    }
+
+    int commits = 0;
+    uint64_t commitNanos = 0, total = 0;
+    for (int i = 0; i < numOps; i++)
+    {
+        EditOp op = {EDIT_INSERT_CHAR, 1000000 + i / 80, i % 80, 'a' + i % 26, NULL}; // typing at line 1M
+        size_t pendingBefore = swap->pendingLen;
+
+        uint64_t start = MonotonicNanos();
+        SwapLogAppend(swap, &op);
+        SwapLogTick(&attr, 0);
+        nanos[i] = MonotonicNanos() - start;
+
+        total += nanos[i];
+        if (swap->pendingLen <= pendingBefore) // records were committed during this keystroke
+        {
+            commits++;
+            commitNanos += nanos[i];
+        }
+    }
+    crashSwap = NULL;
+
+    struct stat st;
+    long long logSize = (stat(swap->path, &st) == 0) ? (long long)st.st_size : -1;
+    SwapLogDiscard(swap);
+    free(swap->path);
+    free(swap->pending);
+
+    qsort(nanos, numOps, sizeof(uint64_t), CompareNanos);
+    printf("swap log: %d edits, %lld bytes logged, %d group commits (%.1f us each)\n", numOps, logSize,
+           commits, commits ? commitNanos / 1e3 / commits : 0.0);
+    printf("  per keystroke: mean %.3f us  p50 %.3f us  p99 %.3f us  max %.1f us\n", total / 1e3 / numOps,
+           nanos[numOps / 2] / 1e3, nanos[(int)(numOps * 0.99)] / 1e3, nanos[numOps - 1] / 1e3);
+    free(nanos);
+    return 0;
+}
+
+/****************************************************************************************************
+ * Run with "./helio --bench-highlight <fileName>". Highlights every row of the file with each
+ * language's syntax in turn (regardless of the file's actual language) and prints the throughput.
+ * The best of three passes is reported to keep noise from other processes out.
+ ****************************************************************************************************/
+int BenchHighlight(char *fileName)
+{
+    TerminalAttr attr;
+    long long bytes = 0;
+
+    InitEditorState(&attr);
+    if (OpenFile(&attr, fileName) == -1)
+    {
+        ErrorHandler("BenchHighlight: Couldn't open the file");
+    }
+    for (int i = 0; i < attr.tRowsTot; i++)
+    {
+        bytes += attr.tRow[i].rendSize + 1; // +1 for the newline
+    }
+    printf("highlight: %s, %d lines, %.1f MB rendered\n", fileName, attr.tRowsTot, bytes / 1e6);
+
+    for (size_t i = 0; i < sizeof(syntaxDefs) / sizeof(syntaxDefs[0]); i++)
+    {
+        uint64_t best = UINT64_MAX;
+
+        attr.syntax = &syntaxDefs[i];
+        for (int pass = 0; pass < 3; pass++)
+        {
+            attr.hlValidTo = 0;
+            uint64_t start = MonotonicNanos();
+            HighlightUpTo(&attr, attr.tRowsTot);
+            uint64_t nanos = MonotonicNanos() - start;
+            best = (nanos < best) ? nanos : best;
+        }
+        printf("  %-6s %8.1f MB/s  (%.1f ms)\n", attr.syntax->name, best ? bytes / 1e6 / (best / 1e9) : 0.0,
+               best / 1e6);
+    }
+    return 0;
+}
+
+/****************************************************************************************************
+ * Run with "./helio --check-highlight". Highlights rows where a comment marker is split across the
+ * end of a row (e.g., "a /" followed by "*b") with the highlight worker, which copies a batch of
+ * rows back to back, and checks the result against HighlightUpTo, which highlights one row at a
+ * time. Every syntax is checked; returns 1 and prints the first differing row if any.
+ ****************************************************************************************************/
+int CheckHighlightWorker(void)
+{
+    TerminalAttr attr;
+    const char *rows[] = {"x = a /", "*b;", "int y = 1;", "/* open", "still open *", "/ y;", "a /*", "b */ c",
+                          "end /", "/ line", "x"};
+    size_t bytes = 0;
+    int failed = 0;
+
+    InitEditorState(&attr);
+    for (size_t i = 0; i < sizeof(rows) / sizeof(rows[0]); i++)
+    {
+        AppendRow(&attr, (char *)rows[i], strlen(rows[i]));
+    }
+    for (size_t i = 0; i < sizeof(syntaxDefs) / sizeof(syntaxDefs[0]); i++) // each marker split in two
+    {
+        const char *markers[] = {syntaxDefs[i].lineComment, syntaxDefs[i].blockCommentStart,
+                                 syntaxDefs[i].blockCommentEnd};
+        for (int m = 0; m < 3; m++)
+        {
+            if ((markers[m] != NULL) && (strlen(markers[m]) >= 2))
+            {
+                char head[8] = "a ";
+                strncat(head, markers[m], 1);
+                AppendRow(&attr, head, strlen(head));
+                AppendRow(&attr, (char *)&markers[m][1], strlen(markers[m]) - 1);
+            }
+        }
+    }
+
+    for (int row = 0; row < attr.tRowsTot; row++)
+    {
+        bytes += attr.tRow[row].rendSize;
+    }
+
+    pthread_mutex_lock(&attr.docLock);
+    for (size_t i = 0; i < sizeof(syntaxDefs) / sizeof(syntaxDefs[0]); i++)
+    {
+        unsigned char *worker = malloc(bytes);
+        int *states = malloc(sizeof(int) * attr.tRowsTot);
+        if ((worker == NULL) || (states == NULL))
+        {
+            ErrorHandler("CheckHighlightWorker: Couldn't allocate memory");
+        }
+
+        attr.syntax = &syntaxDefs[i];
+        attr.hlValidTo = 0;
+        StartHighlightWorker(&attr);
+        while (attr.hlValidTo < attr.tRowsTot) // lets the worker run until every row is done
+        {
+            pthread_mutex_unlock(&attr.docLock);
+            poll(NULL, 0, 1);
+            pthread_mutex_lock(&attr.docLock);
+        }
+        StopHighlightWorker(&attr);
+
+        size_t pos = 0;
+        for (int row = 0; row < attr.tRowsTot; row++)
+        {
+            memcpy(&worker[pos], attr.tRow[row].hl, attr.tRow[row].rendSize);
+            states[row] = attr.tRow[row].hlState;
+            pos += attr.tRow[row].rendSize;
+        }
+
+        attr.hlValidTo = 0;
+        HighlightUpTo(&attr, attr.tRowsTot);
+        pos = 0;
+        for (int row = 0; row < attr.tRowsTot; row++)
+        {
+            TerminalRow *tRow = &attr.tRow[row];
+            if ((states[row] != tRow->hlState) || (memcmp(&worker[pos], tRow->hl, tRow->rendSize) != 0))
+            {
+                printf("  %-6s row %d \"%.*s\": worker state %d, HighlightUpTo state %d\n", attr.syntax->name,
+                       row + 1, tRow->rendSize, tRow->rendStr, states[row], tRow->hlState);
+                failed = 1;
+                break;
+            }
+            pos += tRow->rendSize;
+        }
+        free(worker);
+        free(states);
+    }
+    printf("check-highlight: %d rows, worker %s HighlightUpTo\n", attr.tRowsTot, failed ? "DIFFERS FROM" : "matches");
+    return failed;
+}
+
+/****************************************************************************************************
+ * Run with "./helio --bench-render <fileName>". Times RenderRow over every row of the file, then
+ * WriteRows for every page of the file (without highlighting) as if paging through it on an 80x24
+ * screen, and prints the throughput. The best of three passes is reported.
+ ****************************************************************************************************/
+int BenchRender(char *fileName)
+{
+    TerminalAttr attr;
+    long long bytes = 0, frameBytes = 0;
+    uint64_t bestRender = UINT64_MAX, bestWrite = UINT64_MAX;
+
+    InitEditorState(&attr);
+    if (OpenFile(&attr, fileName) == -1)
+    {
+        ErrorHandler("BenchRender: Couldn't open the file");
+    }
+    attr.syntax = NULL;
+    for (int i = 0; i < attr.tRowsTot; i++)
+    {
+        bytes += attr.tRow[i].size + 1; // +1 for the newline
+    }
+    int frames = (attr.tRowsTot + attr.numRows - 1) / attr.numRows;
+    printf("render: %s, %d lines, %.1f MB\n", fileName, attr.tRowsTot, bytes / 1e6);
+
+    for (int pass = 0; pass < 3; pass++)
+    {
+        uint64_t start = MonotonicNanos();
+        for (int i = 0; i < attr.tRowsTot; i++)
+        {
+            RenderRow(&attr.tRow[i]);
+        }
+        uint64_t nanos = MonotonicNanos() - start;
+        bestRender = (nanos < bestRender) ? nanos : bestRender;
+
+        frameBytes = 0;
+        start = MonotonicNanos();
+        for (int frame = 0; frame < frames; frame++)
+        {
+            AppendBuffer abuff = ABUFF_INIT;
+            attr.rowOffset = frame * attr.numRows;
+            WriteRows(&attr, &abuff, 0, attr.numRows);
+            frameBytes += abuff.length;
+            FreeAbuff(&abuff);
+        }
+        nanos = MonotonicNanos() - start;
+        bestWrite = (nanos < bestWrite) ? nanos : bestWrite;
+    }
+    printf("  RenderRow  %8.1f MB/s  (%.1f ms)\n", bestRender ? bytes / 1e6 / (bestRender / 1e9) : 0.0,
+           bestRender / 1e6);
+    printf("  WriteRows  %8.2f us/frame  (%d frames, %.1f MB written)\n", frames ? bestWrite / 1e3 / frames : 0.0,
+           frames, frameBytes / 1e6);
+
+    // the same frames again with the line number gutter on
+    attr.lineNumbers = LINE_NUMBERS_ABSOLUTE;
+    UpdateGutter(&attr);
+    bestWrite = UINT64_MAX;
+    for (int pass = 0; pass < 3; pass++)
+    {
+        uint64_t start = MonotonicNanos();
+        for (int frame = 0; frame < frames; frame++)
+        {
+            AppendBuffer abuff = ABUFF_INIT;
+            attr.rowOffset = frame * attr.numRows;
+            WriteRows(&attr, &abuff, 0, attr.numRows);
+            FreeAbuff(&abuff);
+        }
+        uint64_t nanos = MonotonicNanos() - start;
+        bestWrite = (nanos < bestWrite) ? nanos : bestWrite;
+    }
+    printf("  + gutter   %8.2f us/frame\n", frames ? bestWrite / 1e3 / frames : 0.0);
+    return 0;
+}
+
+/****************************************************************************************************
+ * Run with "./helio --bench-lines [numLines]". Fills the line table with numLines rows of 0 to 79
+ * chars, then times working out the size of the saved file by walking every row (as saving did
+ * before fileBytes) against reading fileBytes, building byteTree, and looking up the byte offset
+ * of a row and the row at a byte offset. The best of three passes is reported for the walk.
+ ****************************************************************************************************/
+int BenchLines(int numLines)
+{
+    TerminalAttr attr;
+    char line[80];
+    uint64_t bestWalk = UINT64_MAX;
+    uint32_t seed = 1;
+    long long walked = 0;
+
+    InitEditorState(&attr);
+    memset(line, 'x', sizeof(line));
+    for (int i = 0; i < numLines; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        AppendRow(&attr, line, (seed >> 16) % 80);
+    }
+    printf("lines: %d rows, %.1f MB\n", attr.tRowsTot, attr.fileBytes / 1e6);
+
+    for (int pass = 0; pass < 3; pass++)
+    {
+        uint64_t start = MonotonicNanos();
+        walked = 0;
+        for (int i = 0; i < attr.tRowsTot; i++)
+        {
+            walked += attr.tRow[i].size + 1;
+        }
+        uint64_t nanos = MonotonicNanos() - start;
+        bestWalk = (nanos < bestWalk) ? nanos : bestWalk;
+    }
+    uint64_t start = MonotonicNanos();
+    volatile long long fileBytes = attr.fileBytes;
+    uint64_t readNanos = MonotonicNanos() - start;
+    printf("  save size, walking rows   %10.3f ms  (%lld bytes)\n", bestWalk / 1e6, walked);
+    printf("  save size, fileBytes      %10.3f ms  (%lld bytes)\n", readNanos / 1e6, (long long)fileBytes);
+
+    start = MonotonicNanos();
+    BuildByteTree(&attr);
+    printf("  BuildByteTree             %10.3f ms\n", (MonotonicNanos() - start) / 1e6);
+
+    int lookups = 1000000;
+    long long check = 0, rowStart;
+    start = MonotonicNanos();
+    for (int i = 0; i < lookups; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        check += ByteTreePrefix(&attr, (int)(((uint64_t)seed << 8) % (uint64_t)(attr.tRowsTot + 1)));
+    }
+    uint64_t prefixNanos = MonotonicNanos() - start;
+    start = MonotonicNanos();
+    for (int i = 0; i < lookups; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        check += ByteTreeFind(&attr, (long long)(((uint64_t)seed << 8) % (uint64_t)(attr.fileBytes + 1)), &rowStart);
+    }
+    uint64_t findNanos = MonotonicNanos() - start;
+    printf("  offset of a row           %10.1f ns  (ByteTreePrefix)\n", (double)prefixNanos / lookups);
+    printf("  row at an offset          %10.1f ns  (ByteTreeFind)\n", (double)findNanos / lookups);
+    return (check == -1); // keeps the lookups from being optimized away
+}
+
+/****************************************************************************************************
+ * Sets up attr to run without a terminal: the screen is a 24x80 virtual screen and keys are fed in
+ * by ReplayScript. The document lock is taken like in main. As keys are replayed without waiting,
+ * the highlight worker only gets to run while a prompt waits for input, as if typing never paused.
+ ****************************************************************************************************/
+void InitHeadless(TerminalAttr *attr, VirtualScreen *screen)
+{
+    InitEditorState(attr);
+    screen->rows = attr->numRows + 2; // +2 for the status bar and status message
+    screen->cols = attr->numCols;
+    screen->cursorY = 0;
+    screen->cursorX = 0;
+    screen->bytes = 0;
+    screen->writes = 0;
+    screen->top = 0;
+    screen->bottom = screen->rows - 1;
+    screen->cells = malloc(sizeof(uint32_t) * screen->rows * screen->cols);
+    if (screen->cells == NULL)
+    {
+        ErrorHandler("InitHeadless: Couldn't allocate memory to virtual screen");
+    }
+    for (int cell = 0; cell < screen->rows * screen->cols; cell++)
+    {
+        screen->cells[cell] = ' ';
+    }
+    headless = screen;
+    UpdateGutter(attr);
+    pthread_mutex_lock(&attr->docLock);
+}
+
+/****************************************************************************************************
+ * Returns the number of bytes of the key at the start of a script: a whole escape sequence or a
+ * single byte.
+ ****************************************************************************************************/
+int ReplayKeyLength(const char *script, size_t length)
+{
+    if ((script[0] != '\x1b') || (length < 2))
+    {
+        return 1;
+    }
+    if (script[1] == 'O') // e.g., "\x1bOH" for Home
+    {
+        return (length < 3) ? length : 3;
+    }
+    if (script[1] != '[')
+    {
+        return 1;
+    }
+    for (size_t i = 2; i < length; i++) // parameters are followed by a final byte from '@' to '~'
+    {
+        if ((script[i] >= '@') && (script[i] <= '~'))
+        {
+            return i + 1;
+        }
+    }
+    return length;
+}
+
+/****************************************************************************************************
+ * Feeds the keys of a script (the bytes a terminal would send) through ProcessKeypress and
+ * RefreshScreen like the loop in main, and prints how long each key took until its frame was
+ * written, the output and the number of allocations. Keys come from a pipe in place of stdin, kept
+ * filled with up to REPLAY_AHEAD bytes of whole keys, so prompts (e.g., CTRL-G) can read the keys
+ * that follow them. Stops at the end of the script or at CTRL-Q, and returns the number of keys.
+ ****************************************************************************************************/
+int ReplayScript(TerminalAttr *attr, const char *script, size_t length, const char *label)
+{
+    int pipeFds[2];
+    size_t pos = 0, numKeys = 0, capacity = 1024;
+    uint64_t *nanos = malloc(sizeof(uint64_t) * capacity);
+    long long bytesBefore = headless->bytes, writesBefore = headless->writes;
+    long long allocsBefore = ALLOC_CALLS(), rowAllocsBefore = rowMemory.allocCalls;
+
+    if ((nanos == NULL) || (pipe(pipeFds) == -1) || (dup2(pipeFds[0], STDIN_FILENO) == -1))
+    {
+        ErrorHandler("ReplayScript: Couldn't set up the input");
+    }
+    close(pipeFds[0]);
+    fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK); // a lone ESC is read as ESC instead of waiting for more
+
+    while (1)
+    {
+        int queued = 0;
+        ioctl(STDIN_FILENO, FIONREAD, &queued);
+        while (pos < length) // never half of an escape sequence, so it's read like from a terminal
+        {
+            int keyLen = ReplayKeyLength(&script[pos], length - pos);
+            if (queued + keyLen > REPLAY_AHEAD)
+            {
+                break;
+            }
+            if (write(pipeFds[1], &script[pos], keyLen) != keyLen)
+            {
+                ErrorHandler("ReplayScript: write");
+            }
+            queued += keyLen;
+            pos += keyLen;
+        }
+        if (queued == 0)
+        {
+            break;
+        }
+
+        uint64_t start = MonotonicNanos();
+        int running = ProcessKeypress(attr);
+        SwapLogTick(attr, 0);
+        if (FrameNeeded(attr))
+        {
+            RefreshScreen(attr);
+        }
+        if (numKeys == capacity)
+        {
+            capacity *= 2;
+            if ((nanos = realloc(nanos, sizeof(uint64_t) * capacity)) == NULL)
+            {
+                ErrorHandler("ReplayScript: Couldn't reallocate memory to latencies");
+            }
+        }
+        nanos[numKeys++] = MonotonicNanos() - start;
+
+        if (!running) // CTRL-Q
+        {
+            break;
+        }
     }
+    close(pipeFds[1]);
 
-    AppendString(abuff, statusBar1, length1);
-
-    // makes sure it prints spaces until there is exactly enough space left for statusBar2
-    for (int i = length1 + length2; i < attr->numCols; i++)
+    uint64_t total = 0;
+    for (size_t i = 0; i < numKeys; i++)
     {
-        AppendString(abuff, " ", 1); // adds spaces
+        total += nanos[i];
     }
-    AppendString(abuff, statusBar2, length2); // prints right side of statusBar (statusBar2)
-
-    AppendString(abuff, "\x1b[m", 3); // sets display colors back to default
-    AppendString(abuff, "\r\n", 2);   // makes room for status message to be displayed
-}
-
-/****************************************************************************************************
- * Takes in a variable amount of arguments (like printf), so it is a variadic
- * function. To use such functions, we must use a va_list type. We then input the last argument
- * before "..." into va_start so the next arguments' addresses are known. Then we call vsnprintf to
- * take care of reading and formatting the string. Lastly we call va_end.
- ****************************************************************************************************/
-void SetStatusMessage(TerminalAttr *attr, const char *frmt, ...)
-{
-    va_list arguments;
-    va_start(arguments, frmt);                                            // call va_start to provide address of arguments
-    vsnprintf(attr->statusMsg, sizeof(attr->statusMsg), frmt, arguments); // reads and formats the string
-    va_end(arguments);
+    qsort(nanos, numKeys, sizeof(uint64_t), CompareNanos);
+    long long bytes = headless->bytes - bytesBefore, frames = headless->writes - writesBefore;
 
-    attr->statusMsgTime = time(NULL);
+    printf("replay: %s, %zu keys in %.1f ms\n", label, numKeys, total / 1e6);
+    if (numKeys > 0)
+    {
+        printf("  per key:     mean %.1f us  p50 %.1f us  p99 %.1f us  max %.1f us\n", total / 1e3 / numKeys,
+               nanos[numKeys / 2] / 1e3, nanos[(size_t)(numKeys * 0.99)] / 1e3, nanos[numKeys - 1] / 1e3);
+    }
+    printf("  output:      %lld bytes in %lld frames (%.0f bytes/frame)\n", bytes, frames,
+           frames ? (double)bytes / frames : 0.0);
+    if (ALLOC_CALLS() >= 0)
+    {
+        printf("  allocations: %lld (%.1f per key)\n", ALLOC_CALLS() - allocsBefore,
+               numKeys ? (double)(ALLOC_CALLS() - allocsBefore) / numKeys : 0.0);
+    }
+    else
+    {
+        printf("  allocations: not counted (build with \"make bench\")\n");
+    }
+    printf("  row blocks:  %lld (%.1f per key)\n", rowMemory.allocCalls - rowAllocsBefore,
+           numKeys ? (double)(rowMemory.allocCalls - rowAllocsBefore) / numKeys : 0.0);
+    free(nanos);
+    return numKeys;
 }
 
 /****************************************************************************************************
- * Writes the status message that was set in SetStatusMessage to the append buffer, abuff. It also
- * makes sure that it only display status messages that are less than 5 seconds after a keypress.
+ * Writes a C source file for the benchmarks that is at least 'bytes' long and has at least
+ * minLines lines. The text is the same every time.
  ****************************************************************************************************/
-void WriteStatusMessage(TerminalAttr *attr, AppendBuffer *abuff)
+void WriteBenchFile(const char *path, long long bytes, int minLines)
 {
-    AppendString(abuff, "\x1b[k", 3); // clears the current row
-    int length = strlen(attr->statusMsg);
+    FILE *fp = fopen(path, "w");
+    long long written = 0;
 
-    if (length > attr->numCols) // makes sure string length doesn't exceed screen width
+    if (fp == NULL)
     {
-        length = attr->numCols;
+        ErrorHandler("WriteBenchFile: fopen");
     }
-
-    if (length && (time(NULL) - attr->statusMsgTime < 5)) // checks if there is a message and
+    for (int line = 0; (written < bytes) || (line < minLines); line++)
+    {
+        int n = 0;
+        switch (line % 8)
+        {
+        case 0:
+            n = fprintf(fp, "/* block %d, generated for benchmarking */\n", line / 8);
+            break;
+        case 1:
+            n = fprintf(fp, "static int value_%d(int count, const char *name)\n", line);
+            break;
+        case 2:
+            n = fprintf(fp, "{\n");
+            break;
+        case 3:
+            n = fprintf(fp, "\tint total = count * %d + (int)strlen(name); // adds up the parts\n", line % 97);
+            break;
+        case 4:
+            n = fprintf(fp, "\tfor (int i = 0; i < count; i++) total += i ^ 0x%x;\n", line & 0xffff);
+            break;
+        case 5:
+            n = fprintf(fp, "\tprintf(\"%%s: %%d\\n\", \"value_%d\", total);\n", line - 4);
+            break;
+        case 6:
+            n = fprintf(fp, "\treturn total;\n");
+            break;
+        case 7:
+            n = fprintf(fp, "}\n");
+            break;
+        }
+        if (n < 0)
+        {
+            ErrorHandler("WriteBenchFile: fprintf");
+        }
+        written += n;
+    }
+    if (fclose(fp) != 0)
     {
-        AppendString(abuff, attr->statusMsg, length); // if it happened less than 5 seconds ago
+        ErrorHandler("WriteBenchFile: fclose");
     }
 }
 
 /****************************************************************************************************
- * The screen is refreshed after every key press in main through this function. It is also refreshed
- * when a new character is typed in InsertChar. This function calls WriteRows and then prints the
- * append buffer with one snprintf call to avoid flickering.
+ * Run with "./helio --bench-replay <workload> [size]", or all of them with "make bench". Runs a
+ * fixed workload headless on a generated C file and reports it with ReplayScript:
+ *   open [MB]      opens a file of that size (1024 MB by default) and pages through it
+ *   paste [KB]     opens a file of that size (1024 KB by default), selects all of it, copies it
+ *                  with CTRL-C and pastes it at its end with CTRL-V
+ *   type [chars]   types chars (10000 by default) onto line 1,000,000
+ *   large [MB]     opens a file of that size (5120 MB by default), types at its start, middle and
+ *                  end and saves it, then checks the size of the saved file
  ****************************************************************************************************/
-void RefreshScreen(TerminalAttr *attr)
+int BenchReplay(const char *workload, long long size)
 {
-    AppendBuffer abuff = ABUFF_INIT;
+    TerminalAttr attr;
+    VirtualScreen screen;
+    AppendBuffer script = ABUFF_INIT;
+    const char *tmpDir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    const char *label;
+    char path[256];
+    long long savedBytes = -1; // size the file should have once the workload saved it
 
-    // refer to VT100 user guide for descriptions of commands (\x1b = 27 in decimal)
-    AppendString(&abuff, "\x1b[?25l", 6); // command to hide the cursor
-    AppendString(&abuff, "\x1b[H", 3);    // command to reposition cursor to top-left of screen
+    snprintf(path, sizeof(path), "%s/helio-bench-%d.c", tmpDir, (int)getpid());
+    InitHeadless(&attr, &screen);
 
-    WriteRows(attr, &abuff);          // appends rows from file into the append buffer that are supposed to be visible
-    WriteStatusBar(attr, &abuff);     // adds status bar to the bottom of the display
-    WriteStatusMessage(attr, &abuff); // adds a status message below the status bar (i.e., bottommost line)
+    if (strcmp(workload, "open") == 0)
+    {
+        long long megabytes = size ? size : 1024;
+        WriteBenchFile(path, megabytes * 1000000, 0);
 
-    char buff[32];
-    // moves cursor to specified cursorY and cursorX position (+1 to convert 0-indexed to 1-indexed)
-    snprintf(buff, sizeof(buff), "\x1b[%d;%dH", attr->cursorY + 1, attr->cursorX + 1);
-    AppendString(&abuff, buff, strlen(buff));
+        long long allocs = ALLOC_CALLS(), rowAllocs = rowMemory.allocCalls, chunks = rowMemory.chunks;
+        uint64_t start = MonotonicNanos();
+        if (OpenFile(&attr, path) == -1)
+        {
+            ErrorHandler("BenchReplay: Couldn't open the file");
+        }
+        uint64_t openNanos = MonotonicNanos() - start;
+        allocs = ALLOC_CALLS() - allocs;
+        StartHighlightWorker(&attr);
 
-    AppendString(&abuff, "\x1b[?25h", 6); // command to show the cursor
+        start = MonotonicNanos();
+        RefreshScreen(&attr);
+        uint64_t frameNanos = MonotonicNanos() - start;
 
-    write(STDOUT_FILENO, abuff.buff, abuff.length); // writes the whole buffer at once to avoid flickering
-    FreeAbuff(&abuff);
-}
+        printf("open: %lld MB, %d lines in %.1f ms (%.1f MB/s), first frame in %.1f us\n", megabytes,
+               attr.tRowsTot, openNanos / 1e6, megabytes / (openNanos / 1e9), frameNanos / 1e3);
+        if (allocs >= 0)
+        {
+            printf("  allocations: %lld (%.2f per line)\n", allocs, attr.tRowsTot ? (double)allocs / attr.tRowsTot : 0.0);
+        }
+        printf("  row memory: %.1f MB in %lld blocks from %lld chunks\n", rowMemory.liveBytes / 1e6,
+               rowMemory.allocCalls - rowAllocs, rowMemory.chunks - chunks);
 
-//----------------------------------------------------//
-//---------------Text Editing Functions---------------//
-//----------------------------------------------------//
+        for (int i = 0; i < 200; i++)
+        {
+            AppendString(&script, "\x1b[6~", 4); // PAGE_DOWN
+        }
+        AppendString(&script, "\x1b[1;5F", 6); // CTRL-End
+        AppendString(&script, "\x1b[1;5H", 6); // CTRL-Home
+        label = "200 pages down, end and start of the file";
+    }
+    else if (strcmp(workload, "paste") == 0)
+    {
+        long long kilobytes = size ? size : 1024;
+        WriteBenchFile(path, kilobytes * 1024, 0);
+        if (OpenFile(&attr, path) == -1)
+        {
+            ErrorHandler("BenchReplay: Couldn't open the file");
+        }
+        StartHighlightWorker(&attr);
+        RefreshScreen(&attr);
+
+        AppendString(&script, "\0", 1); // CTRL-Space sets the mark at the start
+        AppendString(&script, "\x1b[1;5F\x1b[F", 9); // CTRL-End, then End of the last row
+        AppendString(&script, "\x03", 1); // CTRL-C copies the whole file
+        AppendString(&script, "\x16", 1); // CTRL-V pastes it at the end as one edit
+        label = "select all, copy and paste at the end";
+    }
+    else if (strcmp(workload, "type") == 0)
+    {
+        int chars = size ? size : 10000;
+        WriteBenchFile(path, 0, 1000000 + attr.numRows);
+        if (OpenFile(&attr, path) == -1)
+        {
+            ErrorHandler("BenchReplay: Couldn't open the file");
+        }
+        StartHighlightWorker(&attr);
+        RefreshScreen(&attr);
 
-/****************************************************************************************************
- * Gives tRow and index directly to InsertChar as paramaters (reduces wordiness in InsertChar).
- ****************************************************************************************************/
-void InsertCharWrapper(TerminalAttr *attr, char charIn)
-{
-    if ((attr->cursorY + attr->rowOffset) == attr->tRowsTot) // means cursorY is on the line after the last row of the file
+        AppendString(&script, "\x07" "1000000\r", 9); // CTRL-G to line 1,000,000
+        for (int i = 0; i < chars; i++)
+        {
+            char c = (i % 8 == 7) ? ' ' : 'a' + i % 26;
+            AppendString(&script, &c, 1);
+        }
+        label = "typing at line 1,000,000";
+    }
+    else if (strcmp(workload, "large") == 0)
+    {
+        long long megabytes = size ? size : 5120;
+        WriteBenchFile(path, megabytes * 1000000, 0);
+
+        uint64_t start = MonotonicNanos();
+        if (OpenFile(&attr, path) == -1)
+        {
+            ErrorHandler("BenchReplay: Couldn't open the file");
+        }
+        uint64_t openNanos = MonotonicNanos() - start;
+        StartHighlightWorker(&attr);
+        RefreshScreen(&attr);
+        printf("large: %.2f GB, %d lines in %.1f s, %.1f MB in rows\n", attr.fileBytes / 1e9, attr.tRowsTot,
+               openNanos / 1e9, rowMemory.liveBytes / 1e6);
+
+        AppendString(&script, "start", 5);
+        AppendString(&script, "\x07" "50%\r", 5); // CTRL-G to the middle
+        AppendString(&script, "middle", 6);
+        AppendString(&script, "\x1b[1;5F\x1b[F", 9); // CTRL-End, then End of the last row
+        AppendString(&script, "end", 3);
+        AppendString(&script, "\x13", 1); // CTRL-S
+        savedBytes = attr.fileBytes + 14;
+        label = "typing at the start, middle and end, then saving";
+    }
+    else
     {
-        AppendRow(attr, "", 0); // makes a new row so text can be written in it
+        fprintf(stderr, "unknown workload %s (open, paste, type or large)\n", workload);
+        unlink(path);
+        return 1;
     }
 
-    // pass tRow and cursorX + colOffset directly to faciliate readability
-    int index = attr->cursorX + attr->colOffset; // gives string index of current row
-    InsertChar(&attr->tRow[attr->cursorY + attr->rowOffset], index, charIn);
+    ReplayScript(&attr, script.buff, script.length, label);
+    StopHighlightWorker(&attr);
+    SwapLogDiscard(&attr.swap);
+    if (savedBytes >= 0)
+    {
+        struct stat st;
+        char *undoPath = SidecarPath(path, ".hundo");
+        long long fileSize = (stat(path, &st) == 0) ? (long long)st.st_size : -1;
 
-    MoveCursor(attr, RIGHT_ARROW); // increments cursor by 1 or accounts for col offset
+        printf("  saved:       %lld bytes (%s)\n", fileSize, (fileSize == savedBytes) ? "as expected" : "WRONG SIZE");
+        unlink(undoPath);
+        free(undoPath);
+    }
+    unlink(path);
+    FreeAbuff(&script);
+    free(screen.cells);
+    headless = NULL;
+    return 0;
 }
 
 /****************************************************************************************************
- * tRow is given directly as a pointer to a individual row (not the whole array) and x is cursorX.
- * The size of the row's string is incremented by one and then we reallocate the appropiate amount
- * of memory for the new char. Next, we move the char at index x one to the right to make room for
- * the new char to be inserted. Lastly, the new char is inserted at index x.
+ * Run with "./helio --replay <scriptName> <fileName>". Opens the file headless, replays the keys
+ * saved in the script file (raw bytes as the terminal sends them, e.g., recorded with
+ * "script --log-in") and prints the report of ReplayScript followed by the final screen. The same
+ * script always gives the same screen, which makes it usable for checking changes too. Unsaved
+ * edits are discarded at the end.
  ****************************************************************************************************/
-void InsertChar(TerminalRow *tRow, int x, char charIn)
+int BenchReplayScript(char *scriptName, char *fileName)
 {
-    if (x < 0 || x > tRow->size) // makes sure column index (x) is within valid range
+    TerminalAttr attr;
+    VirtualScreen screen;
+    struct stat st;
+    FILE *fp = fopen(scriptName, "rb");
+
+    if ((fp == NULL) || (fstat(fileno(fp), &st) == -1))
     {
-        x = tRow->size; // cursor can exceed current size by one (to type a char at end of line)
+        ErrorHandler("BenchReplayScript: Couldn't open the script");
+    }
+    char *script = malloc(st.st_size + 1);
+    if ((script == NULL) || (fread(script, 1, st.st_size, fp) != (size_t)st.st_size))
+    {
+        ErrorHandler("BenchReplayScript: Couldn't read the script");
     }
+    fclose(fp);
 
-    if ((tRow->text = realloc(tRow->text, tRow->size + 2)) == NULL) // add 2 to make room for null byte + new char
+    InitHeadless(&attr, &screen);
+    SetStatusMessage(&attr, "HELP: CTRL-Q to quit | CTRL-S to save | CTRL-Z to undo | CTRL-G to go to");
+    if (OpenFile(&attr, fileName) == -1)
     {
-        ErrorHandler("InsertChar: realloc memory for tRow->text");
+        ErrorHandler("BenchReplayScript: Couldn't open the file");
     }
+    StartHighlightWorker(&attr);
+    RefreshScreen(&attr);
+    ReplayScript(&attr, script, st.st_size, scriptName);
+    StopHighlightWorker(&attr);
+    VirtualScreenPrint(&screen);
+
+    SwapLogDiscard(&attr.swap);
+    free(script);
+    free(screen.cells);
+    headless = NULL;
+    return 0;
+}
 
-    // moves char currently at x one to the right to make room for the new char
-    memmove(&tRow->text[x + 1], &tRow->text[x], tRow->size - x + 1);
+//-----------------------------------------------//
+//---------------Utility Functions---------------//
+//-----------------------------------------------//
 
-    tRow->size++;           // increase row size by 1
-    tRow->text[x] = charIn; // inserts newly typed char in specified location
-    RenderRow(tRow);        // to make sure string is updated onto screen
+/****************************************************************************************************
+ * Displays an error description (given as a parameter) and forcefully exits program. Edits that
+ * haven't been committed to the swap file yet are committed first.
+ ****************************************************************************************************/
+void ErrorHandler(const char *str)
+{
+    if (crashSwap != NULL)
+    {
+        SwapLogCommit(crashSwap); // unsaved edits can be recovered the next time the file is opened
+    }
+
+    WriteTerminal("\x1b[2J", 4); // refreshes screen
+    WriteTerminal("\x1b[H", 3);  // repositions cursor to top-left of screen
+    TraceDump(0);                 // the spans up to the error are kept, if it's the main thread's
+
+    perror(str); // prints out error description
+    exit(1);
 }
 
-//------------------------------------------//
-//---------------Saving Files---------------//
-//------------------------------------------//
+/****************************************************************************************************
+ * Returns the time of a clock that never jumps (unlike time(NULL)) in nanoseconds. Only useful for
+ * measuring how much time passed between two calls.
+ ****************************************************************************************************/
+uint64_t MonotonicNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
 /****************************************************************************************************
- * Writes all tRows into a single buffer string and returns it. Adds '\n' to end of each row. Saves
- * the length of the buffer in an int* which must be provided as a parameter. Caller of function must
- * handle freeing the buffer memory.
+ * Used by qsort to sort latencies in ascending order.
  ****************************************************************************************************/
-char *WriteRowsToBuff(TerminalAttr *attr, int *length)
+int CompareNanos(const void *a, const void *b)
 {
-    int lengthTot = 0;
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
 
-    for (int i = 0; i < attr->tRowsTot; i++)
-    {
-        lengthTot += attr->tRow[i].size + 1; // +1 for \n that is added later
-    }
-    *length = lengthTot;
+/****************************************************************************************************
+ * qsort comparison of HexEdits by offset.
+ ****************************************************************************************************/
+int CompareHexEdits(const void *a, const void *b)
+{
+    long long x = ((const HexEdit *)a)->offset, y = ((const HexEdit *)b)->offset;
+    return (x > y) - (x < y);
+}
 
-    char *buff = malloc(lengthTot);
+/****************************************************************************************************
+ * FNV-1a hash of length bytes of data, continuing from hash. Start with HashBytes(0, NULL, 0) which
+ * returns the FNV offset basis.
+ ****************************************************************************************************/
+uint64_t HashBytes(uint64_t hash, const void *data, size_t length)
+{
+    const unsigned char *bytes = data;
 
-    if (buff == NULL) // in case of failure of trying to allocate memory
+    if (data == NULL)
     {
-        ErrorHandler("WriteRowsToBuff: Couldn't allocate memory to buff");
+        return 14695981039346656037ULL; // FNV offset basis
     }
 
-    int index = 0;
-    for (int i = 0; i < attr->tRowsTot; i++)
+    for (size_t i = 0; i < length; i++)
     {
-        memcpy(&buff[index], attr->tRow[i].text, attr->tRow[i].size); // appends new string to end of old buffer
-
-        index += attr->tRow[i].size; // set index to right after the last char written
-        buff[index] = '\n';
-        index++; // again set to after last char written
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL; // FNV prime
     }
-    return buff;
+    return hash;
 }
 
 /****************************************************************************************************
- * Creates file with the same file name as the opened file (if a file was opened) and saves it to
- * storage (same directory as program). Calls WriteRowsToBuff and provides the buffer for it.
+ * Writes all length bytes of buff to fd. write can write fewer bytes than asked for (it never writes
+ * more than about 2 GB at once on Linux) or be interrupted by a signal, so it's called until
+ * everything is written. Returns -1 with errno set if a write failed.
  ****************************************************************************************************/
-void SaveFile(TerminalAttr *attr)
+int WriteAll(int fd, const void *buff, size_t length)
 {
-    if (attr->fileName == NULL)
+    const char *bytes = buff;
+
+    while (length > 0)
     {
-        return;
+        ssize_t n = write(fd, bytes, length);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        bytes += n;
+        length -= n;
     }
-
-    int length;
-    char *buff = WriteRowsToBuff(attr, &length);
-
-    // creates a new file if it doesn't exist and opens it for reading and writing
-    int fd = open(attr->fileName, O_RDWR | O_CREAT, 0644); // 0644 is standard text file perms
-    ftruncate(fd, length);                                 // sets file to specified length
-    write(fd, buff, length);
-    close(fd);
-    free(buff);
+    return 0;
 }
 
-//-----------------------------------------------//
-//---------------Utility Functions---------------//
-//-----------------------------------------------//
-
 /****************************************************************************************************
- * Displays an error description (given as a parameter) and forcefully exits program.
+ * Returns the path of a hidden file that sits next to fileName, e.g., "dir/.notes.txt.hundo" for
+ * "dir/notes.txt" and suffix ".hundo". The caller must free the returned string.
  ****************************************************************************************************/
-void ErrorHandler(const char *str)
+char *SidecarPath(const char *fileName, const char *suffix)
 {
-    write(STDOUT_FILENO, "\x1b[2J", 4); // refreshes screen
-    write(STDOUT_FILENO, "\x1b[H", 3);  // repositions cursor to top-left of screen
+    const char *base = strrchr(fileName, '/');
+    int dirLength = base ? base - fileName + 1 : 0; // keeps the directory part including the '/'
+    base = base ? base + 1 : fileName;
 
-    perror(str); // prints out error description
-    exit(1);
+    size_t length = dirLength + 1 + strlen(base) + strlen(suffix) + 1;
+    char *path = malloc(length);
+    if (path == NULL)
+    {
+        ErrorHandler("SidecarPath: Couldn't allocate memory to path");
+    }
+
+    snprintf(path, length, "%.*s.%s%s", dirLength, fileName, base, suffix);
+    return path;
 }
 
 /****************************************************************************************************
@@ -933,6 +9795,13 @@ void RawModeOff(struct termios originalState)
 int FetchWindowSize(int *numRows, int *numCols)
 {
     struct winsize size;
+
+    if (headless != NULL) // the virtual screen never changes size
+    {
+        *numRows = headless->rows - 2;
+        *numCols = headless->cols;
+        return 0;
+    }
     // ioctl stands for input output control; it is able to fetch the window size on most systems
     if ((ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == -1) || size.ws_col == 0) // checks for erroneous behaviour
     {
@@ -953,27 +9822,112 @@ int FetchWindowSize(int *numRows, int *numCols)
  ****************************************************************************************************/
 void InitTerminalAttr(TerminalAttr *attr)
 {
+    InitEditorState(attr);
+
+    // stores original state attributes; STDIN_FILENO means standard input stream
+    if (tcgetattr(STDIN_FILENO, &(attr->originalState)) == -1)
+    {
+        ErrorHandler("tcgetattr");
+    }
+    // provides pointers of row member and column member to function FetchWindowSize
+    if (FetchWindowSize(&(attr->numRows), &(attr->numCols)) == -1)
+    {
+        ErrorHandler("fetch_window_size"); // gives error description
+    }
+    UpdateGutter(attr);
+}
+
+/****************************************************************************************************
+ * Initializes the variables of attr that don't depend on the terminal, so benchmarks can use attr
+ * without one. The screen size is set to 24x80 until FetchWindowSize replaces it.
+ ****************************************************************************************************/
+void InitEditorState(TerminalAttr *attr)
+{
+    attr->numRows = 24 - 2; // -2 to account for status bar and status message
+    attr->numCols = 80;
+    attr->lineNumbers = LINE_NUMBERS_OFF;
+    attr->gutterDigits = 1;
+    attr->gutterLimit = 10;
+    attr->textCols = attr->numCols;
     attr->cursorX = 0; // set x and y cursor positions to top left of screen
     attr->cursorY = 0;
     attr->rowOffset = 0;
     attr->colOffset = 0;
     attr->maxrowOffset = 0;
     attr->maxcolOffset = 0;
+    attr->softWrap = 0;
+    attr->wrapTop = 0;
+    attr->wrapTree = NULL;
+    attr->wrapTreeWidth = 0;
+    for (int i = 0; i < WRAP_TREE_MAX; i++)
+    {
+        attr->wrapTrees[i] = NULL;
+        attr->wrapTreeWidths[i] = 0;
+    }
+    attr->wrapTreeNext = 0;
+    attr->folds = NULL;
+    attr->foldRoot = FOLD_NONE;
+    attr->foldFree = FOLD_NONE;
+    attr->foldsCap = 0;
+    attr->byteTree = NULL;
+    attr->byteTreeCap = 0;
+    attr->byteTreeValid = 0;
+    attr->fileBytes = 0;
     attr->tRowsTot = 0;
+    attr->tRowsCap = 0;
     attr->tRow = NULL;
     attr->statusMsg[0] = '\0';
     attr->statusMsgTime = 0;
+    attr->readOnly = 0;
+    attr->forceHex = 0;
+    attr->hex = NULL;
+    attr->viewCount = 0;
+    attr->mark = MARK_NONE;
+    attr->markRow = 0;
+    attr->markIndex = 0;
+    attr->perf.hud = 0;
+    attr->perf.inputNanos = 0;
+    attr->perf.numLatencies = 0;
+    attr->perf.writeRowsNanos = 0;
+    attr->perf.frameBytes = 0;
+    attr->perf.allocMark = 0;
+    attr->perf.frameAllocs = 0;
+    memset(&attr->shown, 0, sizeof(attr->shown));
+    attr->shown.rowOffset = -1; // nothing is on screen yet
+    attr->frameNanos = 1000000000 / FRAME_RATE;
+    attr->osc52Max = OSC52_MAX_BYTES;
+    attr->lastShown = 0;
+    attr->cacheBytes = 0;
+    attr->windows = NULL;
+    attr->window = 0;
+    attr->windowKey = 0;
     attr->fileName = "[fileName]"; // in case no file is opened, set default name to no name
-
-    // stores original state attributes; STDIN_FILENO means standard input stream
-    if (tcgetattr(STDIN_FILENO, &(attr->originalState)) == -1)
-    {
-        ErrorHandler("tcgetattr");
-    }
-    // provides pointers of row member and column member to function FetchWindowSize
-    if (FetchWindowSize(&(attr->numRows), &(attr->numCols)) == -1)
+    attr->undo.ops = NULL;
+    attr->undo.opsTot = 0;
+    attr->undo.capacity = 0;
+    attr->undo.mapped = NULL;
+    attr->undo.mappedSize = 0;
+    attr->undo.mappedEnd = 0;
+    attr->fileHash = 0;
+    attr->syntax = NULL;
+    attr->hlValidTo = 0;
+    pthread_mutex_init(&attr->docLock, NULL);
+    pthread_cond_init(&attr->hlWake, NULL);
+    attr->hlThreadRunning = 0;
+    attr->hlStop = 0;
+    attr->hlGeneration = 0;
+    attr->hlRepaint = 0;
+    attr->swap.fd = -1;
+    attr->swap.path = NULL;
+    attr->swap.fileHash = 0;
+    attr->swap.pendingCap = SWAP_COMMIT_BYTES;
+    attr->swap.pending = malloc(attr->swap.pendingCap);
+    attr->swap.pendingLen = 0;
+    attr->swap.lastCommit = 0;
+    attr->swap.failed = 0;
+    if (attr->swap.pending == NULL)
     {
-        ErrorHandler("fetch_window_size"); // gives error description
+        ErrorHandler("InitEditorState: Couldn't allocate memory to swap log");
     }
 }
 
@@ -983,28 +9937,153 @@ void InitTerminalAttr(TerminalAttr *attr)
  ****************************************************************************************************/
 int main(int argc, char *argv[])
 {
-    TerminalAttr attr;
+    TerminalAttr *attr = malloc(sizeof(TerminalAttr)); // the first buffer; OpenBuffer adds the others
+
+    if ((argc >= 2) && (strcmp(argv[1], "--bench-swap") == 0))
+    {
+        return BenchSwapLog(argc >= 3 ? atoi(argv[2]) : 1000000);
+    }
+    if ((argc >= 2) && (strcmp(argv[1], "--check-highlight") == 0))
+    {
+        return CheckHighlightWorker();
+    }
+    if ((argc >= 3) && (strcmp(argv[1], "--bench-highlight") == 0))
+    {
+        return BenchHighlight(argv[2]);
+    }
+    if ((argc >= 2) && (strcmp(argv[1], "--bench-lines") == 0))
+    {
+        return BenchLines(argc >= 3 ? atoi(argv[2]) : 10000000);
+    }
+    if ((argc >= 3) && (strcmp(argv[1], "--bench-render") == 0))
+    {
+        return BenchRender(argv[2]);
+    }
+    if ((argc >= 3) && (strcmp(argv[1], "--bench-replay") == 0))
+    {
+        return BenchReplay(argv[2], argc >= 4 ? atoll(argv[3]) : 0);
+    }
+    if ((argc >= 4) && (strcmp(argv[1], "--replay") == 0))
+    {
+        return BenchReplayScript(argv[2], argv[3]);
+    }
+
+    if (attr == NULL)
+    {
+        ErrorHandler("main: Couldn't allocate memory to attr");
+    }
+    InitTerminalAttr(attr); // initialzes the TerminalAttr struct
+    while ((argc >= 2) && (argv[1][0] == '-')) // options come before the file name
+    {
+        if (strcmp(argv[1], "-R") == 0) // read-only viewer
+        {
+            attr->readOnly = 1;
+        }
+        else if (strcmp(argv[1], "-x") == 0) // hex view, for text files too
+        {
+            attr->forceHex = 1;
+        }
+        else if ((strcmp(argv[1], "--trace") == 0) && (argc >= 3))
+        {
+            TraceStart(argv[2]);
+            argv++;
+            argc--;
+        }
+        else if ((strcmp(argv[1], "--osc52") == 0) && (argc >= 3)) // 0 keeps copies out of the system clipboard
+        {
+            char *end;
+            attr->osc52Max = strtoll(argv[2], &end, 10);
+            if ((end == argv[2]) || (*end != '\0') || (attr->osc52Max < 0))
+            {
+                printf("--osc52 takes a number of bytes (0 or more), not \"%s\"\n", argv[2]);
+                return 1;
+            }
+            argv++;
+            argc--;
+        }
+        else if ((strcmp(argv[1], "--fps") == 0) && (argc >= 3)) // 0 draws a frame for every key
+        {
+            int fps = atoi(argv[2]);
+            attr->frameNanos = (fps > 0) ? 1000000000 / fps : 0;
+            argv++;
+            argc--;
+        }
+        else if ((strcmp(argv[1], "--cache-budget") == 0) && (argc >= 3)) // MB hidden buffers keep cached
+        {
+            buffers.budget = atoll(argv[2]) << 20;
+            argv++;
+            argc--;
+        }
+        else
+        {
+            break;
+        }
+        argv++;
+        argc--;
+    }
+    RawModeOn(attr->originalState);
+    OpenTerminalOutput();
+
+    // signals that would kill Helio commit the swap log first
+    int fatalSignals[] = {SIGHUP, SIGTERM, SIGQUIT, SIGABRT, SIGSEGV, SIGBUS, SIGFPE};
+    for (size_t i = 0; i < sizeof(fatalSignals) / sizeof(fatalSignals[0]); i++)
+    {
+        signal(fatalSignals[i], SwapLogSignal);
+    }
 
-    InitTerminalAttr(&attr); // initialzes the TerminalAttr struct
-    RawModeOn(attr.originalState);
-    if (argc >= 2)
+    // first status message when booting up program (OpenFile may replace it, e.g., after a recovery)
+    if (attr->readOnly)
     {
-        OpenFile(&attr, argv[1]);
+        SetStatusMessage(attr, "HELP: CTRL-Q to quit | SPACE/b to page | N% or CTRL-G to jump");
     }
-    // first status message when booting up program
-    SetStatusMessage(&attr, "HELP: Press CTRL-Q to quit | Press CTRL-S to save");
+    else
+    {
+        SetStatusMessage(attr, "HELP: CTRL-Q to quit | CTRL-S to save | CTRL-Z to undo | CTRL-G to go to");
+    }
+    pthread_mutex_lock(&attr->docLock); // only released while waiting for input
+    if ((argc >= 2) && (OpenFile(attr, argv[1]) == -1))
+    {
+        ErrorHandler(argv[1]);
+    }
+    AddBuffer(attr);
+    for (int i = 2; i < argc; i++) // the other files are opened hidden, in buffers of their own
+    {
+        if (OpenBuffer(attr, argv[i]) == NULL)
+        {
+            SetStatusMessage(attr, "Can't open %.40s: %s", argv[i], strerror(errno));
+        }
+    }
+    StartHighlightWorker(attr);
 
-    while (ProcessKeypress(&attr)) // ProcessKeypress returns either 0 or 1
+    while (1)
     {
-        // providing pointers of row member and column member to function FetchWindowSize
-        if (FetchWindowSize(&(attr.numRows), &(attr.numCols)) == -1)
+        // keys are only processed once there are some; otherwise the screen is just redrawn
+        if (WaitForInput(attr) && (ProcessInput(attr) == 0)) // ProcessInput returns either 0 or 1
         {
-            ErrorHandler("fetch_window_size");
+            break;
         }
+        attr = buffers.list[buffers.current]; // keys may have switched buffers
+        SwapLogTick(attr, 0);                 // group commits edits while the user keeps typing
+
+        UpdateScreenSize(attr); // the terminal may have been resized
 
-        RefreshScreen(&attr); // screen is only refreshed after every keypress
+        if (!FrameNeeded(attr)) // the keys changed nothing on screen
+        {
+            attr->perf.inputNanos = 0;
+        }
+        else if (FrameDelay(attr) == 0) // otherwise WaitForInput returns when the frame is due
+        {
+            RefreshScreen(attr);
+        }
     }
 
-    RawModeOff(attr.originalState);
+    StopHighlightWorker(attr);
+    for (int i = 0; i < buffers.count; i++)
+    {
+        SwapLogDiscard(&buffers.list[i]->swap); // quitting normally discards unsaved edits
+    }
+    FlushOutput(1);
+    RawModeOff(attr->originalState);
+    TraceDump(1);
     return 0;
 }
\ No newline at end of file